@@ -0,0 +1,305 @@
+#define _GNU_SOURCE
+#include "auth.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include <sys/random.h>
+#include "protocol.h"
+#include "shard.h"
+#include "sha256.h"
+#include "log.h"
+
+#define AUTH_LINE_MAX 1024
+#define AUTH_RELOAD_QUIET_MS 100    // 檔案連續變動時等它安靜下來才重新載入
+
+typedef struct {
+    char *username;          // NULL 表示空位
+    uint32_t cost;
+    uint8_t salt[AUTH_SALT_SIZE];
+    uint8_t hash[SHA256_DIGEST_SIZE];
+} AuthUser;
+
+/**
+ * 一份載入完成的使用者清單，建好之後不再修改
+ */
+typedef struct {
+    AuthUser *slots;         // 開放定址，大小是 2 的冪次
+    uint32_t mask;
+    uint32_t count;
+    int refs;                // 正在使用這份清單的登入數，由 table_lock 保護
+} AuthTable;
+
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static AuthTable *current;
+static char users_path[256];
+static uint32_t login_cost;          // 每次驗證至少做的迭代次數
+static int reload_pipe[2] = { -1, -1 };
+
+static void table_free(AuthTable *table) {
+    if (!table) return;
+    for (uint32_t i = 0; i <= table->mask; i++) free(table->slots[i].username);
+    free(table->slots);
+    free(table);
+}
+
+static int hex_decode(const char *hex, size_t hex_len, uint8_t *out, size_t size) {
+    if (hex_len != size * 2) return -1;
+    for (size_t i = 0; i < size; i++) {
+        unsigned int byte;
+        if (sscanf(hex + i * 2, "%2x", &byte) != 1) return -1;
+        out[i] = byte;
+    }
+    return 0;
+}
+
+// 解析 "pbkdf2-sha256$<迭代次數>$<鹽>$<雜湊>"
+static int parse_hash(const char *text, AuthUser *user) {
+    const char *p = text + strlen(AUTH_HASH_PREFIX);
+    char *end;
+    unsigned long cost = strtoul(p, &end, 10);
+    if (end == p || *end != '$' || cost == 0 || cost > UINT32_MAX) return -1;
+    const char *salt = end + 1;
+    const char *hash = strchr(salt, '$');
+    if (!hash) return -1;
+    user->cost = cost;
+    if (hex_decode(salt, hash - salt, user->salt, AUTH_SALT_SIZE) != 0 ||
+        hex_decode(hash + 1, strlen(hash + 1), user->hash, SHA256_DIGEST_SIZE) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static AuthUser *table_find(const AuthTable *table, const char *username) {
+    uint32_t i = shard_hash(username, strlen(username)) & table->mask;
+    while (table->slots[i].username) {
+        if (strcmp(table->slots[i].username, username) == 0) return &table->slots[i];
+        i = (i + 1) & table->mask;
+    }
+    return NULL;
+}
+
+// 讀取使用者清單，建立新的雜湊表；檔案不存在時是空的清單
+static AuthTable *table_load(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp && errno != ENOENT) {
+        log_perror("無法打開使用者清單檔案");
+        return NULL;
+    }
+
+    // 先數行數決定雜湊表的大小，負載不超過一半
+    uint32_t lines = 0;
+    char line[AUTH_LINE_MAX];
+    while (fp && fgets(line, sizeof(line), fp)) lines++;
+    uint32_t size = 16;
+    while (size < lines * 2) size *= 2;
+
+    AuthTable *table = calloc(1, sizeof(AuthTable));
+    if (table) table->slots = calloc(size, sizeof(AuthUser));
+    if (!table || !table->slots) {
+        free(table);
+        if (fp) fclose(fp);
+        return NULL;
+    }
+    table->mask = size - 1;
+    if (!fp) {
+        log_warn("使用者清單檔案不存在: %s", path);
+        return table;
+    }
+
+    rewind(fp);
+    uint32_t plain = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        char username[MAX_USERNAME_LENGTH + 1], password[AUTH_LINE_MAX];
+        if (line[0] == '#' || sscanf(line, "%255s %1023s", username, password) != 2) continue;
+        if (table_find(table, username)) continue;   // 同名的使用者以第一行為準
+
+        AuthUser user = { 0 };
+        if (strncmp(password, AUTH_HASH_PREFIX, strlen(AUTH_HASH_PREFIX)) == 0) {
+            if (parse_hash(password, &user) != 0) {
+                log_warn("使用者 %s 的密碼雜湊格式錯誤，略過", username);
+                continue;
+            }
+        } else {
+            // 檔案本身已經是明文，只雜湊一次；驗證時由 auth_check 補足工作量
+            user.cost = 1;
+            if (getrandom(user.salt, sizeof(user.salt), 0) != sizeof(user.salt)) {
+                log_perror("無法產生鹽");
+                fclose(fp);
+                table_free(table);
+                return NULL;
+            }
+            sha256_pbkdf2((const uint8_t *)password, strlen(password), user.salt, sizeof(user.salt), user.cost,
+                          user.hash);
+            plain++;
+        }
+        if (!(user.username = strdup(username))) {
+            fclose(fp);
+            table_free(table);
+            return NULL;
+        }
+        uint32_t i = shard_hash(username, strlen(username)) & table->mask;
+        while (table->slots[i].username) i = (i + 1) & table->mask;
+        table->slots[i] = user;
+        table->count++;
+    }
+    fclose(fp);
+    if (plain > 0) log_warn("使用者清單中有 %u 個明文密碼，建議以 --hash-password 轉換", plain);
+    return table;
+}
+
+// 替換目前的清單；還有登入在使用舊表時由最後一個登入釋放
+static void table_publish(AuthTable *table) {
+    pthread_mutex_lock(&table_lock);
+    AuthTable *old = current;
+    current = table;
+    if (old && old->refs == 0) table_free(old);
+    pthread_mutex_unlock(&table_lock);
+}
+
+static AuthTable *table_acquire(void) {
+    pthread_mutex_lock(&table_lock);
+    AuthTable *table = current;
+    if (table) table->refs++;
+    pthread_mutex_unlock(&table_lock);
+    return table;
+}
+
+static void table_release(AuthTable *table) {
+    pthread_mutex_lock(&table_lock);
+    if (--table->refs == 0 && table != current) table_free(table);
+    pthread_mutex_unlock(&table_lock);
+}
+
+static void auth_reload(void) {
+    AuthTable *table = table_load(users_path);
+    if (!table) {
+        log_error("重新載入使用者清單失敗，繼續使用原本的清單");
+        return;
+    }
+    table_publish(table);
+    log_info("載入使用者清單：%u 位使用者", table->count);
+}
+
+static void reload_signal(int sig) {
+    (void)sig;
+    int saved = errno;
+    if (write(reload_pipe[1], "", 1) < 0) {
+        // 管線已滿表示已經有一次重新載入在等待
+    }
+    errno = saved;
+}
+
+// 背景執行緒：使用者清單所在的資料夾有變動或收到 SIGHUP 時重新載入
+static void *auth_watcher(void *arg) {
+    int notify = (int)(intptr_t)arg;
+    char dir_buf[256], base_buf[256];
+    snprintf(dir_buf, sizeof(dir_buf), "%s", users_path);
+    snprintf(base_buf, sizeof(base_buf), "%s", users_path);
+    const char *base = basename(base_buf);
+    // 監看資料夾而不是檔案：編輯器常以 rename 取代整個檔案
+    if (notify >= 0 && inotify_add_watch(notify, dirname(dir_buf), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        log_perror("無法監看使用者清單");
+        close(notify);
+        notify = -1;
+    }
+
+    struct pollfd fds[2] = { { reload_pipe[0], POLLIN, 0 }, { notify, POLLIN, 0 } };
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (1) {
+        int pending = 0, timeout = -1;
+        while (poll(fds, 2, timeout) > 0) {
+            if (fds[0].revents & POLLIN) {
+                while (read(reload_pipe[0], buf, sizeof(buf)) > 0) {}
+                pending = 1;
+            }
+            if (fds[1].revents & POLLIN) {
+                ssize_t n;
+                while ((n = read(notify, buf, sizeof(buf))) > 0) {
+                    for (char *p = buf; p < buf + n;) {
+                        const struct inotify_event *event = (const struct inotify_event *)p;
+                        if (event->len > 0 && strcmp(event->name, base) == 0) pending = 1;
+                        p += sizeof(struct inotify_event) + event->len;
+                    }
+                }
+            }
+            if (pending) timeout = AUTH_RELOAD_QUIET_MS;
+        }
+        if (pending) auth_reload();
+    }
+    return NULL;
+}
+
+int auth_init(const char *path, uint32_t cost) {
+    snprintf(users_path, sizeof(users_path), "%s", path);
+    login_cost = cost;
+    AuthTable *table = table_load(users_path);
+    if (!table) return -1;
+    table_publish(table);
+    log_info("載入使用者清單：%u 位使用者", table->count);
+
+    if (pipe2(reload_pipe, O_CLOEXEC | O_NONBLOCK) != 0) {
+        log_perror("pipe 失敗");
+        return -1;
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = reload_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGHUP, &sa, NULL) != 0) {
+        log_perror("sigaction 失敗");
+        return -1;
+    }
+
+    int notify = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (notify < 0) log_perror("inotify 無法使用，只能以 SIGHUP 重新載入使用者清單");
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, auth_watcher, (void *)(intptr_t)notify) != 0) {
+        log_perror("pthread_create 失敗");
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+int auth_check(const char *username, const char *password) {
+    AuthTable *table = table_acquire();
+    const AuthUser *user = table ? table_find(table, username) : NULL;
+    static const uint8_t dummy_salt[AUTH_SALT_SIZE];
+    uint8_t digest[SHA256_DIGEST_SIZE], padding[SHA256_DIGEST_SIZE];
+    uint32_t cost = user ? user->cost : login_cost;
+    sha256_pbkdf2((const uint8_t *)password, strlen(password), user ? user->salt : dummy_salt, AUTH_SALT_SIZE,
+                  cost, digest);
+    // 迭代次數較少的使用者（明文密碼、較低成本的雜湊）補足到 login_cost，
+    // 回應時間不透露使用者是否存在或密碼的存放方式
+    if (cost < login_cost) {
+        sha256_pbkdf2((const uint8_t *)password, strlen(password), dummy_salt, AUTH_SALT_SIZE, login_cost - cost,
+                      padding);
+    }
+
+    // 比較所有位元組，比較的時間不透露雜湊相同的長度
+    uint8_t diff = user ? 0 : 1;
+    for (int i = 0; i < SHA256_DIGEST_SIZE; i++) diff |= digest[i] ^ (user ? user->hash[i] : 0);
+    if (table) table_release(table);
+    return diff == 0;
+}
+
+int auth_hash_password(const char *password, uint32_t cost, char *out, size_t size) {
+    uint8_t salt[AUTH_SALT_SIZE], digest[SHA256_DIGEST_SIZE];
+    if (cost == 0 || getrandom(salt, sizeof(salt), 0) != sizeof(salt)) return -1;
+    sha256_pbkdf2((const uint8_t *)password, strlen(password), salt, sizeof(salt), cost, digest);
+
+    char salt_hex[sizeof(salt) * 2 + 1], digest_hex[sizeof(digest) * 2 + 1];
+    for (size_t i = 0; i < sizeof(salt); i++) sprintf(salt_hex + i * 2, "%02x", salt[i]);
+    for (size_t i = 0; i < sizeof(digest); i++) sprintf(digest_hex + i * 2, "%02x", digest[i]);
+    int len = snprintf(out, size, AUTH_HASH_PREFIX "%u$%s$%s", cost, salt_hex, digest_hex);
+    return len >= 0 && (size_t)len < size ? 0 : -1;
+}
@@ -0,0 +1,46 @@
+#ifndef AUTH_H
+#define AUTH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// 使用者清單：啟動時讀進記憶體中的雜湊表，登入時只查表，不再每次打開檔案。
+// 檔案每行一位使用者，密碼可以是明文或雜湊：
+//   "<使用者> <密碼>"
+//   "<使用者> pbkdf2-sha256$<迭代次數>$<鹽(hex)>$<雜湊(hex)>"（storage --hash-password 產生）
+// 明文密碼載入時就加鹽雜湊，記憶體中不保留明文；檔案本身已經是明文，載入時只雜湊一次。
+// 每次驗證至少做 --login-cost 次迭代（不足的部分另外補上），明文密碼、雜湊密碼與不存在的使用者
+// 回應時間相同（雜湊的迭代次數不超過 --login-cost 時）。
+// 檔案修改（inotify）或收到 SIGHUP 時在背景重新載入，建好新表後才替換，
+// 登入中的 session 繼續使用舊表；讀取失敗時保留舊表。
+#define AUTH_DEFAULT_COST 10000     // 產生雜湊與驗證不存在的使用者時的迭代次數
+#define AUTH_SALT_SIZE 16
+#define AUTH_HASH_PREFIX "pbkdf2-sha256$"
+
+/**
+ * 載入使用者清單並開始監看檔案
+ * @param path 使用者清單檔案
+ * @param cost 每次驗證至少做的迭代次數，不存在的使用者也做一次這個成本的驗證，回應時間不透露使用者是否存在
+ * @return 0 表示成功（檔案不存在時是空的清單，建立後自動載入），-1 表示失敗
+ */
+int auth_init(const char *path, uint32_t cost);
+
+/**
+ * 驗證密碼
+ * @param username 使用者名稱
+ * @param password 密碼
+ * @return 1 表示正確，0 表示錯誤或使用者不存在
+ */
+int auth_check(const char *username, const char *password);
+
+/**
+ * 產生使用者清單中的雜湊密碼
+ * @param password 密碼
+ * @param cost 迭代次數
+ * @param out 輸出 "pbkdf2-sha256$..."
+ * @param size out 緩衝區大小
+ * @return 0 表示成功，-1 表示失敗
+ */
+int auth_hash_password(const char *password, uint32_t cost, char *out, size_t size);
+
+#endif // AUTH_H
@@ -0,0 +1,498 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "protocol.h"
+
+// 效能量測工具
+//   benchmark micro：協議函式與串流解碼迴圈的微基準
+//   benchmark e2e：在 loopback 上啟動 storage 與 transfer，量測 client → transfer → storage 的吞吐量
+// 結果以每行一個 JSON 物件輸出到 stdout，進度訊息輸出到 stderr。
+
+#define BENCH_USER "bench"
+#define BENCH_PASS "bench"
+
+struct BenchConfig {
+    char mode[16];
+    uint32_t frame_size;
+    long iterations;
+    size_t file_size;
+    int concurrency;
+    int sessions;
+    int port_base;
+    char storage_bin[256];
+    char transfer_bin[256];
+    char *transfer_args[16];      // 額外傳給 transfer 的參數（例如 --mode epoll）
+    int transfer_argc;
+    char *storage_args[16];       // 額外傳給 storage 的參數
+    int storage_argc;
+    int dynamic_port;             // 使用舊的動態 port 流程建立 session
+};
+
+static volatile uint64_t bench_sink;  // 避免編譯器把被量測的計算最佳化掉
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct BenchConfig parse_arguments(int argc, char *argv[]) {
+    struct BenchConfig config;
+    memset(&config, 0, sizeof(config));
+    config.frame_size = MAX_DATA_SIZE;
+    config.iterations = 1000000;
+    config.file_size = 8 * 1024 * 1024;
+    config.concurrency = 4;
+    config.sessions = 16;
+    config.port_base = 18080;
+    strcpy(config.storage_bin, "./storage");
+    strcpy(config.transfer_bin, "./transfer");
+
+    static struct option long_options[] = {
+        {"frame-size",   required_argument, 0, 'f'},
+        {"iterations",   required_argument, 0, 'n'},
+        {"file-size",    required_argument, 0, 's'},
+        {"concurrency",  required_argument, 0, 'c'},
+        {"sessions",     required_argument, 0, 'S'},
+        {"port-base",    required_argument, 0, 'p'},
+        {"storage-bin",  required_argument, 0, 'B'},
+        {"transfer-bin", required_argument, 0, 'T'},
+        {"transfer-arg", required_argument, 0, 'A'},
+        {"storage-arg",  required_argument, 0, 'a'},
+        {"dynamic-port", no_argument,       0, 'd'},
+        {0, 0, 0, 0}
+    };
+
+    if (argc < 2 || (strcmp(argv[1], "micro") != 0 && strcmp(argv[1], "e2e") != 0)) {
+        fprintf(stderr, "Usage: %s <micro|e2e> [--frame-size N] [--iterations N] [--file-size N] "
+                        "[--concurrency N] [--sessions N] [--port-base N] [--storage-bin P] [--transfer-bin P] "
+                        "[--transfer-arg ARG]... [--storage-arg ARG]... [--dynamic-port]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    strncpy(config.mode, argv[1], sizeof(config.mode) - 1);
+
+    int opt;
+    int option_index = 0;
+    optind = 2;
+    while ((opt = getopt_long(argc, argv, "f:n:s:c:S:p:B:T:A:a:d", long_options, &option_index)) != -1) {
+        switch (opt) {
+            case 'f': config.frame_size = strtoul(optarg, NULL, 10); break;
+            case 'n': config.iterations = strtol(optarg, NULL, 10); break;
+            case 's': config.file_size = strtoull(optarg, NULL, 10); break;
+            case 'c': config.concurrency = atoi(optarg); break;
+            case 'S': config.sessions = atoi(optarg); break;
+            case 'p': config.port_base = atoi(optarg); break;
+            case 'B': strncpy(config.storage_bin, optarg, sizeof(config.storage_bin) - 1); break;
+            case 'T': strncpy(config.transfer_bin, optarg, sizeof(config.transfer_bin) - 1); break;
+            case 'A':
+                if (config.transfer_argc < 15) config.transfer_args[config.transfer_argc++] = optarg;
+                break;
+            case 'a':
+                if (config.storage_argc < 15) config.storage_args[config.storage_argc++] = optarg;
+                break;
+            case 'd': config.dynamic_port = 1; break;
+            default:
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (config.frame_size == 0 || config.frame_size > MAX_DATA_SIZE_V2 ||
+        config.concurrency <= 0 || config.sessions <= 0 || config.iterations <= 0) {
+        fprintf(stderr, "參數超出範圍\n");
+        exit(EXIT_FAILURE);
+    }
+    return config;
+}
+
+static void report_micro(const char *name, uint32_t frame_size, long ops, size_t bytes, double elapsed) {
+    printf("{\"bench\":\"micro\",\"name\":\"%s\",\"frame_size\":%u,\"ops\":%ld,"
+           "\"ns_per_op\":%.2f,\"ops_per_s\":%.0f,\"mb_per_s\":%.2f}\n",
+           name, frame_size, ops, elapsed * 1e9 / ops, ops / elapsed, bytes / elapsed / 1e6);
+    fflush(stdout);
+}
+
+static void run_micro(const struct BenchConfig *config) {
+    uint32_t frame_size = config->frame_size;
+    long iterations = config->iterations;
+    uint8_t *payload = malloc(frame_size);
+    uint8_t *packed = malloc(FRAME_MAX_HEADER_SIZE + frame_size);
+    uint8_t *output = malloc(frame_size + 1);
+    for (uint32_t i = 0; i < frame_size; i++) payload[i] = (uint8_t)(i * 31);
+
+    // pack_message
+    double start = now_seconds();
+    int packed_len = 0;
+    for (long i = 0; i < iterations; i++) {
+        packed_len = pack_message(3, 0, BENCH_USER, (uint32_t)i, payload, frame_size, packed);
+        bench_sink += packed[packed_len - 1];
+    }
+    report_micro("pack_message", frame_size, iterations, (size_t)packed_len * iterations, now_seconds() - start);
+
+    // parse_header
+    ProtocolHeader header;
+    start = now_seconds();
+    for (long i = 0; i < iterations; i++) {
+        parse_header(packed, &header);
+        bench_sink += header.length;
+    }
+    report_micro("parse_header", frame_size, iterations, (size_t)packed_len * iterations, now_seconds() - start);
+
+    // parse_data
+    start = now_seconds();
+    for (long i = 0; i < iterations; i++) {
+        parse_data(packed + packed_len - frame_size, frame_size, output);
+        bench_sink += output[frame_size / 2];
+    }
+    report_micro("parse_data", frame_size, iterations, (size_t)frame_size * iterations, now_seconds() - start);
+
+    // 串流解碼迴圈：把連續的封包以 recv 大小的區塊餵給解碼器
+    const size_t stream_target = 16 * 1024 * 1024;
+    int frames_in_stream = stream_target / packed_len + 1;
+    size_t stream_len = (size_t)frames_in_stream * packed_len;
+    uint8_t *stream = malloc(stream_len);
+    for (int i = 0; i < frames_in_stream; i++) {
+        pack_message(3, 0, BENCH_USER, i, payload, frame_size, stream + (size_t)i * packed_len);
+    }
+
+    FrameDecoder dec;
+    frame_decoder_init(&dec, frame_size > MAX_DATA_SIZE ? frame_size : MAX_DATA_SIZE);
+    const size_t chunk = 64 * 1024;
+    long rounds = iterations / frames_in_stream + 1;
+    long frames = 0;
+    start = now_seconds();
+    for (long r = 0; r < rounds; r++) {
+        for (size_t off = 0; off < stream_len; off += chunk) {
+            size_t len = stream_len - off < chunk ? stream_len - off : chunk;
+            frame_decoder_feed(&dec, stream + off, len);
+            Frame frame;
+            while (frame_decoder_next(&dec, &frame) == 1) {
+                bench_sink += frame.data[0];
+                frames++;
+            }
+        }
+    }
+    report_micro("frame_decoder", frame_size, frames, (size_t)frames * packed_len, now_seconds() - start);
+
+    frame_decoder_free(&dec);
+    free(stream);
+    free(payload);
+    free(packed);
+    free(output);
+}
+
+// ---- 端到端 ----
+
+typedef struct {
+    const struct BenchConfig *config;
+    const uint8_t *file_data;
+    int next_session;             // 以 __atomic 取號
+    double *latency;              // 每個 session 的耗時（秒）
+    uint64_t frames;
+    uint64_t bytes;
+    int failures;
+    int restore;                  // 0 = 備份，1 = 還原
+    pthread_mutex_t lock;
+} E2EState;
+
+static int bench_connect(int port) {
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) return -1;
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+// 建立 session：要求 port（預設在同一條連線上進行）、登入並協商封包上限
+static int bench_open_session(const struct BenchConfig *config, Connection *conn) {
+    int sockfd = bench_connect(config->port_base + 1);
+    if (sockfd < 0 || conn_init(conn, sockfd) != 0) return -1;
+
+    uint8_t offer[64];
+    int offer_len = 0;
+    int want_v2 = config->frame_size > MAX_DATA_SIZE;
+    ProtocolCaps caps;
+    proto_caps_local(&caps);
+    caps.max_payload = want_v2 ? config->frame_size : MAX_DATA_SIZE;
+    if (!config->dynamic_port) caps.flags |= PROTO_CAP_INLINE_SESSION;
+    if (want_v2 || !config->dynamic_port) {
+        offer_len = proto_caps_append(offer, 0, sizeof(offer), &caps);
+    }
+    caps.flags = 0;
+
+    Frame frame;
+    char port_str[16];
+    if (conn_send(conn, 0, 0, "", 1, offer, offer_len, 0) != 0 || conn_receive(conn, &frame) <= 0) {
+        conn_close(conn);
+        return -1;
+    }
+    frame_copy_string(&frame, port_str, sizeof(port_str));
+    ProtocolCaps server_caps;
+    int server_v2 = proto_caps_parse(frame.data, frame.header.length, &server_caps);
+    int port = atoi(port_str);
+
+    if (port != 0 || !(server_caps.flags & PROTO_CAP_INLINE_SESSION)) {
+        conn_close(conn);
+        sockfd = bench_connect(port);
+        if (sockfd < 0 || conn_init(conn, sockfd) != 0) return -1;
+    }
+
+    uint8_t login[64];
+    int login_len = strlen(BENCH_PASS);
+    memcpy(login, BENCH_PASS, login_len);
+    if (server_v2 && want_v2) {
+        login_len = proto_caps_append(login, login_len, sizeof(login), &caps);
+    }
+    if (conn_send(conn, 1, 0, BENCH_USER, 1, login, login_len, 0) != 0 || conn_receive(conn, &frame) <= 0) {
+        conn_close(conn);
+        return -1;
+    }
+    proto_caps_parse(frame.data, frame.header.length, &caps);
+    conn_apply_caps(conn, &caps);
+    return 0;
+}
+
+static int bench_backup(E2EState *state, int id, uint64_t *frames) {
+    const struct BenchConfig *config = state->config;
+    Connection conn;
+    if (bench_open_session(config, &conn) != 0) return -1;
+
+    char name[64];
+    int name_len = snprintf(name, sizeof(name), "s%d|bench", id) + 1;
+    uint32_t seq = 1;
+    if (conn_send(&conn, 2, 0, BENCH_USER, seq++, (uint8_t *)name, name_len, SEND_MORE) != 0) {
+        conn_close(&conn);
+        return -1;
+    }
+
+    uint32_t frame_size = config->frame_size < conn.max_payload ? config->frame_size : conn.max_payload;
+    for (size_t off = 0; off < config->file_size; off += frame_size) {
+        uint32_t len = config->file_size - off < frame_size ? config->file_size - off : frame_size;
+        if (conn_send(&conn, 3, 0, BENCH_USER, seq++, state->file_data + off, len, SEND_MORE) != 0) {
+            conn_close(&conn);
+            return -1;
+        }
+        (*frames)++;
+    }
+    if (conn_send(&conn, 3, 1, BENCH_USER, seq, NULL, 0, 0) != 0) {
+        conn_close(&conn);
+        return -1;
+    }
+
+    // 等到伺服器關閉連線，代表檔案已寫完並關閉
+    Frame frame;
+    while (conn_receive(&conn, &frame) > 0) {}
+    conn_close(&conn);
+    return 0;
+}
+
+static int bench_restore(E2EState *state, int id, uint64_t *frames) {
+    Connection conn;
+    if (bench_open_session(state->config, &conn) != 0) return -1;
+
+    char name[64];
+    int name_len = snprintf(name, sizeof(name), BENCH_USER "_s%d|bench.txt", id);
+    if (conn_send(&conn, 5, 1, BENCH_USER, 1, (uint8_t *)name, name_len, 0) != 0) {
+        conn_close(&conn);
+        return -1;
+    }
+
+    size_t received = 0;
+    Frame frame;
+    int ret;
+    while ((ret = conn_receive(&conn, &frame)) > 0 && frame.header.status != 1) {
+        received += frame.header.length;
+        (*frames)++;
+    }
+    conn_close(&conn);
+    return (ret > 0 && received == state->config->file_size) ? 0 : -1;
+}
+
+static void *e2e_worker(void *arg) {
+    E2EState *state = arg;
+    while (1) {
+        int id = __atomic_fetch_add(&state->next_session, 1, __ATOMIC_RELAXED);
+        if (id >= state->config->sessions) break;
+
+        uint64_t frames = 0;
+        double start = now_seconds();
+        int ret = state->restore ? bench_restore(state, id, &frames) : bench_backup(state, id, &frames);
+        state->latency[id] = now_seconds() - start;
+
+        pthread_mutex_lock(&state->lock);
+        if (ret == 0) {
+            state->frames += frames;
+            state->bytes += state->config->file_size;
+        } else {
+            state->failures++;
+        }
+        pthread_mutex_unlock(&state->lock);
+    }
+    return NULL;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, int n, double p) {
+    int idx = (int)(p * (n - 1) + 0.5);
+    return sorted[idx];
+}
+
+static void run_e2e_phase(const struct BenchConfig *config, const uint8_t *file_data, int restore) {
+    E2EState state;
+    memset(&state, 0, sizeof(state));
+    state.config = config;
+    state.file_data = file_data;
+    state.restore = restore;
+    state.latency = calloc(config->sessions, sizeof(double));
+    pthread_mutex_init(&state.lock, NULL);
+
+    pthread_t *threads = calloc(config->concurrency, sizeof(pthread_t));
+    double start = now_seconds();
+    for (int i = 0; i < config->concurrency; i++) {
+        pthread_create(&threads[i], NULL, e2e_worker, &state);
+    }
+    for (int i = 0; i < config->concurrency; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = now_seconds() - start;
+
+    qsort(state.latency, config->sessions, sizeof(double), compare_double);
+    int n = config->sessions;
+    printf("{\"bench\":\"e2e\",\"op\":\"%s\",\"file_size\":%zu,\"frame_size\":%u,\"concurrency\":%d,"
+           "\"sessions\":%d,\"failures\":%d,\"seconds\":%.3f,\"mb_per_s\":%.2f,\"frames_per_s\":%.0f,"
+           "\"latency_ms\":{\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f}}\n",
+           restore ? "restore" : "backup", config->file_size, config->frame_size, config->concurrency,
+           n, state.failures, elapsed, state.bytes / elapsed / 1e6, state.frames / elapsed,
+           percentile(state.latency, n, 0.50) * 1e3, percentile(state.latency, n, 0.90) * 1e3,
+           percentile(state.latency, n, 0.99) * 1e3, state.latency[n - 1] * 1e3);
+    fflush(stdout);
+
+    pthread_mutex_destroy(&state.lock);
+    free(threads);
+    free(state.latency);
+}
+
+// 在工作目錄中啟動伺服器，輸出導向 /dev/null
+static pid_t spawn_server(const char *workdir, char *const argv[]) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (chdir(workdir) != 0) _exit(127);
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    return pid;
+}
+
+static int wait_for_port(int port) {
+    for (int i = 0; i < 100; i++) {
+        int sockfd = bench_connect(port);
+        if (sockfd >= 0) {
+            close(sockfd);
+            return 0;
+        }
+        usleep(50 * 1000);
+    }
+    return -1;
+}
+
+static void run_e2e(const struct BenchConfig *config) {
+    char storage_bin[PATH_MAX], transfer_bin[PATH_MAX];
+    if (!realpath(config->storage_bin, storage_bin) || !realpath(config->transfer_bin, transfer_bin)) {
+        fprintf(stderr, "找不到伺服器執行檔，請先執行 make\n");
+        exit(EXIT_FAILURE);
+    }
+
+    char workdir[] = "/tmp/bench.XXXXXX";
+    if (!mkdtemp(workdir)) {
+        perror("建立工作目錄失敗");
+        exit(EXIT_FAILURE);
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/backup", workdir);
+    mkdir(path, 0777);
+    snprintf(path, sizeof(path), "%s/users.txt", workdir);
+    FILE *users = fopen(path, "w");
+    fprintf(users, "%s %s\n", BENCH_USER, BENCH_PASS);
+    fclose(users);
+
+    char storage_port[16], transfer_port[16], backend[32], port_range[32];
+    snprintf(storage_port, sizeof(storage_port), "%d", config->port_base);
+    snprintf(transfer_port, sizeof(transfer_port), "%d", config->port_base + 1);
+    snprintf(backend, sizeof(backend), "127.0.0.1:%d", config->port_base);
+    snprintf(port_range, sizeof(port_range), "%d-%d", config->port_base + 100,
+             config->port_base + 100 + 2 * config->concurrency + 64);
+
+    char *storage_argv[24] = { storage_bin, "--port", storage_port };
+    int storage_argc = 3;
+    for (int i = 0; i < config->storage_argc; i++) storage_argv[storage_argc++] = config->storage_args[i];
+    storage_argv[storage_argc] = NULL;
+
+    char *transfer_argv[24] = { transfer_bin, "--port", transfer_port, "--backend", backend,
+                                "--port-range", port_range };
+    int transfer_argc = 7;
+    for (int i = 0; i < config->transfer_argc; i++) transfer_argv[transfer_argc++] = config->transfer_args[i];
+    transfer_argv[transfer_argc] = NULL;
+    pid_t storage_pid = spawn_server(workdir, storage_argv);
+    pid_t transfer_pid = spawn_server(workdir, transfer_argv);
+
+    if (wait_for_port(config->port_base) != 0 || wait_for_port(config->port_base + 1) != 0) {
+        fprintf(stderr, "伺服器啟動失敗\n");
+    } else {
+        uint8_t *file_data = malloc(config->file_size);
+        for (size_t i = 0; i < config->file_size; i++) file_data[i] = (uint8_t)rand();
+
+        fprintf(stderr, "e2e: %d sessions x %zu bytes, frame %u, concurrency %d\n",
+                config->sessions, config->file_size, config->frame_size, config->concurrency);
+        run_e2e_phase(config, file_data, 0);
+        run_e2e_phase(config, file_data, 1);
+        free(file_data);
+    }
+
+    kill(transfer_pid, SIGTERM);
+    kill(storage_pid, SIGTERM);
+    waitpid(transfer_pid, NULL, 0);
+    waitpid(storage_pid, NULL, 0);
+
+    char cmd[PATH_MAX + 16];
+    snprintf(cmd, sizeof(cmd), "rm -rf '%s'", workdir);
+    if (system(cmd) != 0) {
+        fprintf(stderr, "無法清除工作目錄 %s\n", workdir);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    struct BenchConfig config = parse_arguments(argc, argv);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (strcmp(config.mode, "micro") == 0) {
+        run_micro(&config);
+    } else {
+        run_e2e(&config);
+    }
+    return 0;
+}
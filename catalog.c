@@ -0,0 +1,460 @@
+#define _GNU_SOURCE
+#include "catalog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include "protocol.h"
+#include "shard.h"
+#include "store.h"
+#include "log.h"
+
+#define CATALOG_HASH_SIZE 256
+#define CATALOG_FILE ".catalog"
+#define CATALOG_LINE_MAX 1024
+
+/**
+ * 一個使用者的目錄，第一次用到時載入，之後一直留在記憶體中
+ */
+typedef struct Catalog {
+    char username[MAX_USERNAME_LENGTH + 1];
+    pthread_mutex_t lock;
+    int loaded;
+    CatalogEntry *entries;   // 依備份檔名排序
+    uint32_t count;
+    uint32_t cap;
+    int fd;                  // 目錄檔案，以 O_APPEND 寫入新的紀錄
+    uint32_t records;        // 目錄檔案中的紀錄數，遠多於 count 時重寫
+    struct Catalog *next;
+} Catalog;
+
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static Catalog *catalogs[CATALOG_HASH_SIZE];
+
+// 可以放進目錄的備份檔名：目錄以行與 tab 分隔欄位
+static int valid_file(const char *file) {
+    return file[0] != '\0' && file[0] != '.' && strlen(file) < 256 && !strpbrk(file, "/\t\n");
+}
+
+static void catalog_path(const Catalog *c, const char *name, char *path, size_t size) {
+    snprintf(path, size, "./backup/%s/%s", c->username, name);
+}
+
+// 第一個不小於 file 的位置
+static uint32_t lower_bound(const Catalog *c, const char *file) {
+    uint32_t lo = 0, hi = c->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (strcmp(c->entries[mid].file, file) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static void entry_free(CatalogEntry *e) {
+    free(e->file);
+    free(e->path);
+}
+
+static int entry_init(CatalogEntry *e, const char *file, const char *path, uint64_t size,
+                      const uint8_t sha256[SHA256_DIGEST_SIZE]) {
+    memset(e, 0, sizeof(CatalogEntry));
+    e->file = strdup(file);
+    e->path = strdup(path);
+    if (!e->file || !e->path) {
+        entry_free(e);
+        return -1;
+    }
+    // 原始路徑以 tab 與換行分隔，不能原樣存放
+    for (char *p = e->path; *p; p++) {
+        if (*p == '\t' || *p == '\n') *p = '?';
+    }
+    e->size = size;
+    if (sha256) {
+        memcpy(e->sha256, sha256, SHA256_DIGEST_SIZE);
+        e->has_sha256 = 1;
+    }
+    const char *bar = strrchr(file, '|');
+    e->name_end = bar ? (size_t)(bar - file) : strlen(file);
+    return 0;
+}
+
+// 新增或覆蓋記憶體中的紀錄
+static int catalog_put(Catalog *c, const char *file, const char *path, uint64_t size,
+                       const uint8_t sha256[SHA256_DIGEST_SIZE]) {
+    CatalogEntry e;
+    if (entry_init(&e, file, path, size, sha256) != 0) return -1;
+
+    uint32_t i = lower_bound(c, file);
+    if (i < c->count && strcmp(c->entries[i].file, file) == 0) {
+        entry_free(&c->entries[i]);
+        c->entries[i] = e;
+        return 0;
+    }
+    if (c->count == c->cap) {
+        uint32_t cap = c->cap ? c->cap * 2 : 64;
+        CatalogEntry *grown = realloc(c->entries, cap * sizeof(CatalogEntry));
+        if (!grown) {
+            entry_free(&e);
+            return -1;
+        }
+        c->entries = grown;
+        c->cap = cap;
+    }
+    memmove(&c->entries[i + 1], &c->entries[i], (c->count - i) * sizeof(CatalogEntry));
+    c->entries[i] = e;
+    c->count++;
+    return 0;
+}
+
+static void catalog_drop(Catalog *c, uint32_t i) {
+    entry_free(&c->entries[i]);
+    memmove(&c->entries[i], &c->entries[i + 1], (c->count - i - 1) * sizeof(CatalogEntry));
+    c->count--;
+}
+
+static int format_add(char *line, size_t size, const CatalogEntry *e) {
+    char hex[SHA256_DIGEST_SIZE * 2 + 1] = "-";
+    if (e->has_sha256) {
+        for (int i = 0; i < SHA256_DIGEST_SIZE; i++) sprintf(hex + i * 2, "%02x", e->sha256[i]);
+    }
+    return snprintf(line, size, "+ %llu %s %s\t%s\n", (unsigned long long)e->size, hex, e->file, e->path);
+}
+
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// 只留下目前的紀錄，寫到暫存檔再 rename
+static int catalog_rewrite(Catalog *c) {
+    char path[512], tmp[512];
+    catalog_path(c, CATALOG_FILE, path, sizeof(path));
+    catalog_path(c, CATALOG_FILE ".tmp", tmp, sizeof(tmp));
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+
+    char line[CATALOG_LINE_MAX];
+    for (uint32_t i = 0; i < c->count; i++) {
+        int len = format_add(line, sizeof(line), &c->entries[i]);
+        if (len >= (int)sizeof(line) || write_all(fd, line, len) != 0) {
+            close(fd);
+            unlink(tmp);
+            return -1;
+        }
+    }
+    if (close(fd) != 0 || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    if (c->fd >= 0) close(c->fd);
+    c->fd = -1;
+    c->records = c->count;
+    return 0;
+}
+
+static int catalog_append(Catalog *c, const char *line, int len) {
+    if (c->fd < 0) {
+        char path[512];
+        catalog_path(c, CATALOG_FILE, path, sizeof(path));
+        c->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (c->fd < 0) return -1;
+    }
+    if (len >= CATALOG_LINE_MAX || write_all(c->fd, line, len) != 0) return -1;
+    c->records++;
+    if (c->records > 2 * c->count + 64 && catalog_rewrite(c) != 0) log_warn("無法重寫備份目錄: %s", c->username);
+    return 0;
+}
+
+// 讀入目錄檔案中的紀錄
+static void catalog_read(Catalog *c) {
+    char path[512];
+    catalog_path(c, CATALOG_FILE, path, sizeof(path));
+    FILE *fp = fopen(path, "r");
+    if (!fp) return;
+
+    char line[CATALOG_LINE_MAX];
+    while (fgets(line, sizeof(line), fp)) {
+        c->records++;
+        char *end = strchr(line, '\n');
+        if (!end) continue;
+        *end = '\0';
+
+        if (line[0] == '-' && line[1] == ' ') {
+            uint32_t i = lower_bound(c, line + 2);
+            if (i < c->count && strcmp(c->entries[i].file, line + 2) == 0) catalog_drop(c, i);
+            continue;
+        }
+        unsigned long long size;
+        char hex[SHA256_DIGEST_SIZE * 2 + 1];
+        int used = 0;
+        if (sscanf(line, "+ %llu %64s %n", &size, hex, &used) != 2 || used == 0) continue;
+        char *file = line + used;
+        char *tab = strchr(file, '\t');
+        if (!tab) continue;
+        *tab = '\0';
+
+        uint8_t digest[SHA256_DIGEST_SIZE];
+        int has_sha256 = strlen(hex) == SHA256_DIGEST_SIZE * 2;
+        for (int i = 0; has_sha256 && i < SHA256_DIGEST_SIZE; i++) {
+            unsigned int byte;
+            if (sscanf(hex + i * 2, "%2x", &byte) != 1) has_sha256 = 0;
+            digest[i] = byte;
+        }
+        if (valid_file(file)) catalog_put(c, file, tab + 1, size, has_sha256 ? digest : NULL);
+    }
+    fclose(fp);
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * 載入目錄並與資料夾比對
+ * @return 1 表示目錄與資料夾不一致（已修正，需要重寫），0 表示一致
+ */
+static int catalog_reconcile(Catalog *c) {
+    char folder[512];
+    snprintf(folder, sizeof(folder), "./backup/%s", c->username);
+    DIR *dir = opendir(folder);
+    if (!dir) return c->count > 0;
+
+    char **names = NULL;
+    size_t count = 0, cap = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_type != DT_REG || !valid_file(entry->d_name)) continue;
+        if (count == cap) {
+            cap = cap ? cap * 2 : 64;
+            char **grown = realloc(names, cap * sizeof(char *));
+            if (!grown) break;
+            names = grown;
+        }
+        if (!(names[count] = strdup(entry->d_name))) break;
+        count++;
+    }
+    closedir(dir);
+    qsort(names, count, sizeof(char *), compare_names);
+
+    // 兩邊都已排序：只在目錄中的移除，只在資料夾中的補上
+    int changed = 0;
+    uint32_t i = 0;
+    for (size_t j = 0; j < count; j++) {
+        while (i < c->count && strcmp(c->entries[i].file, names[j]) < 0) {
+            catalog_drop(c, i);
+            changed = 1;
+        }
+        if (i < c->count && strcmp(c->entries[i].file, names[j]) == 0) {
+            i++;
+        } else {
+            char path[768];
+            snprintf(path, sizeof(path), "%s/%s", folder, names[j]);
+            StoreReader *reader = store_reader_open(path);
+            int64_t size = reader ? store_reader_size(reader) : -1;
+            if (reader) store_reader_close(reader);
+            if (size >= 0 && catalog_put(c, names[j], "", size, NULL) == 0) {
+                i++;
+                changed = 1;
+            }
+        }
+        free(names[j]);
+    }
+    while (i < c->count) {
+        catalog_drop(c, i);
+        changed = 1;
+    }
+    free(names);
+    return changed;
+}
+
+// 取得使用者的目錄並鎖住，第一次用到時載入
+static Catalog *catalog_get(const char *username) {
+    uint32_t slot = shard_hash(username, strlen(username)) % CATALOG_HASH_SIZE;
+    pthread_mutex_lock(&table_lock);
+    Catalog *c = catalogs[slot];
+    while (c && strcmp(c->username, username) != 0) c = c->next;
+    if (!c) {
+        c = calloc(1, sizeof(Catalog));
+        if (!c) {
+            pthread_mutex_unlock(&table_lock);
+            return NULL;
+        }
+        snprintf(c->username, sizeof(c->username), "%s", username);
+        pthread_mutex_init(&c->lock, NULL);
+        c->fd = -1;
+        c->next = catalogs[slot];
+        catalogs[slot] = c;
+    }
+    // 載入可能要讀很多檔案，只鎖住這個使用者的目錄
+    pthread_mutex_lock(&c->lock);
+    pthread_mutex_unlock(&table_lock);
+
+    if (!c->loaded) {
+        uint64_t records;
+        catalog_read(c);
+        records = c->records;
+        if ((catalog_reconcile(c) || records > 2 * (uint64_t)c->count + 64) && catalog_rewrite(c) != 0) {
+            log_warn("無法重寫備份目錄: %s", username);
+        }
+        c->loaded = 1;
+        log_debug("載入備份目錄 %s：%u 筆", username, c->count);
+    }
+    return c;
+}
+
+int catalog_add(const char *username, const char *file, const char *path, uint64_t size,
+                const uint8_t sha256[SHA256_DIGEST_SIZE]) {
+    if (!valid_file(file)) return -1;
+    Catalog *c = catalog_get(username);
+    if (!c) return -1;
+
+    int ret = catalog_put(c, file, path, size, sha256);
+    if (ret == 0) {
+        char line[CATALOG_LINE_MAX];
+        const CatalogEntry *e = &c->entries[lower_bound(c, file)];
+        if (catalog_append(c, line, format_add(line, sizeof(line), e)) != 0) {
+            // 記憶體中已經更新，下次載入時會從資料夾補回
+            log_warn("無法寫入備份目錄: %s", username);
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+    return ret;
+}
+
+int catalog_remove(const char *username, const char *file) {
+    Catalog *c = catalog_get(username);
+    if (!c) return -1;
+
+    uint32_t i = lower_bound(c, file);
+    int found = i < c->count && strcmp(c->entries[i].file, file) == 0;
+    if (found) {
+        catalog_drop(c, i);
+        char line[CATALOG_LINE_MAX];
+        if (catalog_append(c, line, snprintf(line, sizeof(line), "- %s\n", file)) != 0) {
+            log_warn("無法寫入備份目錄: %s", username);
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+    return found ? 0 : -1;
+}
+
+static int same_name(const CatalogEntry *a, const CatalogEntry *b) {
+    return a->name_end == b->name_end && memcmp(a->file, b->file, a->name_end) == 0;
+}
+
+// 備份檔名中的時間戳是否在範圍內
+static int in_range(const CatalogEntry *e, const CatalogQuery *query) {
+    const char *ts = e->file + e->name_end + (e->file[e->name_end] ? 1 : 0);
+    size_t ts_len = strlen(ts);
+    if (ts_len >= 4 && strcmp(ts + ts_len - 4, ".txt") == 0) ts_len -= 4;
+
+    if (query->since && query->since[0]) {
+        size_t n = strlen(query->since);
+        int cmp = memcmp(ts, query->since, ts_len < n ? ts_len : n);
+        if (cmp < 0 || (cmp == 0 && ts_len < n)) return 0;
+    }
+    if (query->until && query->until[0]) {
+        // 只比較結束時間的長度，"2024-05" 包含整個五月
+        size_t n = strlen(query->until);
+        if (memcmp(ts, query->until, ts_len < n ? ts_len : n) > 0) return 0;
+    }
+    return 1;
+}
+
+int catalog_query(const char *username, const CatalogQuery *query, CatalogVisit visit, void *arg, uint32_t *total) {
+    Catalog *c = catalog_get(username);
+    if (!c) return -1;
+
+    // 前綴比對原始檔名：所有符合的備份檔名都以 "使用者_前綴" 開頭，在排序中連續
+    char key[MAX_USERNAME_LENGTH + 512] = "";
+    size_t key_len = 0;
+    if (query->prefix && query->prefix[0]) {
+        key_len = snprintf(key, sizeof(key), "%s_%s%s", username, query->prefix,
+                           query->flags & CATALOG_EXACT ? "|" : "");
+        if (key_len >= sizeof(key)) key_len = sizeof(key) - 1;
+    }
+
+    // 分頁範圍內的紀錄先複製出來，放開鎖之後才交給 visit：
+    // visit 可能送出封包而等待很慢的客戶端，期間不能擋住新增、刪除與保留策略
+    CatalogEntry *page = NULL;
+    uint32_t page_count = 0, page_cap = 0;
+    int ret = 0;
+    uint32_t matched = 0;
+    for (uint32_t i = key_len ? lower_bound(c, key) : 0; i < c->count; i++) {
+        const CatalogEntry *e = &c->entries[i];
+        if (strncmp(e->file, key, key_len) != 0) break;
+        if (!in_range(e, query)) continue;
+        // 同一個檔案依時間排序，範圍內的下一個版本也相同名稱時這一筆就不是最新的
+        if ((query->flags & CATALOG_LATEST) && i + 1 < c->count && same_name(e, &c->entries[i + 1]) &&
+            in_range(&c->entries[i + 1], query)) {
+            continue;
+        }
+        if (ret == 0 && matched >= query->offset && (query->limit == 0 || matched - query->offset < query->limit)) {
+            if (page_count == page_cap) {
+                uint32_t cap = page_cap ? page_cap * 2 : 64;
+                CatalogEntry *entries = realloc(page, cap * sizeof(CatalogEntry));
+                if (entries) {
+                    page = entries;
+                    page_cap = cap;
+                }
+            }
+            if (page_count == page_cap ||
+                entry_init(&page[page_count], e->file, e->path, e->size, e->has_sha256 ? e->sha256 : NULL) != 0) {
+                ret = -1;
+            } else {
+                page_count++;
+            }
+        }
+        matched++;
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    for (uint32_t i = 0; i < page_count; i++) {
+        if (ret == 0 && visit(&page[i], arg) != 0) ret = -1;
+        entry_free(&page[i]);
+    }
+    free(page);
+    if (total) *total = matched;
+    return ret;
+}
+
+typedef struct {
+    char *file;
+    size_t size;
+} LatestResult;
+
+static int copy_latest(const CatalogEntry *entry, void *arg) {
+    LatestResult *result = arg;
+    if (strlen(entry->file) >= result->size) return -1;
+    strcpy(result->file, entry->file);
+    return 0;
+}
+
+int catalog_latest(const char *username, const char *name, char *file, size_t size) {
+    CatalogQuery query = { name, NULL, NULL, CATALOG_LATEST | CATALOG_EXACT, 0, 1 };
+    LatestResult result = { file, size };
+    uint32_t total;
+    file[0] = '\0';
+    if (catalog_query(username, &query, copy_latest, &result, &total) != 0) return -1;
+    return file[0] ? 0 : -1;
+}
+
+int catalog_find(const char *username, const char *file, uint64_t *size) {
+    Catalog *c = catalog_get(username);
+    if (!c) return -1;
+
+    uint32_t i = lower_bound(c, file);
+    int found = i < c->count && strcmp(c->entries[i].file, file) == 0;
+    if (found) *size = c->entries[i].size;
+    pthread_mutex_unlock(&c->lock);
+    return found ? 0 : -1;
+}
@@ -0,0 +1,103 @@
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "sha256.h"
+
+// 每個使用者的備份目錄：記錄每個備份的檔名、客戶端的原始路徑、大小與內容的 SHA-256。
+// 目錄存在 ./backup/<使用者>/.catalog，每行一筆異動，第一次用到時讀進記憶體並依備份檔名排序：
+//   "+ <大小> <SHA-256 或 -> <備份檔名>\t<原始路徑>"：新增或覆蓋
+//   "- <備份檔名>"：刪除
+// 讀入時與資料夾的內容比對：目錄中沒有的備份（例如寫完目錄前當機）補上大小，但沒有雜湊；
+// 已經不存在的備份移除。失效的紀錄太多時整個重寫。
+//
+// OP_LIST_CATALOG：客戶端送出 offset(4) limit(4) flags(1) 前綴 '\0' 起始時間 '\0' 結束時間，
+//   前綴比對原始檔名，時間是備份檔名中的時間戳（字串比較，結束時間可以只寫前面一段，例如 "2024-05"），
+//   空字串表示不限；limit 為 0 表示不限。
+//   回覆 status 0 的封包各含多筆 CATALOG_ENTRY：size(8) has_hash(1) sha256(32) 檔名長度(2) 檔名 路徑長度(2) 路徑，
+//   依原始檔名、時間排序；status 1 的結束封包是符合條件的總筆數(4)，用於分頁。
+// 儲存伺服器在登入回覆中帶上 PROTO_CAP_CATALOG 才可以使用。
+#define OP_LIST_CATALOG 10
+
+#define CATALOG_LATEST 0x1      // 每個原始檔名只列出最新的版本
+#define CATALOG_EXACT  0x2      // 前綴必須是完整的原始檔名
+
+#define CATALOG_QUERY_HEADER_SIZE 9
+#define CATALOG_ENTRY_FIXED_SIZE (8 + 1 + SHA256_DIGEST_SIZE + 2 + 2)
+
+typedef struct {
+    char *file;              // 備份檔名："使用者_檔名|時間戳.txt"
+    char *path;              // 客戶端的原始路徑，不知道時是空字串
+    uint64_t size;
+    uint8_t sha256[SHA256_DIGEST_SIZE];
+    int has_sha256;
+    uint16_t name_end;       // file 中最後一個 '|' 的位置，之前是 "使用者_檔名"
+} CatalogEntry;
+
+typedef struct {
+    const char *prefix;
+    const char *since;
+    const char *until;
+    int flags;               // CATALOG_LATEST、CATALOG_EXACT
+    uint32_t offset;
+    uint32_t limit;
+} CatalogQuery;
+
+/**
+ * 查詢時對每筆符合的紀錄呼叫，不持有目錄的鎖（紀錄是查詢當時的複本）
+ * @return 0 表示繼續，-1 表示停止
+ */
+typedef int (*CatalogVisit)(const CatalogEntry *entry, void *arg);
+
+/**
+ * 新增或覆蓋一筆紀錄（備份發布之後呼叫）
+ * @param username 使用者名稱
+ * @param file 備份檔名
+ * @param path 原始路徑，可以是空字串
+ * @param size 原文大小
+ * @param sha256 內容的雜湊，NULL 表示沒有
+ * @return 0 表示成功，-1 表示失敗
+ */
+int catalog_add(const char *username, const char *file, const char *path, uint64_t size,
+                const uint8_t sha256[SHA256_DIGEST_SIZE]);
+
+/**
+ * 刪除一筆紀錄（備份刪除之後呼叫）
+ * @param username 使用者名稱
+ * @param file 備份檔名
+ * @return 0 表示成功，-1 表示失敗
+ */
+int catalog_remove(const char *username, const char *file);
+
+/**
+ * 查詢
+ * @param username 使用者名稱
+ * @param query 條件
+ * @param visit 對每筆分頁範圍內的紀錄呼叫
+ * @param arg 傳給 visit
+ * @param total 輸出符合條件的總筆數（不受分頁限制），可以是 NULL
+ * @return 0 表示成功，-1 表示失敗或 visit 要求停止
+ */
+int catalog_query(const char *username, const CatalogQuery *query, CatalogVisit visit, void *arg, uint32_t *total);
+
+/**
+ * 找出檔案最新的備份
+ * @param username 使用者名稱
+ * @param name 原始檔名
+ * @param file 輸出備份檔名
+ * @param size file 緩衝區大小
+ * @return 0 表示找到，-1 表示沒有
+ */
+int catalog_latest(const char *username, const char *name, char *file, size_t size);
+
+/**
+ * 查詢一個備份
+ * @param username 使用者名稱
+ * @param file 備份檔名
+ * @param size 輸出原文大小
+ * @return 0 表示找到，-1 表示沒有
+ */
+int catalog_find(const char *username, const char *file, uint64_t *size);
+
+#endif // CATALOG_H
@@ -0,0 +1,141 @@
+#define _GNU_SOURCE
+#include "chunk.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "log.h"
+
+#define MASK_BITS(n) (((1ULL << (n)) - 1) << (64 - (n)))   // 用雜湊的高位元，低位元受最近的位元組影響較少
+#define MASK_STRICT MASK_BITS(CHUNK_AVG_BITS + 2)
+#define MASK_LOOSE  MASK_BITS(CHUNK_AVG_BITS - 2)
+
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+// 以固定種子產生 gear 表：切點必須在每次執行時都相同，舊備份的區塊才能被重用
+static void gear_init() {
+    uint64_t x = 0x6a09e667f3bcc908ULL;
+    for (int i = 0; i < 256; i++) {
+        // splitmix64
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+int chunker_init(Chunker *chunker) {
+    pthread_once(&gear_once, gear_init);
+    chunker->buf = malloc(CHUNK_MAX_SIZE);
+    if (!chunker->buf) return -1;
+    chunker_reset(chunker);
+    return 0;
+}
+
+void chunker_free(Chunker *chunker) {
+    free(chunker->buf);
+    chunker->buf = NULL;
+}
+
+void chunker_reset(Chunker *chunker) {
+    chunker->hash = 0;
+    chunker->len = 0;
+}
+
+size_t chunker_feed(Chunker *chunker, const uint8_t *data, size_t len, int *cut) {
+    uint64_t hash = chunker->hash;
+    size_t have = chunker->len;
+    size_t room = CHUNK_MAX_SIZE - have;
+    size_t n = len < room ? len : room;
+    size_t i = 0;
+    *cut = 0;
+
+    for (; i < n; i++) {
+        hash = (hash << 1) + gear[data[i]];
+        size_t size = have + i + 1;
+        if (size < CHUNK_MIN_SIZE) continue;
+        uint64_t mask = size < (1u << CHUNK_AVG_BITS) ? MASK_STRICT : MASK_LOOSE;
+        if ((hash & mask) == 0) {
+            *cut = 1;
+            i++;
+            break;
+        }
+    }
+    if (have + i == CHUNK_MAX_SIZE) *cut = 1;
+
+    memcpy(chunker->buf + have, data, i);
+    chunker->len = have + i;
+    chunker->hash = hash;
+    return i;
+}
+
+// 更新區塊修改時間（讀）與回收區塊時的檢查加刪除（寫）互斥：
+// 回收看到的修改時間不會在刪除之前被更新
+static pthread_rwlock_t gc_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+void chunk_path(const char *hex, char *path, size_t size) {
+    snprintf(path, size, "%s/%.2s/%s", CHUNK_DIR, hex, hex);
+}
+
+int chunk_store_put(const uint8_t *data, size_t len, char hex[CHUNK_HEX_SIZE + 1]) {
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    sha256(data, len, digest);
+    for (int i = 0; i < SHA256_DIGEST_SIZE; i++) sprintf(hex + i * 2, "%02x", digest[i]);
+
+    char path[256];
+    chunk_path(hex, path, sizeof(path));
+    // 已存在時更新修改時間：回收區塊時，寫入中的備份剛用到的區塊不會被當成沒有參考
+    pthread_rwlock_rdlock(&gc_lock);
+    int exists = utimensat(AT_FDCWD, path, NULL, 0) == 0;
+    pthread_rwlock_unlock(&gc_lock);
+    if (exists) return 0;
+
+    char dir[64];
+    snprintf(dir, sizeof(dir), "%s/%.2s", CHUNK_DIR, hex);
+    mkdir(CHUNK_DIR, 0777);
+    mkdir(dir, 0777);
+
+    // 暫存檔名含執行緒 ID，同時寫入相同區塊的執行緒各寫各的，最後 rename 的結果相同
+    char tmp[300];
+    snprintf(tmp, sizeof(tmp), "%s.tmp.%d", path, gettid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        log_perror("無法建立區塊檔案");
+        return -1;
+    }
+    size_t off = 0;
+    while (off < len) {
+        ssize_t n = write(fd, data + off, len - off);
+        if (n < 0) {
+            log_perror("區塊寫入失敗");
+            close(fd);
+            unlink(tmp);
+            return -1;
+        }
+        off += n;
+    }
+    if (close(fd) != 0 || rename(tmp, path) != 0) {
+        log_perror("區塊寫入失敗");
+        unlink(tmp);
+        return -1;
+    }
+    return 1;
+}
+
+int chunk_remove(const char *path, time_t cutoff, uint64_t *size) {
+    pthread_rwlock_wrlock(&gc_lock);
+    struct stat st;
+    int ret = 0;
+    if (stat(path, &st) != 0) {
+        ret = -1;
+    } else if (S_ISREG(st.st_mode) && st.st_mtime < cutoff) {
+        ret = unlink(path) == 0 ? 1 : -1;
+        *size = st.st_size;
+    }
+    pthread_rwlock_unlock(&gc_lock);
+    return ret;
+}
@@ -0,0 +1,87 @@
+#ifndef CHUNK_H
+#define CHUNK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include "sha256.h"
+
+// 內容定義切塊（content-defined chunking）：切點只由附近的內容決定，
+// 檔案中間插入或刪除資料只影響附近的區塊，其餘區塊與上一次備份相同而不必再存一次。
+#define CHUNK_MIN_SIZE (2 * 1024)    // 小於這個長度不切，避免過多的小區塊
+#define CHUNK_AVG_BITS 13            // 平均區塊大小約 2^13 = 8 KB
+#define CHUNK_MAX_SIZE (64 * 1024)   // 超過這個長度強制切
+#define CHUNK_HEX_SIZE (SHA256_DIGEST_SIZE * 2)
+#define CHUNK_DIR "./chunks"         // 所有使用者共用的區塊目錄，以 SHA-256 命名
+
+/**
+ * 串流切塊器：以 gear 滾動雜湊尋找切點，目前區塊的內容累積在 buf
+ * 平均長度之前用較嚴格的遮罩、之後用較寬鬆的遮罩（normalized chunking），區塊大小較集中。
+ */
+typedef struct {
+    uint64_t hash;
+    uint8_t *buf;                    // CHUNK_MAX_SIZE
+    size_t len;
+} Chunker;
+
+/**
+ * 初始化切塊器
+ * @param chunker 切塊器
+ * @return 0 表示成功，-1 表示失敗
+ */
+int chunker_init(Chunker *chunker);
+
+/**
+ * 釋放切塊器的緩衝區
+ * @param chunker 切塊器
+ */
+void chunker_free(Chunker *chunker);
+
+/**
+ * 輸入資料直到找到下一個切點
+ * 回傳 *cut 為 1 時 buf[0..len) 是一個完整的區塊，呼叫端取用後以 chunker_reset 開始下一個區塊，
+ * 再以剩下的資料繼續呼叫。資料結束時 buf 中剩下的內容是最後一個區塊。
+ * @param chunker 切塊器
+ * @param data 資料
+ * @param len 長度
+ * @param cut 輸出是否找到切點
+ * @return 這次取用的位元組數
+ */
+size_t chunker_feed(Chunker *chunker, const uint8_t *data, size_t len, int *cut);
+
+/**
+ * 開始下一個區塊
+ * @param chunker 切塊器
+ */
+void chunker_reset(Chunker *chunker);
+
+/**
+ * 儲存一個區塊，相同內容的區塊已存在時不再寫入
+ * 先寫入暫存檔再 rename，同時寫入相同區塊的連線不會讀到不完整的檔案。
+ * 已存在的區塊更新修改時間（見 retention.h 的區塊回收）。
+ * @param data 區塊內容
+ * @param len 長度
+ * @param hex 輸出區塊的 SHA-256（十六進位，以 '\0' 結尾）
+ * @return 1 表示新寫入，0 表示已存在，-1 表示失敗
+ */
+int chunk_store_put(const uint8_t *data, size_t len, char hex[CHUNK_HEX_SIZE + 1]);
+
+/**
+ * 區塊檔案的路徑：CHUNK_DIR/<前兩個字元>/<雜湊值>
+ * @param hex 區塊的 SHA-256（十六進位）
+ * @param path 輸出路徑
+ * @param size path 的大小
+ */
+void chunk_path(const char *hex, char *path, size_t size);
+
+/**
+ * 回收區塊：修改時間早於 cutoff 才刪除；與 chunk_store_put 更新修改時間互斥，
+ * 檢查之後、刪除之前被重新使用的區塊不會被刪除
+ * @param path 區塊檔案（或當機留下的暫存檔）的路徑
+ * @param cutoff 界線
+ * @param size 輸出刪除的檔案大小
+ * @return 1 表示已刪除，0 表示還在使用，-1 表示失敗（例如已經不存在）
+ */
+int chunk_remove(const char *path, time_t cutoff, uint64_t *size);
+
+#endif // CHUNK_H
@@ -7,34 +7,109 @@
 #include <unistd.h>
 #include <errno.h>
 #include "protocol.h"
+#include "log.h"
+#include "delta.h"
+#include "sha256.h"
+#include "compress.h"
+#include "catalog.h"
+#include "resume.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
 #include <netinet/tcp.h>
 #include <getopt.h>
 
+#define SERVER_IP "192.168.56.102"
 #define SERVER_PORT 8080
-#define RECV_BUF_SIZE 8192
+#define CLIENT_MAX_FILES 1024
+#define CLIENT_PIPELINE_DEPTH 32   // 多操作 session 中最多同時在途（還沒收到結果）的操作數
+#define CLIENT_RESUME_RETRIES 5    // --resume：連線中斷後重新連線續傳的次數
+#define CLIENT_MAX_RANGES 32       // --range 的上限，v1 的小封包也放得下
 
 struct ClientConfig {
     char username[64];
     char password[64];
     char mode[32];
-    char filepath[256];  // 加入 file 路徑參數
+    const char *files[CLIENT_MAX_FILES];  // --file 與其餘的參數，一次 session 處理多個檔案
+    int file_count;
+    char server_ip[64];
+    int server_port;
+    int dynamic_port;    // 強制使用舊的動態 port 流程
+    int delta;           // 備份時只送與上一個版本不同的部分（需要多操作 session）
+    int no_compress;     // 不提出壓縮（CPU 比頻寬貴的環境）
+    int resume;          // 備份途中連線中斷時重新連線，從儲存伺服器已寫入的位置繼續
+    // 取回模式只取部分範圍，每個是 offset(8) length(8)（OP_RESTORE_RANGE）
+    uint8_t ranges[CLIENT_MAX_RANGES][RESTORE_RANGE_SIZE];
+    int range_count;
+    int to_stdout;       // 取回的內容依序寫到標準輸出，而不是寫進檔案的對應位置
+    // 列表模式的查詢條件（需要儲存伺服器支援備份目錄）
+    const char *prefix;  // 原始檔名的前綴
+    const char *since;   // 時間戳範圍，例如 "2024-05-01"、"2024-05"
+    const char *until;
+    int latest;          // 每個檔案只列出最新的版本
+    uint32_t offset;
+    uint32_t limit;
 };
 
+// 解析 --range，輸出 offset(8) length(8)
+static int parse_range(const char *spec, uint8_t range[RESTORE_RANGE_SIZE]) {
+    char *end;
+    uint64_t offset, len;
+    if (spec[0] == '-') {
+        // 最後一段
+        offset = RESTORE_SUFFIX;
+        len = strtoull(spec + 1, &end, 10);
+        if (end == spec + 1 || *end != '\0') return -1;
+    } else {
+        offset = strtoull(spec, &end, 10);
+        if (end == spec || *end != '-') return -1;
+        const char *last = end + 1;
+        if (*last == '\0') {
+            len = UINT64_MAX - offset;   // 到檔案結尾，儲存伺服器截到檔案大小
+        } else {
+            uint64_t stop = strtoull(last, &end, 10);
+            if (*end != '\0' || stop < offset) return -1;
+            len = stop - offset + 1;
+        }
+    }
+    for (int i = 0; i < 8; i++) {
+        range[i] = offset >> ((7 - i) * 8);
+        range[8 + i] = len >> ((7 - i) * 8);
+    }
+    return 0;
+}
+
 struct ClientConfig parse_arguments(int argc, char *argv[]) {
     struct ClientConfig config;
     memset(&config, 0, sizeof(config));
+    strcpy(config.server_ip, SERVER_IP);
+    config.server_port = SERVER_PORT;
 
     static struct option long_options[] = {
         {"username", required_argument, 0, 'u'},
         {"password", required_argument, 0, 'p'},
         {"mode",     required_argument, 0, 'm'},
         {"file",     required_argument, 0, 'f'},  // 加入 file 參數
+        {"server",   required_argument, 0, 's'},
+        {"dynamic-port", no_argument,   0, 'd'},
+        {"delta",    no_argument,       0, 'D'},
+        {"no-compress", no_argument,    0, 'Z'},
+        {"resume",   no_argument,       0, 'r'},
+        {"range",    required_argument, 0, 'R'},  // "開始-結束"（包含結束）、"開始-" 或 "-長度"（最後一段）
+        {"stdout",   no_argument,       0, 'o'},
+        {"log-level", required_argument, 0, 'L'},  // debug 以上印出每個收到的封包
+        {"prefix",   required_argument, 0, 'P'},
+        {"since",    required_argument, 0, 'S'},
+        {"until",    required_argument, 0, 'U'},
+        {"latest",   no_argument,       0, 'l'},
+        {"offset",   required_argument, 0, 'O'},
+        {"limit",    required_argument, 0, 'N'},
         {0, 0, 0, 0}
     };
 
     int opt;
     int option_index = 0;
-    while ((opt = getopt_long(argc, argv, "u:p:m:f:", long_options, &option_index)) != -1) {
+    while ((opt = getopt_long(argc, argv, "u:p:m:f:s:dDZrR:oL:P:S:U:lO:N:", long_options, &option_index)) != -1) {
         switch (opt) {
             case 'u':
                 strncpy(config.username, optarg, sizeof(config.username) - 1);
@@ -46,13 +121,82 @@ struct ClientConfig parse_arguments(int argc, char *argv[]) {
                 strncpy(config.mode, optarg, sizeof(config.mode) - 1);
                 break;
             case 'f':
-                strncpy(config.filepath, optarg, sizeof(config.filepath) - 1);
+                if (config.file_count == CLIENT_MAX_FILES) {
+                    fprintf(stderr, "最多 %d 個檔案\n", CLIENT_MAX_FILES);
+                    exit(EXIT_FAILURE);
+                }
+                config.files[config.file_count++] = optarg;
+                break;
+            case 's':
+                if (parse_address(optarg, config.server_ip, sizeof(config.server_ip), &config.server_port) != 0) {
+                    fprintf(stderr, "Invalid server address: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'd':
+                config.dynamic_port = 1;
+                break;
+            case 'D':
+                config.delta = 1;
+                break;
+            case 'Z':
+                config.no_compress = 1;
+                break;
+            case 'r':
+                config.resume = 1;
+                break;
+            case 'R':
+                if (config.range_count == CLIENT_MAX_RANGES ||
+                    parse_range(optarg, config.ranges[config.range_count]) != 0) {
+                    fprintf(stderr, "無效的範圍（或超過 %d 個）: %s\n", CLIENT_MAX_RANGES, optarg);
+                    exit(EXIT_FAILURE);
+                }
+                config.range_count++;
+                break;
+            case 'o':
+                config.to_stdout = 1;
+                break;
+            case 'L':
+                log_level = log_parse_level(optarg);
+                if (log_level < 0) {
+                    fprintf(stderr, "未知的日誌等級: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'P':
+                config.prefix = optarg;
+                break;
+            case 'S':
+                config.since = optarg;
+                break;
+            case 'U':
+                config.until = optarg;
+                break;
+            case 'l':
+                config.latest = 1;
+                break;
+            case 'O':
+                config.offset = strtoul(optarg, NULL, 10);
+                break;
+            case 'N':
+                config.limit = strtoul(optarg, NULL, 10);
                 break;
             default:
-                fprintf(stderr, "Usage: %s --username <user> --password <pass> --mode <backup|restore|list|setup-cron> [--file <path>]\n", argv[0]);
+                fprintf(stderr, "Usage: %s --username <user> --password <pass> --mode <backup|restore|list|setup-cron> [--file <path>]... [--server <host:port>] [--dynamic-port] [--delta] [--no-compress] [--resume] [--log-level <level>]\n"
+                                "       restore: [--range <start-end|start-|-length>]... [--stdout]\n"
+                                "       list: [--file <name>] [--prefix <name>] [--since <time>] [--until <time>] [--latest] [--offset <n>] [--limit <n>]\n", argv[0]);
                 exit(EXIT_FAILURE);
         }
     }
+    // --file 之外的參數也當成檔案
+    for (int i = optind; i < argc; i++) {
+        if (config.file_count == CLIENT_MAX_FILES) {
+            fprintf(stderr, "最多 %d 個檔案\n", CLIENT_MAX_FILES);
+            exit(EXIT_FAILURE);
+        }
+        config.files[config.file_count++] = argv[i];
+    }
+
     // 簡單檢查是否有輸入必要參數
     if (strlen(config.username) == 0 || strlen(config.password) == 0 || strlen(config.mode) == 0) {
         fprintf(stderr, "Missing required arguments.\n");
@@ -92,128 +236,122 @@ int init_client(const char *server_ip, int port) {
 }
 
 // 發送資料
-int client_send(int sockfd, uint8_t operation, uint8_t status, const char *username, uint32_t *sequence, const uint8_t *data, uint32_t length) {
-    uint8_t buffer[MAX_DATA_SIZE];
-    int send_len = pack_message(operation, status, username, *sequence, data, length, buffer);
-    if (send_len < 0) {
-        fprintf(stderr, "封裝訊息失敗\n");
-        return -1;
-    }
-
-    int sent_bytes = send(sockfd, buffer, send_len, 0);
-    if (sent_bytes != send_len) {
-        perror("發送數據失敗");
+int client_send(Connection *conn, uint8_t operation, uint8_t status, const char *username, uint32_t *sequence, const uint8_t *data, uint32_t length, int flags) {
+    if (conn_send(conn, operation, status, username, *sequence, data, length, flags) != 0) {
+        fprintf(stderr, "發送數據失敗\n");
         return -1;
     }
 
-    return sent_bytes;
+    return length;
 }
 
-// 接收資料
-int client_receive(int sockfd, const char *username, uint32_t *sequence, uint8_t data[MAX_DATA_SIZE]) {
-    static uint8_t recv_buffer[RECV_BUF_SIZE];
-    static int buffer_len = 0;
-
+// 接收資料，frame 的數據區直接指向該連線的接收緩衝區，不做複製
+int client_receive(Connection *conn, const char *username, Frame *frame) {
     while (1) {
-        // 嘗試從 socket 讀更多資料進緩衝區
-        int bytes = recv(sockfd, recv_buffer + buffer_len, RECV_BUF_SIZE - buffer_len, 0);
-        if (bytes < 0) {
-            perror("接收失敗");
+        int ret = conn_receive(conn, frame);
+        if (ret < 0) {
             return -1;
-        } else if (bytes == 0) {
+        } else if (ret == 0) {
             // 對端關閉連線
             printf("連線關閉\n");
             return 0;
         }
-        buffer_len += bytes;
-
-        if (buffer_len < 11) continue;
-
-        uint8_t username_len = recv_buffer[2];
-        int header_len = 3 + username_len + 8;
-        if (buffer_len < header_len) continue;
-
-        // 取得 data 長度（4 bytes）
-        uint32_t data_len;
-        memcpy(&data_len, recv_buffer + 3 + username_len + 4, 4);
-        data_len = ntohl(data_len);
-
-        int total_len = header_len + data_len;
-        if (buffer_len < total_len) continue;
-
-        // 解析 header
-        ProtocolHeader header;
-        if (parse_header(recv_buffer, &header) != 0) {
-            fprintf(stderr, "協議頭部解析失敗\n");
-            return -1;
-        }
 
         // 驗證 username 是否符合
-        if (strcmp(username, header.username) != 0) {
+        if (strcmp(username, frame->header.username) != 0) {
             fprintf(stderr, "收到非針對當前用戶的數據\n");
             // 丟棄這筆封包
-            memmove(recv_buffer, recv_buffer + total_len, buffer_len - total_len);
-            buffer_len -= total_len;
             continue;
         }
 
-        // 複製資料
-        parse_data(recv_buffer + header_len, header.length, data);
-        *sequence = header.sequence;
-
-        printf("接收資料 - Operation: %d, Status: %d, Sequence: %u, Data: %s\n", 
-                header.operation, header.status, *sequence, data);
+        log_frame("接收資料", &frame->header, frame->data);
 
-        // 移除已處理的封包
-        memmove(recv_buffer, recv_buffer + total_len, buffer_len - total_len);
-        buffer_len -= total_len;
-
-        return header.length;
+        return 1;
     }
 }
 
-// 請求動態分配 port
-int request_port(int sockfd) {
+// 請求動態分配 port，同時取得轉發伺服器的能力宣告（v1 伺服器只回 port）
+// inline 非 0 時提出單一連線模式，伺服器接受時回傳 0，session 直接在這條連線上進行
+int request_port(Connection *conn, ProtocolCaps *server_caps, int inline_session) {
     uint32_t sequence = 1;
-    uint8_t buffer[MAX_DATA_SIZE] = {0};
-    int sent = client_send(sockfd, 0, 0, "", &sequence, NULL, 0);
+    char buffer[16] = {0};
+
+    uint8_t offer[PROTO_CAPS_SIZE];
+    ProtocolCaps caps;
+    proto_caps_local(&caps);
+    if (inline_session) caps.flags |= PROTO_CAP_INLINE_SESSION;
+    int offer_len = proto_caps_append(offer, 0, sizeof(offer), &caps);
+
+    int sent = client_send(conn, 0, 0, "", &sequence, offer, offer_len, 0);
     if (sent < 0) {
         fprintf(stderr, "Port request failed\n");
         return -1;
     }
 
-    client_receive(sockfd, "", &sequence, buffer);
+    Frame frame;
+    if (client_receive(conn, "", &frame) <= 0) {
+        fprintf(stderr, "Port request failed\n");
+        return -1;
+    }
+    frame_copy_string(&frame, buffer, sizeof(buffer));
+    proto_caps_parse(frame.data, frame.header.length, server_caps);
 
-    int new_port = atoi((char *)buffer);
+    int new_port = atoi(buffer);
+    if (new_port == 0 && inline_session && (server_caps->flags & PROTO_CAP_INLINE_SESSION)) {
+        printf("Session continues on the main connection\n");
+        return 0;
+    }
+    if (new_port <= 0) {
+        fprintf(stderr, "Port request failed\n");
+        return -1;
+    }
     printf("Received new port: %d\n", new_port);
     return new_port;
 }
 
-// 發送登入請求
-int client_send_login(int sockfd, const char *username, const char *password) {
-    
+// 發送登入請求；轉發伺服器支援 v2 時在密碼後附上能力宣告，由儲存伺服器的回覆決定最終上限
+// 協商的結果（多操作 session、壓縮）記錄在 conn->flags
+int client_send_login(Connection *conn, const char *username, const char *password, const ProtocolCaps *server_caps,
+                      int compress) {
     uint32_t sequence = 1;
+
+    uint8_t login_data[MAX_DATA_SIZE];
+    int login_len = strnlen(password, MAX_DATA_SIZE - PROTO_CAPS_SIZE);
+    memcpy(login_data, password, login_len);
+    if (server_caps->version >= PROTOCOL_VERSION_2) {
+        // 登入時協商版本與上限；轉發伺服器會雙向轉發時才提出多操作 session，
+        // 壓縮只與儲存伺服器有關，轉發伺服器照常轉發
+        ProtocolCaps caps = *server_caps;
+        caps.flags = (server_caps->flags & PROTO_CAP_MULTI_OP) | (compress ? PROTO_CAP_COMPRESS : 0);
+        login_len = proto_caps_append(login_data, login_len, sizeof(login_data), &caps);
+    }
     
-    int sent = client_send(sockfd, 1, 0, username, &sequence, (uint8_t *)password, strlen(password));
+    int sent = client_send(conn, 1, 0, username, &sequence, login_data, login_len, 0);
     if (sent < 0) {
         fprintf(stderr, "登入請求發送失敗\n");
         return -1;
     }
 
-    uint8_t data[MAX_DATA_SIZE] = {0};
-    client_receive(sockfd, username, &sequence, data);
+    Frame frame;
+    if (client_receive(conn, username, &frame) <= 0) {
+        return -1;
+    }
+    if (frame.header.length < 8 || memcmp(frame.data, "Login OK", 8) != 0) {
+        return -1;
+    }
+
+    ProtocolCaps caps;
+    proto_caps_parse(frame.data, frame.header.length, &caps);
+    conn_apply_caps(conn, &caps);
+    printf("協議版本 v%d，封包數據上限 %u bytes%s%s\n", conn->version, conn->max_payload,
+           conn->flags & PROTO_CAP_MULTI_OP_OK ? "，多操作 session" : "",
+           conn->flags & PROTO_CAP_COMPRESS_OK ? "，壓縮" : "");
     
     return 0;
 }
 
-int client_send_file_request(int sockfd, const char *username, const char *filepath) {
-    uint32_t sequence = 1;
-    FILE *fp = fopen(filepath, "rb");
-    if (!fp) {
-        perror("打開檔案失敗");
-        return -1;
-    }
-
+// 備份名稱：檔名|修改時間
+int client_backup_name(const char *filepath, char *data_name, size_t size) {
     // 獲取檔案名稱
     const char *filename = strrchr(filepath, '/');
     filename = (filename) ? filename + 1 : filepath;
@@ -222,19 +360,55 @@ int client_send_file_request(int sockfd, const char *username, const char *filep
     struct stat file_stat;
     if (stat(filepath, &file_stat) != 0) {
         perror("獲取檔案資訊失敗");
-        fclose(fp);
         return -1;
     }
 
     char timestamp[64];
     strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", localtime(&file_stat.st_mtime));
 
-    // 構建資料格式：檔名|時間戳\0
-    char data_name[256];
-    snprintf(data_name, sizeof(data_name), "%s|%s", filename, timestamp);
+    // 構建資料格式：檔名|時間戳
+    snprintf(data_name, size, "%s|%s", filename, timestamp);
+    return 0;
+}
+
+// 檔案的絕對路徑，記錄在儲存伺服器的備份目錄；取不到時是空字串
+static size_t client_source_path(const char *filepath, char *path, size_t size) {
+    char resolved[PATH_MAX];
+    if (!realpath(filepath, resolved)) {
+        path[0] = '\0';
+        return 0;
+    }
+    size_t len = strlen(resolved);
+    if (len >= size) len = size - 1;   // 太長的路徑截掉，只用於顯示
+    memcpy(path, resolved, len);
+    path[len] = '\0';
+    return len;
+}
 
-    // 發送請求
-    int sent = client_send(sockfd, 2, 0, username, &sequence, (uint8_t *)data_name, strlen(data_name) + 1);
+// operation 是 2（新的備份）或 OP_RESUME_BACKUP（續傳），數據區相同
+int client_send_file_request(Connection *conn, uint8_t operation, const char *username, const char *filepath) {
+    uint32_t sequence = 1;
+    FILE *fp = fopen(filepath, "rb");
+    if (!fp) {
+        perror("打開檔案失敗");
+        return -1;
+    }
+
+    char data_name[256 + 8 + 256];
+    if (client_backup_name(filepath, data_name, 256) != 0) {
+        fclose(fp);
+        return -1;
+    }
+
+    // 發送請求：檔名之後附上檔案大小，讓儲存伺服器預先配置空間（舊的伺服器只讀到 '\0'），
+    // 支援備份目錄的伺服器再附上原始路徑
+    struct stat file_stat;
+    uint64_t size = fstat(fileno(fp), &file_stat) == 0 ? (uint64_t)file_stat.st_size : 0;
+    size_t len = strlen(data_name) + 1;
+    for (int i = 7; i >= 0; i--) data_name[len++] = size >> (i * 8);
+    if (conn->flags & PROTO_CAP_CATALOG) len += client_source_path(filepath, data_name + len, 256);
+    int sent = client_send(conn, operation, 0, username, &sequence, (uint8_t *)data_name, len,
+                           operation == 2 ? SEND_MORE : 0);
     if (sent < 0) {
         fprintf(stderr, "備份請求發送失敗\n");
         fclose(fp);
@@ -245,22 +419,49 @@ int client_send_file_request(int sockfd, const char *username, const char *filep
     return 0;
 }
 
-int client_send_file_content(int sockfd, const char *username, const char *filepath) {
+// offset 是續傳時儲存伺服器已寫入的長度，從這裡開始送
+int client_send_file_content(Connection *conn, const char *username, const char *filepath, uint64_t offset) {
     FILE *fp = fopen(filepath, "rb");
     if (!fp) {
         perror("打開檔案失敗");
         return -1;
     }
+    if (offset > 0 && fseeko(fp, offset, SEEK_SET) != 0) {
+        perror("移動檔案位置失敗");
+        fclose(fp);
+        return -1;
+    }
 
-    uint8_t buffer[MAX_DATA_SIZE];
+    // 每個封包塞滿協商後的上限；協商了壓縮時每個封包是一個編碼區塊，原文少放一個頭部
+    int compress = (conn->flags & PROTO_CAP_COMPRESS_OK) != 0;
+    size_t chunk_size = compress ? conn->max_payload - COMPRESS_HEADER_SIZE : conn->max_payload;
+    uint8_t *buffer = malloc(conn->max_payload);
+    uint8_t *encoded = compress ? malloc(conn->max_payload) : NULL;
+    if (!buffer || (compress && !encoded)) {
+        free(buffer);
+        free(encoded);
+        fclose(fp);
+        return -1;
+    }
     size_t read_bytes;
     uint32_t sequence_number = 1;
+    uint64_t raw_total = 0, sent_total = 0;
+
+    while ((read_bytes = fread(buffer, 1, chunk_size, fp)) > 0) {
+        const uint8_t *payload = buffer;
+        uint32_t payload_len = read_bytes;
+        if (compress) {
+            payload_len = compress_encode(buffer, read_bytes, encoded);
+            payload = encoded;
+        }
+        raw_total += read_bytes;
+        sent_total += payload_len;
 
-    while ((read_bytes = fread(buffer, 1, MAX_DATA_SIZE - 11 - strlen(username), fp)) > 0) {
-        
-        int sent = client_send(sockfd, 3, 0, username, &sequence_number, (uint8_t *)buffer, read_bytes);
+        int sent = client_send(conn, 3, 0, username, &sequence_number, payload, payload_len, SEND_MORE);
         if (sent < 0) {
             perror("發送資料失敗");
+            free(buffer);
+            free(encoded);
             fclose(fp);
             return -1;
         }
@@ -269,25 +470,35 @@ int client_send_file_content(int sockfd, const char *username, const char *filep
     }
 
     // 傳送結束標誌
-    int sent = client_send(sockfd, 3, 1, username, &sequence_number, NULL, 0);
+    int sent = client_send(conn, 3, 1, username, &sequence_number, NULL, 0, 0);
     if (sent < 0) {
         fprintf(stderr, "結束標誌傳送失敗\n");
     }
     
+    free(buffer);
+    free(encoded);
     fclose(fp);
-    printf("檔案傳輸完成：%s\n", filepath);
+    if (offset > 0) {
+        printf("檔案傳輸完成：%s（從 %llu bytes 續傳 %llu bytes）\n", filepath, (unsigned long long)offset,
+               (unsigned long long)raw_total);
+    } else if (compress) {
+        printf("檔案傳輸完成：%s（%llu bytes 壓縮成 %llu bytes）\n", filepath,
+               (unsigned long long)raw_total, (unsigned long long)sent_total);
+    } else {
+        printf("檔案傳輸完成：%s\n", filepath);
+    }
     return 0;
 }
 
-int client_backup_file(int sockfd, const char *username, const char *filepath) {
+int client_backup_file(Connection *conn, const char *username, const char *filepath) {
     // 1. 傳送備份請求
-    if (client_send_file_request(sockfd, username, filepath) != 0) {
+    if (client_send_file_request(conn, 2, username, filepath) != 0) {
         fprintf(stderr, "備份請求失敗：%s\n", filepath);
         return -1;
     }
     
     // 2. 傳送檔案內容
-    if (client_send_file_content(sockfd, username, filepath) != 0) {
+    if (client_send_file_content(conn, username, filepath, 0) != 0) {
         fprintf(stderr, "檔案內容傳輸失敗：%s\n", filepath);
         return -1;
     }
@@ -295,17 +506,172 @@ int client_backup_file(int sockfd, const char *username, const char *filepath) {
     return 0;
 }
 
-// 發送取備份請求（operation = 5），data 是檔案名稱
-int client_send_backup_request(int sockfd, const char *username, const char *filename) {
-    uint32_t sequence = 1;
+/**
+ * 差異備份的送出狀態：指令累積到一個封包的上限才送出，連續的複製合併成一個指令
+ */
+typedef struct {
+    Connection *conn;
+    const char *username;
+    uint32_t sequence;
+    uint8_t *buffer;         // conn->max_payload
+    uint32_t len;
+    int64_t copy_index;      // 還沒寫入的連續複製，-1 表示沒有
+    uint32_t copy_count;
+    uint64_t literal_bytes;
+    uint64_t copied_bytes;
+} DeltaSender;
+
+static int delta_flush(DeltaSender *ds) {
+    if (ds->len == 0) return 0;
+    if (client_send(ds->conn, OP_DELTA_BACKUP, 0, ds->username, &ds->sequence, ds->buffer, ds->len, SEND_MORE) < 0) return -1;
+    ds->sequence++;
+    ds->len = 0;
+    return 0;
+}
 
-    // 發送取備份請求（operation = 5）
-    int sent = client_send(sockfd, 5, 1, username, &sequence, (const uint8_t *)filename, strlen(filename));
-    if (sent < 0) {
-        fprintf(stderr, "取備份請求發送失敗\n");
+static int delta_put_pending_copy(DeltaSender *ds) {
+    if (ds->copy_index < 0) return 0;
+    if (ds->len + DELTA_COPY_SIZE > ds->conn->max_payload && delta_flush(ds) != 0) return -1;
+    uint32_t index = htonl(ds->copy_index), count = htonl(ds->copy_count);
+    ds->buffer[ds->len] = DELTA_COPY;
+    memcpy(ds->buffer + ds->len + 1, &index, 4);
+    memcpy(ds->buffer + ds->len + 5, &count, 4);
+    ds->len += DELTA_COPY_SIZE;
+    ds->copy_index = -1;
+    return 0;
+}
+
+static int delta_put_copy(DeltaSender *ds, int64_t index, uint32_t block_size) {
+    ds->copied_bytes += block_size;
+    if (ds->copy_index >= 0 && index == ds->copy_index + ds->copy_count) {
+        ds->copy_count++;
+        return 0;
+    }
+    if (delta_put_pending_copy(ds) != 0) return -1;
+    ds->copy_index = index;
+    ds->copy_count = 1;
+    return 0;
+}
+
+static int delta_put_literal(DeltaSender *ds, const uint8_t *data, size_t len) {
+    if (len > 0 && delta_put_pending_copy(ds) != 0) return -1;
+    ds->literal_bytes += len;
+    while (len > 0) {
+        if (ds->len + DELTA_LITERAL_HEADER_SIZE >= ds->conn->max_payload && delta_flush(ds) != 0) return -1;
+        size_t piece = ds->conn->max_payload - ds->len - DELTA_LITERAL_HEADER_SIZE;
+        if (piece > len) piece = len;
+        uint32_t net_len = htonl(piece);
+        ds->buffer[ds->len] = DELTA_LITERAL;
+        memcpy(ds->buffer + ds->len + 1, &net_len, 4);
+        memcpy(ds->buffer + ds->len + DELTA_LITERAL_HEADER_SIZE, data, piece);
+        ds->len += DELTA_LITERAL_HEADER_SIZE + piece;
+        data += piece;
+        len -= piece;
+    }
+    return 0;
+}
+
+/**
+ * 以上一個版本的簽章比對檔案，送出差異備份
+ * @param conn 連線
+ * @param username 使用者名稱
+ * @param filepath 檔案路徑
+ * @param index 上一個版本的簽章
+ * @param base 儲存伺服器上做為基準的備份檔名
+ * @return 0 表示成功，-1 表示失敗
+ */
+int client_send_delta(Connection *conn, const char *username, const char *filepath, const DeltaIndex *index,
+                      const char *base) {
+    char data_name[256];
+    if (client_backup_name(filepath, data_name, sizeof(data_name)) != 0) return -1;
+
+    int fd = open(filepath, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror("打開檔案失敗");
+        if (fd >= 0) close(fd);
         return -1;
     }
+    size_t size = st.st_size;
+    const uint8_t *data = NULL;
+    if (size > 0) {
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            perror("mmap 失敗");
+            close(fd);
+            return -1;
+        }
+        madvise((void *)data, size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    DeltaSender ds = { conn, username, 1, malloc(conn->max_payload), 0, -1, 0, 0, 0 };
+    int ret = ds.buffer ? 0 : -1;
+
+    // 第一個封包：新備份的名稱與基準，支援備份目錄的伺服器再附上 '\0' 與原始路徑
+    if (ret == 0) {
+        size_t name_len = strlen(data_name) + 1;
+        memcpy(ds.buffer, data_name, name_len);
+        memcpy(ds.buffer + name_len, base, strlen(base));
+        ds.len = name_len + strlen(base);
+        if (conn->flags & PROTO_CAP_CATALOG) {
+            ds.buffer[ds.len++] = '\0';
+            ds.len += client_source_path(filepath, (char *)ds.buffer + ds.len, 256);
+        }
+        ret = delta_flush(&ds);
+    }
+
+    // 滾動比對：視窗與某個區塊相同時送出複製並跳過整塊，否則向後移動一個位元組
+    uint32_t block_size = index->block_size;
+    size_t pos = 0, literal = 0;
+    int64_t next = -1;
+    uint32_t weak = size >= block_size ? delta_weak(data, block_size) : 0;
+    while (ret == 0 && pos + block_size <= size) {
+        int64_t i = delta_index_find(index, weak, data + pos, next);
+        if (i >= 0) {
+            if (delta_put_literal(&ds, data + literal, pos - literal) != 0 ||
+                delta_put_copy(&ds, i, block_size) != 0) {
+                ret = -1;
+                break;
+            }
+            pos += block_size;
+            literal = pos;
+            next = i + 1;
+            if (pos + block_size <= size) weak = delta_weak(data + pos, block_size);
+            continue;
+        }
+        if (pos + block_size < size) weak = delta_weak_roll(weak, data[pos], data[pos + block_size], block_size);
+        pos++;
+        // 長段沒有相符的資料邊比對邊送出
+        if (pos - literal >= conn->max_payload) {
+            if (delta_put_literal(&ds, data + literal, pos - literal) != 0) ret = -1;
+            literal = pos;
+        }
+    }
+    if (ret == 0 && (delta_put_literal(&ds, data + literal, size - literal) != 0 ||
+                     delta_put_pending_copy(&ds) != 0 || delta_flush(&ds) != 0)) {
+        ret = -1;
+    }
+
+    // 結束封包帶上整個檔案的 SHA-256，儲存伺服器以它驗證組回的內容
+    if (ret == 0) {
+        uint8_t digest[SHA256_DIGEST_SIZE];
+        sha256(data, size, digest);
+        if (client_send(conn, OP_DELTA_BACKUP, 1, username, &ds.sequence, digest, sizeof(digest), 0) < 0) ret = -1;
+    }
+    if (ret == 0) {
+        printf("差異備份：%s，複製 %llu bytes，傳送 %llu bytes\n", filepath,
+               (unsigned long long)ds.copied_bytes, (unsigned long long)ds.literal_bytes);
+    }
 
+    free(ds.buffer);
+    if (data) munmap((void *)data, size);
+    return ret;
+}
+
+// 接收一個備份的內容直到結束封包，存成 filename
+// 回傳 0 表示完成，1 表示伺服器找不到這個備份，-1 表示連線錯誤
+int client_receive_backup(Connection *conn, const char *username, const char *filename) {
     // 開始接收備份資料（可能是多封包）
     FILE *fp = fopen(filename, "wb");
     if (!fp) {
@@ -313,35 +679,336 @@ int client_send_backup_request(int sockfd, const char *username, const char *fil
         return -1;
     }
 
+    // 協商了壓縮時每個封包是一個編碼區塊；儲存伺服器原樣送出的區塊原文可能比封包上限大
+    uint8_t *raw = NULL;
+    if (conn->flags & PROTO_CAP_COMPRESS_OK) {
+        raw = malloc(COMPRESS_MAX_BLOCK);
+        if (!raw) {
+            fclose(fp);
+            return -1;
+        }
+    }
+
     while (1) {
-        uint8_t data[MAX_DATA_SIZE] = {0};
-        int recv_len = client_receive(sockfd, username, &sequence, data);
-        if (recv_len < 0) {
+        Frame frame;
+        int ret = client_receive(conn, username, &frame);
+        if (ret < 0) {
             fprintf(stderr, "接收備份資料失敗\n");
+            free(raw);
             fclose(fp);
             return -1;
         }
 
-        // 檢查是否為結束封包（視協議設計而定，這裡假設 status == 1 表示結束）
-        if (recv_len == 0) {
+        // 連線關閉或結束封包（status == 1 表示結束）
+        if (ret == 0 || frame.header.status == 1) {
+            // 結束封包帶有訊息表示伺服器沒有這個備份
+            if (ret == 1 && frame.header.length > 0) {
+                fprintf(stderr, "伺服器無法提供備份：%s\n", filename);
+                free(raw);
+                fclose(fp);
+                remove(filename);
+                return 1;
+            }
             break;
         }
 
-        fwrite(data, 1, recv_len, fp);
+        if (raw) {
+            int64_t raw_len = compress_decode(frame.data, frame.header.length, raw, COMPRESS_MAX_BLOCK);
+            if (raw_len < 0) {
+                fprintf(stderr, "壓縮資料格式錯誤：%s\n", filename);
+                free(raw);
+                fclose(fp);
+                remove(filename);
+                return -1;
+            }
+            fwrite(raw, 1, raw_len, fp);
+        } else {
+            fwrite(frame.data, 1, frame.header.length, fp);
+        }
 
         // 這邊可以視需要顯示接收進度
     }
 
+    free(raw);
     fclose(fp);
     printf("備份資料接收完成，已儲存為 %s\n", filename);
     return 0;
 }
 
-int client_request_and_receive_file_list(int sockfd, const char *username) {
+// 發送取備份請求（operation = 5），data 是檔案名稱
+int client_send_backup_request(Connection *conn, const char *username, const char *filename) {
+    uint32_t sequence = 1;
+
+    // 發送取備份請求（operation = 5）
+    int sent = client_send(conn, 5, 1, username, &sequence, (const uint8_t *)filename, strlen(filename), 0);
+    if (sent < 0) {
+        fprintf(stderr, "取備份請求發送失敗\n");
+        return -1;
+    }
+
+    return client_receive_backup(conn, username, filename) == 0 ? 0 : -1;
+}
+
+/**
+ * 取回備份的部分範圍：寫進同名檔案的對應位置（檔案其他部分不變），或依序寫到 out_fd
+ * @param out_fd 標準輸出的 fd，-1 表示寫進檔案
+ * @return 0 表示成功，-1 表示失敗
+ */
+int client_restore_ranges(Connection *conn, const char *username, const char *filename,
+                          const struct ClientConfig *config, int out_fd) {
+    uint8_t request[MAX_DATA_SIZE];
+    size_t name_len = strlen(filename);
+    size_t len = name_len + 1 + (size_t)config->range_count * RESTORE_RANGE_SIZE;
+    if (len > conn->max_payload || len > sizeof(request)) {
+        fprintf(stderr, "檔名太長或範圍太多：%s\n", filename);
+        return -1;
+    }
+    memcpy(request, filename, name_len + 1);
+    memcpy(request + name_len + 1, config->ranges, (size_t)config->range_count * RESTORE_RANGE_SIZE);
+    uint32_t sequence = 1;
+    if (client_send(conn, OP_RESTORE_RANGE, 1, username, &sequence, request, len, 0) < 0) {
+        fprintf(stderr, "取備份請求發送失敗\n");
+        return -1;
+    }
+
+    int fd = out_fd;
+    if (fd < 0 && (fd = open(filename, O_WRONLY | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+        perror("無法開啟檔案寫入");
+        return -1;
+    }
+    uint8_t *raw = (conn->flags & PROTO_CAP_COMPRESS_OK) ? malloc(COMPRESS_MAX_BLOCK) : NULL;
+    int ret = (conn->flags & PROTO_CAP_COMPRESS_OK) && !raw ? -1 : 1;
+    uint64_t pos = 0, received = 0;
+    while (ret > 0) {
+        Frame frame;
+        if (client_receive(conn, username, &frame) <= 0) {
+            fprintf(stderr, "接收備份資料失敗\n");
+            ret = -1;
+            break;
+        }
+        if (frame.header.operation == OP_RESTORE_RANGE && frame.header.status == 0) {
+            // 下一個範圍的開始位置
+            pos = 0;
+            for (uint32_t i = 0; i < 8 && i < frame.header.length; i++) pos = pos << 8 | frame.data[i];
+            continue;
+        }
+        if (frame.header.operation == OP_RESTORE_RANGE) {
+            ret = frame.header.length == 8 ? 0 : -1;
+            if (ret < 0) fprintf(stderr, "伺服器無法提供備份：%s\n", filename);
+            break;
+        }
+        if (frame.header.operation != 5) continue;
+
+        const uint8_t *data = frame.data;
+        int64_t data_len = frame.header.length;
+        if (raw) {
+            data_len = compress_decode(frame.data, frame.header.length, raw, COMPRESS_MAX_BLOCK);
+            data = raw;
+            if (data_len < 0) {
+                fprintf(stderr, "壓縮資料格式錯誤：%s\n", filename);
+                ret = -1;
+                break;
+            }
+        }
+        for (int64_t off = 0; off < data_len;) {
+            ssize_t n = out_fd >= 0 ? write(fd, data + off, data_len - off) : pwrite(fd, data + off, data_len - off, pos + off);
+            if (n < 0) {
+                perror("寫入失敗");
+                ret = -1;
+                break;
+            }
+            off += n;
+        }
+        pos += data_len;
+        received += data_len;
+    }
+
+    free(raw);
+    if (out_fd < 0) close(fd);
+    if (ret == 0) {
+        fprintf(out_fd >= 0 ? stderr : stdout, "取回 %d 個範圍共 %llu bytes：%s\n", config->range_count,
+                (unsigned long long)received, filename);
+    }
+    return ret;
+}
+
+/**
+ * 多操作 session 中已送出、還沒收到結果的備份
+ */
+typedef struct {
+    const char **files;
+    int *done;               // 每個檔案的結果：0 表示還不知道，1 表示完成，-1 表示失敗
+    int pending[CLIENT_PIPELINE_DEPTH];  // 檔案索引，依送出的順序
+    int head;
+    int inflight;
+    int failures;
+} BackupPipeline;
+
+// 處理一個備份結果（operation 3 或差異備份的 status 1），回傳 0 表示不是備份結果
+static int backup_pipeline_result(BackupPipeline *pipeline, const Frame *frame) {
+    uint8_t operation = frame->header.operation;
+    if ((operation != 3 && operation != OP_DELTA_BACKUP) || frame->header.status != 1 || pipeline->inflight == 0) return 0;
+
+    int i = pipeline->pending[pipeline->head];
+    pipeline->head = (pipeline->head + 1) % CLIENT_PIPELINE_DEPTH;
+    pipeline->inflight--;
+    if (frame->header.length == 9 && memcmp(frame->data, "Backup OK", 9) == 0) {
+        printf("備份完成：%s\n", pipeline->files[i]);
+        pipeline->done[i] = 1;
+    } else {
+        fprintf(stderr, "備份失敗：%s\n", pipeline->files[i]);
+        pipeline->failures++;
+        pipeline->done[i] = -1;
+    }
+    return 1;
+}
+
+/**
+ * 續傳一個備份：詢問儲存伺服器已寫入的位置，等待時先到的備份結果照常處理，再從那裡送出其餘的內容
+ * @return 0 表示已送出（結果之後由管線處理），1 表示儲存伺服器已經有這個備份，-1 表示失敗
+ */
+int client_resume_file(Connection *conn, const char *username, const char *filepath, BackupPipeline *pipeline) {
+    if (client_send_file_request(conn, OP_RESUME_BACKUP, username, filepath) != 0) return -1;
+
+    while (1) {
+        Frame frame;
+        if (client_receive(conn, username, &frame) <= 0) return -1;
+        if (backup_pipeline_result(pipeline, &frame) || frame.header.operation != OP_RESUME_BACKUP) continue;
+
+        if (frame.header.status == 1) {
+            printf("儲存伺服器已經有這個備份：%s\n", filepath);
+            return 1;
+        }
+        uint64_t offset = 0;
+        for (uint32_t i = 0; i < 8 && i < frame.header.length; i++) offset = offset << 8 | frame.data[i];
+        return client_send_file_content(conn, username, filepath, offset);
+    }
+}
+
+/**
+ * 取得檔案上一個版本的簽章，等待時先到的備份結果照常處理
+ * @param base 輸出基準備份檔名，沒有舊版本時是空字串
+ * @return 0 表示成功，-1 表示連線錯誤
+ */
+int client_receive_signatures(Connection *conn, const char *username, const char *filepath, BackupPipeline *pipeline,
+                              DeltaIndex *index, char *base, size_t base_size) {
+    const char *filename = strrchr(filepath, '/');
+    filename = (filename) ? filename + 1 : filepath;
+    uint32_t sequence = 1;
+    if (client_send(conn, OP_DELTA_SIGNATURE, 0, username, &sequence, (const uint8_t *)filename, strlen(filename), 0) < 0) {
+        return -1;
+    }
+
+    base[0] = '\0';
+    while (1) {
+        Frame frame;
+        if (client_receive(conn, username, &frame) <= 0) return -1;
+        if (backup_pipeline_result(pipeline, &frame) || frame.header.operation != OP_DELTA_SIGNATURE) continue;
+
+        if (frame.header.status == 0) {
+            if (delta_index_add(index, frame.data, frame.header.length) != 0) {
+                fprintf(stderr, "簽章格式錯誤\n");
+                return -1;
+            }
+            continue;
+        }
+
+        // 結束封包：區塊大小與基準備份檔名
+        uint32_t block_size;
+        if (frame.header.length <= 4 || frame.header.length - 4 >= base_size) return 0;
+        memcpy(&block_size, frame.data, 4);
+        memcpy(base, frame.data + 4, frame.header.length - 4);
+        base[frame.header.length - 4] = '\0';
+        if (delta_index_build(index, ntohl(block_size)) != 0) base[0] = '\0';
+        return 0;
+    }
+}
+
+// 多操作 session：連續送出多個備份，最多 CLIENT_PIPELINE_DEPTH 個還沒收到結果
+// 儲存伺服器依序處理，結果依送出的順序對應檔案
+// 差異備份與續傳的每個檔案要先收到儲存伺服器的回覆才能開始送，前面的備份仍然在途
+// done 記錄每個檔案的結果，已有結果的檔案跳過；連線中斷時還沒有結果的檔案保持 0
+int client_backup_files(Connection *conn, const char *username, const char **files, int count, int delta,
+                        int resume, int *done) {
+    BackupPipeline pipeline = { .files = files, .done = done };
+    int next = 0;
+
+    while (next < count || pipeline.inflight > 0) {
+        if (next < count && pipeline.inflight < CLIENT_PIPELINE_DEPTH) {
+            int i = next++;
+            if (done[i] != 0) continue;
+            // 打不開的檔案不送出任何封包，不影響結果的對應
+            if (access(files[i], R_OK) != 0) {
+                perror(files[i]);
+                pipeline.failures++;
+                done[i] = -1;
+                continue;
+            }
+            if (resume) {
+                int ret = client_resume_file(conn, username, files[i], &pipeline);
+                if (ret < 0) return -1;
+                if (ret > 0) {
+                    done[i] = 1;
+                    continue;
+                }
+            } else if (delta) {
+                DeltaIndex index;
+                char base[256];
+                delta_index_init(&index);
+                int ret = client_receive_signatures(conn, username, files[i], &pipeline, &index, base, sizeof(base));
+                // 沒有上一個版本時完整上傳
+                if (ret == 0 && base[0]) ret = client_send_delta(conn, username, files[i], &index, base);
+                else if (ret == 0) ret = client_backup_file(conn, username, files[i]);
+                delta_index_free(&index);
+                if (ret != 0) return -1;
+            } else if (client_backup_file(conn, username, files[i]) != 0) {
+                return -1;
+            }
+            pipeline.pending[(pipeline.head + pipeline.inflight++) % CLIENT_PIPELINE_DEPTH] = i;
+            continue;
+        }
+
+        Frame frame;
+        if (client_receive(conn, username, &frame) <= 0) {
+            fprintf(stderr, "等待備份結果時連線中斷，%d 個備份沒有結果\n", pipeline.inflight);
+            return -1;
+        }
+        backup_pipeline_result(&pipeline, &frame);
+    }
+
+    return pipeline.failures == 0 ? 0 : -1;
+}
+
+// 多操作 session：連續送出取備份請求，最多 CLIENT_PIPELINE_DEPTH 個在途，內容依請求的順序送回
+int client_restore_files(Connection *conn, const char *username, const char **files, int count) {
+    int sent = 0, failures = 0;
+
+    for (int i = 0; i < count; i++) {
+        while (sent < count && sent - i < CLIENT_PIPELINE_DEPTH) {
+            uint32_t sequence = 1;
+            if (client_send(conn, 5, 1, username, &sequence, (const uint8_t *)files[sent], strlen(files[sent]), SEND_MORE) < 0) {
+                return -1;
+            }
+            sent++;
+        }
+        if (conn_flush(conn, 0) != 0) {
+            perror("取備份請求發送失敗");
+            return -1;
+        }
+
+        int ret = client_receive_backup(conn, username, files[i]);
+        if (ret < 0) return -1;
+        if (ret > 0) failures++;
+    }
+
+    return failures == 0 ? 0 : -1;
+}
+
+int client_request_and_receive_file_list(Connection *conn, const char *username) {
     uint32_t sequence = 1;
 
     // 發送請求：operation = 4
-    int sent = client_send(sockfd, 4, 1, username, &sequence, NULL, 0);
+    int sent = client_send(conn, 4, 1, username, &sequence, NULL, 0, 0);
     if (sent < 0) {
         fprintf(stderr, "取備份檔案列表請求發送失敗\n");
         return -1;
@@ -351,19 +1018,19 @@ int client_request_and_receive_file_list(int sockfd, const char *username) {
     int total_files = 0;
 
     while (1) {
-        uint8_t data[MAX_DATA_SIZE] = {0};
-        int recv_len = client_receive(sockfd, username, &sequence, data);
-        if (recv_len <= 0) {
+        Frame frame;
+        int ret = client_receive(conn, username, &frame);
+        if (ret <= 0) {
             fprintf(stderr, "接收備份列表時發生錯誤或連線關閉\n");
             break;
         }
 
-        // 檢查結尾條件（例：空字串）
-        if (strlen((char *)data) == 0) {
+        // 檢查結尾條件（結束封包或空字串）
+        if (frame.header.status == 1 || frame.header.length == 0) {
             break;
         }
 
-        printf("備份檔案 #%d: %s\n", ++total_files, data);
+        printf("備份檔案 #%d: %.*s\n", ++total_files, (int)frame.header.length, (const char *)frame.data);
     }
 
     if (total_files == 0) {
@@ -373,68 +1040,249 @@ int client_request_and_receive_file_list(int sockfd, const char *username) {
     return total_files;
 }
 
+/**
+ * 依條件查詢備份目錄，印出每個備份的大小、雜湊與原始路徑
+ * @param conn 已登入的連線
+ * @param username 使用者名稱
+ * @param config 查詢條件
+ * @param name 完整的原始檔名，NULL 表示使用 --prefix
+ * @return 列出的備份數，失敗時回傳 -1
+ */
+int client_list_catalog(Connection *conn, const char *username, const struct ClientConfig *config, const char *name) {
+    uint32_t sequence = 1;
+    uint8_t request[MAX_DATA_SIZE];
+    const char *fields[3] = { name ? name : config->prefix, config->since, config->until };
+    uint32_t len = CATALOG_QUERY_HEADER_SIZE;
+    for (int i = 3; i >= 0; i--) {
+        request[3 - i] = config->offset >> (i * 8);
+        request[7 - i] = config->limit >> (i * 8);
+    }
+    request[8] = (config->latest ? CATALOG_LATEST : 0) | (name ? CATALOG_EXACT : 0);
+    for (int i = 0; i < 3; i++) {
+        size_t field_len = fields[i] ? strlen(fields[i]) : 0;
+        if (len + field_len + 1 > sizeof(request)) {
+            fprintf(stderr, "查詢條件太長\n");
+            return -1;
+        }
+        if (field_len) memcpy(request + len, fields[i], field_len);
+        len += field_len;
+        if (i < 2) request[len++] = '\0';
+    }
+    if (client_send(conn, OP_LIST_CATALOG, 1, username, &sequence, request, len, 0) < 0) {
+        fprintf(stderr, "查詢備份目錄請求發送失敗\n");
+        return -1;
+    }
+
+    int listed = 0;
+    while (1) {
+        Frame frame;
+        if (client_receive(conn, username, &frame) <= 0) {
+            fprintf(stderr, "接收備份目錄時發生錯誤或連線關閉\n");
+            return -1;
+        }
+        if (frame.header.operation != OP_LIST_CATALOG) continue;
+
+        if (frame.header.status == 1) {
+            uint32_t total = 0;
+            for (uint32_t i = 0; i < 4 && i < frame.header.length; i++) total = total << 8 | frame.data[i];
+            if (listed == 0) printf("沒有符合條件的備份\n");
+            printf("共 %u 筆符合條件，列出第 %u 到第 %u 筆\n", total, listed ? config->offset + 1 : 0,
+                   config->offset + listed);
+            return listed;
+        }
+
+        const uint8_t *p = frame.data, *end = frame.data + frame.header.length;
+        while (end - p >= CATALOG_ENTRY_FIXED_SIZE) {
+            uint64_t size = 0;
+            for (int i = 0; i < 8; i++) size = size << 8 | p[i];
+            int has_hash = p[8];
+            const uint8_t *hash = p + 9;
+            p += 9 + SHA256_DIGEST_SIZE;
+            uint16_t file_len = p[0] << 8 | p[1];
+            if (end - p < 2 + file_len + 2) break;
+            const char *file = (const char *)p + 2;
+            p += 2 + file_len;
+            uint16_t path_len = p[0] << 8 | p[1];
+            if (end - p < 2 + path_len) break;
+            const char *path = (const char *)p + 2;
+            p += 2 + path_len;
+
+            char short_hash[17] = "-";
+            if (has_hash) {
+                for (int i = 0; i < 8; i++) sprintf(short_hash + i * 2, "%02x", hash[i]);
+            }
+            printf("備份檔案 #%u: %.*s  %llu bytes  %s  %.*s\n", config->offset + ++listed, (int)file_len, file,
+                   (unsigned long long)size, short_hash, (int)path_len, path);
+        }
+    }
+}
+
 void generate_cron_job(struct ClientConfig config) {
    
 }
 
 
-int main(int argc, char *argv[]) {
-    // 1. 解析命令列參數
-    struct ClientConfig config = parse_arguments(argc, argv);
-    
-    const char *server_ip = "192.168.56.102";
-    char *username = config.username;
-    char *password = config.password;
-
+// 連到轉發伺服器、取得 session 的連線並登入
+int client_open_session(const struct ClientConfig *config, Connection *conn) {
      // 初始連接以請求新的 port
-    int sockfd = init_client(server_ip, SERVER_PORT);
+    int sockfd = init_client(config->server_ip, config->server_port);
     if (sockfd < 0) return -1;
+
+    if (conn_init(conn, sockfd) != 0) {
+        close(sockfd);
+        return -1;
+    }
     
-    // 請求新的 port
-    int new_port = request_port(sockfd);
-    close(sockfd);
+    // 請求新的 port；轉發伺服器接受單一連線模式時不需要重新連線
+    ProtocolCaps server_caps;
+    int new_port = request_port(conn, &server_caps, !config->dynamic_port);
+    if (new_port < 0) {
+        conn_close(conn);
+        return -1;
+    }
 
-    if (new_port < 0) return -1;
+    if (new_port > 0) {
+        conn_close(conn);
 
-    // 使用新的 port 進行後續通訊
-    sockfd = init_client(server_ip, new_port);
+        // 使用新的 port 進行後續通訊
+        sockfd = init_client(config->server_ip, new_port);
+        if (sockfd < 0) return -1;
+        if (conn_init(conn, sockfd) != 0) {
+            close(sockfd);
+            return -1;
+        }
+    }
 
+    // 小封包已由 conn_send 在使用者空間合併、大封包以 MSG_MORE 送出，
+    // 保留 TCP_NODELAY 讓每次 flush 的最後一段不會被 Nagle 延遲
     int flag = 1;
     if (setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(flag)) < 0) {
         perror("setsockopt TCP_NODELAY 失敗");
     } else {
         printf("TCP_NODELAY 設定成功\n");
     }
-    
-    if (sockfd >= 0) {
 
-        if(client_send_login(sockfd, username, password)){
-            fprintf(stderr, "Login failed.\n");
-            return 1;
-        };
-        
-        if (strcmp(config.mode, "backup") == 0 && strlen(config.filepath) == 0) {
-            fprintf(stderr, "備份模式下必須提供 --file 參數\n");
+    if (client_send_login(conn, config->username, config->password, &server_caps, !config->no_compress) != 0) {
+        fprintf(stderr, "Login failed.\n");
+        conn_close(conn);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    // 1. 解析命令列參數
+    struct ClientConfig config = parse_arguments(argc, argv);
+    char *username = config.username;
+
+    int backup = strcmp(config.mode, "backup") == 0;
+    int restore = strcmp(config.mode, "restore") == 0;
+    if (!backup && !restore && strcmp(config.mode, "list") != 0) {
+        /* setup-cron: generate_cron_job(config);  // 會自動產生 crontab 任務 */
+        fprintf(stderr, "Unknown mode: %s\n", config.mode);
+        return 1;
+    }
+    if ((backup || restore) && config.file_count == 0) {
+        fprintf(stderr, "%s模式下必須提供 --file 參數\n", backup ? "備份" : "取回");
+        exit(EXIT_FAILURE);
+    }
+    // 取回的內容寫到與備份同名的檔案：備份名稱不含 '/' 也不以 '.' 開頭，其他名稱會寫到工作目錄以外
+    for (int i = 0; restore && i < config.file_count; i++) {
+        if (config.files[i][0] == '.' || strchr(config.files[i], '/')) {
+            fprintf(stderr, "無效的備份檔名: %s\n", config.files[i]);
             exit(EXIT_FAILURE);
         }
-        
-
-        if (sockfd >= 0) {
-         // 3. 根據模式執行操作
-            if (strcmp(config.mode, "backup") == 0) {
-                client_backup_file(sockfd, username, config.filepath);
-            } else if (strcmp(config.mode, "restore") == 0) {
-                client_send_backup_request(sockfd, username, config.filepath);
-            } else if (strcmp(config.mode, "list") == 0) {
-                client_request_and_receive_file_list(sockfd, username);
-            } /*else if (strcmp(config.mode, "setup-cron") == 0) {
-                generate_cron_job(config);  // 會自動產生 crontab 任務*/
-            } else {
-                fprintf(stderr, "Unknown mode: %s\n", config.mode);
+    }
+
+    // --stdout：取回的內容獨佔原本的標準輸出，其他訊息改到標準錯誤
+    int out_fd = -1;
+    if (config.to_stdout) {
+        if (!restore || config.range_count == 0) {
+            fprintf(stderr, "--stdout 只用於以 --range 取回\n");
+            return 1;
+        }
+        out_fd = dup(STDOUT_FILENO);
+        if (out_fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) return 1;
+    }
+
+    // 2. 登入；伺服器支援多操作 session 時所有檔案在同一個 session 中管線化處理
+    Connection conn;
+    if (client_open_session(&config, &conn) != 0) return 1;
+    int multi_op = (conn.flags & PROTO_CAP_MULTI_OP_OK) != 0;
+
+    // 3. 根據模式執行操作
+    int ret = 0;
+    if (!backup && !restore) {
+        // 伺服器支援備份目錄時依條件查詢；--file 指定完整的原始檔名
+        int filtered = config.prefix || config.since || config.until || config.latest || config.offset ||
+                       config.limit || config.file_count > 0;
+        if (!(conn.flags & PROTO_CAP_CATALOG)) {
+            if (filtered) printf("伺服器不支援備份目錄，列出所有備份\n");
+            client_request_and_receive_file_list(&conn, username);
+        } else if (config.file_count == 0) {
+            if (client_list_catalog(&conn, username, &config, NULL) < 0) ret = -1;
+        } else {
+            for (int i = 0; i < config.file_count && (multi_op || i == 0); i++) {
+                if (client_list_catalog(&conn, username, &config, config.files[i]) < 0) ret = -1;
+            }
+        }
+    } else if (multi_op && backup) {
+        int *done = calloc(config.file_count, sizeof(int));
+        if (!done) return 1;
+        int resume = config.resume && (conn.flags & PROTO_CAP_RESUME);
+        if (config.resume && !resume) printf("伺服器不支援續傳\n");
+        // 差異備份沒有續傳，中斷後的重試才改為續傳完整的內容
+        ret = client_backup_files(&conn, username, config.files, config.file_count, config.delta,
+                                  resume && !config.delta, done);
+
+        // 連線中斷時重新連線，還沒有結果的檔案從儲存伺服器已寫入的位置繼續
+        for (int attempt = 1; resume && attempt <= CLIENT_RESUME_RETRIES; attempt++) {
+            int left = 0;
+            for (int i = 0; i < config.file_count; i++) left += done[i] == 0;
+            if (left == 0) break;
+            conn_close(&conn);
+            printf("連線中斷，%d 個檔案沒有結果，%d 秒後重新連線續傳（第 %d 次）\n", left, attempt, attempt);
+            sleep(attempt);
+            if (client_open_session(&config, &conn) != 0) continue;
+            if (!(conn.flags & PROTO_CAP_RESUME)) break;
+            ret = client_backup_files(&conn, username, config.files, config.file_count, 0, 1, done);
+        }
+        for (int i = 0; i < config.file_count; i++) {
+            if (done[i] != 1) ret = -1;
+        }
+        free(done);
+    } else if (restore && config.range_count > 0) {
+        if (!(conn.flags & PROTO_CAP_RANGE)) {
+            fprintf(stderr, "伺服器不支援取回部分範圍\n");
+            conn_close(&conn);
+            return 1;
+        }
+        for (int i = 0; i < config.file_count; i++) {
+            // 舊的 session 一個只能進行一個操作
+            if (i > 0 && !multi_op) {
+                conn_close(&conn);
+                if (client_open_session(&config, &conn) != 0) return 1;
+            }
+            if (client_restore_ranges(&conn, username, config.files[i], &config, out_fd) != 0) ret = -1;
+        }
+    } else if (multi_op) {
+        ret = client_restore_files(&conn, username, config.files, config.file_count);
+    } else {
+        // 舊的伺服器一個 session 只能進行一個操作，每個檔案重新建立 session
+        if (backup && config.delta) printf("伺服器不支援多操作 session，改為完整上傳\n");
+        for (int i = 0; i < config.file_count; i++) {
+            if (i > 0) {
+                conn_close(&conn);
+                if (client_open_session(&config, &conn) != 0) return 1;
+            }
+            if (backup) {
+                if (client_backup_file(&conn, username, config.files[i]) != 0) ret = -1;
+            } else if (client_send_backup_request(&conn, username, config.files[i]) != 0) {
+                ret = -1;
             }
         }
-        close(sockfd);
     }
+    conn_close(&conn);
 
-    return 0;
+    return ret == 0 ? 0 : 1;
 }
@@ -0,0 +1,171 @@
+#include "compress.h"
+#include <string.h>
+#include <arpa/inet.h>
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 14
+#define LZ_LAST_LITERALS 5     // 最後 5 個位元組一定是原文
+#define LZ_MFLIMIT 12          // 最後一個 match 必須在結尾前 12 個位元組之前開始
+#define LZ_MAX_OFFSET 65535
+#define LZ_SKIP_TRIGGER 6      // 連續找不到 match 時加大步伐，不可壓縮的資料很快掃過
+
+static uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// 寫入 15 以上的長度延伸位元組
+static uint8_t *put_length(uint8_t *op, size_t len) {
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap) {
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    uint8_t *op = dst;
+    uint8_t *end = dst + cap;
+    size_t ip = 0, anchor = 0;
+    size_t limit = len > LZ_MFLIMIT ? len - LZ_MFLIMIT : 0;
+    uint32_t misses = 0;
+
+    while (ip < limit) {
+        uint32_t h = lz_hash(read32(src + ip));
+        size_t candidate = table[h];
+        table[h] = ip;
+        if (candidate >= ip || ip - candidate > LZ_MAX_OFFSET || read32(src + candidate) != read32(src + ip)) {
+            ip += 1 + (misses++ >> LZ_SKIP_TRIGGER);
+            continue;
+        }
+        misses = 0;
+
+        size_t match = LZ_MIN_MATCH;
+        while (ip + match < len - LZ_LAST_LITERALS && src[candidate + match] == src[ip + match]) match++;
+
+        // token + 原文長度 + 原文 + offset + match 長度
+        size_t literals = ip - anchor;
+        if ((size_t)(end - op) < 1 + literals / 255 + 1 + literals + 2 + (match - LZ_MIN_MATCH) / 255 + 1) return 0;
+        uint8_t *token = op++;
+        *token = (literals >= 15 ? 15 : literals) << 4;
+        if (literals >= 15) op = put_length(op, literals - 15);
+        memcpy(op, src + anchor, literals);
+        op += literals;
+        size_t offset = ip - candidate;
+        *op++ = offset & 0xff;
+        *op++ = offset >> 8;
+        size_t extra = match - LZ_MIN_MATCH;
+        *token |= extra >= 15 ? 15 : extra;
+        if (extra >= 15) op = put_length(op, extra - 15);
+
+        ip += match;
+        anchor = ip;
+        if (ip < limit) table[lz_hash(read32(src + ip - 2))] = ip - 2;
+    }
+
+    // 最後一段原文，沒有 match
+    size_t literals = len - anchor;
+    if ((size_t)(end - op) < 1 + literals / 255 + 1 + literals) return 0;
+    uint8_t *token = op++;
+    *token = (literals >= 15 ? 15 : literals) << 4;
+    if (literals >= 15) op = put_length(op, literals - 15);
+    memcpy(op, src + anchor, literals);
+    op += literals;
+    return op - dst;
+}
+
+// 讀取延伸的長度，回傳 -1 表示輸入不完整
+static int64_t get_length(const uint8_t *src, size_t len, size_t *ip) {
+    int64_t total = 0;
+    uint8_t b;
+    do {
+        if (*ip >= len) return -1;
+        b = src[(*ip)++];
+        total += b;
+    } while (b == 255);
+    return total;
+}
+
+int64_t lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap) {
+    size_t ip = 0, op = 0;
+    while (ip < len) {
+        uint8_t token = src[ip++];
+        int64_t literals = token >> 4;
+        if (literals == 15) {
+            int64_t more = get_length(src, len, &ip);
+            if (more < 0) return -1;
+            literals += more;
+        }
+        if ((uint64_t)literals > len - ip || (uint64_t)literals > cap - op) return -1;
+        memcpy(dst + op, src + ip, literals);
+        ip += literals;
+        op += literals;
+        if (ip == len) break;  // 最後一段只有原文
+
+        if (len - ip < 2) return -1;
+        size_t offset = src[ip] | src[ip + 1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > op) return -1;
+
+        int64_t match = token & 15;
+        if (match == 15) {
+            int64_t more = get_length(src, len, &ip);
+            if (more < 0) return -1;
+            match += more;
+        }
+        match += LZ_MIN_MATCH;
+        if ((uint64_t)match > cap - op) return -1;
+
+        // 重疊的 match（offset 小於長度）必須逐位元組複製
+        const uint8_t *from = dst + op - offset;
+        if (offset >= (size_t)match) {
+            memcpy(dst + op, from, match);
+        } else {
+            for (int64_t i = 0; i < match; i++) dst[op + i] = from[i];
+        }
+        op += match;
+    }
+    return op;
+}
+
+uint32_t compress_encode(const uint8_t *src, uint32_t len, uint8_t *dst) {
+    uint32_t net_len = htonl(len);
+    memcpy(dst + 1, &net_len, 4);
+
+    // 輸出空間只給到原文的長度，壓縮後沒有變小就放棄
+    size_t packed = lz_compress(src, len, dst + COMPRESS_HEADER_SIZE, len);
+    if (packed > 0 && packed < len) {
+        dst[0] = COMPRESS_LZ;
+        return COMPRESS_HEADER_SIZE + packed;
+    }
+    dst[0] = COMPRESS_RAW;
+    memcpy(dst + COMPRESS_HEADER_SIZE, src, len);
+    return COMPRESS_HEADER_SIZE + len;
+}
+
+int64_t compress_raw_size(const uint8_t *block, uint32_t len) {
+    if (len < COMPRESS_HEADER_SIZE || block[0] > COMPRESS_LZ) return -1;
+    uint32_t net_len;
+    memcpy(&net_len, block + 1, 4);
+    uint32_t raw_len = ntohl(net_len);
+    if (raw_len > COMPRESS_MAX_BLOCK) return -1;
+    if (block[0] == COMPRESS_RAW && raw_len != len - COMPRESS_HEADER_SIZE) return -1;
+    return raw_len;
+}
+
+int64_t compress_decode(const uint8_t *block, uint32_t len, uint8_t *dst, uint32_t cap) {
+    int64_t raw_len = compress_raw_size(block, len);
+    if (raw_len < 0 || raw_len > cap) return -1;
+    if (block[0] == COMPRESS_RAW) {
+        memcpy(dst, block + COMPRESS_HEADER_SIZE, raw_len);
+        return raw_len;
+    }
+    int64_t n = lz_decompress(block + COMPRESS_HEADER_SIZE, len - COMPRESS_HEADER_SIZE, dst, raw_len);
+    return n == raw_len ? n : -1;
+}
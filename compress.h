@@ -0,0 +1,69 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// 內建的快速壓縮（LZ77，區塊格式與 LZ4 block 相同），不依賴系統函式庫。
+// 壓縮後的資料以「編碼區塊」傳送與儲存：encoding(1) raw_len(4, network byte order) 資料
+//   COMPRESS_RAW：資料是原文（壓縮後沒有變小時使用）
+//   COMPRESS_LZ：資料是壓縮後的內容
+// 協商了 PROTO_CAP_COMPRESS 的 session 中，operation 3 與 5 的每個數據區都是一個編碼區塊。
+#define COMPRESS_RAW 0
+#define COMPRESS_LZ  1
+#define COMPRESS_HEADER_SIZE 5
+#define COMPRESS_MAX_BLOCK (1024 * 1024)   // 一個編碼區塊的原文上限（與 v2 的數據區上限相同）
+
+/**
+ * 壓縮後的最大長度（不含編碼區塊的頭部）
+ */
+#define LZ_BOUND(n) ((n) + (n) / 255 + 16)
+
+/**
+ * 壓縮
+ * @param src 原文
+ * @param len 原文長度
+ * @param dst 輸出緩衝區
+ * @param cap 輸出緩衝區大小
+ * @return 壓縮後的長度，空間不足時回傳 0
+ */
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+
+/**
+ * 解壓縮，檢查所有邊界，損毀的輸入不會讀寫超出緩衝區
+ * @param src 壓縮後的內容
+ * @param len 長度
+ * @param dst 輸出緩衝區
+ * @param cap 輸出緩衝區大小
+ * @return 原文長度，格式錯誤或空間不足時回傳 -1
+ */
+int64_t lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+
+/**
+ * 把原文編碼成編碼區塊，壓縮沒有變小時以原文存放
+ * @param src 原文，不超過 COMPRESS_MAX_BLOCK
+ * @param len 原文長度
+ * @param dst 輸出緩衝區，至少 len + COMPRESS_HEADER_SIZE
+ * @return 編碼區塊的長度
+ */
+uint32_t compress_encode(const uint8_t *src, uint32_t len, uint8_t *dst);
+
+/**
+ * 編碼區塊的原文長度
+ * @param block 編碼區塊
+ * @param len 編碼區塊的長度
+ * @return 原文長度，格式錯誤時回傳 -1
+ */
+int64_t compress_raw_size(const uint8_t *block, uint32_t len);
+
+/**
+ * 解開編碼區塊
+ * @param block 編碼區塊
+ * @param len 編碼區塊的長度
+ * @param dst 輸出緩衝區
+ * @param cap 輸出緩衝區大小
+ * @return 原文長度，格式錯誤、長度不符或空間不足時回傳 -1
+ */
+int64_t compress_decode(const uint8_t *block, uint32_t len, uint8_t *dst, uint32_t cap);
+
+#endif // COMPRESS_H
@@ -0,0 +1,103 @@
+#include "delta.h"
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "sha256.h"
+
+uint32_t delta_block_size(uint64_t file_size) {
+    uint64_t block = DELTA_BLOCK_MIN;
+    while (block < DELTA_BLOCK_MAX && block * block < file_size) block *= 2;
+    return block;
+}
+
+uint32_t delta_weak(const uint8_t *data, size_t len) {
+    uint32_t a = 0, b = 0;
+    for (size_t i = 0; i < len; i++) {
+        a += data[i];
+        b += (uint32_t)(len - i) * data[i];
+    }
+    return (a & 0xffff) | (b & 0xffff) << 16;
+}
+
+void delta_strong(const uint8_t *data, size_t len, uint8_t strong[DELTA_STRONG_SIZE]) {
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    sha256(data, len, digest);
+    memcpy(strong, digest, DELTA_STRONG_SIZE);
+}
+
+static const uint8_t *sig_at(const DeltaIndex *index, uint32_t i) {
+    return index->sigs + (size_t)i * DELTA_SIG_SIZE;
+}
+
+static uint32_t sig_weak(const DeltaIndex *index, uint32_t i) {
+    uint32_t weak;
+    memcpy(&weak, sig_at(index, i), 4);
+    return ntohl(weak);
+}
+
+// 弱校驗的低位元分布較差（兩個和都只跟位元組總和有關），先混合再取雜湊表的位置
+static uint32_t slot_of(uint32_t weak, uint32_t mask) {
+    return (weak * 0x9e3779b1u) >> 7 & mask;
+}
+
+void delta_index_init(DeltaIndex *index) {
+    memset(index, 0, sizeof(DeltaIndex));
+}
+
+int delta_index_add(DeltaIndex *index, const uint8_t *sigs, size_t len) {
+    if (len % DELTA_SIG_SIZE != 0) return -1;
+    size_t count = len / DELTA_SIG_SIZE;
+    uint8_t *grown = realloc(index->sigs, (index->count + count) * DELTA_SIG_SIZE);
+    if (!grown) return -1;
+    memcpy(grown + (size_t)index->count * DELTA_SIG_SIZE, sigs, len);
+    index->sigs = grown;
+    index->count += count;
+    return 0;
+}
+
+int delta_index_build(DeltaIndex *index, uint32_t block_size) {
+    index->block_size = block_size;
+    uint32_t size = 16;
+    while (size < index->count * 2) size *= 2;
+    index->slots = calloc(size, sizeof(uint32_t));
+    if (!index->slots) return -1;
+    index->mask = size - 1;
+
+    // 內容相同的區塊（例如整段的 0）只放第一個，避免同一個位置串成很長的探測序列
+    for (uint32_t i = 0; i < index->count; i++) {
+        uint32_t slot = slot_of(sig_weak(index, i), index->mask);
+        while (index->slots[slot] && memcmp(sig_at(index, index->slots[slot] - 1), sig_at(index, i), DELTA_SIG_SIZE) != 0) {
+            slot = (slot + 1) & index->mask;
+        }
+        if (!index->slots[slot]) index->slots[slot] = i + 1;
+    }
+    return 0;
+}
+
+int64_t delta_index_find(const DeltaIndex *index, uint32_t weak, const uint8_t *data, int64_t next) {
+    if (!index->slots) return -1;
+
+    int have_strong = 0;
+    uint8_t strong[DELTA_STRONG_SIZE];
+    for (uint32_t slot = slot_of(weak, index->mask); index->slots[slot]; slot = (slot + 1) & index->mask) {
+        uint32_t i = index->slots[slot] - 1;
+        if (sig_weak(index, i) != weak) continue;
+        if (!have_strong) {
+            delta_strong(data, index->block_size, strong);
+            have_strong = 1;
+        }
+        if (memcmp(sig_at(index, i) + 4, strong, DELTA_STRONG_SIZE) != 0) continue;
+        // 表中只有第一個相同的區塊，下一塊內容也相同時改用下一塊
+        if (next >= 0 && next < index->count && memcmp(sig_at(index, next), sig_at(index, i), DELTA_SIG_SIZE) == 0) {
+            return next;
+        }
+        return i;
+    }
+    return -1;
+}
+
+void delta_index_free(DeltaIndex *index) {
+    free(index->sigs);
+    free(index->slots);
+    delta_index_init(index);
+}
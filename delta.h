@@ -0,0 +1,120 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// rsync 式差異備份：儲存伺服器把使用者上一個版本切成固定大小的區塊，送出每個區塊的
+// 弱校驗（可滾動）與強雜湊；客戶端在新檔案上滾動比對，相同的區塊只送「複製第幾塊」的指令，
+// 其餘送原始資料，由儲存伺服器組回完整的新版本。
+//
+// OP_DELTA_SIGNATURE：客戶端送出檔名，回覆 status 0 的封包是連續的簽章（weak(4) strong(DELTA_STRONG_SIZE)），
+//   status 1 的結束封包是 block_size(4) 加上做為基準的備份檔名；沒有舊版本時結束封包是空的。
+// OP_DELTA_BACKUP：status 0 的第一個封包是 "檔名|時間戳" '\0' 基準備份檔名，之後每個封包是完整的指令：
+//   DELTA_COPY index(4) count(4)：複製基準的第 index 塊起 count 塊
+//   DELTA_LITERAL len(4) 資料：原樣寫入
+//   status 1 的結束封包是整個新檔案的 SHA-256，組回的內容不符時備份失敗；
+//   結果以 status 1 的 OP_DELTA_BACKUP 回覆 "Backup OK" 或 "Backup Failed"。
+// 兩個 operation 都需要多操作 session（簽章要先收到才能開始比對）。
+#define OP_DELTA_SIGNATURE 8
+#define OP_DELTA_BACKUP 9
+
+#define DELTA_BLOCK_MIN 2048
+#define DELTA_BLOCK_MAX (128 * 1024)
+#define DELTA_STRONG_SIZE 16               // 截短的 SHA-256，最後另外以整個檔案的 SHA-256 驗證
+#define DELTA_SIG_SIZE (4 + DELTA_STRONG_SIZE)
+
+#define DELTA_COPY 'C'
+#define DELTA_LITERAL 'L'
+#define DELTA_COPY_SIZE 9
+#define DELTA_LITERAL_HEADER_SIZE 5
+
+/**
+ * 依基準檔案大小選擇區塊大小：約為檔案大小的平方根，簽章總量與比對的粒度取得平衡
+ * @param file_size 基準檔案大小
+ * @return 區塊大小
+ */
+uint32_t delta_block_size(uint64_t file_size);
+
+/**
+ * 計算一個區塊的弱校驗（rsync 的兩個 16 位元和）
+ * @param data 資料
+ * @param len 長度
+ * @return 弱校驗
+ */
+uint32_t delta_weak(const uint8_t *data, size_t len);
+
+/**
+ * 視窗向後移動一個位元組，更新弱校驗
+ * @param weak 目前的弱校驗
+ * @param out 移出視窗的位元組
+ * @param in 移入視窗的位元組
+ * @param len 視窗長度
+ * @return 新的弱校驗
+ */
+static inline uint32_t delta_weak_roll(uint32_t weak, uint8_t out, uint8_t in, uint32_t len) {
+    uint32_t a = weak & 0xffff, b = weak >> 16;
+    a = (a - out + in) & 0xffff;
+    b = (b - len * out + a) & 0xffff;
+    return a | b << 16;
+}
+
+/**
+ * 計算一個區塊的強雜湊
+ * @param data 資料
+ * @param len 長度
+ * @param strong 輸出
+ */
+void delta_strong(const uint8_t *data, size_t len, uint8_t strong[DELTA_STRONG_SIZE]);
+
+/**
+ * 客戶端的簽章索引：以弱校驗查詢的開放定址雜湊表
+ */
+typedef struct {
+    uint32_t block_size;
+    uint32_t count;
+    uint8_t *sigs;           // count 個 DELTA_SIG_SIZE 的簽章
+    uint32_t *slots;         // 區塊編號 + 1，0 表示空位
+    uint32_t mask;
+} DeltaIndex;
+
+/**
+ * 初始化空的簽章索引
+ * @param index 簽章索引
+ */
+void delta_index_init(DeltaIndex *index);
+
+/**
+ * 加入收到的簽章（可分多次加入）
+ * @param index 簽章索引
+ * @param sigs 簽章
+ * @param len 長度，必須是 DELTA_SIG_SIZE 的倍數
+ * @return 0 表示成功，-1 表示失敗
+ */
+int delta_index_add(DeltaIndex *index, const uint8_t *sigs, size_t len);
+
+/**
+ * 收完簽章後建立雜湊表
+ * @param index 簽章索引
+ * @param block_size 區塊大小
+ * @return 0 表示成功，-1 表示失敗
+ */
+int delta_index_build(DeltaIndex *index, uint32_t block_size);
+
+/**
+ * 查詢與視窗內容相同的區塊，弱校驗相同時才計算強雜湊
+ * @param index 簽章索引
+ * @param weak 視窗的弱校驗
+ * @param data 視窗內容，長度為 block_size
+ * @param next 上一個相符區塊的下一塊，內容相同時優先選擇，讓連續的複製可以合併；沒有時傳 -1
+ * @return 區塊編號，找不到回傳 -1
+ */
+int64_t delta_index_find(const DeltaIndex *index, uint32_t weak, const uint8_t *data, int64_t next);
+
+/**
+ * 釋放簽章索引
+ * @param index 簽章索引
+ */
+void delta_index_free(DeltaIndex *index);
+
+#endif // DELTA_H
@@ -0,0 +1,277 @@
+#define _GNU_SOURCE
+#include "durable.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "log.h"
+
+struct DurableFile {
+    int fd;
+    char path[256];
+    char tmp_path[300];
+    uint8_t *buf;                // DURABLE_BATCH，以 DURABLE_ALIGN 對齊
+    size_t len;
+    uint64_t written;            // 已寫進檔案的長度
+    uint64_t allocated;          // fallocate 配置的長度，提交時截掉沒用到的部分
+    int sync_fs;
+    int failed;
+    struct DurableFile *next;    // 提交佇列
+    int done;                    // 提交執行緒已處理完，result 有效
+    int result;
+    int created;                 // 發布時 path 原本不存在，之後的同步失敗時可以收回
+    DurableDone callback;        // 不等待同步的提交：完成時由提交執行緒呼叫
+    void *callback_arg;
+};
+
+static int durable_policy = DURABLE_NONE;
+static _Atomic unsigned int tmp_serial;
+
+// 提交執行緒的佇列：處理一批的期間新到的備份排在下一批
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commit_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t commit_done = PTHREAD_COND_INITIALIZER;
+static DurableFile *commit_head;
+static DurableFile *commit_tail;
+
+static void durable_free(DurableFile *file) {
+    if (file->fd >= 0) close(file->fd);
+    free(file->buf);
+    free(file);
+}
+
+// 以 rename 發布暫存檔。同名的備份（來源檔案沒有變動）已經回覆成功並記錄在目錄中，
+// 先以 RENAME_NOREPLACE 試著建立，只有這次新建立的備份在之後的同步失敗時收回
+static int durable_publish(DurableFile *file) {
+    if (renameat2(AT_FDCWD, file->tmp_path, AT_FDCWD, file->path, RENAME_NOREPLACE) == 0) {
+        file->created = 1;
+        return 0;
+    }
+    if (errno != EEXIST && errno != EINVAL && errno != ENOSYS) return -1;
+    return rename(file->tmp_path, file->path);
+}
+
+// 提交結束：失敗時刪除暫存檔，釋放 file
+static int durable_finish(DurableFile *file, int ok) {
+    if (!ok) unlink(file->tmp_path);
+    durable_free(file);
+    return ok ? 0 : -1;
+}
+
+static void *durable_committer(void *arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&commit_lock);
+        while (!commit_head) pthread_cond_wait(&commit_queued, &commit_lock);
+        DurableFile *batch = commit_head;
+        commit_head = commit_tail = NULL;
+        pthread_mutex_unlock(&commit_lock);
+
+        // 先讓所有暫存檔的內容落地再 rename，當機後看到的備份一定是完整的；
+        // 再同步一次讓 rename 本身落地，之後才回覆成功
+        int count = 0, ok = syncfs(batch->fd) == 0;
+        if (!ok) log_perror("同步檔案系統失敗");
+        for (DurableFile *f = batch; f; f = f->next) {
+            f->result = ok && durable_publish(f) == 0 ? 0 : -1;
+            if (ok && f->result != 0) log_perror("無法發布備份檔案");
+            count++;
+        }
+        if (ok && syncfs(batch->fd) != 0) {
+            // 這次新建立的備份收回，回覆失敗時資料夾中也不留下沒有記錄的備份；取代的同名備份保留
+            log_perror("同步檔案系統失敗");
+            for (DurableFile *f = batch; f; f = f->next) {
+                if (f->result == 0 && f->created) unlink(f->path);
+                f->result = -1;
+            }
+        }
+        log_debug("group commit：%d 個備份共用一次同步", count);
+
+        // 設定 done 之後等待的 session 就會釋放 f，先取出 next；不等待的提交另外串起來，放開鎖之後再回報
+        DurableFile *callbacks = NULL;
+        pthread_mutex_lock(&commit_lock);
+        for (DurableFile *f = batch, *next; f; f = next) {
+            next = f->next;
+            if (f->callback) {
+                f->next = callbacks;
+                callbacks = f;
+            } else {
+                f->done = 1;
+            }
+        }
+        pthread_cond_broadcast(&commit_done);
+        pthread_mutex_unlock(&commit_lock);
+
+        for (DurableFile *f = callbacks, *next; f; f = next) {
+            next = f->next;
+            DurableDone callback = f->callback;
+            void *arg = f->callback_arg;
+            int result = durable_finish(f, f->result == 0);
+            callback(arg, result);
+        }
+    }
+    return NULL;
+}
+
+int durable_init(int policy) {
+    durable_policy = policy;
+    if (policy != DURABLE_GROUP) return 0;
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, durable_committer, NULL) != 0) {
+        log_perror("pthread_create 失敗");
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+int durable_parse(const char *name) {
+    if (strcmp(name, "none") == 0) return DURABLE_NONE;
+    if (strcmp(name, "backup") == 0) return DURABLE_BACKUP;
+    if (strcmp(name, "group") == 0) return DURABLE_GROUP;
+    return -1;
+}
+
+DurableFile *durable_open(const char *path, uint64_t size_hint) {
+    DurableFile *file = calloc(1, sizeof(DurableFile));
+    if (!file) return NULL;
+    if (posix_memalign((void **)&file->buf, DURABLE_ALIGN, DURABLE_BATCH) != 0) {
+        free(file);
+        return NULL;
+    }
+
+    // 暫存檔與備份在同一個資料夾（rename 不能跨檔案系統），名稱加上序號，同名的備份各寫各的
+    snprintf(file->path, sizeof(file->path), "%s", path);
+    const char *slash = strrchr(path, '/');
+    int dir_len = slash ? slash + 1 - path : 0;
+    snprintf(file->tmp_path, sizeof(file->tmp_path), "%.*s.%s.%u.tmp", dir_len, path, path + dir_len,
+             atomic_fetch_add_explicit(&tmp_serial, 1, memory_order_relaxed));
+    file->fd = open(file->tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (file->fd < 0) {
+        log_perror("無法建立備份檔案");
+        free(file->buf);
+        free(file);
+        return NULL;
+    }
+
+    // 預先配置連續的空間，寫入時不必一再擴充檔案；不支援的檔案系統照常寫入
+    if (size_hint > 0) {
+        if (fallocate(file->fd, 0, 0, size_hint) == 0) file->allocated = size_hint;
+        else log_debug("預先配置空間失敗: %s", strerror(errno));
+    }
+    return file;
+}
+
+// 把累積的資料寫進檔案；有同步需求時順便開始寫回，提交時的同步不必一次寫完整個檔案
+static int durable_put(DurableFile *file, const uint8_t *data, size_t len) {
+    size_t off = 0;
+    while (off < len) {
+        ssize_t n = write(file->fd, data + off, len - off);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            log_perror("備份資料寫入失敗");
+            file->failed = 1;
+            return -1;
+        }
+        off += n;
+    }
+    if (durable_policy != DURABLE_NONE) sync_file_range(file->fd, file->written, len, SYNC_FILE_RANGE_WRITE);
+    file->written += len;
+    return 0;
+}
+
+int durable_write(DurableFile *file, const void *data, size_t len) {
+    if (file->failed) return -1;
+    const uint8_t *p = data;
+
+    // 緩衝區是空的而資料有整批以上時直接寫，省下一次複製，檔案位置仍然是整批的倍數
+    if (file->len == 0 && len >= DURABLE_BATCH) {
+        size_t whole = len - len % DURABLE_BATCH;
+        if (durable_put(file, p, whole) != 0) return -1;
+        p += whole;
+        len -= whole;
+    }
+
+    while (len > 0) {
+        size_t n = DURABLE_BATCH - file->len;
+        if (n > len) n = len;
+        memcpy(file->buf + file->len, p, n);
+        file->len += n;
+        p += n;
+        len -= n;
+        if (file->len == DURABLE_BATCH) {
+            if (durable_put(file, file->buf, file->len) != 0) return -1;
+            file->len = 0;
+        }
+    }
+    return 0;
+}
+
+void durable_sync_fs(DurableFile *file) {
+    file->sync_fs = 1;
+}
+
+// fsync 備份所在的資料夾，讓 rename 落地
+static int durable_sync_dir(const char *path) {
+    char dir[256];
+    snprintf(dir, sizeof(dir), "%s", path);
+    int fd = open(dirname(dir), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    int ret = fsync(fd);
+    close(fd);
+    return ret;
+}
+
+int durable_commit(DurableFile *file, DurableDone callback, void *arg) {
+    int ok = !file->failed;
+    if (ok && file->len > 0 && durable_put(file, file->buf, file->len) != 0) ok = 0;
+    if (ok && file->allocated > file->written && ftruncate(file->fd, file->written) != 0) {
+        log_perror("無法截掉預先配置的空間");
+        ok = 0;
+    }
+
+    if (ok && durable_policy == DURABLE_GROUP) {
+        // 有 callback 時排進佇列就回傳，之後 file 屬於提交執行緒
+        file->callback = callback;
+        file->callback_arg = arg;
+        pthread_mutex_lock(&commit_lock);
+        file->next = NULL;
+        if (commit_tail) commit_tail->next = file;
+        else commit_head = file;
+        commit_tail = file;
+        pthread_cond_signal(&commit_queued);
+        if (callback) {
+            pthread_mutex_unlock(&commit_lock);
+            return 1;
+        }
+        while (!file->done) pthread_cond_wait(&commit_done, &commit_lock);
+        pthread_mutex_unlock(&commit_lock);
+        ok = file->result == 0;
+    } else if (ok) {
+        if (durable_policy == DURABLE_BACKUP && (file->sync_fs ? syncfs(file->fd) : fdatasync(file->fd)) != 0) {
+            log_perror("同步備份檔案失敗");
+            ok = 0;
+        }
+        if (ok && durable_publish(file) != 0) {
+            log_perror("無法發布備份檔案");
+            ok = 0;
+        }
+        if (ok && durable_policy == DURABLE_BACKUP && durable_sync_dir(file->path) != 0) {
+            log_perror("同步備份資料夾失敗");
+            if (file->created) unlink(file->path);
+            ok = 0;
+        }
+    }
+
+    return durable_finish(file, ok);
+}
+
+void durable_abort(DurableFile *file) {
+    unlink(file->tmp_path);
+    durable_free(file);
+}
@@ -0,0 +1,87 @@
+#ifndef DURABLE_H
+#define DURABLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// 備份檔案的寫入引擎：先寫到同一個資料夾中的隱藏暫存檔，完成後依持久化策略同步，
+// 再以 rename 發布，當機時不會留下只寫了一半卻看起來完整的備份。
+//   DURABLE_NONE：不同步，交給核心決定何時寫回（速度最快，回覆成功的備份當機時可能遺失）
+//   DURABLE_BACKUP：每個備份各自 fsync 檔案與資料夾
+//   DURABLE_GROUP：同時完成的備份交給同一個提交執行緒，一批只做一次 syncfs，
+//                  所有等待中的 session 共用同一次同步；提交時可以交給 callback 回報結果，
+//                  呼叫端（工作執行緒）不必等待同步
+// 暫存檔以 '.' 開頭，列出備份時不會出現。
+// rename 之後的同步失敗時收回這次新建立的備份，回覆失敗的備份不會留在資料夾中；
+// 取代了同名的備份時保留檔案，目錄中的紀錄仍然有效。
+#define DURABLE_NONE   0
+#define DURABLE_BACKUP 1
+#define DURABLE_GROUP  2
+
+#define DURABLE_BATCH (1024 * 1024)   // 累積到這麼多才寫入一次，檔案位置保持對齊
+#define DURABLE_ALIGN 4096
+
+typedef struct DurableFile DurableFile;
+
+/**
+ * 不等待同步的提交完成時，由提交執行緒呼叫
+ * @param arg 提交時傳入的參數
+ * @param result 0 表示已發布，-1 表示失敗（暫存檔已刪除）
+ */
+typedef void (*DurableDone)(void *arg, int result);
+
+/**
+ * 設定持久化策略，DURABLE_GROUP 會啟動提交執行緒
+ * @param policy DURABLE_NONE、DURABLE_BACKUP 或 DURABLE_GROUP
+ * @return 0 表示成功，-1 表示失敗
+ */
+int durable_init(int policy);
+
+/**
+ * 解析持久化策略的名稱
+ * @param name "none"、"backup" 或 "group"
+ * @return 策略，無法辨識時回傳 -1
+ */
+int durable_parse(const char *name);
+
+/**
+ * 建立暫存檔
+ * @param path 完成後發布的路徑
+ * @param size_hint 預期的檔案大小，大於 0 時預先配置空間（fallocate）；0 表示不知道
+ * @return 寫入中的檔案，失敗時回傳 NULL
+ */
+DurableFile *durable_open(const char *path, uint64_t size_hint);
+
+/**
+ * 寫入資料，累積成整批後才寫進檔案
+ * @param file 寫入中的檔案
+ * @param data 資料
+ * @param len 長度
+ * @return 0 表示成功，-1 表示失敗
+ */
+int durable_write(DurableFile *file, const void *data, size_t len);
+
+/**
+ * 提交時同步整個檔案系統而不是只同步這個檔案（內容參考了其他新寫入的檔案，例如去重的區塊）
+ * @param file 寫入中的檔案
+ */
+void durable_sync_fs(DurableFile *file);
+
+/**
+ * 寫入剩下的資料，依持久化策略同步後發布，釋放 file
+ * DURABLE_GROUP 沒有 callback 時等到同一批的同步完成才回傳；有 callback 時排進提交佇列就回傳 1，
+ * 結果之後由提交執行緒呼叫 callback 回報。其他策略一律直接回傳結果，不呼叫 callback。
+ * @param file 寫入中的檔案
+ * @param callback 不等待同步時的完成通知，可以是 NULL
+ * @param arg 傳給 callback 的參數
+ * @return 0 表示已發布，-1 表示失敗（暫存檔已刪除），1 表示結果由 callback 回報
+ */
+int durable_commit(DurableFile *file, DurableDone callback, void *arg);
+
+/**
+ * 放棄寫入中的檔案：刪除暫存檔，釋放 file
+ * @param file 寫入中的檔案
+ */
+void durable_abort(DurableFile *file);
+
+#endif // DURABLE_H
@@ -0,0 +1,64 @@
+#include "lane.h"
+#include <stdlib.h>
+#include <string.h>
+#include "shard.h"
+
+int lane_table_init(LaneTable *table) {
+    memset(table, 0, sizeof(LaneTable));
+    return pthread_mutex_init(&table->lock, NULL) == 0 ? 0 : -1;
+}
+
+Lane *lane_acquire(LaneTable *table, const char *username, LaneWaiter *waiter) {
+    uint32_t slot = shard_hash(username, strlen(username)) % LANE_HASH_SIZE;
+    waiter->next = NULL;
+    waiter->granted = 0;
+
+    pthread_mutex_lock(&table->lock);
+    Lane *lane = table->lanes[slot];
+    while (lane && strcmp(lane->username, username) != 0) lane = lane->next;
+    if (!lane) {
+        lane = calloc(1, sizeof(Lane));
+        if (!lane) {
+            pthread_mutex_unlock(&table->lock);
+            return NULL;
+        }
+        strcpy(lane->username, username);
+        lane->next = table->lanes[slot];
+        table->lanes[slot] = lane;
+    }
+    lane->refs++;
+
+    if (!lane->busy) {
+        lane->busy = 1;
+        waiter->granted = 1;
+    } else {
+        if (lane->queue_tail) lane->queue_tail->next = waiter;
+        else lane->queue_head = waiter;
+        lane->queue_tail = waiter;
+    }
+    pthread_mutex_unlock(&table->lock);
+    return lane;
+}
+
+void lane_release(LaneTable *table, Lane *lane) {
+    pthread_mutex_lock(&table->lock);
+    LaneWaiter *next = lane->queue_head;
+    if (next) {
+        // 通道直接轉給排最前面的連線，busy 維持 1
+        lane->queue_head = next->next;
+        if (!lane->queue_head) lane->queue_tail = NULL;
+        next->granted = 1;
+        next->wake(next);
+    } else {
+        lane->busy = 0;
+    }
+
+    if (--lane->refs == 0) {
+        uint32_t slot = shard_hash(lane->username, strlen(lane->username)) % LANE_HASH_SIZE;
+        Lane **link = &table->lanes[slot];
+        while (*link != lane) link = &(*link)->next;
+        *link = lane->next;
+        free(lane);
+    }
+    pthread_mutex_unlock(&table->lock);
+}
@@ -0,0 +1,64 @@
+#ifndef LANE_H
+#define LANE_H
+
+#include <pthread.h>
+#include "protocol.h"
+
+#define LANE_HASH_SIZE 256
+
+/**
+ * 等待使用者通道的請求
+ * 通道由釋放的 session 直接轉給佇列最前面的請求（granted 設為 1），再呼叫 wake。
+ * wake 在持有通道表的鎖時呼叫，不可以再呼叫 lane_* 函式。
+ */
+typedef struct LaneWaiter {
+    struct LaneWaiter *next;
+    int granted;
+    void (*wake)(struct LaneWaiter *waiter);
+    void *arg;
+} LaneWaiter;
+
+/**
+ * 一個使用者的通道：同一時間只有一條連線處理這個使用者的封包，其餘依到達順序排隊
+ */
+typedef struct Lane {
+    char username[MAX_USERNAME_LENGTH + 1];
+    int busy;                // 已有連線持有
+    int refs;                // 持有與排隊中的連線，都釋放後刪除
+    LaneWaiter *queue_head;
+    LaneWaiter *queue_tail;
+    struct Lane *next;
+} Lane;
+
+/**
+ * 所有使用者的通道，以使用者名稱雜湊
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    Lane *lanes[LANE_HASH_SIZE];
+} LaneTable;
+
+/**
+ * 初始化通道表
+ * @param table 通道表
+ * @return 0 表示成功，-1 表示失敗
+ */
+int lane_table_init(LaneTable *table);
+
+/**
+ * 取得使用者的通道：空閒時直接持有（waiter->granted = 1），否則排入佇列
+ * @param table 通道表
+ * @param username 使用者名稱
+ * @param waiter 呼叫端的排隊請求，須保持有效直到 lane_release
+ * @return 使用者的通道，記憶體不足時回傳 NULL
+ */
+Lane *lane_acquire(LaneTable *table, const char *username, LaneWaiter *waiter);
+
+/**
+ * 釋放持有的通道，直接轉給佇列最前面的請求
+ * @param table 通道表
+ * @param lane lane_acquire 的回傳值，呼叫端必須已持有
+ */
+void lane_release(LaneTable *table, Lane *lane);
+
+#endif // LANE_H
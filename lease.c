@@ -0,0 +1,163 @@
+#include "lease.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+// 粗粒度的單調時鐘，lease_touch 在每次收到資料時呼叫，不需要更高的精度
+static int64_t lease_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void lease_push(LeasePool *pool, PortLease *lease) {
+    uint32_t index = (uint32_t)(lease - pool->leases) + 1;
+    uint64_t head = atomic_load(&pool->free_head);
+    uint64_t new_head;
+    do {
+        atomic_store_explicit(&lease->next, (uint32_t)head, memory_order_relaxed);
+        new_head = ((head >> 32) + 1) << 32 | index;
+    } while (!atomic_compare_exchange_weak(&pool->free_head, &head, new_head));
+}
+
+static PortLease *lease_pop(LeasePool *pool) {
+    uint64_t head = atomic_load(&pool->free_head);
+    uint64_t new_head;
+    do {
+        uint32_t index = (uint32_t)head;
+        if (index == 0) return NULL;
+        // next 可能已被其他執行緒改寫，這時版本標記也已改變，CAS 會失敗重試
+        uint32_t next = atomic_load_explicit(&pool->leases[index - 1].next, memory_order_relaxed);
+        new_head = ((head >> 32) + 1) << 32 | next;
+    } while (!atomic_compare_exchange_weak(&pool->free_head, &head, new_head));
+
+    return &pool->leases[(uint32_t)head - 1];
+}
+
+int lease_pool_init(LeasePool *pool, int start, int end, int accept_timeout_ms, int idle_ttl_ms) {
+    pool->count = end - start;
+    pool->leases = calloc(pool->count, sizeof(PortLease));
+    if (!pool->leases) return -1;
+    atomic_init(&pool->free_head, 0);
+    atomic_init(&pool->in_use, 0);
+    atomic_init(&pool->reclaimed, 0);
+    pool->accept_timeout_ms = accept_timeout_ms;
+    pool->idle_ttl_ms = idle_ttl_ms;
+
+    // 反向放入，讓第一次分配從範圍開頭的 port 開始
+    for (int i = pool->count - 1; i >= 0; i--) {
+        PortLease *lease = &pool->leases[i];
+        lease->port = start + i;
+        lease->fds[0] = lease->fds[1] = -1;
+        lease->pool = pool;
+        atomic_init(&lease->state, LEASE_FREE);
+        atomic_init(&lease->stamp, 0);
+        pthread_mutex_init(&lease->lock, NULL);
+        lease_push(pool, lease);
+    }
+    return 0;
+}
+
+PortLease *lease_acquire(LeasePool *pool) {
+    PortLease *lease = lease_pop(pool);
+    if (!lease) return NULL;
+    atomic_fetch_add(&pool->in_use, 1);
+    return lease;
+}
+
+void lease_watch(PortLease *lease, int state, int fd0, int fd1) {
+    int64_t now = lease_now_ms();
+    pthread_mutex_lock(&lease->lock);
+    lease->fds[0] = fd0;
+    lease->fds[1] = fd1;
+    atomic_store(&lease->stamp, state == LEASE_ACCEPTING ? now + lease->pool->accept_timeout_ms : now);
+    atomic_store(&lease->state, state);
+    pthread_mutex_unlock(&lease->lock);
+}
+
+void lease_touch(PortLease *lease) {
+    if (lease) atomic_store_explicit(&lease->stamp, lease_now_ms(), memory_order_relaxed);
+}
+
+void lease_detach(PortLease *lease) {
+    if (!lease) return;
+    pthread_mutex_lock(&lease->lock);
+    lease->fds[0] = lease->fds[1] = -1;
+    pthread_mutex_unlock(&lease->lock);
+}
+
+void lease_release(PortLease *lease) {
+    LeasePool *pool = lease->pool;
+
+    pthread_mutex_lock(&lease->lock);
+    lease->fds[0] = lease->fds[1] = -1;
+    lease->reclaimed = 0;
+    atomic_store(&lease->state, LEASE_FREE);
+    pthread_mutex_unlock(&lease->lock);
+
+    atomic_fetch_sub(&pool->in_use, 1);
+    lease_push(pool, lease);
+}
+
+int lease_in_use(LeasePool *pool) {
+    return atomic_load(&pool->in_use);
+}
+
+uint64_t lease_reclaimed(LeasePool *pool) {
+    return atomic_load(&pool->reclaimed);
+}
+
+// 到期的租約只 shutdown 其 socket：阻塞中的 accept／recv 會返回，
+// 由持有者照正常流程關閉並歸還，避免和持有者同時關閉同一個 fd
+static int lease_reap(LeasePool *pool) {
+    int64_t now = lease_now_ms();
+    int reaped = 0;
+
+    for (int i = 0; i < pool->count; i++) {
+        PortLease *lease = &pool->leases[i];
+        int state = atomic_load(&lease->state);
+        if (state == LEASE_FREE) continue;
+
+        int64_t stamp = atomic_load(&lease->stamp);
+        int expired = state == LEASE_ACCEPTING ? now >= stamp
+                                               : pool->idle_ttl_ms > 0 && now - stamp >= pool->idle_ttl_ms;
+        if (!expired) continue;
+
+        pthread_mutex_lock(&lease->lock);
+        if (!lease->reclaimed && atomic_load(&lease->state) == state &&
+            (lease->fds[0] >= 0 || lease->fds[1] >= 0)) {
+            for (int j = 0; j < 2; j++) {
+                if (lease->fds[j] >= 0) shutdown(lease->fds[j], SHUT_RDWR);
+            }
+            lease->reclaimed = 1;
+            atomic_fetch_add(&pool->reclaimed, 1);
+            log_info("回收 port %d（%s逾時）", lease->port, state == LEASE_ACCEPTING ? "等待連線" : "閒置");
+            reaped++;
+        }
+        pthread_mutex_unlock(&lease->lock);
+    }
+    return reaped;
+}
+
+static void *lease_reaper(void *arg) {
+    LeasePool *pool = arg;
+    while (1) {
+        usleep(LEASE_REAP_INTERVAL_MS * 1000);
+        if (lease_reap(pool) > 0) {
+            log_info("port 租約：使用中 %d，累計回收 %lu", lease_in_use(pool), (unsigned long)lease_reclaimed(pool));
+        }
+    }
+    return NULL;
+}
+
+int lease_pool_start_reaper(LeasePool *pool) {
+    if (pthread_create(&pool->reaper, NULL, lease_reaper, pool) != 0) {
+        log_perror("建立回收執行緒失敗");
+        return -1;
+    }
+    pthread_detach(pool->reaper);
+    return 0;
+}
@@ -0,0 +1,105 @@
+#ifndef LEASE_H
+#define LEASE_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+// 租約狀態
+#define LEASE_FREE      0
+#define LEASE_ACCEPTING 1    // 已分配 port、等待客戶端連線，受 accept 期限限制
+#define LEASE_ACTIVE    2    // session 進行中，受閒置期限限制
+
+#define LEASE_REAP_INTERVAL_MS 1000
+
+/**
+ * 動態 port 的租約
+ * 分配與釋放只動到無鎖的空閒堆疊；fds 由每個租約自己的鎖保護，
+ * 只有綁定／解除綁定與回收執行緒會拿這個鎖，避免回收執行緒對已關閉（可能已被重用）的 fd 呼叫 shutdown。
+ */
+typedef struct {
+    int port;
+    _Atomic uint32_t next;         // 空閒堆疊中的下一個（索引 + 1，0 表示結尾）
+    _Atomic int state;
+    _Atomic int64_t stamp;         // ACCEPTING：accept 期限；ACTIVE：最後一次有資料的時間（毫秒）
+    pthread_mutex_t lock;
+    int fds[2];                    // 到期時要 shutdown 的 socket，-1 表示沒有
+    int reclaimed;                 // 已被回收執行緒強制結束，等待持有者釋放
+    struct LeasePool *pool;
+} PortLease;
+
+typedef struct LeasePool {
+    PortLease *leases;
+    int count;
+    _Atomic uint64_t free_head;    // 高 32 位元為版本標記（避免 ABA），低 32 位元為索引 + 1
+    _Atomic int in_use;
+    _Atomic uint64_t reclaimed;
+    int accept_timeout_ms;
+    int idle_ttl_ms;               // 0 表示不限制閒置時間
+    pthread_t reaper;
+} LeasePool;
+
+/**
+ * 初始化租約池，port 範圍為 [start, end)
+ * @param pool 租約池
+ * @param start 第一個 port
+ * @param end 最後一個 port 的下一個
+ * @param accept_timeout_ms 分配後客戶端必須在這段時間內連線
+ * @param idle_ttl_ms session 閒置超過這段時間就回收，0 表示不限制
+ * @return 0 表示成功，-1 表示失敗
+ */
+int lease_pool_init(LeasePool *pool, int start, int end, int accept_timeout_ms, int idle_ttl_ms);
+
+/**
+ * 啟動回收執行緒：定期檢查到期的租約並 shutdown 其 socket，讓持有者結束後釋放
+ * @param pool 租約池
+ * @return 0 表示成功，-1 表示失敗
+ */
+int lease_pool_start_reaper(LeasePool *pool);
+
+/**
+ * 取得一個空閒的 port，O(1)、無鎖
+ * @param pool 租約池
+ * @return 租約，沒有空閒 port 時回傳 NULL
+ */
+PortLease *lease_acquire(LeasePool *pool);
+
+/**
+ * 設定租約目前的狀態與到期時要 shutdown 的 socket
+ * 更換 socket 時必須先呼叫這個函式再關閉舊的 socket。
+ * @param lease 租約
+ * @param state LEASE_ACCEPTING 或 LEASE_ACTIVE，計時從現在開始
+ * @param fd0 socket，-1 表示沒有
+ * @param fd1 socket，-1 表示沒有
+ */
+void lease_watch(PortLease *lease, int state, int fd0, int fd1);
+
+/**
+ * 記錄 session 有資料往來，延後閒置期限
+ * @param lease 租約，NULL 時不做事
+ */
+void lease_touch(PortLease *lease);
+
+/**
+ * 解除 socket 綁定，必須在關閉這些 socket 之前呼叫
+ * @param lease 租約，NULL 時不做事
+ */
+void lease_detach(PortLease *lease);
+
+/**
+ * 歸還租約，O(1)、無鎖（會先解除 socket 綁定）
+ * @param lease 租約
+ */
+void lease_release(PortLease *lease);
+
+/**
+ * 使用中的租約數量
+ */
+int lease_in_use(LeasePool *pool);
+
+/**
+ * 累計被回收執行緒強制回收的租約數量
+ */
+uint64_t lease_reclaimed(LeasePool *pool);
+
+#endif // LEASE_H
@@ -0,0 +1,193 @@
+#define _GNU_SOURCE
+#include "limit.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include "shard.h"
+#include "log.h"
+
+static double limit_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bucket_init(TokenBucket *bucket, double rate) {
+    pthread_mutex_init(&bucket->lock, NULL);
+    bucket->rate = rate;
+    // 至少容得下一個 v1 封包，速率很低時也不會每個封包都要等待
+    bucket->burst = rate * LIMIT_BURST_MS / 1000;
+    if (bucket->burst < MAX_DATA_SIZE) bucket->burst = MAX_DATA_SIZE;
+    bucket->tokens = bucket->burst;
+    bucket->last = limit_now();
+}
+
+// 補充額度後回傳還要等待的毫秒數；呼叫端持有 bucket->lock
+static int bucket_refill(TokenBucket *bucket, double now) {
+    bucket->tokens += (now - bucket->last) * bucket->rate;
+    if (bucket->tokens > bucket->burst) bucket->tokens = bucket->burst;
+    bucket->last = now;
+    if (bucket->tokens >= LIMIT_MIN_READ) return 0;
+    return (int)((LIMIT_MIN_READ - bucket->tokens) * 1000 / bucket->rate) + 1;
+}
+
+// 把可以讀取的位元組數壓低到這個令牌桶的額度
+static int bucket_delay(TokenBucket *bucket, double now, size_t *allowance) {
+    if (bucket->rate == 0) return 0;
+    pthread_mutex_lock(&bucket->lock);
+    int delay = bucket_refill(bucket, now);
+    if (delay == 0 && (*allowance == 0 || bucket->tokens < *allowance)) *allowance = bucket->tokens;
+    pthread_mutex_unlock(&bucket->lock);
+    return delay;
+}
+
+static void bucket_charge(TokenBucket *bucket, size_t bytes) {
+    if (bucket->rate == 0) return;
+    pthread_mutex_lock(&bucket->lock);
+    bucket->tokens -= bytes;
+    pthread_mutex_unlock(&bucket->lock);
+}
+
+int limiter_init(Limiter *limiter, uint64_t user_rate, uint64_t total_rate, int max_sessions) {
+    memset(limiter, 0, sizeof(Limiter));
+    if (pthread_mutex_init(&limiter->lock, NULL) != 0 || pthread_cond_init(&limiter->admitted, NULL) != 0) {
+        return -1;
+    }
+    bucket_init(&limiter->total, total_rate);
+    limiter->user_rate = user_rate;
+    limiter->max_sessions = max_sessions;
+    return 0;
+}
+
+int limiter_enabled(const Limiter *limiter) {
+    return limiter->total.rate > 0 || limiter->user_rate > 0 || limiter->max_sessions > 0;
+}
+
+UserLimit *limiter_join(Limiter *limiter, const char *username, LimitWaiter *waiter) {
+    uint32_t slot = shard_hash(username, strlen(username)) % LIMIT_HASH_SIZE;
+    waiter->next = NULL;
+    waiter->admitted = 0;
+
+    pthread_mutex_lock(&limiter->lock);
+    UserLimit *user = limiter->users[slot];
+    while (user && strcmp(user->username, username) != 0) user = user->next;
+    if (!user) {
+        user = calloc(1, sizeof(UserLimit));
+        if (!user) {
+            pthread_mutex_unlock(&limiter->lock);
+            return NULL;
+        }
+        strcpy(user->username, username);
+        user->limiter = limiter;
+        bucket_init(&user->bucket, limiter->user_rate);
+        user->next = limiter->users[slot];
+        limiter->users[slot] = user;
+    }
+    user->refs++;
+
+    // 已經有人在排隊時也要排隊，名額依到達順序分配
+    if (limiter->max_sessions == 0 || (user->sessions < limiter->max_sessions && !user->queue_head)) {
+        user->sessions++;
+        waiter->admitted = 1;
+    } else {
+        if (user->queue_tail) user->queue_tail->next = waiter;
+        else user->queue_head = waiter;
+        user->queue_tail = waiter;
+        log_info("使用者 %s 已有 %d 個 session，新的 session 排隊等待", username, user->sessions);
+    }
+    pthread_mutex_unlock(&limiter->lock);
+    return user;
+}
+
+int limiter_wait(UserLimit *user, LimitWaiter *waiter, int client_fd) {
+    Limiter *limiter = user->limiter;
+    pthread_mutex_lock(&limiter->lock);
+    while (!waiter->admitted) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += LIMIT_WAIT_CHECK_MS / 1000;
+        pthread_cond_timedwait(&limiter->admitted, &limiter->lock, &deadline);
+        if (waiter->admitted) break;
+
+        // 客戶端關閉或被回收執行緒 shutdown 時放棄排隊
+        struct pollfd pfd = { .fd = client_fd, .events = POLLRDHUP };
+        if (poll(&pfd, 1, 0) > 0) {
+            pthread_mutex_unlock(&limiter->lock);
+            return -1;
+        }
+    }
+    pthread_mutex_unlock(&limiter->lock);
+    return 0;
+}
+
+void limiter_leave(UserLimit *user, LimitWaiter *waiter) {
+    if (!user) return;
+    Limiter *limiter = user->limiter;
+
+    pthread_mutex_lock(&limiter->lock);
+    if (waiter->admitted) {
+        user->sessions--;
+        // 名額直接轉給排最前面的 session
+        LimitWaiter *next = user->queue_head;
+        if (next) {
+            user->queue_head = next->next;
+            if (!user->queue_head) user->queue_tail = NULL;
+            user->sessions++;
+            next->admitted = 1;
+            if (next->wake) next->wake(next);
+            else pthread_cond_broadcast(&limiter->admitted);
+        }
+    } else {
+        LimitWaiter **link = &user->queue_head;
+        LimitWaiter *prev = NULL;
+        while (*link && *link != waiter) {
+            prev = *link;
+            link = &(*link)->next;
+        }
+        if (*link) {
+            *link = waiter->next;
+            if (user->queue_tail == waiter) user->queue_tail = prev;
+        }
+    }
+
+    if (--user->refs == 0) {
+        uint32_t slot = shard_hash(user->username, strlen(user->username)) % LIMIT_HASH_SIZE;
+        UserLimit **link = &limiter->users[slot];
+        while (*link != user) link = &(*link)->next;
+        *link = user->next;
+        pthread_mutex_destroy(&user->bucket.lock);
+        free(user);
+    }
+    pthread_mutex_unlock(&limiter->lock);
+}
+
+int limiter_delay(UserLimit *user, size_t *allowance) {
+    *allowance = 0;
+    if (!user) return 0;
+    double now = limit_now();
+    int user_delay = bucket_delay(&user->bucket, now, allowance);
+    int total_delay = bucket_delay(&user->limiter->total, now, allowance);
+    return user_delay > total_delay ? user_delay : total_delay;
+}
+
+void limiter_charge(UserLimit *user, size_t bytes) {
+    if (!user) return;
+    bucket_charge(&user->bucket, bytes);
+    bucket_charge(&user->limiter->total, bytes);
+}
+
+int parse_rate(const char *text, uint64_t *rate) {
+    char *end;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (end == text) return -1;
+    switch (*end) {
+        case 'k': case 'K': value <<= 10; end++; break;
+        case 'm': case 'M': value <<= 20; end++; break;
+        case 'g': case 'G': value <<= 30; end++; break;
+    }
+    if (*end != '\0') return -1;
+    *rate = value;
+    return 0;
+}
@@ -0,0 +1,132 @@
+#ifndef LIMIT_H
+#define LIMIT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "protocol.h"
+
+#define LIMIT_HASH_SIZE 256
+#define LIMIT_BURST_MS 100           // 令牌桶最多累積這段時間的額度
+#define LIMIT_MIN_READ MAX_DATA_SIZE // 額度累積到這麼多才讀取，避免很小的 recv
+#define LIMIT_WAIT_CHECK_MS 1000     // 排隊中的執行緒每隔這段時間檢查客戶端是否已離開
+
+/**
+ * 令牌桶：額度以每秒 rate bytes 補充，最多累積 burst
+ * 每次讀取不超過目前的額度；splice 的數據區在開始時一次扣除，額度可以是負的，
+ * 累積回 LIMIT_MIN_READ 以上才能再讀取，長期平均仍是 rate。
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    double rate;             // bytes/s，0 表示不限制
+    double burst;
+    double tokens;
+    double last;             // 上次補充的時間（秒，CLOCK_MONOTONIC）
+} TokenBucket;
+
+/**
+ * 排隊等待 session 名額的請求
+ * 名額由結束的 session 直接轉給佇列最前面的請求（admitted 設為 1），再呼叫 wake。
+ * wake 在持有限制器的鎖時呼叫，不可以再呼叫 limiter_* 函式。
+ */
+typedef struct LimitWaiter {
+    struct LimitWaiter *next;
+    int admitted;
+    void (*wake)(struct LimitWaiter *waiter);  // NULL 表示以 limiter_wait 阻塞等待
+    void *arg;
+} LimitWaiter;
+
+struct Limiter;
+
+/**
+ * 一個使用者的限制狀態，進行中與排隊中的 session 共用，都結束後釋放
+ */
+typedef struct UserLimit {
+    char username[MAX_USERNAME_LENGTH + 1];
+    struct Limiter *limiter;
+    int sessions;            // 進行中的 session
+    int refs;                // 進行中與排隊中的 session
+    TokenBucket bucket;
+    LimitWaiter *queue_head; // 等待名額的 session，先到先進
+    LimitWaiter *queue_tail;
+    struct UserLimit *next;
+} UserLimit;
+
+/**
+ * 轉發伺服器的頻寬與 session 數限制，以封包頭部的使用者名稱區分使用者
+ */
+typedef struct Limiter {
+    pthread_mutex_t lock;    // 保護雜湊表、名額與佇列
+    pthread_cond_t admitted; // 阻塞等待的 session 在名額轉移時被喚醒
+    TokenBucket total;       // 所有使用者合計
+    double user_rate;        // 每個使用者的上限，0 表示不限制
+    int max_sessions;        // 每個使用者同時進行的 session，0 表示不限制
+    UserLimit *users[LIMIT_HASH_SIZE];
+} Limiter;
+
+/**
+ * 初始化限制器
+ * @param limiter 限制器
+ * @param user_rate 每個使用者的頻寬上限（bytes/s，兩個方向合計），0 表示不限制
+ * @param total_rate 所有使用者合計的頻寬上限（bytes/s），0 表示不限制
+ * @param max_sessions 每個使用者同時進行的 session 數，超過的排隊等待，0 表示不限制
+ * @return 0 表示成功，-1 表示失敗
+ */
+int limiter_init(Limiter *limiter, uint64_t user_rate, uint64_t total_rate, int max_sessions);
+
+/**
+ * 是否設定了任何限制；沒有時 session 不需要加入限制器
+ * @param limiter 限制器
+ * @return 1 表示有限制
+ */
+int limiter_enabled(const Limiter *limiter);
+
+/**
+ * session 加入使用者的限制：有名額時直接取得（waiter->admitted = 1），否則排入佇列
+ * @param limiter 限制器
+ * @param username session 的使用者名稱
+ * @param waiter 呼叫端的排隊請求，須保持有效直到 limiter_leave
+ * @return 使用者的限制狀態，記憶體不足時回傳 NULL
+ */
+UserLimit *limiter_join(Limiter *limiter, const char *username, LimitWaiter *waiter);
+
+/**
+ * 阻塞等待名額（執行緒模式），期間定期檢查客戶端是否已關閉
+ * @param user limiter_join 的回傳值
+ * @param waiter 排隊請求
+ * @param client_fd 客戶端 socket
+ * @return 0 表示取得名額，-1 表示客戶端已離開
+ */
+int limiter_wait(UserLimit *user, LimitWaiter *waiter, int client_fd);
+
+/**
+ * session 結束或放棄排隊：歸還名額並轉給佇列最前面的請求
+ * @param user limiter_join 的回傳值，NULL 時不做事
+ * @param waiter 排隊請求
+ */
+void limiter_leave(UserLimit *user, LimitWaiter *waiter);
+
+/**
+ * 讀取更多資料前要等待的時間（使用者與全域額度都累積到 LIMIT_MIN_READ 以上）
+ * @param user 使用者的限制狀態，NULL 表示不限制
+ * @param allowance 輸出可以立即讀取的位元組數（兩個額度中較小的），0 表示不限制
+ * @return 毫秒，0 表示可以立即讀取
+ */
+int limiter_delay(UserLimit *user, size_t *allowance);
+
+/**
+ * 扣除已轉發的位元組
+ * @param user 使用者的限制狀態，NULL 時不做事
+ * @param bytes 位元組數
+ */
+void limiter_charge(UserLimit *user, size_t bytes);
+
+/**
+ * 解析頻寬設定，可加上 K、M、G（1024 的倍數）
+ * @param text 例如 "512K"、"20M"
+ * @param rate 輸出 bytes/s
+ * @return 0 表示成功，-1 表示格式錯誤
+ */
+int parse_rate(const char *text, uint64_t *rate);
+
+#endif // LIMIT_H
@@ -0,0 +1,205 @@
+#define _GNU_SOURCE
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+int log_level = LOG_INFO;
+
+static const char *level_names[] = { "error", "warn", "info", "debug", "trace" };
+
+typedef struct {
+    struct timespec time;    // 記錄的時間（CLOCK_REALTIME），輸出時才格式化
+    int level;
+    char text[LOG_RECORD_SIZE - sizeof(struct timespec) - sizeof(int)];
+} LogRecord;
+
+/**
+ * 一個執行緒的紀錄緩衝區：單一寫入端（擁有的執行緒）與單一讀取端（輸出執行緒）
+ * 寫入端先填好紀錄再以 release 推進 head，讀取端以 acquire 讀取 head，兩端都不需要鎖。
+ */
+typedef struct LogRing {
+    LogRecord records[LOG_RING_SIZE];
+    _Atomic uint32_t head;       // 下一筆寫入的位置，只由擁有的執行緒更新
+    _Atomic uint32_t tail;       // 下一筆輸出的位置，只由輸出端更新
+    _Atomic uint64_t dropped;    // 緩衝區已滿而丟棄的筆數
+    _Atomic int closed;          // 執行緒已結束，輸出完剩餘的紀錄後釋放
+    struct LogRing *next;
+} LogRing;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;  // 保護 rings 串列的插入與移除
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;  // 同時只有一個輸出端
+static LogRing *rings;
+static pthread_key_t ring_key;
+static __thread LogRing *thread_ring;
+static atomic_int started;
+
+static void print_record(const LogRecord *record) {
+    struct tm tm;
+    localtime_r(&record->time.tv_sec, &tm);
+    FILE *out = record->level <= LOG_WARN ? stderr : stdout;
+    fprintf(out, "%02d:%02d:%02d.%03ld [%s] %s\n", tm.tm_hour, tm.tm_min, tm.tm_sec,
+            record->time.tv_nsec / 1000000, level_names[record->level], record->text);
+}
+
+static void format_record(LogRecord *record, int level, const char *format, va_list args) {
+    clock_gettime(CLOCK_REALTIME, &record->time);
+    record->level = level;
+    vsnprintf(record->text, sizeof(record->text), format, args);
+}
+
+// 執行緒結束時由 pthread 呼叫，緩衝區留給輸出端釋放
+static void ring_release(void *arg) {
+    LogRing *ring = arg;
+    atomic_store_explicit(&ring->closed, 1, memory_order_release);
+}
+
+static LogRing *ring_get() {
+    if (thread_ring) return thread_ring;
+    LogRing *ring = calloc(1, sizeof(LogRing));
+    if (!ring) return NULL;
+    pthread_setspecific(ring_key, ring);
+
+    pthread_mutex_lock(&rings_lock);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&rings_lock);
+
+    thread_ring = ring;
+    return ring;
+}
+
+// 輸出所有緩衝區中的紀錄，回傳輸出的筆數
+static int log_drain() {
+    int count = 0;
+    pthread_mutex_lock(&drain_lock);
+
+    // 新的緩衝區只插在串列開頭，移除只由持有 drain_lock 的輸出端進行，走訪時不需要 rings_lock
+    pthread_mutex_lock(&rings_lock);
+    LogRing *ring = rings;
+    pthread_mutex_unlock(&rings_lock);
+
+    while (ring) {
+        LogRing *next = ring->next;
+        // 先讀 closed 再讀 head：執行緒結束前寫入的紀錄都會在這一輪輸出
+        int closed = atomic_load_explicit(&ring->closed, memory_order_acquire);
+        uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        for (; tail != head; tail++, count++) {
+            print_record(&ring->records[tail & (LOG_RING_SIZE - 1)]);
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+        uint64_t dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+        if (dropped > 0) {
+            fprintf(stderr, "日誌緩衝區已滿，丟棄 %llu 筆紀錄\n", (unsigned long long)dropped);
+        }
+
+        if (closed) {
+            pthread_mutex_lock(&rings_lock);
+            LogRing **link = &rings;
+            while (*link != ring) link = &(*link)->next;
+            *link = next;
+            pthread_mutex_unlock(&rings_lock);
+            free(ring);
+        }
+        ring = next;
+    }
+
+    if (count > 0) fflush(stdout);
+    pthread_mutex_unlock(&drain_lock);
+    return count;
+}
+
+static void *log_thread(void *arg) {
+    (void)arg;
+    struct timespec idle = { 0, LOG_DRAIN_MS * 1000000L };
+    while (1) {
+        if (log_drain() == 0) nanosleep(&idle, NULL);
+    }
+    return NULL;
+}
+
+int log_parse_level(const char *name) {
+    for (int level = LOG_ERROR; level <= LOG_TRACE; level++) {
+        if (strcmp(name, level_names[level]) == 0) return level;
+    }
+    return -1;
+}
+
+int log_start() {
+    if (pthread_key_create(&ring_key, ring_release) != 0) {
+        fprintf(stderr, "建立日誌緩衝區失敗\n");
+        return -1;
+    }
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, log_thread, NULL) != 0) {
+        perror("pthread_create 失敗");
+        return -1;
+    }
+    pthread_detach(tid);
+    atomic_store(&started, 1);
+    atexit(log_flush);
+    return 0;
+}
+
+void log_flush() {
+    if (atomic_load(&started)) log_drain();
+    fflush(stdout);
+}
+
+void log_write(int level, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+
+    LogRing *ring = atomic_load_explicit(&started, memory_order_relaxed) ? ring_get() : NULL;
+    if (!ring) {
+        LogRecord record;
+        format_record(&record, level, format, args);
+        print_record(&record);
+        va_end(args);
+        return;
+    }
+
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail >= LOG_RING_SIZE) {
+        if (level == LOG_ERROR) {
+            // 錯誤訊息不丟棄，改為同步輸出（順序可能早於緩衝區中的紀錄）
+            LogRecord record;
+            format_record(&record, level, format, args);
+            print_record(&record);
+        } else {
+            atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        }
+        va_end(args);
+        return;
+    }
+
+    format_record(&ring->records[head & (LOG_RING_SIZE - 1)], level, format, args);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    va_end(args);
+}
+
+void log_write_frame(const char *what, const ProtocolHeader *header, const uint8_t *data) {
+    if (!data || !log_enabled(LOG_TRACE)) {
+        log_write(LOG_DEBUG, "%s - Operation: %d, Status: %d, Sequence: %u, Length: %u", what,
+                  header->operation, header->status, header->sequence, header->length);
+        return;
+    }
+
+    // 數據區可能是二進位內容，只印出前段並把控制字元換成 '.'
+    char excerpt[LOG_EXCERPT + 1];
+    uint32_t len = header->length < LOG_EXCERPT ? header->length : LOG_EXCERPT;
+    for (uint32_t i = 0; i < len; i++) {
+        excerpt[i] = data[i] < 0x20 || data[i] == 0x7f ? '.' : (char)data[i];
+    }
+    excerpt[len] = '\0';
+    log_write(LOG_TRACE, "%s - Operation: %d, Status: %d, Sequence: %u, Length: %u, Data: %s%s", what,
+              header->operation, header->status, header->sequence, header->length, excerpt,
+              header->length > LOG_EXCERPT ? "..." : "");
+}
@@ -0,0 +1,84 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include "protocol.h"
+
+// 日誌等級，數字越大越詳細
+#define LOG_ERROR 0
+#define LOG_WARN  1
+#define LOG_INFO  2
+#define LOG_DEBUG 3   // 每個封包的頭部
+#define LOG_TRACE 4   // 每個封包的頭部與數據區摘錄
+
+// 編譯時的上限：高於這個等級的呼叫連同參數的計算都會被編譯器移除
+// 例如 make CFLAGS="-Wall -g -DLOG_COMPILE_LEVEL=LOG_INFO"
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_TRACE
+#endif
+
+#define LOG_RING_SIZE 256            // 每個執行緒的環狀緩衝區筆數，須為 2 的冪
+#define LOG_RECORD_SIZE 256          // 每筆紀錄的大小，過長的訊息會被截斷
+#define LOG_EXCERPT 64               // trace 等級印出的數據區前綴長度
+#define LOG_DRAIN_MS 10              // 背景執行緒沒有紀錄可輸出時的休眠間隔
+
+/**
+ * 執行時的等級，預設 LOG_INFO；只在啟動時設定
+ */
+extern int log_level;
+
+#define log_enabled(level) ((level) <= LOG_COMPILE_LEVEL && (level) <= log_level)
+
+// 等級不足時只有一次比較，不會格式化參數
+#define log_at(level, ...) do { if (log_enabled(level)) log_write(level, __VA_ARGS__); } while (0)
+#define log_error(...) log_at(LOG_ERROR, __VA_ARGS__)
+#define log_warn(...)  log_at(LOG_WARN, __VA_ARGS__)
+#define log_info(...)  log_at(LOG_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_DEBUG, __VA_ARGS__)
+#define log_trace(...) log_at(LOG_TRACE, __VA_ARGS__)
+
+// 和 perror 相同的輸出內容
+#define log_perror(msg) log_error("%s: %s", msg, strerror(errno))
+
+// 封包紀錄：debug 等級印出頭部，trace 等級再加上數據區摘錄
+#define log_frame(what, header, data) \
+    do { if (log_enabled(LOG_DEBUG)) log_write_frame(what, header, data); } while (0)
+
+/**
+ * 解析等級名稱
+ * @param name error、warn、info、debug 或 trace
+ * @return 等級，-1 表示名稱錯誤
+ */
+int log_parse_level(const char *name);
+
+/**
+ * 啟動背景輸出執行緒；之後每個執行緒的紀錄先寫入自己的環狀緩衝區，不取得任何鎖
+ * 沒有呼叫時（命令列工具）紀錄直接同步輸出。行程正常結束時會輸出剩餘的紀錄。
+ * @return 0 表示成功，-1 表示失敗
+ */
+int log_start();
+
+/**
+ * 輸出所有執行緒緩衝區中的紀錄
+ */
+void log_flush();
+
+/**
+ * 記錄一則訊息，請透過 log_error 等巨集呼叫
+ * error 與 warn 輸出到 stderr，其餘輸出到 stdout；緩衝區已滿時 error 同步輸出，其他等級丟棄並計數。
+ * @param level 等級
+ * @param format printf 格式，不需要結尾的換行
+ */
+void log_write(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+ * 記錄一個封包，請透過 log_frame 巨集呼叫
+ * @param what 訊息前綴，例如 "接收到數據"
+ * @param header 封包頭部
+ * @param data 數據區，長度為 header->length
+ */
+void log_write_frame(const char *what, const ProtocolHeader *header, const uint8_t *data);
+
+#endif // LOG_H
@@ -0,0 +1,192 @@
+#define _GNU_SOURCE
+#include "metrics.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+Metrics metrics;
+
+static const char *direction_names[2][2] = {
+    { "up", "down" },   // 轉發伺服器
+    { "in", "out" },    // 儲存伺服器
+};
+
+uint64_t metrics_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void metrics_observe_n(Histogram *hist, uint64_t us, uint64_t n) {
+    // 不超過 2^i 微秒的放在第 i 格
+    int index = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+    if (index > METRICS_BUCKETS) index = METRICS_BUCKETS;
+    atomic_fetch_add_explicit(&hist->buckets[index], n, memory_order_relaxed);
+    atomic_fetch_add_explicit(&hist->count, n, memory_order_relaxed);
+    atomic_fetch_add_explicit(&hist->sum_us, us * n, memory_order_relaxed);
+}
+
+void metrics_observe(Histogram *hist, uint64_t us) {
+    metrics_observe_n(hist, us, 1);
+}
+
+void metrics_observe_since(Histogram *hist, uint64_t since) {
+    metrics_observe(hist, metrics_now_us() - since);
+}
+
+void metrics_count_frame(int direction, uint8_t operation, uint64_t bytes) {
+    OpCounter *counter = &metrics.ops[direction][operation < METRICS_MAX_OP ? operation : METRICS_MAX_OP - 1];
+    atomic_fetch_add_explicit(&counter->frames, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&counter->bytes, bytes, memory_order_relaxed);
+}
+
+void metrics_session(int delta) {
+    atomic_fetch_add_explicit(&metrics.active_sessions, delta, memory_order_relaxed);
+    if (delta > 0) atomic_fetch_add_explicit(&metrics.sessions_total, 1, memory_order_relaxed);
+}
+
+static void dump_histogram(FILE *out, const char *prefix, const char *name, const char *help, Histogram *hist) {
+    fprintf(out, "# HELP %s_%s_seconds %s\n# TYPE %s_%s_seconds histogram\n", prefix, name, help, prefix, name);
+
+    // 各格分別讀取，累計值可能和 count 有些微差距，但不會遞減
+    uint64_t cumulative = 0;
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        cumulative += atomic_load_explicit(&hist->buckets[i], memory_order_relaxed);
+        fprintf(out, "%s_%s_seconds_bucket{le=\"%g\"} %llu\n", prefix, name, (double)(1ULL << i) / 1e6,
+                (unsigned long long)cumulative);
+    }
+    cumulative += atomic_load_explicit(&hist->buckets[METRICS_BUCKETS], memory_order_relaxed);
+    fprintf(out, "%s_%s_seconds_bucket{le=\"+Inf\"} %llu\n", prefix, name, (unsigned long long)cumulative);
+    fprintf(out, "%s_%s_seconds_sum %.6f\n", prefix, name,
+            atomic_load_explicit(&hist->sum_us, memory_order_relaxed) / 1e6);
+    fprintf(out, "%s_%s_seconds_count %llu\n", prefix, name, (unsigned long long)cumulative);
+}
+
+static void dump_ops(FILE *out, const char *prefix, const char *kind, const char *help, int bytes) {
+    fprintf(out, "# HELP %s_%s_total %s\n# TYPE %s_%s_total counter\n", prefix, kind, help, prefix, kind);
+    const char **names = direction_names[metrics.server == METRICS_STORAGE];
+    for (int d = 0; d < 2; d++) {
+        for (int op = 0; op < METRICS_MAX_OP; op++) {
+            OpCounter *counter = &metrics.ops[d][op];
+            uint64_t value = atomic_load_explicit(bytes ? &counter->bytes : &counter->frames, memory_order_relaxed);
+            fprintf(out, "%s_%s_total{direction=\"%s\",operation=\"%d\"} %llu\n", prefix, kind, names[d], op,
+                    (unsigned long long)value);
+        }
+    }
+}
+
+int metrics_dump(int fd) {
+    char *text = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&text, &size);
+    if (!out) return -1;
+
+    const char *prefix = metrics.server == METRICS_STORAGE ? "storage" : "transfer";
+    fprintf(out, "# HELP %s_active_sessions Sessions in progress.\n# TYPE %s_active_sessions gauge\n", prefix, prefix);
+    fprintf(out, "%s_active_sessions %lld\n", prefix,
+            (long long)atomic_load_explicit(&metrics.active_sessions, memory_order_relaxed));
+    fprintf(out, "# HELP %s_sessions_total Sessions started.\n# TYPE %s_sessions_total counter\n", prefix, prefix);
+    fprintf(out, "%s_sessions_total %llu\n", prefix,
+            (unsigned long long)atomic_load_explicit(&metrics.sessions_total, memory_order_relaxed));
+    dump_ops(out, prefix, "frames", "Frames by direction and operation code.", 0);
+    dump_ops(out, prefix, "bytes", "Payload bytes by direction and operation code.", 1);
+
+    if (metrics.server == METRICS_TRANSFER) {
+        dump_histogram(out, prefix, "backend_connect", "Time to obtain a backend connection.", &metrics.backend_connect);
+        dump_histogram(out, prefix, "relay_frame", "Time from receiving a frame to finishing sending it.", &metrics.relay_frame);
+        if (metrics.ports_in_use) {
+            fprintf(out, "# HELP transfer_ports_in_use Dynamic ports leased.\n# TYPE transfer_ports_in_use gauge\n");
+            fprintf(out, "transfer_ports_in_use %d\n", metrics.ports_in_use());
+            fprintf(out, "# HELP transfer_ports_total Dynamic ports in the pool.\n# TYPE transfer_ports_total gauge\n");
+            fprintf(out, "transfer_ports_total %d\n", metrics.ports_total);
+            fprintf(out, "# HELP transfer_ports_reclaimed_total Leases reclaimed by the reaper.\n"
+                         "# TYPE transfer_ports_reclaimed_total counter\n");
+            fprintf(out, "transfer_ports_reclaimed_total %llu\n", (unsigned long long)metrics.ports_reclaimed());
+        }
+    } else {
+        dump_histogram(out, prefix, "login", "Time to verify credentials.", &metrics.login);
+        dump_histogram(out, prefix, "fwrite", "Time per fwrite of backup data.", &metrics.write);
+        dump_histogram(out, prefix, "fread", "Time per read of backup data (fread, or sendfile of one frame).", &metrics.read);
+        dump_histogram(out, prefix, "commit", "Time to make a finished backup durable and publish it.", &metrics.commit);
+        dump_histogram(out, prefix, "retention", "Time per retention pass.", &metrics.retention);
+        static const char *kinds[] = { "backup", "chunk" };
+        fprintf(out, "# HELP storage_retention_deleted_total Files deleted by retention.\n"
+                     "# TYPE storage_retention_deleted_total counter\n");
+        for (int i = 0; i < 2; i++) {
+            fprintf(out, "storage_retention_deleted_total{kind=\"%s\"} %llu\n", kinds[i],
+                    (unsigned long long)atomic_load_explicit(&metrics.retention_deleted[i], memory_order_relaxed));
+        }
+        fprintf(out, "# HELP storage_retention_reclaimed_bytes_total Bytes freed by retention.\n"
+                     "# TYPE storage_retention_reclaimed_bytes_total counter\n");
+        for (int i = 0; i < 2; i++) {
+            fprintf(out, "storage_retention_reclaimed_bytes_total{kind=\"%s\"} %llu\n", kinds[i],
+                    (unsigned long long)atomic_load_explicit(&metrics.retention_bytes[i], memory_order_relaxed));
+        }
+    }
+    fclose(out);
+
+    // 對方先關閉連線時不能因為 SIGPIPE 結束整個程式
+    int ret = 0;
+    for (size_t off = 0; off < size;) {
+        ssize_t n = send(fd, text + off, size - off, MSG_NOSIGNAL);
+        if (n <= 0) {
+            ret = -1;
+            break;
+        }
+        off += n;
+    }
+    free(text);
+    return ret;
+}
+
+static void *metrics_server(void *arg) {
+    int listen_fd = (int)(intptr_t)arg;
+    while (1) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            log_perror("指標 socket accept 失敗");
+            continue;
+        }
+        metrics_dump(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+int metrics_serve(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        log_error("指標 socket 路徑過長: %s", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_perror("建立指標 socket 失敗");
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 8) < 0) {
+        log_perror("指標 socket 監聽失敗");
+        close(fd);
+        return -1;
+    }
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, metrics_server, (void *)(intptr_t)fd) != 0) {
+        log_perror("pthread_create 失敗");
+        close(fd);
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
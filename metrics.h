@@ -0,0 +1,109 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define METRICS_BUCKETS 24           // 直方圖第 i 格：不超過 2^i 微秒（最後一格約 8 秒），另有一格 +Inf
+#define METRICS_MAX_OP 13            // 依 operation 分開計數，更大的操作碼併入最後一格
+
+// 指標分屬的伺服器
+#define METRICS_TRANSFER 0x1
+#define METRICS_STORAGE  0x2
+
+/**
+ * 延遲直方圖，所有欄位只以 relaxed 的原子操作累加，記錄時不需要鎖
+ */
+typedef struct {
+    _Atomic uint64_t buckets[METRICS_BUCKETS + 1];
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum_us;
+} Histogram;
+
+typedef struct {
+    _Atomic uint64_t frames;
+    _Atomic uint64_t bytes;          // 數據區的位元組數
+} OpCounter;
+
+/**
+ * 一個伺服器行程的所有指標
+ * 方向 0／1 在轉發伺服器是 up（客戶端 → 後端）／down，在儲存伺服器是 in（收到）／out（送出）。
+ */
+typedef struct {
+    int server;                      // METRICS_TRANSFER 或 METRICS_STORAGE
+    _Atomic int64_t active_sessions;
+    _Atomic uint64_t sessions_total;
+    OpCounter ops[2][METRICS_MAX_OP];
+    Histogram backend_connect;       // 轉發：取得後端連線（連線池或新連線）到可以送出
+    Histogram relay_frame;           // 轉發：封包從讀進接收緩衝區到送完
+    Histogram login;                 // 儲存：驗證帳號密碼
+    Histogram write;                 // 儲存：每次 fwrite
+    Histogram read;                  // 儲存：每次讀取備份資料（fread，或 sendfile 送出一個封包）
+    Histogram commit;                // 儲存：備份完成到資料落地並發布（含等待 group commit）
+    Histogram retention;             // 儲存：一輪保留策略（刪除舊版本與回收區塊）
+    _Atomic uint64_t retention_deleted[2];   // 儲存：保留策略刪除的 0 備份／1 區塊
+    _Atomic uint64_t retention_bytes[2];     // 儲存：因此釋放的空間
+    int (*ports_in_use)();           // 轉發：動態 port 的使用量，dump 時才讀取
+    int ports_total;
+    uint64_t (*ports_reclaimed)();
+} Metrics;
+
+extern Metrics metrics;
+
+/**
+ * 單調時鐘的目前時間
+ * @return 微秒
+ */
+uint64_t metrics_now_us();
+
+/**
+ * 記錄一個延遲
+ * @param hist 直方圖
+ * @param us 微秒
+ */
+void metrics_observe(Histogram *hist, uint64_t us);
+
+/**
+ * 記錄 n 個相同的延遲（同一批轉發的封包）
+ * @param hist 直方圖
+ * @param us 微秒
+ * @param n 次數
+ */
+void metrics_observe_n(Histogram *hist, uint64_t us, uint64_t n);
+
+/**
+ * 記錄 since 到現在的延遲
+ * @param hist 直方圖
+ * @param since metrics_now_us 的回傳值
+ */
+void metrics_observe_since(Histogram *hist, uint64_t since);
+
+/**
+ * 計數一個封包
+ * @param direction 0 或 1，意義見 Metrics
+ * @param operation 操作碼
+ * @param bytes 數據區長度
+ */
+void metrics_count_frame(int direction, uint8_t operation, uint64_t bytes);
+
+/**
+ * session 開始或結束
+ * @param delta 1 表示開始，-1 表示結束
+ */
+void metrics_session(int delta);
+
+/**
+ * 以 Prometheus 文字格式輸出目前的指標
+ * @param fd 輸出的 socket
+ * @return 0 表示成功，-1 表示寫入失敗
+ */
+int metrics_dump(int fd);
+
+/**
+ * 在本機 Unix socket 上提供指標：每條連線送出一次 metrics_dump 後關閉
+ * @param path socket 路徑，已存在的檔案會先刪除
+ * @return 0 表示成功啟動服務執行緒，-1 表示失敗
+ */
+int metrics_serve(const char *path);
+
+#endif // METRICS_H
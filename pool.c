@@ -0,0 +1,241 @@
+#include "pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include "transfer.h"
+#include "log.h"
+
+static void set_nonblocking_mode(int fd, int nonblocking) {
+    int flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, nonblocking ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
+}
+
+static Connection *backend_connect(BackendPool *pool, int nonblocking) {
+    int fd = connect_to_backend(pool->host, pool->port, nonblocking);
+    if (fd < 0) return NULL;
+
+    Connection *conn = malloc(sizeof(Connection));
+    if (!conn || conn_init(conn, fd) != 0) {
+        free(conn);
+        close(fd);
+        return NULL;
+    }
+    return conn;
+}
+
+static void backend_free(Connection *conn) {
+    conn_close(conn);
+    free(conn);
+}
+
+// 閒置中的連線不應該收到任何資料，可讀代表對端已關閉或狀態不明
+static int backend_idle_alive(Connection *conn) {
+    struct pollfd pfd = { .fd = conn->fd, .events = POLLIN };
+    return poll(&pfd, 1, 0) == 0;
+}
+
+int backend_open(BackendPool *pool, Backend *backend, int nonblocking) {
+    memset(backend, 0, sizeof(Backend));
+    backend->pool = pool;
+
+    Connection *conn = NULL;
+    int admit = 0;
+    pthread_mutex_lock(&pool->lock);
+    while (pool->idle_count > 0) {
+        conn = pool->idle[--pool->idle_count];
+        if (backend_idle_alive(conn)) break;
+        pool->open--;
+        backend_free(conn);
+        conn = NULL;
+    }
+    if (!conn && pool->max > 0 && pool->supported != 0 && pool->open < pool->max) {
+        pool->open++;
+        admit = 1;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (conn) {
+        set_nonblocking_mode(conn->fd, nonblocking);
+        backend->conn = conn;
+        backend->pooled = 1;
+        return 0;
+    }
+
+    conn = backend_connect(pool, nonblocking);
+    if (!conn) {
+        if (admit) {
+            pthread_mutex_lock(&pool->lock);
+            pool->open--;
+            pthread_mutex_unlock(&pool->lock);
+        }
+        return -1;
+    }
+    backend->conn = conn;
+    backend->fresh = 1;
+    backend->pooled = admit;
+
+    // 新連線的第一個封包：讓儲存伺服器把它標記為可重用
+    if (admit && backend_queue_reset(backend) != 0) {
+        backend_close(backend, 0);
+        return -1;
+    }
+    return 0;
+}
+
+int backend_queue_reset(Backend *backend) {
+    backend->resets_sent++;
+    return conn_send(backend->conn, OP_SESSION_RESET, 0, "", backend->resets_sent, NULL, 0, SEND_MORE);
+}
+
+int backend_wait_reset(Backend *backend, int timeout_ms) {
+    Connection *conn = backend->conn;
+    if (conn_flush(conn, 0) != 0) return -1;
+
+    while (1) {
+        Frame frame;
+        int ret = 0;
+        while (backend->resets_acked < backend->resets_sent &&
+               (ret = frame_decoder_next(&conn->decoder, &frame)) == 1) {
+            if (frame.header.operation == OP_SESSION_RESET && frame.header.status == 0) backend->resets_acked++;
+        }
+        if (backend->resets_acked == backend->resets_sent) break;
+        if (ret < 0) return -1;
+
+        struct pollfd pfd = { .fd = conn->fd, .events = POLLIN };
+        if (poll(&pfd, 1, timeout_ms) <= 0) {
+            log_warn("等待後端重設回覆逾時");
+            return -1;
+        }
+        if (frame_decoder_fill(&conn->decoder, conn->fd) <= 0) return -1;
+    }
+
+    return frame_decoder_pending(&conn->decoder) == 0 ? 0 : -1;
+}
+
+void backend_close(Backend *backend, int reusable) {
+    Connection *conn = backend->conn;
+    BackendPool *pool = backend->pool;
+    if (!conn) return;
+    backend->conn = NULL;
+
+    if (!backend->pooled) {
+        backend_free(conn);
+        return;
+    }
+
+    if (reusable && backend->resets_sent > 0 && backend->resets_acked == backend->resets_sent &&
+        !conn_has_pending_output(conn) && frame_decoder_pending(&conn->decoder) == 0) {
+        // 回到協商前的狀態：v1 上限、阻塞模式，v2 session 擴大過的接收緩衝區也縮回來
+        ProtocolCaps caps = { PROTOCOL_VERSION_1, 0, MAX_DATA_SIZE };
+        conn_apply_caps(conn, &caps);
+        if (conn->decoder.cap > FRAME_DECODER_INIT_SIZE) {
+            frame_decoder_free(&conn->decoder);
+            if (frame_decoder_init(&conn->decoder, MAX_DATA_SIZE) != 0) reusable = 0;
+        }
+        set_nonblocking_mode(conn->fd, 0);
+
+        if (reusable) {
+            pthread_mutex_lock(&pool->lock);
+            if (pool->supported != 1) {
+                log_info("儲存伺服器 %s:%d 支援連線重用，啟用後端連線池（上限 %d）", pool->host, pool->port, pool->max);
+            }
+            pool->supported = 1;
+            pool->idle[pool->idle_count++] = conn;
+            pthread_mutex_unlock(&pool->lock);
+            return;
+        }
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->open--;
+    // 新連線的握手從未得到回覆：儲存伺服器不認得 OP_SESSION_RESET，之後改為每個 session 建立新連線
+    if (backend->fresh && backend->resets_sent > 0 && backend->resets_acked == 0 && pool->supported == -1) {
+        log_info("儲存伺服器 %s:%d 不支援連線重用，每個 session 使用新連線", pool->host, pool->port);
+        pool->supported = 0;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    backend_free(conn);
+}
+
+// 補充閒置連線到 BACKEND_POOL_WARM；儲存伺服器不支援時每個週期只試一條，升級後可自動啟用
+static void backend_pool_warm(BackendPool *pool) {
+    int target = pool->max < BACKEND_POOL_WARM ? pool->max : BACKEND_POOL_WARM;
+
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        int need = pool->idle_count < target && pool->open < pool->max;
+        if (need) pool->open++;
+        int probe = pool->supported == 0;
+        if (probe) pool->supported = -1;
+        pthread_mutex_unlock(&pool->lock);
+        if (!need) break;
+
+        Backend backend = { .pool = pool, .pooled = 1, .fresh = 1 };
+        backend.conn = backend_connect(pool, 0);
+        if (!backend.conn) {
+            pthread_mutex_lock(&pool->lock);
+            pool->open--;
+            if (probe) pool->supported = 0;
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+
+        int ok = backend_queue_reset(&backend) == 0 && backend_wait_reset(&backend, BACKEND_RESET_TIMEOUT) == 0;
+        backend_close(&backend, ok);
+        if (!ok) break;
+    }
+}
+
+// 閒置連線逐一做一次重設握手，沒有回應的關閉
+static void backend_pool_check(BackendPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    int count = pool->idle_count;
+    Connection **checking = malloc(count * sizeof(Connection *));
+    if (checking) {
+        memcpy(checking, pool->idle, count * sizeof(Connection *));
+        pool->idle_count = 0;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if (!checking) return;
+
+    for (int i = 0; i < count; i++) {
+        Backend backend = { .conn = checking[i], .pool = pool, .pooled = 1 };
+        int ok = backend_queue_reset(&backend) == 0 && backend_wait_reset(&backend, BACKEND_RESET_TIMEOUT) == 0;
+        if (!ok) log_warn("後端連線健康檢查失敗，關閉連線");
+        backend_close(&backend, ok);
+    }
+    free(checking);
+}
+
+static void *backend_pool_checker(void *arg) {
+    BackendPool *pool = arg;
+    while (1) {
+        backend_pool_warm(pool);
+        sleep(BACKEND_POOL_CHECK_INTERVAL);
+        backend_pool_check(pool);
+    }
+    return NULL;
+}
+
+int backend_pool_init(BackendPool *pool, const char *host, int port, int max) {
+    memset(pool, 0, sizeof(BackendPool));
+    snprintf(pool->host, sizeof(pool->host), "%s", host);
+    pool->port = port;
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->max = max;
+    pool->supported = -1;
+    if (max <= 0) return 0;
+
+    pool->idle = calloc(max, sizeof(Connection *));
+    if (!pool->idle) return -1;
+
+    if (pthread_create(&pool->checker, NULL, backend_pool_checker, pool) != 0) {
+        log_perror("建立連線池檢查執行緒失敗");
+        return -1;
+    }
+    pthread_detach(pool->checker);
+    return 0;
+}
@@ -0,0 +1,88 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+#include "protocol.h"
+
+#define BACKEND_POOL_SIZE 64          // 預設最多保留的後端連線數
+#define BACKEND_POOL_WARM 4           // 預先建立的閒置連線數（不超過上限）
+#define BACKEND_POOL_CHECK_INTERVAL 10  // 秒，健康檢查與補充閒置連線的週期
+#define BACKEND_RESET_TIMEOUT 2000    // 毫秒，等待 OP_SESSION_RESET 回覆的上限
+
+/**
+ * 轉發伺服器到一個儲存節點的長連線池
+ * 連線在 session 結束時以 OP_SESSION_RESET 重設，收到回覆後才放回池中；
+ * 閒置的連線由背景執行緒定期以同樣的握手做健康檢查。
+ * open 計算所有屬於連線池的連線（閒置與使用中），不超過 max；
+ * 超過上限的 session 使用一次性的連線，結束時直接關閉。
+ */
+typedef struct {
+    char host[64];           // 儲存節點位址
+    int port;
+    pthread_mutex_t lock;
+    Connection **idle;       // 閒置連線的堆疊
+    int idle_count;
+    int open;
+    int max;                 // 0 表示停用連線池
+    int supported;           // 儲存伺服器是否支援 OP_SESSION_RESET：-1 未知，0 否，1 是
+    pthread_t checker;
+} BackendPool;
+
+/**
+ * 一個 session 使用中的後端連線
+ */
+typedef struct {
+    Connection *conn;
+    BackendPool *pool;       // 連線所屬的節點連線池
+    int pooled;              // 屬於連線池，結束時重設並歸還
+    int fresh;               // 這次新建立的連線（非阻塞時可能仍在連線中）
+    int resets_sent;         // 已送出的 OP_SESSION_RESET
+    int resets_acked;        // 已收到的回覆
+    int closing;             // 已送出結束 session 的重設，它的回覆之後不會再有資料
+} Backend;
+
+/**
+ * 初始化連線池並啟動健康檢查執行緒
+ * @param pool 連線池
+ * @param host 儲存節點的 IP
+ * @param port 儲存節點的 port
+ * @param max 最多保留的連線數，0 表示停用
+ * @return 0 表示成功，-1 表示失敗
+ */
+int backend_pool_init(BackendPool *pool, const char *host, int port, int max);
+
+/**
+ * 為 session 取得後端連線：優先使用閒置連線，沒有時建立新連線
+ * 新連線若可以加入連線池，會先在送出佇列中放入一個 OP_SESSION_RESET，
+ * 讓儲存伺服器把這條連線標記為可重用（回覆由轉發端吸收，不轉給客戶端）。
+ * @param pool 連線池
+ * @param backend 輸出
+ * @param nonblocking 非 0 時連線設為非阻塞；新連線可能仍在連線中（backend->fresh）
+ * @return 0 表示成功，-1 表示失敗
+ */
+int backend_open(BackendPool *pool, Backend *backend, int nonblocking);
+
+/**
+ * 把 OP_SESSION_RESET 放入送出佇列（不立即送出）
+ * @param backend 後端連線
+ * @return 0 表示成功，-1 表示失敗
+ */
+int backend_queue_reset(Backend *backend);
+
+/**
+ * 阻塞等待所有 OP_SESSION_RESET 的回覆，期間收到的其他封包直接丟棄
+ * @param backend 後端連線
+ * @param timeout_ms 每次等待資料的上限
+ * @return 0 表示全部收到且接收緩衝區沒有殘留，-1 表示失敗或逾時
+ */
+int backend_wait_reset(Backend *backend, int timeout_ms);
+
+/**
+ * 結束 session 對後端連線的使用
+ * reusable 且所有重設都已回覆時放回所屬的連線池，否則關閉。
+ * @param backend 後端連線，沒有連線時不做事
+ * @param reusable 0 表示連線狀態不明（錯誤、對端關閉），一律關閉
+ */
+void backend_close(Backend *backend, int reusable);
+
+#endif // POOL_H
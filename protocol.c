@@ -1,14 +1,21 @@
 #include "protocol.h"
+#include "log.h"
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
 #include <arpa/inet.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
 
 
-// 封裝完整協議包
-int pack_message(uint8_t operation, uint8_t status, const char *username, uint32_t sequence, const uint8_t *data, uint32_t data_length, uint8_t *buffer) {
-    uint8_t username_len = strlen(username);
-    if (data_length > MAX_DATA_SIZE) return -1;
+// 封裝協議頭部
+int pack_header(uint8_t operation, uint8_t status, const char *username, uint32_t sequence, uint32_t data_length, uint8_t *buffer) {
+    size_t name_len = strlen(username);
+    uint8_t username_len = name_len > MAX_USERNAME_LENGTH ? MAX_USERNAME_LENGTH : name_len;
 
     buffer[0] = operation;
     buffer[1] = status;
@@ -22,10 +29,19 @@ int pack_message(uint8_t operation, uint8_t status, const char *username, uint32
     uint32_t net_data_length = htonl(data_length);
     memcpy(buffer + 3 + username_len + 4, &net_data_length, sizeof(uint32_t));
 
+    return 3 + username_len + 4 + 4;
+}
+
+// 封裝完整協議包
+int pack_message(uint8_t operation, uint8_t status, const char *username, uint32_t sequence, const uint8_t *data, uint32_t data_length, uint8_t *buffer) {
+    if (data_length > MAX_DATA_SIZE_V2) return -1;
+
+    int header_len = pack_header(operation, status, username, sequence, data_length, buffer);
+
     // 寫入 data
-    memcpy(buffer + 3 + username_len + 4 + 4, data, data_length);
+    memcpy(buffer + header_len, data, data_length);
 
-    return 3 + username_len + 4 + 4 + data_length;
+    return header_len + data_length;
 }
 
 // 解析協議頭部
@@ -57,3 +73,435 @@ int parse_data(const uint8_t *buffer, uint32_t length, uint8_t *output) {
     output[length] = '\0';  // 若你希望轉成 C-style 字串時再加
     return 0;
 }
+
+// 每次 recv 前尾端至少保留的空間，避免剩一點點空間時頻繁呼叫 recv
+#define FRAME_DECODER_MIN_READ 4096
+
+int frame_decoder_init(FrameDecoder *dec, uint32_t max_payload) {
+    dec->buf = malloc(FRAME_DECODER_INIT_SIZE);
+    if (!dec->buf) return -1;
+    dec->cap = FRAME_DECODER_INIT_SIZE;
+    dec->start = 0;
+    dec->end = 0;
+    dec->max_payload = max_payload;
+    return 0;
+}
+
+void frame_decoder_free(FrameDecoder *dec) {
+    free(dec->buf);
+    dec->buf = NULL;
+    dec->cap = dec->start = dec->end = 0;
+}
+
+size_t frame_decoder_pending(const FrameDecoder *dec) {
+    return dec->end - dec->start;
+}
+
+// 目前起點的封包還需要多少連續空間（頭部不完整時以最大頭部估計）
+static size_t frame_decoder_needed(const FrameDecoder *dec) {
+    size_t avail = dec->end - dec->start;
+    if (avail < 3) return FRAME_MAX_HEADER_SIZE;
+
+    const uint8_t *p = dec->buf + dec->start;
+    size_t header_len = FRAME_FIXED_HEADER_SIZE + p[2];
+    if (avail < header_len) return FRAME_MAX_HEADER_SIZE;
+
+    uint32_t data_len;
+    memcpy(&data_len, p + header_len - 4, 4);
+    data_len = ntohl(data_len);
+    if (data_len > dec->max_payload) return header_len;  // 交給 next 回報錯誤
+    return header_len + data_len;
+}
+
+// 確保尾端有足夠空間接收：優先重設/搬移殘留的半個封包，不夠才擴充
+static int frame_decoder_reserve(FrameDecoder *dec) {
+    if (dec->start == dec->end) {
+        dec->start = dec->end = 0;
+    }
+
+    size_t needed = frame_decoder_needed(dec);
+    size_t pending = dec->end - dec->start;
+    size_t want = needed > pending + FRAME_DECODER_MIN_READ ? needed : pending + FRAME_DECODER_MIN_READ;
+
+    if (dec->cap - dec->start >= want && dec->cap - dec->end >= FRAME_DECODER_MIN_READ) {
+        return 0;
+    }
+
+    if (dec->cap < want) {
+        size_t new_cap = dec->cap;
+        while (new_cap < want) new_cap *= 2;
+        uint8_t *new_buf = malloc(new_cap);
+        if (!new_buf) return -1;
+        memcpy(new_buf, dec->buf + dec->start, pending);
+        free(dec->buf);
+        dec->buf = new_buf;
+        dec->cap = new_cap;
+    } else if (dec->start > 0) {
+        memmove(dec->buf, dec->buf + dec->start, pending);
+    }
+    dec->start = 0;
+    dec->end = pending;
+    return 0;
+}
+
+ssize_t frame_decoder_fill(FrameDecoder *dec, int sockfd) {
+    return frame_decoder_fill_limit(dec, sockfd, SIZE_MAX);
+}
+
+ssize_t frame_decoder_fill_limit(FrameDecoder *dec, int sockfd, size_t limit) {
+    if (frame_decoder_reserve(dec) != 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    size_t room = dec->cap - dec->end;
+    ssize_t bytes;
+    do {
+        bytes = recv(sockfd, dec->buf + dec->end, room < limit ? room : limit, 0);
+    } while (bytes < 0 && errno == EINTR);
+
+    if (bytes > 0) dec->end += bytes;
+    return bytes;
+}
+
+int frame_decoder_feed(FrameDecoder *dec, const uint8_t *bytes, size_t len) {
+    while (len > 0) {
+        if (frame_decoder_reserve(dec) != 0) return -1;
+
+        size_t chunk = dec->cap - dec->end;
+        if (chunk > len) chunk = len;
+        memcpy(dec->buf + dec->end, bytes, chunk);
+        dec->end += chunk;
+        bytes += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+int frame_decoder_next(FrameDecoder *dec, Frame *frame) {
+    size_t avail = dec->end - dec->start;
+    if (avail < FRAME_FIXED_HEADER_SIZE) return 0;
+
+    const uint8_t *p = dec->buf + dec->start;
+    uint32_t header_len = FRAME_FIXED_HEADER_SIZE + p[2];
+    if (avail < header_len) return 0;
+
+    uint32_t data_len;
+    memcpy(&data_len, p + header_len - 4, 4);
+    data_len = ntohl(data_len);
+    if (data_len > dec->max_payload) {
+        log_error("封包數據長度 %u 超過上限 %u", data_len, dec->max_payload);
+        return -1;
+    }
+
+    if (avail < header_len + data_len) return 0;
+
+    if (parse_header(p, &frame->header) != 0) return -1;
+    frame->raw = p;
+    frame->raw_len = header_len + data_len;
+    frame->data = p + header_len;
+
+    dec->start += frame->raw_len;
+    return 1;
+}
+
+int frame_decoder_peek(FrameDecoder *dec, Frame *frame) {
+    size_t avail = dec->end - dec->start;
+    if (avail < FRAME_FIXED_HEADER_SIZE) return 0;
+
+    const uint8_t *p = dec->buf + dec->start;
+    uint32_t header_len = FRAME_FIXED_HEADER_SIZE + p[2];
+    if (avail < header_len) return 0;
+
+    if (parse_header(p, &frame->header) != 0) return -1;
+    if (frame->header.length > dec->max_payload) {
+        log_error("封包數據長度 %u 超過上限 %u", frame->header.length, dec->max_payload);
+        return -1;
+    }
+
+    size_t frame_len = (size_t)header_len + frame->header.length;
+    frame->raw = p;
+    frame->raw_len = avail < frame_len ? avail : frame_len;
+    frame->data = p + header_len;
+    return 1;
+}
+
+void frame_decoder_consume(FrameDecoder *dec, size_t n) {
+    dec->start += n;
+}
+
+size_t frame_copy_string(const Frame *frame, char *output, size_t output_size) {
+    if (output_size == 0) return 0;
+    size_t len = frame->header.length;
+    if (len > output_size - 1) len = output_size - 1;
+    memcpy(output, frame->data, len);
+    output[len] = '\0';
+    return strlen(output);
+}
+
+void proto_caps_local(ProtocolCaps *caps) {
+    caps->version = PROTOCOL_VERSION_2;
+    caps->flags = 0;
+    caps->max_payload = MAX_DATA_SIZE_V2;
+}
+
+int proto_caps_append(uint8_t *buffer, uint32_t len, uint32_t buffer_size, const ProtocolCaps *caps) {
+    if (buffer_size < PROTO_CAPS_SIZE || len > buffer_size - PROTO_CAPS_SIZE) return -1;
+
+    uint8_t *p = buffer + len;
+    p[0] = '\0';
+    p[1] = 'P';
+    p[2] = 'V';
+    p[3] = caps->version;
+    p[4] = caps->flags;
+    uint32_t net_max = htonl(caps->max_payload);
+    memcpy(p + 5, &net_max, sizeof(uint32_t));
+
+    return len + PROTO_CAPS_SIZE;
+}
+
+int proto_caps_parse(const uint8_t *data, uint32_t len, ProtocolCaps *caps) {
+    caps->version = PROTOCOL_VERSION_1;
+    caps->flags = 0;
+    caps->max_payload = MAX_DATA_SIZE;
+
+    if (len < PROTO_CAPS_SIZE) return 0;
+    const uint8_t *p = data + len - PROTO_CAPS_SIZE;
+    if (p[0] != '\0' || p[1] != 'P' || p[2] != 'V' || p[3] < PROTOCOL_VERSION_2) return 0;
+
+    uint32_t net_max;
+    memcpy(&net_max, p + 5, sizeof(uint32_t));
+    uint32_t max_payload = ntohl(net_max);
+    if (max_payload < MAX_DATA_SIZE) return 0;
+
+    caps->version = PROTOCOL_VERSION_2;
+    caps->flags = p[4];
+    caps->max_payload = max_payload > MAX_DATA_SIZE_V2 ? MAX_DATA_SIZE_V2 : max_payload;
+    return 1;
+}
+
+int proto_caps_clamp(uint8_t *data, uint32_t len, ProtocolCaps *caps) {
+    if (!proto_caps_parse(data, len, caps)) return 0;
+
+    // 重新寫回同一個位置，長度不變
+    proto_caps_append(data, len - PROTO_CAPS_SIZE, len, caps);
+    return 1;
+}
+
+int conn_init(Connection *conn, int fd) {
+    conn->fd = fd;
+    memset(&conn->writer, 0, sizeof(conn->writer));
+    conn->version = PROTOCOL_VERSION_1;
+    conn->max_payload = MAX_DATA_SIZE;
+    conn->flags = 0;
+    return frame_decoder_init(&conn->decoder, MAX_DATA_SIZE);
+}
+
+void conn_apply_caps(Connection *conn, const ProtocolCaps *caps) {
+    conn->version = caps->version;
+    conn->max_payload = caps->max_payload;
+    conn->flags = caps->flags;
+    conn->decoder.max_payload = caps->max_payload;
+}
+
+void conn_close(Connection *conn) {
+    if (conn->fd >= 0) close(conn->fd);
+    conn->fd = -1;
+    frame_decoder_free(&conn->decoder);
+    free(conn->writer.stage);
+    conn->writer.stage = NULL;
+}
+
+int conn_receive(Connection *conn, Frame *frame) {
+    while (1) {
+        int ret = frame_decoder_next(&conn->decoder, frame);
+        if (ret != 0) return ret;
+
+        ssize_t bytes = frame_decoder_fill(&conn->decoder, conn->fd);
+        if (bytes < 0) {
+            log_perror("接收失敗");
+            return -1;
+        } else if (bytes == 0) {
+            return 0; // 連線關閉
+        }
+    }
+}
+
+// 把一段資料加入 iovec，與前一段相鄰時直接合併
+static void frame_writer_push(FrameWriter *w, const uint8_t *data, size_t len) {
+    if (len == 0) return;
+    if (w->iov_cnt > 0) {
+        struct iovec *last = &w->iov[w->iov_cnt - 1];
+        if ((const uint8_t *)last->iov_base + last->iov_len == data) {
+            last->iov_len += len;
+            return;
+        }
+    }
+    w->iov[w->iov_cnt].iov_base = (void *)data;
+    w->iov[w->iov_cnt].iov_len = len;
+    w->iov_cnt++;
+}
+
+int conn_flush(Connection *conn, int flags) {
+    FrameWriter *w = &conn->writer;
+    struct iovec *iov = w->iov;
+    int iov_cnt = w->iov_cnt;
+    int send_flags = MSG_NOSIGNAL | ((flags & SEND_MORE) ? MSG_MORE : 0);
+
+    while (iov_cnt > 0) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iov_cnt;
+
+        ssize_t sent = sendmsg(conn->fd, &msg, send_flags);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (flags & SEND_NOWAIT) {
+                    // 保留尚未送出的部分，等呼叫端收到可寫事件再續送
+                    memmove(w->iov, iov, iov_cnt * sizeof(struct iovec));
+                    w->iov_cnt = iov_cnt;
+                    return 1;
+                }
+                // 非阻塞 socket：等到可寫再續送
+                struct pollfd pfd = { .fd = conn->fd, .events = POLLOUT };
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            log_perror("發送數據失敗");
+            w->iov_cnt = 0;
+            w->stage_len = 0;
+            return -1;
+        }
+
+        // 短寫：跳過已送出的 iovec，調整部分送出的那一個
+        while (sent > 0) {
+            if ((size_t)sent >= iov->iov_len) {
+                sent -= iov->iov_len;
+                iov++;
+                iov_cnt--;
+            } else {
+                iov->iov_base = (uint8_t *)iov->iov_base + sent;
+                iov->iov_len -= sent;
+                sent = 0;
+            }
+        }
+    }
+
+    w->iov_cnt = 0;
+    w->stage_len = 0;
+    return 0;
+}
+
+int conn_has_pending_output(const Connection *conn) {
+    return conn->writer.iov_cnt > 0;
+}
+
+int conn_queue_raw(Connection *conn, const uint8_t *data, size_t len) {
+    if (conn->writer.iov_cnt == FRAME_WRITER_MAX_IOV && conn_flush(conn, SEND_MORE) != 0) return -1;
+    frame_writer_push(&conn->writer, data, len);
+    return 0;
+}
+
+// 把頭部放進暫存並排入佇列，暫存還要再放 copy_len 的數據區；空間不夠時先送出佇列
+static int conn_queue_header(Connection *conn, uint8_t operation, uint8_t status, const char *username,
+                             uint32_t sequence, uint32_t data_length, size_t copy_len) {
+    FrameWriter *w = &conn->writer;
+    if (data_length > conn->max_payload) {
+        log_error("數據長度 %u 超過協商上限 %u", data_length, conn->max_payload);
+        return -1;
+    }
+
+    if (!w->stage) {
+        w->stage = malloc(FRAME_WRITER_STAGE_SIZE);
+        if (!w->stage) return -1;
+    }
+
+    if (w->stage_len + FRAME_MAX_HEADER_SIZE + copy_len > FRAME_WRITER_STAGE_SIZE || w->iov_cnt + 2 > FRAME_WRITER_MAX_IOV) {
+        if (conn_flush(conn, SEND_MORE) != 0) return -1;
+    }
+
+    uint8_t *header = w->stage + w->stage_len;
+    int header_len = pack_header(operation, status, username, sequence, data_length, header);
+    w->stage_len += header_len;
+    frame_writer_push(w, header, header_len);
+    return 0;
+}
+
+int conn_send(Connection *conn, uint8_t operation, uint8_t status, const char *username, uint32_t sequence,
+              const uint8_t *data, uint32_t data_length, int flags) {
+    FrameWriter *w = &conn->writer;
+    int copy = data_length <= FRAME_WRITER_COPY_MAX;
+    if (conn_queue_header(conn, operation, status, username, sequence, data_length, copy ? data_length : 0) != 0) {
+        return -1;
+    }
+
+    if (copy) {
+        if (data_length > 0) memcpy(w->stage + w->stage_len, data, data_length);
+        frame_writer_push(w, w->stage + w->stage_len, data_length);
+        w->stage_len += data_length;
+        if (flags & SEND_MORE) return 0;
+        return conn_flush(conn, 0);
+    }
+
+    // 大型數據區直接引用呼叫端的緩衝區，返回前必須送出
+    frame_writer_push(w, data, data_length);
+    return conn_flush(conn, flags);
+}
+
+int conn_queue_frame(Connection *conn, uint8_t operation, uint8_t status, const char *username, uint32_t sequence,
+                     const uint8_t *data, uint32_t data_length) {
+    if (conn_queue_header(conn, operation, status, username, sequence, data_length, 0) != 0) return -1;
+    frame_writer_push(&conn->writer, data, data_length);
+    return 0;
+}
+
+int conn_sendfile(Connection *conn, uint8_t operation, uint8_t status, const char *username, uint32_t sequence,
+                  int in_fd, off_t offset, uint32_t data_length) {
+    // 頭部（連同佇列中的封包）以 MSG_MORE 送出，與之後的檔案內容合併成完整的 TCP 區段
+    if (conn_queue_header(conn, operation, status, username, sequence, data_length, 0) != 0 ||
+        conn_flush(conn, SEND_MORE) != 0) {
+        return -1;
+    }
+
+    while (data_length > 0) {
+        ssize_t sent = sendfile(conn->fd, in_fd, &offset, data_length);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct pollfd pfd = { .fd = conn->fd, .events = POLLOUT };
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            log_perror("sendfile 失敗");
+            return -1;
+        }
+        if (sent == 0) {
+            // 頭部已經送出，封包無法補齊，呼叫端只能關閉連線
+            log_error("檔案在送出途中變短");
+            return -1;
+        }
+        data_length -= sent;
+    }
+    return 0;
+}
+
+int parse_address(const char *text, char *host, size_t host_size, int *port) {
+    const char *colon = strrchr(text, ':');
+    if (!colon) {
+        if (strlen(text) + 1 > host_size) return -1;
+        strcpy(host, text);
+        return 0;
+    }
+
+    size_t host_len = colon - text;
+    if (host_len + 1 > host_size) return -1;
+    if (host_len > 0) {
+        memcpy(host, text, host_len);
+        host[host_len] = '\0';
+    }
+
+    *port = atoi(colon + 1);
+    return (*port > 0 && *port < 65536) ? 0 : -1;
+}
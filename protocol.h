@@ -2,10 +2,48 @@
 #define PROTOCOL_H
 
 #include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
-#define MAX_DATA_SIZE 1024
+#define MAX_DATA_SIZE 1024                 // v1 的數據區上限，也是協商完成前的上限
+#define MAX_DATA_SIZE_V2 (1024 * 1024)     // v2 可協商的數據區上限
 #define MAX_USERNAME_LENGTH 255
 
+#define PROTOCOL_VERSION_1 1
+#define PROTOCOL_VERSION_2 2
+
+// 轉發伺服器與儲存伺服器之間的控制封包，不會轉給客戶端：
+// 結束目前的 session（關閉未完成的備份、恢復 v1 預設值），儲存伺服器保留這條連線給下一個 session，
+// 並以同一個 operation 回覆。轉發伺服器的連線池以它做為新連線的握手、歸還前的重設與健康檢查。
+// 重用中的連線在原本會關閉的時機（客戶端送出 status 1、登入失敗），儲存伺服器改送 status 1 的
+// OP_SESSION_RESET 通知 session 結束，由轉發伺服器關閉客戶端連線。
+#define OP_SESSION_RESET 6
+
+// 刪除一個備份檔案（data 是檔名），只接受這條連線上已登入的使用者，回覆 "Delete OK" 或 "Delete Failed"。
+// 給直接連到儲存節點的管理工具（rebalance）使用，轉發伺服器不轉發客戶端送來的這個 operation。
+#define OP_DELETE_BACKUP 7
+
+// 取回備份的部分範圍：客戶端送出 檔名 '\0' 之後一個或多個範圍 offset(8) length(8)，
+// offset 為 RESTORE_SUFFIX 時表示最後 length bytes。每個範圍回覆一個 status 0 的頭部
+// （截到檔案大小後的 offset(8) length(8)），之後是這個範圍的 operation 5 資料封包（與完整取回相同，
+// 壓縮與 splice 照常）；status 1 的結束封包是備份的大小(8)，失敗時是訊息。
+// 儲存伺服器在登入回覆中帶上 PROTO_CAP_RANGE 才可以使用。
+#define OP_RESTORE_RANGE 12
+#define RESTORE_RANGE_SIZE 16
+#define RESTORE_SUFFIX UINT64_MAX
+
+#define FRAME_FIXED_HEADER_SIZE 11   // operation + status + username_len + sequence + length
+#define FRAME_MAX_HEADER_SIZE (FRAME_FIXED_HEADER_SIZE + MAX_USERNAME_LENGTH)
+#define FRAME_DECODER_INIT_SIZE (64 * 1024)
+
+#define FRAME_WRITER_STAGE_SIZE (64 * 1024)  // 頭部與小型數據區的暫存空間
+#define FRAME_WRITER_MAX_IOV 64
+#define FRAME_WRITER_COPY_MAX 512            // 不超過此長度的數據區複製進暫存以便合併，較大的直接引用
+
+#define SEND_MORE 0x1   // 後面還有封包：小封包先留在佇列，大封包以 MSG_MORE 送出
+#define SEND_NOWAIT 0x2 // 非阻塞 socket 暫時寫不下時保留剩餘佇列並立即返回（事件迴圈使用）
+
 typedef struct {
     uint8_t operation;
     uint8_t status;
@@ -29,6 +67,14 @@ typedef struct {
 int pack_message(uint8_t operation, uint8_t status, const char *username, uint32_t sequence,
                  const uint8_t *data, uint32_t data_length, uint8_t *buffer);
 
+/**
+ * 只封裝協議頭部（數據區由呼叫端另外送出）
+ * @param buffer 至少 FRAME_MAX_HEADER_SIZE 位元組
+ * @return 頭部長度
+ */
+int pack_header(uint8_t operation, uint8_t status, const char *username, uint32_t sequence,
+                uint32_t data_length, uint8_t *buffer);
+
 /**
  * 解析協議頭部
  * @param buffer 接收的緩衝區
@@ -46,4 +92,315 @@ int parse_header(const uint8_t *buffer, ProtocolHeader *header);
  */
 int parse_data(const uint8_t *buffer, uint32_t length, uint8_t *output);
 
+/**
+ * 一個完整封包的檢視（view）
+ * raw 與 data 直接指向解碼器內部的緩衝區，不做任何複製，
+ * 只在下一次對同一個解碼器呼叫 frame_decoder_fill 之前有效。
+ */
+typedef struct {
+    ProtocolHeader header;
+    const uint8_t *raw;      // 整個封包（含頭部）的起點
+    uint32_t raw_len;        // 整個封包的長度
+    const uint8_t *data;     // 數據區起點，長度為 header.length，不以 '\0' 結尾
+} Frame;
+
+/**
+ * 增量式封包解碼器（每條連線一個）
+ * 使用滑動緩衝區：解析封包只移動 start，不搬移資料；
+ * 只有在尾端空間放不下下一個封包時，才把剩餘的半個封包搬回開頭，必要時擴充緩衝區。
+ */
+typedef struct {
+    uint8_t *buf;
+    size_t cap;
+    size_t start;            // 尚未解析資料的起點
+    size_t end;              // 有效資料的終點
+    uint32_t max_payload;    // 允許的最大數據區長度，超過視為協議錯誤
+} FrameDecoder;
+
+/**
+ * 初始化解碼器
+ * @param dec 解碼器
+ * @param max_payload 允許的最大數據區長度
+ * @return 0 表示成功，-1 表示失敗
+ */
+int frame_decoder_init(FrameDecoder *dec, uint32_t max_payload);
+
+/**
+ * 釋放解碼器的緩衝區
+ * @param dec 解碼器
+ */
+void frame_decoder_free(FrameDecoder *dec);
+
+/**
+ * 從 socket 讀取更多資料到解碼器（只呼叫一次 recv）
+ * 之前取得的 Frame 檢視在呼叫後失效。
+ * @param dec 解碼器
+ * @param sockfd 來源 socket
+ * @return 讀到的位元組數，0 表示連線關閉，-1 表示失敗（errno 保留，非阻塞時可能為 EAGAIN）
+ */
+ssize_t frame_decoder_fill(FrameDecoder *dec, int sockfd);
+
+/**
+ * 同 frame_decoder_fill，但這次 recv 最多只讀 limit 個位元組
+ * （轉發伺服器以 splice 轉發數據區時，只把下一個頭部讀進使用者空間）
+ * @param dec 解碼器
+ * @param sockfd 來源 socket
+ * @param limit 最多讀取的位元組數
+ * @return 讀到的位元組數，0 表示連線關閉，-1 表示失敗（errno 保留）
+ */
+ssize_t frame_decoder_fill_limit(FrameDecoder *dec, int sockfd, size_t limit);
+
+/**
+ * 把記憶體中的位元組加入解碼器（例如已從其他地方讀出的資料）
+ * 之前取得的 Frame 檢視在呼叫後失效。
+ * @param dec 解碼器
+ * @param bytes 資料
+ * @param len 資料長度
+ * @return 0 表示成功，-1 表示失敗
+ */
+int frame_decoder_feed(FrameDecoder *dec, const uint8_t *bytes, size_t len);
+
+/**
+ * 從已緩衝的資料中取出下一個完整封包
+ * @param dec 解碼器
+ * @param frame 輸出的封包檢視
+ * @return 1 表示取得封包，0 表示資料不足，-1 表示協議錯誤
+ */
+int frame_decoder_next(FrameDecoder *dec, Frame *frame);
+
+/**
+ * 檢視下一個封包，頭部完整即可，不消耗任何位元組
+ * frame->raw 指向封包起點，raw_len 為目前已緩衝的部分（不超過整個封包），
+ * data 之後只有 raw_len 減去頭部長度的位元組可用。
+ * @param dec 解碼器
+ * @param frame 輸出的封包檢視
+ * @return 1 表示頭部完整，0 表示資料不足，-1 表示協議錯誤
+ */
+int frame_decoder_peek(FrameDecoder *dec, Frame *frame);
+
+/**
+ * 丟棄接收緩衝區開頭的 n 個位元組（已由呼叫端以其他方式處理）
+ * @param dec 解碼器
+ * @param n 位元組數，不可超過 frame_decoder_pending
+ */
+void frame_decoder_consume(FrameDecoder *dec, size_t n);
+
+/**
+ * 解碼器中尚未解析的位元組數
+ */
+size_t frame_decoder_pending(const FrameDecoder *dec);
+
+/**
+ * 把封包數據區複製成 C 字串（用於時間戳、檔名、密碼等短字串）
+ * @param frame 封包
+ * @param output 輸出緩衝區
+ * @param output_size 輸出緩衝區大小（含 '\0'）
+ * @return 字串長度（遇到內嵌的 '\0' 時會較短）
+ */
+size_t frame_copy_string(const Frame *frame, char *output, size_t output_size);
+
+/**
+ * 協議能力宣告（v2 握手）
+ * 附加在 operation 0（要求 port）、operation 1（登入）的請求與回覆數據區尾端：
+ *   '\0' 'P' 'V' version flags max_payload(4 bytes, network byte order)
+ * 開頭的 '\0' 讓只懂 v1 的對端把數據區當成原本的字串（port、密碼、"Login OK"），
+ * 沒有附加能力宣告的對端一律視為 v1，上限維持 MAX_DATA_SIZE。
+ * 頭部格式本身不變（length 欄位原本就是 32 位元），版本記錄在每條連線上。
+ */
+#define PROTO_CAPS_SIZE 9
+
+typedef struct {
+    uint8_t version;
+    uint8_t flags;           // 可選功能，PROTO_CAP_* 位元
+    uint32_t max_payload;    // 願意接收的最大數據區長度
+} ProtocolCaps;
+
+// operation 0：session 直接在主 port 的這條連線上進行，不再分配動態 port。
+// 客戶端在請求中提出，轉發伺服器接受時回覆 port "0" 並帶上同一個旗標；
+// 沒有帶回旗標（舊的轉發伺服器）就照原本的流程連到回覆的 port。
+#define PROTO_CAP_INLINE_SESSION 0x01
+
+// 一個 session 依序進行多個操作（登入一次後連續備份或取回多個檔案，可以管線化送出）。
+// operation 0：轉發伺服器在回覆中帶上，表示雙向同時轉發、不依操作切分階段；
+// operation 1：客戶端在轉發伺服器支援時提出，儲存伺服器接受時回覆 PROTO_CAP_MULTI_OP_OK。
+// 舊的儲存伺服器會把登入的能力宣告原樣帶回，所以接受與否另外用一個位元表示。
+// 接受後 status 1 只結束該操作而不結束 session，每個備份結束時回覆 operation 3 status 1
+// 的 "Backup OK" 或 "Backup Failed"；session 在客戶端關閉連線時結束。
+#define PROTO_CAP_MULTI_OP    0x02
+#define PROTO_CAP_MULTI_OP_OK 0x04
+
+// operation 1：客戶端提出壓縮，儲存伺服器接受時回覆 PROTO_CAP_COMPRESS_OK（理由同 MULTI_OP_OK）。
+// 接受後 operation 3（客戶端送出）與 operation 5（儲存伺服器送出）的資料封包，數據區都是一個
+// 編碼區塊（compress.h）；轉發伺服器不需要解開，照常轉發（包含 splice）。
+#define PROTO_CAP_COMPRESS    0x08
+#define PROTO_CAP_COMPRESS_OK 0x10
+
+// operation 1：只由儲存伺服器在回覆中帶上，表示支援 OP_LIST_CATALOG（catalog.h）。
+#define PROTO_CAP_CATALOG     0x20
+
+// operation 1：只由儲存伺服器在回覆中帶上，表示支援 OP_RESUME_BACKUP（resume.h）。
+#define PROTO_CAP_RESUME      0x40
+
+// operation 1：只由儲存伺服器在回覆中帶上，表示支援 OP_RESTORE_RANGE。
+#define PROTO_CAP_RANGE       0x80
+
+/**
+ * 本端支援的能力
+ * @param caps 輸出
+ */
+void proto_caps_local(ProtocolCaps *caps);
+
+/**
+ * 把能力宣告附加到數據區尾端
+ * @param buffer 數據區緩衝區，已有 len 位元組
+ * @param len 目前數據長度
+ * @param buffer_size 緩衝區大小
+ * @param caps 能力宣告
+ * @return 附加後的數據長度，空間不足回傳 -1
+ */
+int proto_caps_append(uint8_t *buffer, uint32_t len, uint32_t buffer_size, const ProtocolCaps *caps);
+
+/**
+ * 解析數據區尾端的能力宣告
+ * @param data 數據區
+ * @param len 數據長度
+ * @param caps 輸出，沒有宣告時填入 v1 的預設值
+ * @return 1 表示有能力宣告，0 表示對端只懂 v1
+ */
+int proto_caps_parse(const uint8_t *data, uint32_t len, ProtocolCaps *caps);
+
+/**
+ * 把數據區尾端的能力宣告就地壓低到本端可接受的範圍（轉發伺服器使用）
+ * @param data 數據區
+ * @param len 數據長度
+ * @param caps 輸出壓低後的能力宣告
+ * @return 1 表示有能力宣告，0 表示沒有
+ */
+int proto_caps_clamp(uint8_t *data, uint32_t len, ProtocolCaps *caps);
+
+/**
+ * 合併送出的佇列
+ * 頭部與小型數據區複製到暫存空間並合併成連續的 iovec，
+ * 大型數據區直接以 iovec 引用呼叫端的緩衝區，最後以一次 sendmsg 送出。
+ */
+typedef struct {
+    uint8_t *stage;          // 第一次需要時才配置
+    size_t stage_len;
+    struct iovec iov[FRAME_WRITER_MAX_IOV];
+    int iov_cnt;
+} FrameWriter;
+
+/**
+ * 連線：socket 與它專屬的收送狀態及協商結果
+ */
+typedef struct {
+    int fd;
+    FrameDecoder decoder;
+    FrameWriter writer;
+    uint8_t version;         // 協商後的協議版本
+    uint32_t max_payload;    // 協商後雙方都接受的最大數據區長度
+    uint8_t flags;           // 協商結果的 PROTO_CAP_* 旗標（儲存伺服器回覆的版本）
+} Connection;
+
+/**
+ * 初始化連線
+ * @param conn 連線
+ * @param fd 已連接的 socket
+ * @return 0 表示成功，-1 表示失敗
+ */
+int conn_init(Connection *conn, int fd);
+
+/**
+ * 套用協商結果，之後收送的封包數據區上限為 caps->max_payload
+ * @param conn 連線
+ * @param caps 協商結果
+ */
+void conn_apply_caps(Connection *conn, const ProtocolCaps *caps);
+
+/**
+ * 關閉 socket 並釋放連線的緩衝區
+ * @param conn 連線
+ */
+void conn_close(Connection *conn);
+
+/**
+ * 阻塞接收一個完整封包，處理任意切割在多次 recv 之間的封包
+ * @param conn 連線
+ * @param frame 輸出的封包檢視，在下一次接收前有效
+ * @return 1 表示收到封包，0 表示連線關閉，-1 表示失敗
+ */
+int conn_receive(Connection *conn, Frame *frame);
+
+/**
+ * 送出一個封包，頭部與數據區以 sendmsg 一起送出，數據區不另外複製
+ * 短寫（partial write）會自動續送。
+ * @param conn 連線
+ * @param operation 操作碼
+ * @param status 狀態碼
+ * @param username 使用者名稱
+ * @param sequence 傳輸序號
+ * @param data 數據
+ * @param data_length 數據長度，不可超過協商上限
+ * @param flags SEND_MORE 表示後面還有封包，可以延後或合併送出；0 表示立即送出整個佇列
+ * @return 0 表示成功，-1 表示失敗
+ */
+int conn_send(Connection *conn, uint8_t operation, uint8_t status, const char *username, uint32_t sequence,
+              const uint8_t *data, uint32_t data_length, int flags);
+
+/**
+ * 把一個封包排入佇列但不送出，數據區不複製（一次讀進大緩衝區的多個小封包，之後以一次 conn_flush 送出）
+ * data 必須在下一次 conn_flush 完成前保持有效；佇列滿時會先送出前面的封包。
+ * @return 0 表示成功，-1 表示失敗
+ */
+int conn_queue_frame(Connection *conn, uint8_t operation, uint8_t status, const char *username, uint32_t sequence,
+                     const uint8_t *data, uint32_t data_length);
+
+/**
+ * 送出一個數據區來自檔案的封包：頭部經由佇列送出，數據區以 sendfile 從 page cache 直接送到 socket
+ * 數據區送到一半失敗時封包已經無法補齊，呼叫端必須關閉連線。
+ * sendfile 無法帶 MSG_NOSIGNAL，使用的程式必須忽略 SIGPIPE（儲存伺服器在 main 中設定）。
+ * @param conn 連線
+ * @param operation 操作碼
+ * @param status 狀態碼
+ * @param username 使用者名稱
+ * @param sequence 傳輸序號
+ * @param in_fd 檔案
+ * @param offset 數據區在檔案中的位置
+ * @param data_length 數據長度，不可超過協商上限
+ * @return 0 表示成功，-1 表示失敗
+ */
+int conn_sendfile(Connection *conn, uint8_t operation, uint8_t status, const char *username, uint32_t sequence,
+                  int in_fd, off_t offset, uint32_t data_length);
+
+/**
+ * 把已封裝好的位元組（例如轉發的整個封包）排入佇列，不複製
+ * data 必須在下一次 conn_flush 完成前保持有效；相鄰的區段會合併成同一個 iovec。
+ * @return 0 表示成功，-1 表示失敗
+ */
+int conn_queue_raw(Connection *conn, const uint8_t *data, size_t len);
+
+/**
+ * 送出佇列中所有資料
+ * @param conn 連線
+ * @param flags SEND_MORE 表示之後馬上還有資料（以 MSG_MORE 送出）；
+ *              SEND_NOWAIT 表示遇到 EAGAIN 時不等待
+ * @return 0 表示全部送出，1 表示（SEND_NOWAIT 時）仍有資料留在佇列，-1 表示失敗
+ */
+int conn_flush(Connection *conn, int flags);
+
+/**
+ * 佇列中是否還有尚未送出的資料
+ */
+int conn_has_pending_output(const Connection *conn);
+
+/**
+ * 解析 "host:port" 形式的位址，省略 host 時保留 host 原本的內容
+ * @param text 輸入字串
+ * @param host 輸出主機名稱
+ * @param host_size host 緩衝區大小
+ * @param port 輸出 port
+ * @return 0 表示成功，-1 表示格式錯誤
+ */
+int parse_address(const char *text, char *host, size_t host_size, int *port);
+
 #endif // PROTOCOL_H
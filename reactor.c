@@ -0,0 +1,567 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include "protocol.h"
+#include "relay.h"
+#include "transfer.h"
+#include "metrics.h"
+#include "log.h"
+
+// epoll 模式：每個 reactor 執行緒有自己的 epoll 與自己的主 port 監聽 socket（SO_REUSEPORT），
+// 由核心把新連線分散到各個 reactor。session 建立後兩個方向都以非阻塞方式轉發封包，
+// 不再需要每個 session 一個執行緒。
+
+#define REACTOR_MAX_EVENTS 256
+
+enum {
+    EV_MAIN_LISTEN,      // 主 port 的監聽 socket
+    EV_MAIN_CONN,        // 主 port 上等待 operation 0 的連線
+    EV_DYNAMIC_LISTEN,   // 分配給某個客戶端的動態 port
+    EV_SESSION,          // session 的客戶端或後端 socket，或超過頻寬限制時的 timerfd
+    EV_WAKE              // 其他執行緒轉來的 session 名額（eventfd）
+};
+
+// 所有註冊到 epoll 的物件都以這個結構開頭
+typedef struct {
+    int type;
+    int fd;
+    uint32_t events;     // 目前註冊的事件，0 表示未註冊
+} EventSource;
+
+typedef struct {
+    EventSource ev;
+    Connection conn;
+} MainConn;
+
+typedef struct {
+    EventSource ev;
+    PortLease *lease;
+} DynamicListener;
+
+typedef struct Session Session;
+typedef struct Reactor Reactor;
+
+typedef struct {
+    EventSource ev;
+    Session *session;
+} SessionEnd;
+
+struct Session {
+    SessionEnd client_end;
+    SessionEnd backend_end;
+    SessionEnd timer_end;  // 頻寬額度恢復時觸發，第一次需要時才建立，-1 表示沒有
+    Reactor *reactor;
+    Connection client;
+    Backend backend;     // 可能來自連線池，結束時重設後歸還
+    RelayDir up;         // 客戶端 → 後端
+    RelayDir down;       // 後端 → 客戶端
+    PortLease *lease;    // 結束時要歸還的動態 port 租約，單一連線模式為 NULL
+    int routing;         // 等待第一個封包的使用者名稱以選擇儲存節點
+    int queued;          // 使用者的 session 數已達上限，排隊等待名額
+    UserLimit *limit;    // 使用者的限制狀態，沒有設定限制時為 NULL
+    LimitWaiter waiter;
+    Session *next_admitted;
+    int connecting;      // 後端仍在非阻塞連線中
+    uint64_t connect_us; // 開始取得後端連線的時間
+    int closed;
+    Session *next_closed;
+};
+
+struct Reactor {
+    int id;
+    int epfd;
+    EventSource listen_ev;
+    EventSource wake_ev;
+    pthread_mutex_t admitted_lock;
+    Session *admitted;   // 其他執行緒結束 session 時轉來名額的排隊 session，由 wake_ev 通知
+    Session *closed;     // 本輪事件處理完後才釋放，避免同一批事件引用到已釋放的 session
+    pthread_t tid;
+};
+
+static int set_nonblocking(int fd) {
+    return fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+// 把事件來源的註冊調整為 events；0 表示移出 epoll（避免 EPOLLHUP 在沒有興趣時不斷觸發）
+static int reactor_watch(Reactor *reactor, EventSource *ev, uint32_t events) {
+    if (ev->events == events) return 0;
+
+    struct epoll_event ee;
+    memset(&ee, 0, sizeof(ee));
+    ee.events = events;
+    ee.data.ptr = ev;
+
+    int op = events == 0 ? EPOLL_CTL_DEL : (ev->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD);
+    if (epoll_ctl(reactor->epfd, op, ev->fd, &ee) < 0) {
+        log_perror("epoll_ctl 失敗");
+        return -1;
+    }
+    ev->events = events;
+    return 0;
+}
+
+// reusable 非 0 表示後端連線已完成重設，可以放回連線池
+static void session_close(Reactor *reactor, Session *session, int reusable) {
+    if (session->closed) return;
+    session->closed = 1;
+    metrics_session(-1);
+
+    reactor_watch(reactor, &session->client_end.ev, 0);
+    reactor_watch(reactor, &session->backend_end.ev, 0);
+    if (session->timer_end.ev.fd >= 0) {
+        reactor_watch(reactor, &session->timer_end.ev, 0);
+        close(session->timer_end.ev.fd);
+    }
+
+    // 歸還名額後不會再被轉入名額；已經轉入、還在通知佇列中的先移除
+    limiter_leave(session->limit, &session->waiter);
+    if (session->queued) {
+        pthread_mutex_lock(&reactor->admitted_lock);
+        Session **link = &reactor->admitted;
+        while (*link && *link != session) link = &(*link)->next_admitted;
+        if (*link) *link = session->next_admitted;
+        pthread_mutex_unlock(&reactor->admitted_lock);
+    }
+    lease_detach(session->lease);
+    conn_close(&session->client);
+    relay_free(&session->up);
+    relay_free(&session->down);
+    backend_close(&session->backend, reusable);
+    if (session->lease) lease_release(session->lease);
+
+    session->next_closed = reactor->closed;
+    reactor->closed = session;
+}
+
+// 超過頻寬限制：wait_ms 後由 timerfd 觸發下一次轉發
+static int session_arm_timer(Reactor *reactor, Session *session, int wait_ms) {
+    if (session->timer_end.ev.fd < 0) {
+        int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (fd < 0) {
+            log_perror("建立 timerfd 失敗");
+            return -1;
+        }
+        session->timer_end.ev.fd = fd;
+        if (reactor_watch(reactor, &session->timer_end.ev, EPOLLIN) != 0) return -1;
+    }
+
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = wait_ms / 1000;
+    spec.it_value.tv_nsec = (long)(wait_ms % 1000) * 1000000;
+    return timerfd_settime(session->timer_end.ev.fd, 0, &spec, NULL);
+}
+
+// 兩個方向都盡可能轉發，再依照各自在等待什麼重新設定兩個 socket 的事件
+static void session_update(Reactor *reactor, Session *session) {
+    lease_touch(session->lease);
+    int up, down;
+    int result = session_pump(&session->up, &session->down, &session->backend, &up, &down);
+    if (result != SESSION_ACTIVE) {
+        session_close(reactor, session, result == SESSION_REUSABLE);
+        return;
+    }
+
+    int wait_ms = -1;
+    if (up == RELAY_WANT_TIME) wait_ms = session->up.wait_ms;
+    if (down == RELAY_WANT_TIME && (wait_ms < 0 || session->down.wait_ms < wait_ms)) wait_ms = session->down.wait_ms;
+    if (wait_ms >= 0 && session_arm_timer(reactor, session, wait_ms) != 0) {
+        session_close(reactor, session, 0);
+        return;
+    }
+
+    uint32_t client_events = (up == RELAY_WANT_READ ? EPOLLIN : 0) | (down == RELAY_WANT_WRITE ? EPOLLOUT : 0);
+    uint32_t backend_events = (down == RELAY_WANT_READ ? EPOLLIN : 0) | (up == RELAY_WANT_WRITE ? EPOLLOUT : 0);
+    if (reactor_watch(reactor, &session->client_end.ev, client_events) != 0 ||
+        reactor_watch(reactor, &session->backend_end.ev, backend_events) != 0) {
+        session_close(reactor, session, 0);
+    }
+}
+
+// 依使用者所在的節點取得後端連線，開始轉發
+static void session_connect(Reactor *reactor, Session *session, BackendPool *pool) {
+    session->connect_us = metrics_now_us();
+    if (backend_open(pool, &session->backend, 1) != 0) {
+        session_close(reactor, session, 0);
+        return;
+    }
+    Connection *backend = session->backend.conn;
+    if (session->lease) lease_watch(session->lease, LEASE_ACTIVE, session->client.fd, backend->fd);
+
+    session->connecting = session->backend.fresh;
+    session->backend_end.ev.fd = backend->fd;
+    relay_init(&session->up, &session->client, backend, 0);
+    relay_init(&session->down, backend, &session->client, 1);
+    splice_state_init(&session->up.splice, config.splice);
+    splice_state_init(&session->down.splice, config.splice);
+    session->up.keep_open = session->backend.pooled;
+    session->up.limit = session->down.limit = session->limit;
+
+    if (!session->connecting) {
+        metrics_observe_since(&metrics.backend_connect, session->connect_us);
+        session_update(reactor, session);
+        return;
+    }
+
+    // 等後端連線完成（可寫）才開始轉發，在那之前不處理客戶端的事件
+    if (reactor_watch(reactor, &session->client_end.ev, 0) != 0 ||
+        reactor_watch(reactor, &session->backend_end.ev, EPOLLOUT) != 0) {
+        session_close(reactor, session, 0);
+    }
+}
+
+// 由結束 session 的執行緒呼叫（持有限制器的鎖）：把取得名額的 session 交回它所屬的 reactor
+static void session_admit(LimitWaiter *waiter) {
+    Session *session = waiter->arg;
+    Reactor *reactor = session->reactor;
+    pthread_mutex_lock(&reactor->admitted_lock);
+    session->next_admitted = reactor->admitted;
+    reactor->admitted = session;
+    pthread_mutex_unlock(&reactor->admitted_lock);
+
+    uint64_t one = 1;
+    if (write(reactor->wake_ev.fd, &one, sizeof(one)) < 0) log_perror("通知 reactor 失敗");
+}
+
+// 等待第一個封包的頭部，依使用者名稱選擇儲存節點、取得 session 名額
+static void session_route(Reactor *reactor, Session *session) {
+    char username[MAX_USERNAME_LENGTH + 1];
+    int ret = relay_read_username(&session->client, username);
+    if (ret < 0) {
+        session_close(reactor, session, 0);
+        return;
+    } else if (ret == 0) {
+        if (reactor_watch(reactor, &session->client_end.ev, EPOLLIN) != 0) {
+            session_close(reactor, session, 0);
+        }
+        return;
+    }
+
+    session->routing = 0;
+    if (limiter_enabled(&limiter)) {
+        session->waiter.wake = session_admit;
+        session->waiter.arg = session;
+        session->limit = limiter_join(&limiter, username, &session->waiter);
+        if (!session->limit) {
+            session_close(reactor, session, 0);
+            return;
+        }
+        if (!session->waiter.admitted) {
+            // 排隊期間只注意客戶端是否離開
+            session->queued = 1;
+            if (reactor_watch(reactor, &session->client_end.ev, EPOLLRDHUP) != 0) {
+                session_close(reactor, session, 0);
+            }
+            return;
+        }
+    }
+    session_connect(reactor, session, backend_pool_for(username));
+}
+
+// 建立 session，接手 client 連線（包含接收緩衝區中已讀到的位元組）
+// lease 為動態 port 的租約（已綁定 client 的 socket），單一連線模式為 NULL
+static void session_start(Reactor *reactor, Connection *client, PortLease *lease) {
+    Session *session = calloc(1, sizeof(Session));
+    if (!session) {
+        lease_detach(lease);
+        conn_close(client);
+        if (lease) lease_release(lease);
+        return;
+    }
+    metrics_session(1);
+    session->client = *client;
+    session->lease = lease;
+    session->client_end.ev.type = EV_SESSION;
+    session->client_end.ev.fd = session->client.fd;
+    session->client_end.session = session;
+    session->backend_end.ev.type = EV_SESSION;
+    session->backend_end.session = session;
+    session->timer_end.ev.type = EV_SESSION;
+    session->timer_end.ev.fd = -1;
+    session->timer_end.session = session;
+    session->reactor = reactor;
+    // 選定節點之前關閉 session 也會釋放轉發方向
+    splice_state_init(&session->up.splice, 0);
+    splice_state_init(&session->down.splice, 0);
+
+    // 只有一個節點且沒有使用者限制時不必等使用者名稱，後端連線可以和客戶端的第一個封包同時進行
+    if (session_needs_username()) {
+        session->routing = 1;
+        session_route(reactor, session);
+        return;
+    }
+    session_connect(reactor, session, &backend_pools[0]);
+}
+
+static void handle_session_event(Reactor *reactor, SessionEnd *end) {
+    Session *session = end->session;
+    if (session->closed) return;
+
+    if (session->routing) {
+        session_route(reactor, session);
+        return;
+    }
+
+    if (session->queued) {
+        log_warn("排隊中的客戶端已離開");
+        session_close(reactor, session, 0);
+        return;
+    }
+
+    if (end == &session->timer_end) {
+        uint64_t expirations;
+        if (read(end->ev.fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+            session_close(reactor, session, 0);
+            return;
+        }
+    }
+
+    if (session->connecting) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(session->backend.conn->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            errno = err;
+            log_perror("連接後端伺服器失敗");
+            session_close(reactor, session, 0);
+            return;
+        }
+        session->connecting = 0;
+        metrics_observe_since(&metrics.backend_connect, session->connect_us);
+    }
+
+    session_update(reactor, session);
+}
+
+// 取得名額的排隊 session 開始連接後端
+static void handle_wake(Reactor *reactor) {
+    uint64_t count;
+    if (read(reactor->wake_ev.fd, &count, sizeof(count)) < 0 && errno != EAGAIN) log_perror("讀取 eventfd 失敗");
+
+    pthread_mutex_lock(&reactor->admitted_lock);
+    Session *session = reactor->admitted;
+    reactor->admitted = NULL;
+    pthread_mutex_unlock(&reactor->admitted_lock);
+
+    while (session) {
+        Session *next = session->next_admitted;
+        session->queued = 0;
+        session_connect(reactor, session, backend_pool_for(session->limit->username));
+        session = next;
+    }
+}
+
+static void handle_dynamic_listen(Reactor *reactor, DynamicListener *listener) {
+    PortLease *lease = listener->lease;
+    int client_socket = accept4(listener->ev.fd, NULL, NULL, SOCK_NONBLOCK);
+    if (client_socket < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return;
+        // 回收執行緒 shutdown 了逾時的監聽 socket（或其他錯誤），放棄這個 port
+        log_perror("accept 失敗");
+        lease_detach(lease);
+        reactor_watch(reactor, &listener->ev, 0);
+        close(listener->ev.fd);
+        lease_release(lease);
+        free(listener);
+        return;
+    }
+
+    // 每個動態 port 只服務一個客戶端
+    lease_watch(lease, LEASE_ACTIVE, client_socket, -1);
+    reactor_watch(reactor, &listener->ev, 0);
+    close(listener->ev.fd);
+    free(listener);
+
+    Connection client;
+    if (conn_init(&client, client_socket) != 0) {
+        lease_detach(lease);
+        close(client_socket);
+        lease_release(lease);
+        return;
+    }
+    session_start(reactor, &client, lease);
+}
+
+static void main_conn_close(Reactor *reactor, MainConn *main_conn) {
+    reactor_watch(reactor, &main_conn->ev, 0);
+    conn_close(&main_conn->conn);
+    free(main_conn);
+}
+
+static void handle_main_conn(Reactor *reactor, MainConn *main_conn) {
+    Frame frame;
+    int ret;
+    while ((ret = frame_decoder_next(&main_conn->conn.decoder, &frame)) == 0) {
+        ssize_t bytes = frame_decoder_fill(&main_conn->conn.decoder, main_conn->conn.fd);
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (bytes <= 0) {
+            main_conn_close(reactor, main_conn);
+            return;
+        }
+    }
+
+    if (ret < 0 || frame.header.operation != 0) {
+        log_error("協議解析失敗或操作碼錯誤");
+        main_conn_close(reactor, main_conn);
+        return;
+    }
+
+    // 單一連線模式：回覆 port 0 後這條連線直接成為 session 的客戶端
+    if (inline_session_requested(&frame)) {
+        if (send_port_reply(&main_conn->conn, &frame, 0) != 0) {
+            main_conn_close(reactor, main_conn);
+            return;
+        }
+        reactor_watch(reactor, &main_conn->ev, 0);
+        Connection client = main_conn->conn;
+        free(main_conn);
+        session_start(reactor, &client, NULL);
+        return;
+    }
+
+    PortLease *lease = lease_acquire(&port_pool);
+    if (!lease) {
+        log_warn("無可用 port");
+        main_conn_close(reactor, main_conn);
+        return;
+    }
+    int allocated_port = lease->port;
+
+    DynamicListener *listener = calloc(1, sizeof(DynamicListener));
+    int dynamic_socket = listener ? open_listener(allocated_port, 16, 0) : -1;
+    if (dynamic_socket < 0) {
+        free(listener);
+        lease_release(lease);
+        main_conn_close(reactor, main_conn);
+        return;
+    }
+    set_nonblocking(dynamic_socket);
+    listener->ev.type = EV_DYNAMIC_LISTEN;
+    listener->ev.fd = dynamic_socket;
+    listener->lease = lease;
+    if (reactor_watch(reactor, &listener->ev, EPOLLIN) != 0) {
+        close(dynamic_socket);
+        free(listener);
+        lease_release(lease);
+        main_conn_close(reactor, main_conn);
+        return;
+    }
+    lease_watch(lease, LEASE_ACCEPTING, dynamic_socket, -1);
+
+    // 動態 port 已開始監聽後才回覆客戶端
+    log_info("reactor %d 分配 port %d 給新的客戶端", reactor->id, allocated_port);
+    send_port_reply(&main_conn->conn, &frame, allocated_port);
+    main_conn_close(reactor, main_conn);
+}
+
+static void handle_main_listen(Reactor *reactor) {
+    while (1) {
+        int client_socket = accept4(reactor->listen_ev.fd, NULL, NULL, SOCK_NONBLOCK);
+        if (client_socket < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) log_perror("接受連接失敗");
+            return;
+        }
+
+        MainConn *main_conn = calloc(1, sizeof(MainConn));
+        if (!main_conn || conn_init(&main_conn->conn, client_socket) != 0) {
+            free(main_conn);
+            close(client_socket);
+            continue;
+        }
+        main_conn->ev.type = EV_MAIN_CONN;
+        main_conn->ev.fd = client_socket;
+        if (reactor_watch(reactor, &main_conn->ev, EPOLLIN) != 0) {
+            conn_close(&main_conn->conn);
+            free(main_conn);
+        }
+    }
+}
+
+static void *reactor_loop(void *arg) {
+    Reactor *reactor = arg;
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    while (1) {
+        int n = epoll_wait(reactor->epfd, events, REACTOR_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            log_perror("epoll_wait 失敗");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            EventSource *ev = events[i].data.ptr;
+            switch (ev->type) {
+                case EV_MAIN_LISTEN:
+                    handle_main_listen(reactor);
+                    break;
+                case EV_MAIN_CONN:
+                    handle_main_conn(reactor, (MainConn *)ev);
+                    break;
+                case EV_DYNAMIC_LISTEN:
+                    handle_dynamic_listen(reactor, (DynamicListener *)ev);
+                    break;
+                case EV_SESSION:
+                    handle_session_event(reactor, (SessionEnd *)ev);
+                    break;
+                case EV_WAKE:
+                    handle_wake(reactor);
+                    break;
+            }
+        }
+
+        while (reactor->closed) {
+            Session *session = reactor->closed;
+            reactor->closed = session->next_closed;
+            free(session);
+        }
+    }
+
+    return NULL;
+}
+
+int reactor_run() {
+    Reactor *reactors = calloc(config.reactors, sizeof(Reactor));
+    if (!reactors) return -1;
+
+    for (int i = 0; i < config.reactors; i++) {
+        Reactor *reactor = &reactors[i];
+        reactor->id = i;
+        reactor->epfd = epoll_create1(0);
+        int listen_socket = open_listener(config.port, SOMAXCONN, 1);
+        if (reactor->epfd < 0 || listen_socket < 0) {
+            log_perror("建立 reactor 失敗");
+            return -1;
+        }
+        set_nonblocking(listen_socket);
+        reactor->listen_ev.type = EV_MAIN_LISTEN;
+        reactor->listen_ev.fd = listen_socket;
+        if (reactor_watch(reactor, &reactor->listen_ev, EPOLLIN) != 0) return -1;
+
+        pthread_mutex_init(&reactor->admitted_lock, NULL);
+        reactor->wake_ev.type = EV_WAKE;
+        reactor->wake_ev.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (reactor->wake_ev.fd < 0 || reactor_watch(reactor, &reactor->wake_ev, EPOLLIN) != 0) {
+            log_perror("建立 eventfd 失敗");
+            return -1;
+        }
+    }
+
+    for (int i = 1; i < config.reactors; i++) {
+        if (pthread_create(&reactors[i].tid, NULL, reactor_loop, &reactors[i]) != 0) {
+            log_perror("pthread_create 失敗");
+            return -1;
+        }
+    }
+    reactor_loop(&reactors[0]);
+    return -1;
+}
@@ -0,0 +1,357 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <getopt.h>
+#include "protocol.h"
+#include "shard.h"
+#include "auth.h"
+
+// 儲存節點增減後搬移使用者的工具
+//   rebalance --from <舊的節點清單> --to <新的節點清單> [--users users.txt] [--credentials <檔案>] [--dry-run]
+// 以和轉發伺服器相同的一致性雜湊計算每個使用者在新舊清單中的節點，只搬移節點改變的使用者：
+// 直接連到舊節點列出並取回備份，上傳到新節點，確認新節點列得出來後再從舊節點刪除。
+// 建議先以新清單重新啟動轉發伺服器再執行，搬移期間的新備份直接寫到新節點；重複執行是安全的。
+// 所有儲存節點共用同一份 users.txt，這個工具以其中的帳號登入各節點。
+// users.txt 中以雜湊存放的密碼無法用來登入，這些使用者的明文密碼放在 --credentials 指定的檔案
+// （格式與 users.txt 相同，每行 "<使用者> <密碼>"），沒有提供的使用者略過並計為失敗。
+
+#define DEFAULT_PORT 8080
+#define MAX_LIST_FILES 4096
+#define LINE_MAX_SIZE 1024
+
+struct RebalanceConfig {
+    char from[1024];
+    char to[1024];
+    char users[256];
+    char credentials[256];  // 雜湊密碼的使用者登入用的明文密碼，空字串表示沒有
+    int dry_run;
+};
+
+typedef struct {
+    int users;
+    int moved_users;
+    int files;
+    int failures;
+    unsigned long long bytes;
+} RebalanceStats;
+
+struct RebalanceConfig parse_arguments(int argc, char *argv[]) {
+    struct RebalanceConfig config;
+    memset(&config, 0, sizeof(config));
+    strcpy(config.users, "users.txt");
+
+    static struct option long_options[] = {
+        {"from",    required_argument, 0, 'f'},
+        {"to",      required_argument, 0, 't'},
+        {"users",   required_argument, 0, 'u'},
+        {"credentials", required_argument, 0, 'c'},
+        {"dry-run", no_argument,       0, 'n'},
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+    int option_index = 0;
+    while ((opt = getopt_long(argc, argv, "f:t:u:c:n", long_options, &option_index)) != -1) {
+        switch (opt) {
+            case 'f':
+                strncpy(config.from, optarg, sizeof(config.from) - 1);
+                break;
+            case 't':
+                strncpy(config.to, optarg, sizeof(config.to) - 1);
+                break;
+            case 'u':
+                strncpy(config.users, optarg, sizeof(config.users) - 1);
+                break;
+            case 'c':
+                strncpy(config.credentials, optarg, sizeof(config.credentials) - 1);
+                break;
+            case 'n':
+                config.dry_run = 1;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s --from <host:port,...> --to <host:port,...> [--users <file>] [--credentials <file>] [--dry-run]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (!config.from[0] || !config.to[0]) {
+        fprintf(stderr, "必須指定 --from 與 --to\n");
+        exit(EXIT_FAILURE);
+    }
+
+    return config;
+}
+
+// 連到儲存節點並登入；節點支援 v2 時協商較大的封包
+static int node_login(const ShardNode *node, Connection *conn, const char *username, const char *password) {
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        perror("建立 socket 失敗");
+        return -1;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(node->port);
+    if (inet_pton(AF_INET, node->host, &addr.sin_addr) <= 0 ||
+        connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "無法連接節點 %s:%d\n", node->host, node->port);
+        close(sockfd);
+        return -1;
+    }
+    if (conn_init(conn, sockfd) != 0) {
+        close(sockfd);
+        return -1;
+    }
+
+    uint8_t login[MAX_DATA_SIZE];
+    int login_len = strnlen(password, MAX_DATA_SIZE - PROTO_CAPS_SIZE);
+    memcpy(login, password, login_len);
+    ProtocolCaps caps;
+    proto_caps_local(&caps);
+    login_len = proto_caps_append(login, login_len, sizeof(login), &caps);
+
+    Frame frame;
+    if (conn_send(conn, 1, 0, username, 1, login, login_len, 0) != 0 || conn_receive(conn, &frame) <= 0 ||
+        frame.header.length < 8 || memcmp(frame.data, "Login OK", 8) != 0) {
+        fprintf(stderr, "使用者 %s 無法登入節點 %s:%d\n", username, node->host, node->port);
+        conn_close(conn);
+        return -1;
+    }
+    proto_caps_parse(frame.data, frame.header.length, &caps);
+    conn_apply_caps(conn, &caps);
+    return 0;
+}
+
+// 列出使用者在節點上的備份檔名；沒有任何備份時回傳 0 個
+static int node_list(const ShardNode *node, const char *username, const char *password, char ***names) {
+    Connection conn;
+    if (node_login(node, &conn, username, password) != 0) return -1;
+    if (conn_send(&conn, 4, 1, username, 1, NULL, 0, 0) != 0) {
+        conn_close(&conn);
+        return -1;
+    }
+
+    *names = calloc(MAX_LIST_FILES, sizeof(char *));
+    int count = 0;
+    Frame frame;
+    while (*names && conn_receive(&conn, &frame) > 0 && frame.header.status == 0 && count < MAX_LIST_FILES) {
+        char *name = malloc(frame.header.length + 1);
+        if (!name) break;
+        frame_copy_string(&frame, name, frame.header.length + 1);
+        (*names)[count++] = name;
+    }
+    conn_close(&conn);
+    return *names ? count : -1;
+}
+
+static void free_names(char **names, int count) {
+    for (int i = 0; i < count; i++) free(names[i]);
+    free(names);
+}
+
+static int name_listed(char **names, int count, const char *name) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(names[i], name) == 0) return 1;
+    }
+    return 0;
+}
+
+// 把一個備份從 from 串流複製到 to，新節點上的檔名與原本相同
+// 節點把備份存成 <使用者>_<檔名|時間戳>.txt，上傳時送出中間那一段
+static int copy_backup(const ShardNode *from, const ShardNode *to, const char *username, const char *password,
+                       const char *name, unsigned long long *bytes) {
+    size_t user_len = strlen(username), name_len = strlen(name);
+    if (name_len <= user_len + 5 || strncmp(name, username, user_len) != 0 || name[user_len] != '_' ||
+        strcmp(name + name_len - 4, ".txt") != 0) {
+        fprintf(stderr, "無法辨識的備份檔名，略過: %s\n", name);
+        return -1;
+    }
+    char start[MAX_DATA_SIZE];
+    snprintf(start, sizeof(start), "%.*s", (int)(name_len - user_len - 5), name + user_len + 1);
+
+    Connection src, dst;
+    if (node_login(from, &src, username, password) != 0) return -1;
+    if (node_login(to, &dst, username, password) != 0) {
+        conn_close(&src);
+        return -1;
+    }
+
+    int ok = 0;
+    uint32_t seq = 1;
+    if (conn_send(&dst, 2, 0, username, seq++, (const uint8_t *)start, strlen(start) + 1, SEND_MORE) != 0 ||
+        conn_send(&src, 5, 1, username, 1, (const uint8_t *)name, name_len, 0) != 0) {
+        goto done;
+    }
+
+    Frame frame;
+    while (conn_receive(&src, &frame) > 0) {
+        if (frame.header.status == 1) {
+            // 結束封包之後節點寫完檔案就關閉連線
+            if (conn_send(&dst, 3, 1, username, seq, NULL, 0, 0) != 0) break;
+            while (conn_receive(&dst, &frame) > 0) {}
+            ok = 1;
+            break;
+        }
+
+        // 兩個節點協商出的上限可能不同，依目的端的上限切開
+        for (uint32_t off = 0; off < frame.header.length; off += dst.max_payload) {
+            uint32_t len = frame.header.length - off < dst.max_payload ? frame.header.length - off : dst.max_payload;
+            if (conn_send(&dst, 3, 0, username, seq++, frame.data + off, len, SEND_MORE) != 0) goto done;
+        }
+        *bytes += frame.header.length;
+    }
+
+done:
+    if (!ok) fprintf(stderr, "複製備份失敗: %s\n", name);
+    conn_close(&src);
+    conn_close(&dst);
+    return ok ? 0 : -1;
+}
+
+// 從節點刪除已搬走的備份，全部的請求送出後再依序讀取回覆
+static int delete_backups(const ShardNode *node, const char *username, const char *password, char **names, int count) {
+    Connection conn;
+    if (node_login(node, &conn, username, password) != 0) return -1;
+
+    int failures = 0;
+    for (int i = 0; i < count; i++) {
+        if (conn_send(&conn, OP_DELETE_BACKUP, 0, username, i + 1, (const uint8_t *)names[i], strlen(names[i]),
+                      i + 1 < count ? SEND_MORE : 0) != 0) {
+            conn_close(&conn);
+            return -1;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        Frame frame;
+        if (conn_receive(&conn, &frame) <= 0) {
+            failures += count - i;
+            break;
+        }
+        if (frame.header.length != 9 || memcmp(frame.data, "Delete OK", 9) != 0) {
+            fprintf(stderr, "無法從舊節點刪除: %s\n", names[i]);
+            failures++;
+        }
+    }
+    conn_close(&conn);
+    return failures == 0 ? 0 : -1;
+}
+
+static void migrate_user(const ShardNode *from, const ShardNode *to, const char *username, const char *password,
+                         RebalanceStats *stats) {
+    char **names;
+    int count = node_list(from, username, password, &names);
+    if (count < 0) {
+        stats->failures++;
+        return;
+    }
+
+    // 逐一複製，只有確認新節點列得出來的才從舊節點刪除
+    char **copied = calloc(count + 1, sizeof(char *));
+    int copied_count = 0;
+    for (int i = 0; i < count && copied; i++) {
+        if (copy_backup(from, to, username, password, names[i], &stats->bytes) == 0) {
+            copied[copied_count++] = names[i];
+        } else {
+            stats->failures++;
+        }
+    }
+
+    char **listed;
+    int listed_count = copied_count > 0 ? node_list(to, username, password, &listed) : 0;
+    char **removable = calloc(copied_count + 1, sizeof(char *));
+    int removable_count = 0;
+    for (int i = 0; i < copied_count && listed_count > 0 && removable; i++) {
+        if (name_listed(listed, listed_count, copied[i])) removable[removable_count++] = copied[i];
+    }
+    if (listed_count > 0) free_names(listed, listed_count);
+    if (removable_count < copied_count) {
+        fprintf(stderr, "使用者 %s 有 %d 個備份在新節點上找不到，保留在舊節點\n", username, copied_count - removable_count);
+        stats->failures += copied_count - removable_count;
+    }
+
+    if (removable_count > 0 && delete_backups(from, username, password, removable, removable_count) != 0) {
+        stats->failures++;
+    }
+    stats->files += removable_count;
+    printf("使用者 %s：搬移 %d/%d 個備份\n", username, removable_count, count);
+
+    free(removable);
+    free(copied);
+    free_names(names, count);
+}
+// 讀取一行 "<使用者> <密碼>"，略過註解與空行；回傳 0 表示檔案結束
+static int read_user(FILE *fp, char username[MAX_USERNAME_LENGTH + 1], char password[LINE_MAX_SIZE]) {
+    char line[LINE_MAX_SIZE];
+    while (fgets(line, sizeof(line), fp)) {
+        if (line[0] != '#' && sscanf(line, "%255s %1023s", username, password) == 2) return 1;
+    }
+    return 0;
+}
+
+// 在 --credentials 檔案中找使用者的明文密碼
+static int find_credential(const char *path, const char *username, char password[LINE_MAX_SIZE]) {
+    FILE *fp = path[0] ? fopen(path, "r") : NULL;
+    if (!fp) return -1;
+    char name[MAX_USERNAME_LENGTH + 1];
+    int found = -1;
+    while (found != 0 && read_user(fp, name, password)) {
+        if (strcmp(name, username) == 0) found = 0;
+    }
+    fclose(fp);
+    return found;
+}
+
+int main(int argc, char *argv[]) {
+    struct RebalanceConfig config = parse_arguments(argc, argv);
+
+    ShardRing from, to;
+    if (shard_ring_init(&from, config.from, DEFAULT_PORT) != 0 || shard_ring_init(&to, config.to, DEFAULT_PORT) != 0) {
+        fprintf(stderr, "無效的節點清單\n");
+        exit(EXIT_FAILURE);
+    }
+
+    FILE *fp = fopen(config.users, "r");
+    if (!fp) {
+        perror("無法打開使用者清單檔案");
+        exit(EXIT_FAILURE);
+    }
+
+    if (config.credentials[0] && access(config.credentials, R_OK) != 0) {
+        perror("無法打開登入密碼檔案");
+        exit(EXIT_FAILURE);
+    }
+
+    RebalanceStats stats;
+    memset(&stats, 0, sizeof(stats));
+    char username[MAX_USERNAME_LENGTH + 1], password[LINE_MAX_SIZE];
+    while (read_user(fp, username, password)) {
+        stats.users++;
+        const ShardNode *old_node = &from.nodes[shard_lookup(&from, username)];
+        const ShardNode *new_node = &to.nodes[shard_lookup(&to, username)];
+        if (strcmp(old_node->host, new_node->host) == 0 && old_node->port == new_node->port) continue;
+
+        stats.moved_users++;
+        printf("使用者 %s：%s:%d → %s:%d\n", username, old_node->host, old_node->port, new_node->host, new_node->port);
+        if (strncmp(password, AUTH_HASH_PREFIX, strlen(AUTH_HASH_PREFIX)) == 0 &&
+            find_credential(config.credentials, username, password) != 0) {
+            fprintf(stderr, "使用者 %s 的密碼是雜湊，無法登入；請以 --credentials 提供明文密碼\n", username);
+            stats.failures++;
+            continue;
+        }
+        if (!config.dry_run) migrate_user(old_node, new_node, username, password, &stats);
+    }
+    fclose(fp);
+
+    printf("共 %d 位使用者，%d 位換了節點", stats.users, stats.moved_users);
+    if (!config.dry_run) {
+        printf("，搬移 %d 個備份（%llu bytes），失敗 %d", stats.files, stats.bytes, stats.failures);
+    }
+    printf("\n");
+
+    shard_ring_free(&from);
+    shard_ring_free(&to);
+    return stats.failures == 0 ? 0 : EXIT_FAILURE;
+}
@@ -0,0 +1,244 @@
+#define _GNU_SOURCE
+#include "relay.h"
+#include "metrics.h"
+#include "log.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+void relay_init(RelayDir *dir, Connection *src, Connection *dst, int face) {
+    dir->src = src;
+    dir->dst = dst;
+    dir->face = face;
+    dir->eof = 0;
+    dir->shut = 0;
+    dir->keep_open = 0;
+    dir->controls = 0;
+    dir->ended = 0;
+    dir->limit = NULL;
+    dir->wait_ms = 0;
+    dir->fill_us = metrics_now_us();  // 開始前已緩衝的資料從現在起算
+    dir->batch_us = 0;
+    dir->batch_frames = 0;
+    splice_state_init(&dir->splice, 0);
+}
+
+void relay_free(RelayDir *dir) {
+    splice_state_free(&dir->splice);
+}
+
+void relay_inspect_frame(Frame *frame, Connection *src, Connection *dst, int face) {
+    ProtocolHeader *header = &frame->header;
+
+    // 登入封包中的能力宣告壓低到本端上限；後端的回覆即為三方協商結果
+    ProtocolCaps caps;
+    if (header->operation == 1 &&
+        proto_caps_clamp((uint8_t *)frame->data, header->length, &caps) && face == 1) {
+        conn_apply_caps(src, &caps);
+        conn_apply_caps(dst, &caps);
+    }
+
+    metrics_count_frame(face, header->operation, header->length);
+    log_frame("接收到數據", header, frame->data);
+}
+
+int relay_is_control(const Frame *frame, int face) {
+    uint8_t operation = frame->header.operation;
+    if (operation != OP_SESSION_RESET && operation != OP_DELETE_BACKUP) return 0;
+    if (face == 0) log_warn("丟棄客戶端送來的控制封包");
+    return 1;
+}
+
+int relay_read_username(Connection *src, char *username) {
+    while (1) {
+        Frame frame;
+        int ret = frame_decoder_peek(&src->decoder, &frame);
+        if (ret > 0) {
+            strcpy(username, frame.header.username);
+            return 1;
+        } else if (ret < 0) {
+            log_error("協議解析失敗");
+            return -1;
+        }
+
+        ssize_t bytes = frame_decoder_fill(&src->decoder, src->fd);
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if (bytes <= 0) return -1;
+    }
+}
+
+void splice_state_init(SpliceState *sp, int enabled) {
+    sp->enabled = enabled;
+    sp->pipe_fds[0] = sp->pipe_fds[1] = -1;
+    sp->header_only = 0;
+    sp->remaining = 0;
+    sp->in_pipe = 0;
+}
+
+void splice_state_free(SpliceState *sp) {
+    if (sp->pipe_fds[0] >= 0) {
+        close(sp->pipe_fds[0]);
+        close(sp->pipe_fds[1]);
+    }
+    sp->pipe_fds[0] = sp->pipe_fds[1] = -1;
+}
+
+int splice_begin(SpliceState *sp, Connection *src, Connection *dst, int face) {
+    if (!sp->enabled) return 0;
+
+    Frame frame;
+    int ret = frame_decoder_peek(&src->decoder, &frame);
+    if (ret <= 0) return ret;
+
+    ProtocolHeader *header = &frame.header;
+    uint32_t header_len = frame.data - frame.raw;
+    if (header->status != 0 || header->length < SPLICE_MIN_PAYLOAD ||
+        !((header->operation == 3 && face == 0) || (header->operation == 5 && face == 1)) ||
+        frame.raw_len == header_len + header->length) {
+        sp->header_only = 0;
+        return 0;
+    }
+
+    if (sp->pipe_fds[0] < 0) {
+        if (pipe2(sp->pipe_fds, O_CLOEXEC) != 0) {
+            log_perror("建立 pipe 失敗");
+            sp->pipe_fds[0] = sp->pipe_fds[1] = -1;
+            sp->enabled = 0;
+            return 0;
+        }
+        // 擴大失敗時沿用預設大小，只是 splice 的次數較多
+        fcntl(sp->pipe_fds[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+    }
+
+    metrics_count_frame(face, header->operation, header->length);
+    log_frame("接收到數據（splice）", header, NULL);
+
+    // 頭部與已緩衝的數據直接引用接收緩衝區，下一次 fill 前會先送出
+    if (conn_queue_raw(dst, frame.raw, frame.raw_len) != 0) return -1;
+    frame_decoder_consume(&src->decoder, frame.raw_len);
+    sp->remaining = header_len + header->length - frame.raw_len;
+    sp->header_only = 1;
+    return 1;
+}
+
+int splice_pump(SpliceState *sp, int src_fd, int dst_fd) {
+    while (sp->remaining > 0 || sp->in_pipe > 0) {
+        // pipe 裡的先送完，再從 src 搬下一段；SPLICE_F_NONBLOCK 只影響 pipe，socket 依照自己的模式
+        if (sp->in_pipe > 0) {
+            ssize_t n = splice(sp->pipe_fds[0], NULL, dst_fd, NULL, sp->in_pipe,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK | (sp->remaining > 0 ? SPLICE_F_MORE : 0));
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return RELAY_WANT_WRITE;
+                log_perror("splice 送出失敗");
+                return RELAY_ERROR;
+            }
+            sp->in_pipe -= n;
+            continue;
+        }
+
+        ssize_t n = splice(src_fd, NULL, sp->pipe_fds[1], NULL, sp->remaining,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return RELAY_WANT_READ;
+            log_perror("splice 接收失敗");
+            return RELAY_ERROR;
+        } else if (n == 0) {
+            log_error("對端在封包數據區中途關閉連接");
+            return RELAY_ERROR;
+        }
+        sp->remaining -= n;
+        sp->in_pipe += n;
+    }
+    return RELAY_DONE;
+}
+
+ssize_t splice_fill(SpliceState *sp, Connection *src, size_t limit) {
+    if (sp->header_only && (limit == 0 || limit > FRAME_MAX_HEADER_SIZE)) limit = FRAME_MAX_HEADER_SIZE;
+    if (limit > 0) return frame_decoder_fill_limit(&src->decoder, src->fd, limit);
+    return frame_decoder_fill(&src->decoder, src->fd);
+}
+
+int relay_pump(RelayDir *dir) {
+    int budget = RELAY_READ_BUDGET;
+
+    while (1) {
+        // 先把佇列送完，之後才能覆寫 src 的接收緩衝區
+        if (conn_has_pending_output(dir->dst)) {
+            int ret = conn_flush(dir->dst, SEND_NOWAIT);
+            if (ret < 0) return RELAY_ERROR;
+            if (ret > 0) return RELAY_WANT_WRITE;
+        }
+
+        // 進行中的 splice 必須完成，下一個頭部才接得上
+        if (dir->splice.remaining > 0 || dir->splice.in_pipe > 0) {
+            int ret = splice_pump(&dir->splice, dir->src->fd, dir->dst->fd);
+            if (ret != RELAY_DONE) return ret;
+        }
+
+        // 佇列中的封包（包含 splice 的數據區）都已送出
+        if (dir->batch_frames > 0) {
+            metrics_observe_n(&metrics.relay_frame, metrics_now_us() - dir->batch_us, dir->batch_frames);
+            dir->batch_frames = 0;
+        }
+
+        if (dir->eof) {
+            if (!dir->shut && !dir->keep_open) {
+                shutdown(dir->dst->fd, SHUT_WR);
+                dir->shut = 1;
+            }
+            return RELAY_DONE;
+        }
+
+        // 同一次 recv 取得的封包都是相鄰的，排入佇列後會合併成一個 iovec
+        Frame frame;
+        int queued = 0;
+        int ret;
+        while ((ret = frame_decoder_next(&dir->src->decoder, &frame)) == 1) {
+            if (relay_is_control(&frame, dir->face)) {
+                if (dir->face == 1 && frame.header.status == 1) dir->ended = 1;
+                else if (dir->face == 1) dir->controls++;
+                continue;
+            }
+            relay_inspect_frame(&frame, dir->src, dir->dst, dir->face);
+            if (conn_queue_raw(dir->dst, frame.raw, frame.raw_len) != 0) return RELAY_ERROR;
+            if (dir->batch_frames++ == 0) dir->batch_us = dir->fill_us;
+            queued = 1;
+        }
+        if (ret == 0) {
+            ret = splice_begin(&dir->splice, dir->src, dir->dst, dir->face);
+            if (ret > 0) {
+                // 還在 src 裡的數據區不經過 fill，開始時先整個計入額度
+                limiter_charge(dir->limit, dir->splice.remaining);
+                if (dir->batch_frames++ == 0) dir->batch_us = dir->fill_us;
+                continue;
+            }
+        }
+        if (ret < 0) {
+            log_error("協議解析失敗");
+            return RELAY_ERROR;
+        }
+        if (queued) continue;
+
+        if (budget-- == 0) return RELAY_WANT_READ;
+
+        // 每次最多讀取目前的額度，讓一個大封包也分散在一段時間內轉發
+        size_t allowance;
+        dir->wait_ms = limiter_delay(dir->limit, &allowance);
+        if (dir->wait_ms > 0) return RELAY_WANT_TIME;
+
+        ssize_t bytes = splice_fill(&dir->splice, dir->src, allowance);
+        if (bytes < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return RELAY_WANT_READ;
+            return RELAY_ERROR;
+        } else if (bytes == 0) {
+            dir->eof = 1;
+        }
+        dir->fill_us = metrics_now_us();
+        limiter_charge(dir->limit, bytes);
+    }
+}
@@ -0,0 +1,151 @@
+#ifndef RELAY_H
+#define RELAY_H
+
+#include "protocol.h"
+#include "limit.h"
+
+#define RELAY_READ_BUDGET 16   // 每次事件最多處理的 recv 次數，避免單一 session 占住事件迴圈
+
+// relay_pump 的結果
+#define RELAY_WANT_READ  1     // 等待 src 可讀
+#define RELAY_WANT_WRITE 2     // 等待 dst 可寫
+#define RELAY_DONE       3     // src 已關閉且剩餘資料都已轉出（已對 dst 半關閉）
+#define RELAY_WANT_TIME  4     // 超過頻寬限制，wait_ms 毫秒後再從 src 讀取
+#define RELAY_ERROR      -1
+
+#define SPLICE_MIN_PAYLOAD (64 * 1024)     // 數據區至少這麼大才值得多一次只讀頭部的 recv
+#define SPLICE_PIPE_SIZE   MAX_DATA_SIZE_V2 // 嘗試把 pipe 擴大到一個完整的數據區
+
+/**
+ * 以 splice 轉發大型數據區（operation 3 與 5）的狀態
+ * 頭部照常讀進接收緩衝區以便路由與記錄，數據區經由 pipe 從 src socket 直接搬到 dst socket，
+ * 不經過使用者空間。之後的 recv 只讀一個頭部的長度，直到遇到不走 splice 的封包。
+ */
+typedef struct {
+    int enabled;
+    int pipe_fds[2];     // 第一次需要時才建立，-1 表示尚未建立
+    int header_only;     // 上一個封包走 splice，下次 recv 只讀最多一個頭部
+    uint32_t remaining;  // 目前封包還留在 src socket 裡的數據
+    uint32_t in_pipe;    // 已在 pipe 裡、尚未送到 dst 的數據
+} SpliceState;
+
+/**
+ * 單一方向的非阻塞封包轉發狀態（src → dst）
+ * 封包以檢視的方式從 src 的接收緩衝區直接排入 dst 的送出佇列，
+ * dst 還有資料沒送完時不會再從 src 讀取，接收緩衝區也就不會被覆寫。
+ */
+typedef struct {
+    Connection *src;
+    Connection *dst;
+    int face;            // 0 = 客戶端 → 後端，1 = 後端 → 客戶端
+    int eof;             // src 已關閉
+    int shut;            // 已對 dst 送出 SHUT_WR
+    int keep_open;       // src 關閉時不對 dst 半關閉（dst 是連線池中的後端連線）
+    int controls;        // 從後端收到、沒有轉出的 OP_SESSION_RESET 回覆數
+    int ended;           // 後端通知 session 結束（status 1 的 OP_SESSION_RESET）
+    UserLimit *limit;    // session 使用者的頻寬限制，NULL 表示不限制
+    int wait_ms;         // RELAY_WANT_TIME 時要等待的時間
+    uint64_t fill_us;    // 最近一次從 src 讀到資料的時間
+    uint64_t batch_us;   // 佇列中最早的封包被讀進來的時間
+    uint32_t batch_frames; // 佇列中還沒送完的封包數，送完時記錄轉發延遲
+    SpliceState splice;
+} RelayDir;
+
+/**
+ * 初始化轉發方向
+ * @param dir 轉發方向
+ * @param src 來源連線
+ * @param dst 目的連線
+ * @param face 0 = 客戶端 → 後端，1 = 後端 → 客戶端
+ */
+void relay_init(RelayDir *dir, Connection *src, Connection *dst, int face);
+
+/**
+ * 釋放轉發方向持有的資源（splice 的 pipe）
+ * @param dir 轉發方向
+ */
+void relay_free(RelayDir *dir);
+
+/**
+ * 盡可能轉發資料，直到需要等待事件
+ * 兩端的 socket 都必須是非阻塞的。OP_SESSION_RESET 只存在於轉發伺服器與後端之間：
+ * 後端的回覆計入 controls、結束通知設定 ended，客戶端送來的直接丟棄。
+ * 設定了 limit 時，從 src 讀到的位元組（splice 的數據區在開始時一次）計入使用者與全域額度，
+ * 額度不足時暫停讀取並回傳 RELAY_WANT_TIME；已讀到的資料照常送出。
+ * @param dir 轉發方向
+ * @return RELAY_WANT_READ、RELAY_WANT_WRITE、RELAY_WANT_TIME、RELAY_DONE 或 RELAY_ERROR
+ */
+int relay_pump(RelayDir *dir);
+
+/**
+ * 內部 operation（OP_SESSION_RESET、OP_DELETE_BACKUP）不轉發：來自客戶端的丟棄，來自後端的是連線池握手的回覆
+ * @param frame 封包
+ * @param face 0 = 客戶端 → 後端，1 = 後端 → 客戶端
+ * @return 1 表示這是控制封包（呼叫端不轉發），0 表示一般封包
+ */
+int relay_is_control(const Frame *frame, int face);
+
+/**
+ * 讀到 session 第一個封包的頭部為止，取出用來選擇儲存節點的使用者名稱
+ * 只檢視接收緩衝區，不消耗任何位元組，之後照常轉發。
+ * @param src 客戶端連線；阻塞的 socket 會一直讀到頭部完整
+ * @param username 輸出，至少 MAX_USERNAME_LENGTH + 1 bytes
+ * @return 1 表示取得，0 表示非阻塞 socket 需要等待可讀，-1 表示錯誤或對端關閉
+ */
+int relay_read_username(Connection *src, char *username);
+
+/**
+ * 檢查一個經過轉發伺服器的封包：記錄內容，並處理登入時的能力協商
+ * （壓低能力宣告；後端回覆的協商結果套用到兩端連線）
+ * @param frame 封包，數據區可能被就地修改
+ * @param src 來源連線
+ * @param dst 目的連線
+ * @param face 0 = 客戶端 → 後端，1 = 後端 → 客戶端
+ */
+void relay_inspect_frame(Frame *frame, Connection *src, Connection *dst, int face);
+
+/**
+ * 初始化 splice 狀態
+ * @param sp splice 狀態
+ * @param enabled 0 表示停用，所有封包照一般方式轉發
+ */
+void splice_state_init(SpliceState *sp, int enabled);
+
+/**
+ * 關閉 splice 使用的 pipe
+ * @param sp splice 狀態
+ */
+void splice_state_free(SpliceState *sp);
+
+/**
+ * src 接收緩衝區開頭是一個數據區夠大、尚未收完的 operation 3／5 封包時，
+ * 把頭部與已收到的數據排入 dst 的送出佇列、從接收緩衝區移除，剩下的數據交給 splice_pump
+ * 佇列必須在 splice_pump 之前送出。
+ * @param sp splice 狀態
+ * @param src 來源連線
+ * @param dst 目的連線
+ * @param face 0 = 客戶端 → 後端，1 = 後端 → 客戶端
+ * @return 1 表示開始 splice，0 表示照一般方式處理，-1 表示錯誤
+ */
+int splice_begin(SpliceState *sp, Connection *src, Connection *dst, int face);
+
+/**
+ * 把目前封包剩下的數據經由 pipe 從 src 搬到 dst
+ * 阻塞的 socket 會一直搬到完成；非阻塞的 socket 在需要等待時返回。
+ * @param sp splice 狀態
+ * @param src_fd 來源 socket
+ * @param dst_fd 目的 socket
+ * @return RELAY_DONE 表示數據已全部送出，RELAY_WANT_READ、RELAY_WANT_WRITE 或 RELAY_ERROR
+ */
+int splice_pump(SpliceState *sp, int src_fd, int dst_fd);
+
+/**
+ * 從 src 讀取更多資料到接收緩衝區；上一個封包走 splice 時只讀最多一個頭部的長度
+ * @param sp splice 狀態
+ * @param src 來源連線
+ * @param limit 這次最多讀取的位元組數（頻寬額度），0 表示不限制
+ * @return 同 frame_decoder_fill
+ */
+ssize_t splice_fill(SpliceState *sp, Connection *src, size_t limit);
+
+#endif // RELAY_H
@@ -0,0 +1,136 @@
+#include "resume.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "protocol.h"
+#include "log.h"
+
+/**
+ * 一個暫存中的備份
+ */
+typedef struct Parked {
+    char username[MAX_USERNAME_LENGTH + 1];
+    char file[256];
+    uint64_t size;
+    StoreWriter *writer;
+    time_t parked_at;
+    struct Parked *next;
+} Parked;
+
+static pthread_mutex_t parked_lock = PTHREAD_MUTEX_INITIALIZER;
+static Parked *parked_head;          // 依暫存的時間排序，最舊的在前面
+static int parked_count;
+static int resume_timeout = RESUME_DEFAULT_TIMEOUT;
+
+static time_t resume_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+// 放棄暫存的備份，不持有鎖時呼叫（刪除暫存檔）
+static void parked_free(Parked *p, const char *reason) {
+    log_info("放棄暫存的備份 %s（%s，已寫入 %llu bytes）", p->file, reason,
+             (unsigned long long)store_writer_size(p->writer));
+    store_writer_abort(p->writer);
+    free(p);
+}
+
+// 從串列中取出符合的備份，持有鎖時呼叫
+static Parked *parked_unlink(const char *username, const char *file) {
+    for (Parked **pp = &parked_head; *pp; pp = &(*pp)->next) {
+        Parked *p = *pp;
+        if (strcmp(p->username, username) == 0 && strcmp(p->file, file) == 0) {
+            *pp = p->next;
+            parked_count--;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static void *resume_reaper(void *arg) {
+    (void)arg;
+    while (1) {
+        sleep(resume_timeout < 60 ? 1 : 10);
+        time_t now = resume_now();
+
+        Parked *expired = NULL;
+        pthread_mutex_lock(&parked_lock);
+        while (parked_head && now - parked_head->parked_at >= resume_timeout) {
+            Parked *p = parked_head;
+            parked_head = p->next;
+            parked_count--;
+            p->next = expired;
+            expired = p;
+        }
+        pthread_mutex_unlock(&parked_lock);
+
+        while (expired) {
+            Parked *next = expired->next;
+            parked_free(expired, "逾時");
+            expired = next;
+        }
+    }
+    return NULL;
+}
+
+int resume_init(int timeout) {
+    resume_timeout = timeout;
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, resume_reaper, NULL) != 0) {
+        log_perror("pthread_create 失敗");
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+void resume_park(const char *username, const char *file, uint64_t size, StoreWriter *writer) {
+    Parked *p = calloc(1, sizeof(Parked));
+    if (!p) {
+        store_writer_abort(writer);
+        return;
+    }
+    snprintf(p->username, sizeof(p->username), "%s", username);
+    snprintf(p->file, sizeof(p->file), "%s", file);
+    p->size = size;
+    p->writer = writer;
+    p->parked_at = resume_now();
+
+    pthread_mutex_lock(&parked_lock);
+    Parked *old = parked_unlink(username, file);
+    Parked *oldest = NULL;
+    if (parked_count == RESUME_MAX_PARKED) {
+        oldest = parked_head;
+        parked_head = oldest->next;
+        parked_count--;
+    }
+    Parked **tail = &parked_head;
+    while (*tail) tail = &(*tail)->next;
+    *tail = p;
+    parked_count++;
+    pthread_mutex_unlock(&parked_lock);
+
+    if (old) parked_free(old, "被新的中斷取代");
+    if (oldest) parked_free(oldest, "暫存的備份太多");
+    log_info("暫存中斷的備份 %s，已寫入 %llu bytes", file, (unsigned long long)store_writer_size(writer));
+}
+
+StoreWriter *resume_take(const char *username, const char *file, uint64_t size) {
+    pthread_mutex_lock(&parked_lock);
+    Parked *p = parked_unlink(username, file);
+    pthread_mutex_unlock(&parked_lock);
+    if (!p) return NULL;
+
+    if (p->size != size || store_writer_size(p->writer) > size) {
+        parked_free(p, "檔案大小不同");
+        return NULL;
+    }
+    StoreWriter *writer = p->writer;
+    free(p);
+    return writer;
+}
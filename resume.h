@@ -0,0 +1,48 @@
+#ifndef RESUME_H
+#define RESUME_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "store.h"
+
+// 續傳：連線在備份途中中斷時，寫入中的備份不放棄，連同寫入器的狀態暫存在記憶體中，
+// 以使用者、備份檔名（"使用者_檔名|修改時間.txt"）與檔案大小識別。客戶端重新連線後以
+// OP_RESUME_BACKUP 取回，從已寫入的位置繼續送 operation 3；超過期限沒有取回的由回收執行緒放棄。
+// 寫入器保留了壓縮與去重的狀態，所以任何儲存格式都可以續傳；儲存伺服器重新啟動後暫存的備份就不在了。
+//
+// OP_RESUME_BACKUP：數據區與 operation 2 相同（"檔名|時間戳" '\0' 檔案大小(8) [原始路徑]），
+//   回覆同一個 operation：status 0 是已寫入的原文長度(8)，0 表示從頭開始（沒有可續傳的備份時
+//   就是新的備份），之後照常送 operation 3；status 1 表示備份目錄中已經有相同的備份
+//   （例如中斷前已經完成，只是沒收到結果），不需要再送。
+// 儲存伺服器在登入回覆中帶上 PROTO_CAP_RESUME 才可以使用，需要多操作 session。
+#define OP_RESUME_BACKUP 11
+
+#define RESUME_DEFAULT_TIMEOUT 3600   // 暫存的備份保留的秒數
+#define RESUME_MAX_PARKED 128         // 暫存的備份上限，每個都佔著一個檔案與寫入緩衝區，超過時放棄最舊的
+
+/**
+ * 啟動回收執行緒
+ * @param timeout 暫存的備份保留的秒數
+ * @return 0 表示成功，-1 表示失敗
+ */
+int resume_init(int timeout);
+
+/**
+ * 暫存中斷的備份，取得寫入器的所有權；同一個備份已經暫存時放棄舊的
+ * @param username 使用者名稱
+ * @param file 備份檔名
+ * @param size 客戶端宣告的檔案大小
+ * @param writer 寫入器
+ */
+void resume_park(const char *username, const char *file, uint64_t size, StoreWriter *writer);
+
+/**
+ * 取回暫存的備份；找到同名但大小不同（檔案已經改變）的備份時放棄它
+ * @param username 使用者名稱
+ * @param file 備份檔名
+ * @param size 客戶端宣告的檔案大小
+ * @return 寫入器，沒有時回傳 NULL
+ */
+StoreWriter *resume_take(const char *username, const char *file, uint64_t size);
+
+#endif // RESUME_H
@@ -0,0 +1,427 @@
+#define _GNU_SOURCE
+#include "retention.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "catalog.h"
+#include "chunk.h"
+#include "store.h"
+#include "metrics.h"
+#include "log.h"
+
+#define BACKUP_ROOT "./backup"
+#define RETENTION_TIME_SLACK 2       // 秒，修改時間與 time() 的精確度不同
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+/**
+ * 一個備份版本
+ */
+typedef struct {
+    char *file;
+    uint64_t size;
+    uint16_t name_end;       // file 中最後一個 '|' 的位置
+    time_t time;             // 備份檔名中的時間戳，-1 表示無法解析
+    int latest;
+    int keep;
+} Version;
+
+typedef struct {
+    Version *items;          // 依原始檔名、時間排序（備份目錄的順序）
+    size_t count;
+    size_t cap;
+} VersionList;
+
+/**
+ * 標記中的區塊：以 SHA-256 為鍵的開放定址雜湊表
+ */
+typedef struct {
+    uint8_t (*keys)[SHA256_DIGEST_SIZE];
+    uint8_t *used;
+    size_t mask;
+    size_t count;
+} ChunkSet;
+
+/**
+ * 一輪釋放的空間
+ */
+typedef struct {
+    uint64_t files;
+    uint64_t file_bytes;
+    uint64_t chunks;
+    uint64_t chunk_bytes;
+} Reclaimed;
+
+static RetentionPolicy policy;
+static double next_delete;           // 限速：下一次可以刪除的時間
+
+static double retention_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 刪除前呼叫，平均每秒不超過 rate 個
+static void retention_pace() {
+    if (policy.rate == 0) return;
+    double now = retention_now();
+    if (next_delete > now) usleep((next_delete - now) * 1e6);
+    else next_delete = now;
+    next_delete += 1.0 / policy.rate;
+}
+
+// 備份檔名 "使用者_檔名|YYYY-MM-DD HH:MM:SS.txt" 中的時間戳
+static time_t version_time(const char *stamp) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char *end = strptime(stamp, "%Y-%m-%d %H:%M:%S", &tm);
+    if (!end || strcmp(end, ".txt") != 0) return -1;
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+static int collect_version(const CatalogEntry *entry, void *arg) {
+    VersionList *list = arg;
+    if (list->count == list->cap) {
+        size_t cap = list->cap ? list->cap * 2 : 64;
+        Version *items = realloc(list->items, cap * sizeof(Version));
+        if (!items) return -1;
+        list->items = items;
+        list->cap = cap;
+    }
+    Version *v = &list->items[list->count];
+    if (!(v->file = strdup(entry->file))) return -1;
+    v->size = entry->size;
+    v->name_end = entry->name_end;
+    v->time = version_time(entry->file + entry->name_end + 1);
+    v->latest = 0;
+    v->keep = 1;
+    list->count++;
+    return 0;
+}
+
+static int same_name(const Version *a, const Version *b) {
+    return a->name_end == b->name_end && memcmp(a->file, b->file, a->name_end) == 0;
+}
+
+static int older_first(const void *a, const void *b) {
+    const Version *x = *(Version *const *)a, *y = *(Version *const *)b;
+    if (x->time != y->time) return x->time < y->time ? -1 : 1;
+    return strcmp(x->file, y->file);
+}
+
+// 依版本數與天數決定保留哪些版本
+static void apply_versions(VersionList *list, time_t now) {
+    int versioned = policy.keep_last > 0 || policy.keep_daily > 0;
+    for (size_t i = 0; i < list->count;) {
+        size_t j = i + 1;
+        while (j < list->count && same_name(&list->items[i], &list->items[j])) j++;
+
+        // 從最新的版本往回看，每天第一個看到的就是當天最新的
+        const char *prev_day = NULL;
+        uint32_t rank = 0;
+        for (size_t k = j; k-- > i; rank++) {
+            Version *v = &list->items[k];
+            const char *day = v->file + v->name_end + 1;
+            int newest_of_day = !prev_day || strncmp(prev_day, day, 10) != 0;
+            prev_day = day;
+            v->latest = rank == 0;
+            if (!versioned || v->latest || v->time < 0) continue;
+            v->keep = rank < policy.keep_last ||
+                      (policy.keep_daily > 0 && newest_of_day && now - v->time < (time_t)policy.keep_daily * 86400);
+        }
+        i = j;
+    }
+}
+
+// 超過配額時從最舊的版本開始放棄
+static void apply_quota(VersionList *list) {
+    uint64_t total = 0;
+    size_t candidates = 0;
+    for (size_t i = 0; i < list->count; i++) {
+        if (!list->items[i].keep) continue;
+        total += list->items[i].size;
+        if (!list->items[i].latest && list->items[i].time >= 0) candidates++;
+    }
+    if (policy.quota == 0 || total <= policy.quota || candidates == 0) return;
+
+    Version **order = malloc(candidates * sizeof(Version *));
+    if (!order) return;
+    size_t n = 0;
+    for (size_t i = 0; i < list->count; i++) {
+        Version *v = &list->items[i];
+        if (v->keep && !v->latest && v->time >= 0) order[n++] = v;
+    }
+    qsort(order, n, sizeof(Version *), older_first);
+    for (size_t i = 0; i < n && total > policy.quota; i++) {
+        order[i]->keep = 0;
+        total -= order[i]->size;
+    }
+    free(order);
+    if (total > policy.quota) log_warn("最新的版本已經超過配額：%llu bytes", (unsigned long long)total);
+}
+
+// 對一個使用者套用保留策略，刪除不保留的版本
+static void retention_user(const char *username, time_t now, Reclaimed *reclaimed) {
+    VersionList list = { 0 };
+    CatalogQuery query = { NULL, NULL, NULL, 0, 0, 0 };
+    if (catalog_query(username, &query, collect_version, &list, NULL) != 0) {
+        log_error("無法讀取使用者 %s 的備份目錄", username);
+    } else {
+        apply_versions(&list, now);
+        apply_quota(&list);
+    }
+
+    for (size_t i = 0; i < list.count; i++) {
+        Version *v = &list.items[i];
+        if (!v->keep) {
+            char path[512];
+            struct stat st;
+            snprintf(path, sizeof(path), "%s/%s/%s", BACKUP_ROOT, username, v->file);
+            retention_pace();
+            // 使用者可能已經自己刪除了
+            if (stat(path, &st) == 0 && unlink(path) == 0) {
+                catalog_remove(username, v->file);
+                reclaimed->files++;
+                reclaimed->file_bytes += st.st_size;
+                log_debug("保留策略刪除備份 %s", v->file);
+            }
+        }
+        free(v->file);
+    }
+    free(list.items);
+}
+
+static int chunk_set_init(ChunkSet *set) {
+    set->mask = 4096 - 1;
+    set->count = 0;
+    set->keys = malloc((set->mask + 1) * SHA256_DIGEST_SIZE);
+    set->used = calloc(set->mask + 1, 1);
+    return set->keys && set->used ? 0 : -1;
+}
+
+static void chunk_set_free(ChunkSet *set) {
+    free(set->keys);
+    free(set->used);
+}
+
+static size_t chunk_set_find(const ChunkSet *set, const uint8_t *digest) {
+    uint64_t h;
+    memcpy(&h, digest, sizeof(h));   // SHA-256 本身就是均勻的雜湊
+    size_t i = h & set->mask;
+    while (set->used[i] && memcmp(set->keys[i], digest, SHA256_DIGEST_SIZE) != 0) i = (i + 1) & set->mask;
+    return i;
+}
+
+static int chunk_set_add(ChunkSet *set, const uint8_t *digest) {
+    // 負載不超過一半
+    if ((set->count + 1) * 2 > set->mask + 1) {
+        ChunkSet bigger = { NULL, NULL, set->mask * 2 + 1, 0 };
+        bigger.keys = malloc((bigger.mask + 1) * SHA256_DIGEST_SIZE);
+        bigger.used = calloc(bigger.mask + 1, 1);
+        if (!bigger.keys || !bigger.used) {
+            chunk_set_free(&bigger);
+            return -1;
+        }
+        for (size_t i = 0; i <= set->mask; i++) {
+            if (!set->used[i]) continue;
+            size_t j = chunk_set_find(&bigger, set->keys[i]);
+            memcpy(bigger.keys[j], set->keys[i], SHA256_DIGEST_SIZE);
+            bigger.used[j] = 1;
+        }
+        bigger.count = set->count;
+        chunk_set_free(set);
+        *set = bigger;
+    }
+    size_t i = chunk_set_find(set, digest);
+    if (!set->used[i]) {
+        memcpy(set->keys[i], digest, SHA256_DIGEST_SIZE);
+        set->used[i] = 1;
+        set->count++;
+    }
+    return 0;
+}
+
+static int hex_digest(const char *hex, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    for (int i = 0; i < SHA256_DIGEST_SIZE; i++) {
+        unsigned int byte;
+        if (sscanf(hex + i * 2, "%2x", &byte) != 1) return -1;
+        digest[i] = byte;
+    }
+    return 0;
+}
+
+// 標記一個備份參考的區塊，不是去重格式的備份直接略過
+static int mark_backup(ChunkSet *set, const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) return 0;   // 已經被刪除
+    char magic[STORE_MAGIC_SIZE];
+    int ret = 0;
+    if (fread(magic, 1, sizeof(magic), fp) == sizeof(magic) &&
+        memcmp(magic, STORE_MANIFEST_MAGIC, sizeof(magic)) == 0) {
+        char line[CHUNK_HEX_SIZE + 32];
+        uint8_t digest[SHA256_DIGEST_SIZE];
+        while (ret == 0 && fgets(line, sizeof(line), fp)) {
+            if (strlen(line) < CHUNK_HEX_SIZE || hex_digest(line, digest) != 0 || chunk_set_add(set, digest) != 0) {
+                ret = -1;
+            }
+        }
+        if (ferror(fp)) ret = -1;
+        if (ret < 0) log_error("無法讀取區塊清單 %s", path);
+    }
+    // 前景的取回比較需要 page cache
+    posix_fadvise(fileno(fp), 0, 0, POSIX_FADV_DONTNEED);
+    fclose(fp);
+    return ret;
+}
+
+// 標記所有備份參考的區塊；暫存檔（'.' 開頭）由寫入中的時間保護
+static int mark_chunks(ChunkSet *set) {
+    DIR *root = opendir(BACKUP_ROOT);
+    if (!root) return 0;
+    int ret = 0;
+    struct dirent *user;
+    while (ret == 0 && (user = readdir(root))) {
+        if (user->d_name[0] == '.') continue;
+        char folder[512];
+        snprintf(folder, sizeof(folder), "%s/%s", BACKUP_ROOT, user->d_name);
+        DIR *dir = opendir(folder);
+        if (!dir) continue;
+        struct dirent *entry;
+        while (ret == 0 && (entry = readdir(dir))) {
+            if (entry->d_name[0] == '.') continue;
+            char path[1024];
+            snprintf(path, sizeof(path), "%s/%s", folder, entry->d_name);
+            ret = mark_backup(set, path);
+        }
+        closedir(dir);
+    }
+    closedir(root);
+    return ret;
+}
+
+// 刪除沒有標記、而且在 cutoff 之前就沒有再被用到的區塊（包含當機留下的暫存檔）
+static void sweep_chunks(const ChunkSet *set, time_t cutoff, Reclaimed *reclaimed) {
+    DIR *root = opendir(CHUNK_DIR);
+    if (!root) return;
+    struct dirent *sub;
+    while ((sub = readdir(root))) {
+        if (sub->d_name[0] == '.') continue;
+        char folder[512];
+        snprintf(folder, sizeof(folder), "%s/%s", CHUNK_DIR, sub->d_name);
+        DIR *dir = opendir(folder);
+        if (!dir) continue;
+        struct dirent *entry;
+        while ((entry = readdir(dir))) {
+            if (entry->d_name[0] == '.') continue;
+            uint8_t digest[SHA256_DIGEST_SIZE];
+            if (strlen(entry->d_name) == CHUNK_HEX_SIZE && hex_digest(entry->d_name, digest) == 0 &&
+                set->used[chunk_set_find(set, digest)]) {
+                continue;
+            }
+            // 先以修改時間篩選，限速只算真的要刪除的區塊；刪除時再檢查一次
+            char path[1024];
+            struct stat st;
+            uint64_t size;
+            snprintf(path, sizeof(path), "%s/%s", folder, entry->d_name);
+            if (stat(path, &st) != 0 || !S_ISREG(st.st_mode) || st.st_mtime >= cutoff) continue;
+            retention_pace();
+            if (chunk_remove(path, cutoff, &size) == 1) {
+                reclaimed->chunks++;
+                reclaimed->chunk_bytes += size;
+            }
+        }
+        closedir(dir);
+    }
+    closedir(root);
+}
+
+static void collect_chunks(Reclaimed *reclaimed) {
+    if (access(CHUNK_DIR, F_OK) != 0) return;
+
+    // 在標記之前決定界線：之後才開始的寫入用到的區塊，修改時間都不早於界線
+    time_t start = time(NULL);
+    time_t cutoff = store_oldest_writer();
+    if (cutoff == 0 || cutoff > start) cutoff = start;
+    cutoff -= RETENTION_TIME_SLACK;
+
+    ChunkSet set;
+    if (chunk_set_init(&set) != 0 || mark_chunks(&set) != 0) {
+        log_error("標記區塊失敗，這一輪不回收區塊");
+        chunk_set_free(&set);
+        return;
+    }
+    // 標記開始之前就在讀取的清單可能已經被刪除，等它們讀完
+    for (int waited = 0; ; waited++) {
+        time_t reader = store_oldest_reader();
+        if (reader == 0 || reader > start) break;
+        if (waited == RETENTION_READER_WAIT) {
+            log_info("還有讀取中的去重備份，這一輪不回收區塊");
+            chunk_set_free(&set);
+            return;
+        }
+        sleep(1);
+    }
+    sweep_chunks(&set, cutoff, reclaimed);
+    log_debug("標記了 %zu 個使用中的區塊", set.count);
+    chunk_set_free(&set);
+}
+
+static void retention_pass() {
+    uint64_t start = metrics_now_us();
+    Reclaimed reclaimed = { 0 };
+    time_t now = time(NULL);
+
+    if (policy.keep_last > 0 || policy.keep_daily > 0 || policy.quota > 0) {
+        DIR *root = opendir(BACKUP_ROOT);
+        struct dirent *user;
+        while (root && (user = readdir(root))) {
+            if (user->d_name[0] == '.' || (user->d_type != DT_DIR && user->d_type != DT_UNKNOWN)) continue;
+            retention_user(user->d_name, now, &reclaimed);
+        }
+        if (root) closedir(root);
+    }
+    collect_chunks(&reclaimed);
+
+    metrics_observe_since(&metrics.retention, start);
+    atomic_fetch_add_explicit(&metrics.retention_deleted[0], reclaimed.files, memory_order_relaxed);
+    atomic_fetch_add_explicit(&metrics.retention_bytes[0], reclaimed.file_bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&metrics.retention_deleted[1], reclaimed.chunks, memory_order_relaxed);
+    atomic_fetch_add_explicit(&metrics.retention_bytes[1], reclaimed.chunk_bytes, memory_order_relaxed);
+    log_info("保留策略：刪除 %llu 個備份（%llu bytes），回收 %llu 個區塊（%llu bytes），耗時 %llu ms",
+             (unsigned long long)reclaimed.files, (unsigned long long)reclaimed.file_bytes,
+             (unsigned long long)reclaimed.chunks, (unsigned long long)reclaimed.chunk_bytes,
+             (unsigned long long)(metrics_now_us() - start) / 1000);
+}
+
+static void *retention_worker(void *arg) {
+    (void)arg;
+    // 只使用磁碟空閒的時間
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) != 0) {
+        log_perror("無法設定保留策略執行緒的 I/O 優先權");
+    }
+    while (1) {
+        retention_pass();
+        sleep(policy.interval);
+    }
+    return NULL;
+}
+
+int retention_init(const RetentionPolicy *config) {
+    policy = *config;
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, retention_worker, NULL) != 0) {
+        log_perror("pthread_create 失敗");
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
@@ -0,0 +1,36 @@
+#ifndef RETENTION_H
+#define RETENTION_H
+
+#include <stdint.h>
+
+// 保留策略：背景執行緒定期刪除舊的備份版本，再回收去重格式不再被參考的區塊。
+// 依備份目錄把每個使用者的備份依原始檔名分組，每組依備份檔名中的時間戳排序：
+//   keep_last N：保留最新的 N 個版本
+//   keep_daily D：D 天內每天保留當天最新的一個版本
+//   兩者都設定時符合任一項就保留，都沒設定時不依版本刪除；每個檔案最新的版本與時間戳無法解析的備份一定保留
+//   quota：每個使用者備份原文大小的總和上限，超過時從最舊的版本開始刪除（最新的版本仍然保留）
+// 區塊回收（標記－清除）：讀遍所有去重清單標記參考到的區塊，刪除沒有標記、修改時間早於寫入中最久的
+// 去重備份的區塊（寫入中的清單還沒發布，它用到的區塊都在它開始之後建立或更新過修改時間），
+// 刪除前等標記開始之前就在讀取的去重備份結束（它讀的清單可能已經被刪除）。
+// 刪除以 rate 限速，執行緒使用 idle 的 I/O 優先權，讀過的清單不留在 page cache，不與前景的備份、取回競爭。
+// 每一輪釋放的空間記在日誌與指標（storage_retention_*）。
+#define RETENTION_DEFAULT_INTERVAL 3600   // 每隔多少秒執行一輪
+#define RETENTION_DEFAULT_RATE 200        // 每秒最多刪除的檔案數（備份與區塊）
+#define RETENTION_READER_WAIT 60          // 等待讀取中的去重備份結束的秒數，超過時這一輪不回收區塊
+
+typedef struct {
+    uint32_t keep_last;      // 0 表示不限
+    uint32_t keep_daily;     // 天數，0 表示不限
+    uint64_t quota;          // bytes，0 表示不限
+    int interval;            // 秒
+    uint32_t rate;           // 0 表示不限速
+} RetentionPolicy;
+
+/**
+ * 啟動背景執行緒，啟動後立刻執行第一輪
+ * @param policy 保留策略
+ * @return 0 表示成功，-1 表示失敗
+ */
+int retention_init(const RetentionPolicy *policy);
+
+#endif // RETENTION_H
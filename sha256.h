@@ -0,0 +1,57 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SHA256_DIGEST_SIZE 32
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;         // 已輸入的位元組數
+    uint8_t block[64];
+    size_t block_len;
+} Sha256;
+
+/**
+ * 初始化雜湊狀態
+ * @param ctx 雜湊狀態
+ */
+void sha256_init(Sha256 *ctx);
+
+/**
+ * 輸入資料
+ * @param ctx 雜湊狀態
+ * @param data 資料
+ * @param len 長度
+ */
+void sha256_update(Sha256 *ctx, const uint8_t *data, size_t len);
+
+/**
+ * 取得雜湊值
+ * @param ctx 雜湊狀態，之後需要重新初始化才能再使用
+ * @param digest 輸出 32 bytes
+ */
+void sha256_final(Sha256 *ctx, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+/**
+ * 計算一段資料的雜湊值
+ * @param data 資料
+ * @param len 長度
+ * @param digest 輸出 32 bytes
+ */
+void sha256(const uint8_t *data, size_t len, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+/**
+ * PBKDF2-HMAC-SHA256，輸出一個區塊（32 bytes）
+ * @param password 密碼
+ * @param password_len 密碼長度
+ * @param salt 鹽
+ * @param salt_len 鹽的長度
+ * @param iterations 迭代次數，決定驗證一次的成本
+ * @param digest 輸出 32 bytes
+ */
+void sha256_pbkdf2(const uint8_t *password, size_t password_len, const uint8_t *salt, size_t salt_len,
+                   uint32_t iterations, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+#endif // SHA256_H
@@ -0,0 +1,94 @@
+#include "shard.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "protocol.h"
+
+uint32_t shard_hash(const void *data, size_t len) {
+    const uint8_t *p = data;
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+
+    // FNV-1a 的低位元在相近的字串間變化不大，再混合一次讓環上的位置分散
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+static int compare_point(const void *a, const void *b) {
+    const ShardPoint *x = a, *y = b;
+    if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    return x->node - y->node;
+}
+
+int shard_ring_init(ShardRing *ring, const char *list, int default_port) {
+    memset(ring, 0, sizeof(ShardRing));
+
+    char buffer[1024];
+    if (strlen(list) + 1 > sizeof(buffer)) return -1;
+    strcpy(buffer, list);
+
+    char *saveptr;
+    for (char *item = strtok_r(buffer, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr)) {
+        if (ring->count == SHARD_MAX_NODES) {
+            fprintf(stderr, "儲存節點最多 %d 個\n", SHARD_MAX_NODES);
+            return -1;
+        }
+        ShardNode *node = &ring->nodes[ring->count];
+        node->port = default_port;
+        if (parse_address(item, node->host, sizeof(node->host), &node->port) != 0 || node->host[0] == '\0') {
+            fprintf(stderr, "無效的節點位址: %s\n", item);
+            return -1;
+        }
+        for (int i = 0; i < ring->count; i++) {
+            if (strcmp(ring->nodes[i].host, node->host) == 0 && ring->nodes[i].port == node->port) {
+                fprintf(stderr, "重複的節點位址: %s\n", item);
+                return -1;
+            }
+        }
+        ring->count++;
+    }
+    if (ring->count == 0) return -1;
+
+    ring->point_count = ring->count * SHARD_VNODES;
+    ring->points = malloc(ring->point_count * sizeof(ShardPoint));
+    if (!ring->points) return -1;
+
+    for (int n = 0; n < ring->count; n++) {
+        for (int v = 0; v < SHARD_VNODES; v++) {
+            char key[96];
+            int len = snprintf(key, sizeof(key), "%s:%d#%d", ring->nodes[n].host, ring->nodes[n].port, v);
+            ShardPoint *point = &ring->points[n * SHARD_VNODES + v];
+            point->hash = shard_hash(key, len);
+            point->node = n;
+        }
+    }
+    qsort(ring->points, ring->point_count, sizeof(ShardPoint), compare_point);
+    return 0;
+}
+
+void shard_ring_free(ShardRing *ring) {
+    free(ring->points);
+    ring->points = NULL;
+    ring->point_count = 0;
+}
+
+int shard_lookup(const ShardRing *ring, const char *username) {
+    if (ring->count == 1) return 0;
+
+    // 順時針方向第一個 hash 不小於使用者 hash 的虛擬節點，超過結尾則回到開頭
+    uint32_t h = shard_hash(username, strlen(username));
+    int lo = 0, hi = ring->point_count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (ring->points[mid].hash < h) lo = mid + 1;
+        else hi = mid;
+    }
+    return ring->points[lo == ring->point_count ? 0 : lo].node;
+}
@@ -0,0 +1,63 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SHARD_MAX_NODES 64
+#define SHARD_VNODES 160             // 每個節點在環上的虛擬節點數，越多分布越平均
+
+typedef struct {
+    char host[64];
+    int port;
+} ShardNode;
+
+typedef struct {
+    uint32_t hash;
+    int node;                        // 在 nodes 中的索引
+} ShardPoint;
+
+/**
+ * 儲存節點的一致性雜湊環
+ * 虛擬節點的位置只由節點位址（host:port）決定，與清單順序無關，
+ * 因此增減一個節點時只有約 1/N 的使用者換到別的節點。
+ */
+typedef struct {
+    ShardNode nodes[SHARD_MAX_NODES];
+    int count;
+    ShardPoint *points;              // 依 hash 排序
+    int point_count;
+} ShardRing;
+
+/**
+ * 解析節點清單並建立雜湊環
+ * @param ring 雜湊環
+ * @param list 以逗號分隔的 host:port 清單，省略 port 時使用 default_port
+ * @param default_port 預設 port
+ * @return 0 表示成功，-1 表示清單無效或記憶體不足
+ */
+int shard_ring_init(ShardRing *ring, const char *list, int default_port);
+
+/**
+ * 釋放雜湊環
+ * @param ring 雜湊環
+ */
+void shard_ring_free(ShardRing *ring);
+
+/**
+ * 查詢使用者所在的節點
+ * @param ring 雜湊環
+ * @param username 使用者名稱
+ * @return 節點在 ring->nodes 中的索引
+ */
+int shard_lookup(const ShardRing *ring, const char *username);
+
+/**
+ * 32 位元雜湊（FNV-1a 加上 murmur3 的最終混合）
+ * @param data 資料
+ * @param len 長度
+ * @return 雜湊值
+ */
+uint32_t shard_hash(const void *data, size_t len);
+
+#endif // SHARD_H
@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// 讀取伺服器指標的工具
+//   stats --socket <path>
+// 連到 storage 或 transfer 以 --stats-socket 指定的 Unix socket，把 Prometheus 文字格式的指標輸出到 stdout。
+// 可以搭配 watch 或 node_exporter 的 textfile collector 定期收集。
+
+struct StatsConfig {
+    char socket_path[108];
+};
+
+struct StatsConfig parse_arguments(int argc, char *argv[]) {
+    struct StatsConfig config;
+    memset(&config, 0, sizeof(config));
+
+    static struct option long_options[] = {
+        {"socket", required_argument, 0, 's'},
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+    int option_index = 0;
+    while ((opt = getopt_long(argc, argv, "s:", long_options, &option_index)) != -1) {
+        switch (opt) {
+            case 's':
+                strncpy(config.socket_path, optarg, sizeof(config.socket_path) - 1);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s --socket <path>\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (config.socket_path[0] == '\0') {
+        fprintf(stderr, "Usage: %s --socket <path>\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    return config;
+}
+
+int main(int argc, char *argv[]) {
+    struct StatsConfig config = parse_arguments(argc, argv);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("建立 socket 失敗");
+        return 1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, config.socket_path);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("連接指標 socket 失敗");
+        close(fd);
+        return 1;
+    }
+
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+        if (fwrite(buffer, 1, n, stdout) != (size_t)n) {
+            perror("輸出失敗");
+            close(fd);
+            return 1;
+        }
+    }
+    if (n < 0) perror("讀取指標失敗");
+    close(fd);
+    return n < 0 ? 1 : 0;
+}
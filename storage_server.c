@@ -1,297 +1,1431 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include "protocol.h"
+#include "metrics.h"
+#include "log.h"
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>    
 #include <unistd.h> 
 #include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "lane.h"
+#include "store.h"
+#include "durable.h"
+#include "catalog.h"
+#include "auth.h"
+#include "resume.h"
+#include "retention.h"
+#include "limit.h"
+#include "delta.h"
+#include "compress.h"
+#include "sha256.h"
 
 #define MAIN_PORT 8080
+#define STORAGE_WORKERS_PER_CPU 2  // 預設每個 CPU 的工作執行緒數，處理封包時會阻塞在磁碟與送出上
+#define STORAGE_BATCH_FRAMES 64     // 一條連線連續處理這麼多個封包後讓出工作執行緒
+#define RESTORE_SENDFILE_MIN (64 * 1024)      // 封包至少這麼大才改用 sendfile，每個封包多一次系統呼叫才划算
+#define RESTORE_BATCH (256 * 1024)            // 較小的封包一次讀這麼多，合併成一次 sendmsg
+#define RESTORE_READAHEAD (4 * 1024 * 1024)   // sendfile 時在送出位置之前保持要求預讀的範圍
 
-// 發送資料
-int server_send(int sockfd, uint8_t operation, uint8_t status, const char *username, uint32_t *sequence, const uint8_t *data, uint32_t length) {
-    uint8_t buffer[MAX_DATA_SIZE];
-    int send_len = pack_message(operation, status, username, *sequence, data, length, buffer);
-    if (send_len < 0) {
-        fprintf(stderr, "封裝訊息失敗\n");
-        return -1;
+struct StorageConfig {
+    int port;
+    char stats_socket[108]; // 提供指標的 Unix socket 路徑，空字串表示不提供
+    int workers;            // 處理封包的工作執行緒數
+    int dedup;              // 新備份以內容定義切塊去重儲存
+    int compress;           // 新備份壓縮儲存
+    int durability;         // 備份完成時的同步方式（DURABLE_*）
+    char users[256];        // 使用者清單檔案
+    uint32_t login_cost;    // 密碼雜湊的迭代次數
+    int hash_password;      // 從標準輸入讀密碼，印出使用者清單用的雜湊後結束
+    int resume_timeout;     // 中斷的備份保留多久（秒）等待續傳
+    RetentionPolicy retention; // 舊版本的保留策略；interval 為 0 表示不啟動
+};
+
+struct StorageConfig parse_arguments(int argc, char *argv[]) {
+    struct StorageConfig config;
+    memset(&config, 0, sizeof(config));
+    config.port = MAIN_PORT;
+    config.durability = DURABLE_GROUP;
+    strcpy(config.users, "users.txt");
+    config.login_cost = AUTH_DEFAULT_COST;
+    config.resume_timeout = RESUME_DEFAULT_TIMEOUT;
+    config.retention.rate = RETENTION_DEFAULT_RATE;
+    config.workers = sysconf(_SC_NPROCESSORS_ONLN) * STORAGE_WORKERS_PER_CPU;
+    if (config.workers < 1) config.workers = 1;
+
+    static struct option long_options[] = {
+        {"port", required_argument, 0, 'p'},
+        {"stats-socket", required_argument, 0, 'M'},
+        {"log-level", required_argument, 0, 'L'},
+        {"workers", required_argument, 0, 'w'},
+        {"dedup", no_argument, 0, 'D'},
+        {"compress", no_argument, 0, 'z'},
+        {"durability", required_argument, 0, 'S'},
+        {"users", required_argument, 0, 'u'},
+        {"login-cost", required_argument, 0, 'c'},
+        {"hash-password", no_argument, 0, 'H'},
+        {"resume-timeout", required_argument, 0, 'R'},
+        {"keep-last", required_argument, 0, 'k'},
+        {"keep-daily", required_argument, 0, 'd'},
+        {"quota", required_argument, 0, 'q'},            // 每個使用者，可加上 K、M、G
+        {"retention-interval", required_argument, 0, 'i'},
+        {"retention-rate", required_argument, 0, 'r'},   // 每秒最多刪除的檔案數，0 表示不限速
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+    int option_index = 0;
+    while ((opt = getopt_long(argc, argv, "p:M:L:w:DzS:u:c:HR:k:d:q:i:r:", long_options, &option_index)) != -1) {
+        switch (opt) {
+            case 'p':
+                config.port = atoi(optarg);
+                break;
+            case 'M':
+                strncpy(config.stats_socket, optarg, sizeof(config.stats_socket) - 1);
+                break;
+            case 'D':
+                config.dedup = 1;
+                break;
+            case 'z':
+                config.compress = 1;
+                break;
+            case 'S':
+                config.durability = durable_parse(optarg);
+                if (config.durability < 0) {
+                    fprintf(stderr, "無效的持久化策略: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'u':
+                strncpy(config.users, optarg, sizeof(config.users) - 1);
+                break;
+            case 'c':
+                config.login_cost = strtoul(optarg, NULL, 10);
+                if (config.login_cost < 1) {
+                    fprintf(stderr, "迭代次數至少為 1\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'H':
+                config.hash_password = 1;
+                break;
+            case 'R':
+                config.resume_timeout = atoi(optarg);
+                if (config.resume_timeout < 1) {
+                    fprintf(stderr, "續傳期限至少為 1 秒\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'k':
+                config.retention.keep_last = strtoul(optarg, NULL, 10);
+                break;
+            case 'd':
+                config.retention.keep_daily = strtoul(optarg, NULL, 10);
+                break;
+            case 'q':
+                if (parse_rate(optarg, &config.retention.quota) != 0) {
+                    fprintf(stderr, "無效的配額: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'i':
+                config.retention.interval = atoi(optarg);
+                if (config.retention.interval < 1) {
+                    fprintf(stderr, "保留策略的執行間隔至少為 1 秒\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'r':
+                config.retention.rate = strtoul(optarg, NULL, 10);
+                break;
+            case 'w':
+                config.workers = atoi(optarg);
+                if (config.workers < 1) {
+                    fprintf(stderr, "工作執行緒數至少為 1\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'L':
+                log_level = log_parse_level(optarg);
+                if (log_level < 0) {
+                    fprintf(stderr, "未知的日誌等級: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [--port <port>] [--stats-socket <path>] [--workers <n>] [--dedup | --compress] [--durability <none|backup|group>] [--users <path>] [--login-cost <n>] [--hash-password] [--resume-timeout <sec>] [--keep-last <n>] [--keep-daily <days>] [--quota <bytes>] [--retention-interval <sec>] [--retention-rate <n>] [--log-level <error|warn|info|debug|trace>]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
     }
 
-    int sent_bytes = send(sockfd, buffer, send_len, 0);
-    if (sent_bytes != send_len) {
-        perror("發送數據失敗");
+    // 設定了任何保留策略才啟動；只設定間隔時只回收沒有參考的區塊
+    if (config.retention.interval == 0 &&
+        (config.retention.keep_last || config.retention.keep_daily || config.retention.quota)) {
+        config.retention.interval = RETENTION_DEFAULT_INTERVAL;
+    }
+
+    if (config.dedup && config.compress) {
+        fprintf(stderr, "--dedup 與 --compress 不能同時使用\n");
+        exit(EXIT_FAILURE);
+    }
+
+    return config;
+}
+
+// 發送資料
+int server_send(Connection *conn, uint8_t operation, uint8_t status, const char *username, uint32_t *sequence, const uint8_t *data, uint32_t length, int flags) {
+    if (conn_send(conn, operation, status, username, *sequence, data, length, flags) != 0) {
+        log_error("發送數據失敗");
         return -1;
     }
+    metrics_count_frame(1, operation, length);
 
-    return sent_bytes;
+    return length;
 }
 
-#define RECV_BUF_SIZE 8192
+// 使用者清單已在記憶體中，驗證的時間主要是密碼雜湊的成本（--login-cost）
+int handle_login(const char *username, const uint8_t *password) {
+    uint64_t start = metrics_now_us();
+    int valid = auth_check(username, (const char *)password);
+    metrics_observe_since(&metrics.login, start);
+    return valid;
+}
 
-int server_receive(int sockfd, 
-                   uint8_t *operation, 
-                   uint8_t *status,   // 新增 status 輸出參數
-                   char *username, 
-                   uint32_t *sequence, 
-                   uint8_t data[MAX_DATA_SIZE]) {
-    static uint8_t recv_buffer[RECV_BUF_SIZE];
-    static int buffer_len = 0;
+// 備份檔案的路徑，順便建立使用者的資料夾；file 輸出資料夾中的檔名
+static void backup_path(const char *username, const char *timestamp, char *filename, size_t filename_size,
+                        char *file, size_t file_size) {
+    char folder[128];
+    snprintf(folder, sizeof(folder), "./backup/%s", username);
+    mkdir(folder, 0777);  // 若資料夾不存在則建立
 
-    while (1) {
-        int bytes = recv(sockfd, recv_buffer + buffer_len, RECV_BUF_SIZE - buffer_len, 0);
-        if (bytes < 0) {
-            perror("接收失敗");
-            return -1;
-        } else if (bytes == 0) {
-            return 0; // 連線關閉
-        }
-        buffer_len += bytes;
+    snprintf(file, file_size, "%s_%s.txt", username, timestamp);
+    snprintf(filename, filename_size, "%s/%s", folder, file);
+}
 
-        if (buffer_len < 11) continue;
+StoreWriter *handle_start_backup(const char *username, const char *timestamp, uint64_t size_hint,
+                                 char *file, size_t file_size) {
+    char filename[512];
+    backup_path(username, timestamp, filename, sizeof(filename), file, file_size);
+    return store_writer_open(filename, size_hint);
+}
 
-        uint8_t username_len = recv_buffer[2];
-        int header_len = 3 + username_len + 8;
-        if (buffer_len < header_len) continue;
+// 取回中斷的備份
+StoreWriter *handle_resume_backup(const char *username, const char *timestamp, uint64_t size,
+                                  char *file, size_t file_size) {
+    char filename[512];
+    backup_path(username, timestamp, filename, sizeof(filename), file, file_size);
+    StoreWriter *writer = size > 0 ? resume_take(username, file, size) : NULL;
+    if (writer) log_info("續傳備份 %s，從 %llu bytes 繼續", file, (unsigned long long)store_writer_size(writer));
+    return writer;
+}
 
-        uint32_t data_len;
-        memcpy(&data_len, recv_buffer + 3 + username_len + 4, 4);
-        data_len = ntohl(data_len);
+int handle_write_backup(StoreWriter *writer, const uint8_t *data, int len) {
+    if (!writer) return -1;
+    uint64_t start = metrics_now_us();
+    int ret = store_writer_write(writer, data, len);
+    metrics_observe_since(&metrics.write, start);
+    return ret;
+}
 
-        int total_len = header_len + data_len;
-        if (buffer_len < total_len) continue;
+// 協商了壓縮的 session：數據區是編碼區塊
+int handle_write_backup_encoded(StoreWriter *writer, const uint8_t *data, int len) {
+    if (!writer) return -1;
+    uint64_t start = metrics_now_us();
+    int ret = store_writer_write_encoded(writer, data, len);
+    metrics_observe_since(&metrics.write, start);
+    return ret;
+}
 
-        ProtocolHeader header;
-        if (parse_header(recv_buffer, &header) != 0) {
-            fprintf(stderr, "協議頭部解析失敗\n");
+static int send_list_entry(const CatalogEntry *entry, void *arg) {
+    Connection *conn = ((void **)arg)[0];
+    const char *username = ((void **)arg)[1];
+    uint32_t *seq = ((void **)arg)[2];
+    if (server_send(conn, 4, 0, username, seq, (const uint8_t *)entry->file, strlen(entry->file), SEND_MORE) < 0) return -1;
+    (*seq)++;
+    return 0;
+}
+
+// 舊的列表操作：每個封包一個檔名，由備份目錄提供，不再每次讀資料夾
+int handle_list_backups(Connection *conn, const char *username) {
+    uint32_t seq = 1;
+    CatalogQuery query = { NULL, NULL, NULL, 0, 0, 0 };
+    void *arg[] = { conn, (void *)username, &seq };
+    int ret = catalog_query(username, &query, send_list_entry, arg, NULL);
+    // 沒有任何備份時也送出結束封包，讓同一個 session 可以繼續下一個操作
+    server_send(conn, 4, 1, username, &seq, NULL, 0, 0);
+    return ret;
+}
+
+/**
+ * 查詢備份目錄時累積回覆的封包
+ */
+typedef struct {
+    Connection *conn;
+    const char *username;
+    uint32_t seq;
+    uint8_t *buffer;         // conn->max_payload
+    uint32_t len;
+} CatalogReply;
+
+static int send_catalog_entry(const CatalogEntry *entry, void *arg) {
+    CatalogReply *reply = arg;
+    size_t file_len = strlen(entry->file), path_len = strlen(entry->path);
+    if (path_len > 0xffff) path_len = 0xffff;
+    size_t need = CATALOG_ENTRY_FIXED_SIZE + file_len + path_len;
+    if (need > reply->conn->max_payload) path_len = 0;   // v1 的小封包放不下時省略路徑
+    need = CATALOG_ENTRY_FIXED_SIZE + file_len + path_len;
+    if (need > reply->conn->max_payload) return 0;
+
+    // 這個封包放不下時先送出，一個封包放進越多筆越好
+    if (reply->len + need > reply->conn->max_payload) {
+        if (server_send(reply->conn, OP_LIST_CATALOG, 0, reply->username, &reply->seq, reply->buffer, reply->len, SEND_MORE) < 0) {
             return -1;
         }
+        reply->seq++;
+        reply->len = 0;
+    }
 
-        *operation = header.operation;
-        *status = header.status;            // 解析 status
-        strncpy(username, header.username, header.username_len);
-        username[header.username_len] = '\0';
-        *sequence = header.sequence;
+    uint8_t *p = reply->buffer + reply->len;
+    for (int i = 7; i >= 0; i--) *p++ = entry->size >> (i * 8);
+    *p++ = entry->has_sha256;
+    memcpy(p, entry->sha256, SHA256_DIGEST_SIZE);
+    p += SHA256_DIGEST_SIZE;
+    *p++ = file_len >> 8;
+    *p++ = file_len;
+    memcpy(p, entry->file, file_len);
+    p += file_len;
+    *p++ = path_len >> 8;
+    *p++ = path_len;
+    memcpy(p, entry->path, path_len);
+    reply->len += need;
+    return 0;
+}
 
-        parse_data(recv_buffer + header_len, header.length, data);
+// 從數據區取出以 '\0' 分隔的下一個字串，超過 size 的部分截掉
+static const uint8_t *next_field(const uint8_t *p, const uint8_t *end, char *out, size_t size) {
+    size_t len = 0;
+    while (p < end && *p != '\0') {
+        if (len + 1 < size) out[len++] = *p;
+        p++;
+    }
+    out[len] = '\0';
+    return p < end ? p + 1 : end;
+}
 
-        printf("接收資料 - Operation: %d, Status: %d, Username: %s, Sequence: %u, Data: %s\n",
-               *operation, *status, username, *sequence, data);
+int handle_list_catalog(Connection *conn, const char *username, const Frame *frame) {
+    CatalogReply reply = { conn, username, 1, NULL, 0 };
+    uint32_t total = 0;
+    int ret = -1;
+    if (frame->header.length >= CATALOG_QUERY_HEADER_SIZE && (reply.buffer = malloc(conn->max_payload))) {
+        const uint8_t *p = frame->data, *end = frame->data + frame->header.length;
+        char prefix[256], since[64], until[64];
+        CatalogQuery query = { prefix, since, until, p[8], 0, 0 };
+        for (int i = 0; i < 4; i++) {
+            query.offset = query.offset << 8 | p[i];
+            query.limit = query.limit << 8 | p[4 + i];
+        }
+        p = next_field(p + CATALOG_QUERY_HEADER_SIZE, end, prefix, sizeof(prefix));
+        p = next_field(p, end, since, sizeof(since));
+        next_field(p, end, until, sizeof(until));
 
-        memmove(recv_buffer, recv_buffer + total_len, buffer_len - total_len);
-        buffer_len -= total_len;
+        ret = catalog_query(username, &query, send_catalog_entry, &reply, &total);
+        if (ret == 0 && reply.len > 0) {
+            ret = server_send(conn, OP_LIST_CATALOG, 0, username, &reply.seq, reply.buffer, reply.len, SEND_MORE) < 0 ? -1 : 0;
+            reply.seq++;
+        }
+    }
+    free(reply.buffer);
 
-        return header.length;
+    // 結束封包帶上符合條件的總筆數
+    uint8_t end_data[4] = { total >> 24, total >> 16, total >> 8, total };
+    server_send(conn, OP_LIST_CATALOG, 1, username, &reply.seq, end_data, sizeof(end_data), 0);
+    return ret;
+}
+
+int handle_delete_backup(const char *username, const char *filename) {
+    // 只能刪除使用者自己資料夾中的檔案
+    if (filename[0] == '\0' || filename[0] == '.' || strchr(filename, '/')) {
+        log_error("無效的備份檔名: %s", filename);
+        return -1;
     }
+
+    char filepath[256];
+    snprintf(filepath, sizeof(filepath), "./backup/%s/%s", username, filename);
+    if (unlink(filepath) != 0) {
+        log_perror("無法刪除備份檔案");
+        return -1;
+    }
+    catalog_remove(username, filename);
+    return 0;
 }
 
-int handle_login(const char *username, const uint8_t *password) {
-    FILE *fp = fopen("users.txt", "r");
-    if (!fp) {
-        perror("無法打開使用者清單檔案");
-        return 0;
+// 完整副本以 sendfile 從 page cache 直接送出，數據區不經過使用者空間
+static int send_backup_file(Connection *conn, const char *username, int fd, uint64_t offset, uint64_t end,
+                            uint32_t *seq) {
+    uint64_t advised = offset;
+    while (offset < end) {
+        // 送出的同時讓核心先把後面的內容讀進來
+        while (advised < end && advised < offset + RESTORE_READAHEAD) {
+            posix_fadvise(fd, advised, RESTORE_READAHEAD, POSIX_FADV_WILLNEED);
+            advised += RESTORE_READAHEAD;
+        }
+        uint32_t len = end - offset < conn->max_payload ? end - offset : conn->max_payload;
+        uint64_t start = metrics_now_us();
+        if (conn_sendfile(conn, 5, 0, username, *seq, fd, offset, len) != 0) {
+            // 頭部已經送出，封包無法補齊，只能中斷連線（之後的讀取會結束這個 session）
+            shutdown(conn->fd, SHUT_RDWR);
+            return -1;
+        }
+        metrics_observe_since(&metrics.read, start);
+        metrics_count_frame(1, 5, len);
+        offset += len;
+        (*seq)++;
     }
+    return 0;
+}
 
-    char file_user[100], file_pass[100];
-    int valid = 0;
+// 其他格式讀出原文：封包較小時一次讀好幾個，排入佇列後以一次 sendmsg 送出
+// 從讀取器目前的位置送出最多 limit bytes
+static ssize_t send_backup_frames(Connection *conn, const char *username, StoreReader *reader, uint64_t limit,
+                                  uint32_t *seq) {
+    size_t batch = conn->max_payload;
+    if (batch < RESTORE_BATCH) batch = RESTORE_BATCH / batch * batch;
+    uint8_t *buffer = malloc(batch);
+    if (!buffer) return -1;
 
-    while (fscanf(fp, "%s %s", file_user, file_pass) == 2) {
-        if (strcmp(file_user, username) == 0 && strcmp(file_pass, (const char *)password) == 0) {
-            valid = 1;
+    ssize_t read_len = 0;
+    while (limit > 0) {
+        uint64_t start = metrics_now_us();
+        read_len = store_reader_read(reader, buffer, limit < batch ? limit : batch);
+        metrics_observe_since(&metrics.read, start);
+        if (read_len <= 0) break;
+        limit -= read_len;
+        int failed = 0;
+        for (ssize_t off = 0; off < read_len && !failed; off += conn->max_payload) {
+            uint32_t len = read_len - off < conn->max_payload ? read_len - off : conn->max_payload;
+            failed = conn_queue_frame(conn, 5, 0, username, *seq, buffer + off, len) != 0;
+            metrics_count_frame(1, 5, len);
+            (*seq)++;
+        }
+        // 佇列引用 buffer，讀下一批之前必須送完
+        if (failed || conn_flush(conn, SEND_MORE) != 0) {
+            log_error("發送數據失敗");
+            read_len = -1;
             break;
         }
     }
+    free(buffer);
+    return read_len;
+}
 
-    fclose(fp);
-    return valid;
+// 協商了壓縮時每個封包是一個編碼區塊，長度不固定，逐一送出
+// 從讀取器目前的位置送出最多 limit bytes 的原文：剩下不到一個區塊時讀出原文自己編碼，不會超過範圍
+static ssize_t send_backup_encoded(Connection *conn, const char *username, StoreReader *reader, uint64_t limit,
+                                   uint32_t *seq) {
+    uint8_t *buffer = malloc(conn->max_payload);
+    uint8_t *raw = limit != UINT64_MAX ? malloc(conn->max_payload - COMPRESS_HEADER_SIZE) : NULL;
+    if (!buffer || (limit != UINT64_MAX && !raw)) {
+        free(buffer);
+        free(raw);
+        return -1;
+    }
+
+    ssize_t read_len = 0;
+    while (limit > 0) {
+        uint64_t start = metrics_now_us();
+        if (limit >= COMPRESS_MAX_BLOCK) {
+            read_len = store_reader_read_encoded(reader, buffer, conn->max_payload);
+            int64_t raw_len = read_len > 0 ? compress_raw_size(buffer, read_len) : 0;
+            if (raw_len < 0) read_len = -1;
+            else if (limit != UINT64_MAX) limit -= raw_len;
+        } else {
+            uint32_t want = conn->max_payload - COMPRESS_HEADER_SIZE;
+            if (want > limit) want = limit;
+            read_len = store_reader_read(reader, raw, want);
+            if (read_len > 0) {
+                limit -= read_len;
+                read_len = compress_encode(raw, read_len, buffer);
+            }
+        }
+        metrics_observe_since(&metrics.read, start);
+        if (read_len <= 0) break;
+        server_send(conn, 5, 0, username, seq, buffer, read_len, SEND_MORE);
+        (*seq)++;
+    }
+    free(buffer);
+    free(raw);
+    return read_len;
 }
 
-FILE* handle_start_backup(const char *username, const char *timestamp) {
-    char folder[128], filename[256];
-    snprintf(folder, sizeof(folder), "./backup/%s", username);
-    mkdir(folder, 0777);  // 若資料夾不存在則建立
+int handle_send_backup(Connection *conn, const char *username, const char *filename) {
+    char filepath[256];
+    snprintf(filepath, sizeof(filepath), "./backup/%s/%s", username, filename);
+
+    // 只能取回使用者自己資料夾中的檔案
+    uint32_t seq = 1;
+    int valid = filename[0] != '\0' && filename[0] != '.' && !strchr(filename, '/');
+    StoreReader *reader = valid ? store_reader_open(filepath) : NULL;
+    if (!reader) {
+        if (valid) log_perror("無法打開備份檔案");
+        else log_error("無效的備份檔名: %s", filename);
+        const char *reply = "Restore Failed";
+        server_send(conn, 5, 1, username, &seq, (const uint8_t *)reply, strlen(reply), 0);
+        return -1;
+    }
+
+    // 每個封包塞滿協商後的上限，v2 連線可減少約千倍的封包數
+    ssize_t ret;
+    int fd = store_reader_fd(reader);
+    if (conn->flags & PROTO_CAP_COMPRESS_OK) {
+        ret = send_backup_encoded(conn, username, reader, UINT64_MAX, &seq);
+    } else if (fd >= 0 && conn->max_payload >= RESTORE_SENDFILE_MIN) {
+        struct stat st;
+        ret = fstat(fd, &st) == 0 ? send_backup_file(conn, username, fd, 0, st.st_size, &seq) : -1;
+        if (ret < 0) {
+            store_reader_close(reader);
+            return -1;
+        }
+    } else {
+        ret = send_backup_frames(conn, username, reader, UINT64_MAX, &seq);
+    }
 
-    snprintf(filename, sizeof(filename), "%s/%s_%s.txt", folder, username, timestamp);
-    return fopen(filename, "w");
+    // 讀取中途失敗（例如區塊遺失）時結束封包帶上訊息，客戶端會丟棄已收到的部分
+    const char *reply = ret < 0 ? "Restore Failed" : "";
+    server_send(conn, 5, 1, username, &seq, (const uint8_t *)reply, strlen(reply), 0);
+
+    store_reader_close(reader);
+    return ret < 0 ? -1 : 0;
 }
 
-int handle_write_backup(FILE *fp, const uint8_t *data, int len) {
-    if (!fp) return -1;
-    size_t written = fwrite(data, 1, len, fp);
-    return written == len ? 0 : -1;
+// 依請求送出一個範圍：先送範圍的頭部，之後是 operation 5 的資料封包
+static int send_backup_range(Connection *conn, const char *username, StoreReader *reader, uint64_t offset,
+                             uint64_t len, uint32_t *seq) {
+    uint8_t header[RESTORE_RANGE_SIZE];
+    for (int i = 0; i < 8; i++) {
+        header[i] = offset >> ((7 - i) * 8);
+        header[8 + i] = len >> ((7 - i) * 8);
+    }
+    if (server_send(conn, OP_RESTORE_RANGE, 0, username, seq, header, sizeof(header), SEND_MORE) < 0) return -1;
+    (*seq)++;
+    if (len == 0) return 0;
+
+    int fd = store_reader_fd(reader);
+    if (!(conn->flags & PROTO_CAP_COMPRESS_OK) && fd >= 0 && conn->max_payload >= RESTORE_SENDFILE_MIN) {
+        if (send_backup_file(conn, username, fd, offset, offset + len, seq) != 0) return -2;
+        return 0;
+    }
+    if (store_reader_seek(reader, offset) != 0) return -1;
+    ssize_t ret = conn->flags & PROTO_CAP_COMPRESS_OK ? send_backup_encoded(conn, username, reader, len, seq)
+                                                      : send_backup_frames(conn, username, reader, len, seq);
+    return ret < 0 ? -1 : 0;
 }
 
-int handle_list_backups(int sockfd, const char *username) {
-    char path[128];
-    snprintf(path, sizeof(path), "./backup/%s", username);
+int handle_send_range(Connection *conn, const char *username, const Frame *frame) {
+    char filename[MAX_DATA_SIZE + 1], filepath[MAX_DATA_SIZE + 64];
+    size_t name_len = frame_copy_string(frame, filename, sizeof(filename));
+    snprintf(filepath, sizeof(filepath), "./backup/%s/%s", username, filename);
 
-    DIR *dir = opendir(path);
-    if (!dir) {
-        perror("無法開啟備份資料夾1\n");
+    uint32_t seq = 1;
+    StoreReader *reader = NULL;
+    int64_t size = -1;
+    size_t ranges_len = frame->header.length > name_len ? frame->header.length - name_len - 1 : 0;
+    if (filename[0] != '.' && !strchr(filename, '/') && ranges_len % RESTORE_RANGE_SIZE == 0 &&
+        (reader = store_reader_open(filepath))) {
+        size = store_reader_size(reader);
+    }
+    if (size < 0) {
+        log_error("無法提供備份的範圍: %s", filename);
+        if (reader) store_reader_close(reader);
+        const char *reply = "Restore Failed";
+        server_send(conn, OP_RESTORE_RANGE, 1, username, &seq, (const uint8_t *)reply, strlen(reply), 0);
         return -1;
     }
 
-    struct dirent *entry;
+    // 依請求的順序送出，超出檔案的部分截掉
+    int ret = 0;
+    const uint8_t *p = frame->data + name_len + 1;
+    for (size_t n = 0; n < ranges_len / RESTORE_RANGE_SIZE && ret == 0; n++, p += RESTORE_RANGE_SIZE) {
+        uint64_t offset = 0, len = 0;
+        for (int i = 0; i < 8; i++) {
+            offset = offset << 8 | p[i];
+            len = len << 8 | p[8 + i];
+        }
+        if (offset == RESTORE_SUFFIX) offset = len < (uint64_t)size ? size - len : 0;
+        if (offset > (uint64_t)size) offset = size;
+        if (len > size - offset) len = size - offset;
+        ret = send_backup_range(conn, username, reader, offset, len, &seq);
+    }
+    store_reader_close(reader);
+    if (ret == -2) return -1;   // sendfile 中途失敗，連線已中斷
+
+    // 結束封包是備份的大小；讀取失敗時帶上訊息，客戶端丟棄已收到的部分
+    uint8_t reply[8];
+    for (int i = 0; i < 8; i++) reply[i] = (uint64_t)size >> ((7 - i) * 8);
+    const char *failed = "Restore Failed";
+    if (ret < 0) server_send(conn, OP_RESTORE_RANGE, 1, username, &seq, (const uint8_t *)failed, strlen(failed), 0);
+    else server_send(conn, OP_RESTORE_RANGE, 1, username, &seq, reply, sizeof(reply), 0);
+    return ret;
+}
+
+int handle_send_signatures(Connection *conn, const char *username, const char *filename) {
     uint32_t seq = 1;
+    char base[256], filepath[512];
+    StoreReader *reader = NULL;
+    if (catalog_latest(username, filename, base, sizeof(base)) == 0) {
+        snprintf(filepath, sizeof(filepath), "./backup/%s/%s", username, base);
+        reader = store_reader_open(filepath);
+    }
+    int64_t size = reader ? store_reader_size(reader) : -1;
+    if (size < 0) {
+        // 沒有舊版本，客戶端改為完整上傳
+        if (reader) store_reader_close(reader);
+        server_send(conn, OP_DELTA_SIGNATURE, 1, username, &seq, NULL, 0, 0);
+        return -1;
+    }
+
+    uint32_t block_size = delta_block_size(size);
+    uint32_t sigs_size = conn->max_payload / DELTA_SIG_SIZE * DELTA_SIG_SIZE;
+    uint8_t *block = malloc(block_size);
+    uint8_t *sigs = malloc(sigs_size);
+    if (!block || !sigs) {
+        free(block);
+        free(sigs);
+        store_reader_close(reader);
+        server_send(conn, OP_DELTA_SIGNATURE, 1, username, &seq, NULL, 0, 0);
+        return -1;
+    }
 
-    while ((entry = readdir(dir))) {
-        if (entry->d_type == DT_REG) {
-            server_send(sockfd, 4, 0, username, &seq, (const uint8_t *)entry->d_name, strlen(entry->d_name));
+    // 只送完整的區塊，最後不足一塊的部分由客戶端當成原始資料送出
+    uint32_t filled = 0;
+    ssize_t n;
+    while ((n = store_reader_read(reader, block, block_size)) == (ssize_t)block_size) {
+        uint32_t weak = htonl(delta_weak(block, block_size));
+        memcpy(sigs + filled, &weak, 4);
+        delta_strong(block, block_size, sigs + filled + 4);
+        filled += DELTA_SIG_SIZE;
+        if (filled == sigs_size) {
+            server_send(conn, OP_DELTA_SIGNATURE, 0, username, &seq, sigs, filled, SEND_MORE);
             seq++;
+            filled = 0;
+        }
+    }
+    if (filled > 0) {
+        server_send(conn, OP_DELTA_SIGNATURE, 0, username, &seq, sigs, filled, SEND_MORE);
+        seq++;
+    }
+
+    // 讀取失敗時不提供基準，已送出的簽章由客戶端丟棄
+    uint8_t reply[4 + sizeof(base)];
+    uint32_t reply_len = 0;
+    if (n >= 0) {
+        uint32_t net_block_size = htonl(block_size);
+        memcpy(reply, &net_block_size, 4);
+        reply_len = 4 + strlen(base);
+        memcpy(reply + 4, base, reply_len - 4);
+    }
+    server_send(conn, OP_DELTA_SIGNATURE, 1, username, &seq, reply, reply_len, 0);
+
+    free(block);
+    free(sigs);
+    store_reader_close(reader);
+    return n >= 0 ? 0 : -1;
+}
+
+/**
+ * 進行中的差異備份：從基準備份複製區塊、寫入原始資料，同時計算組回內容的 SHA-256
+ */
+typedef struct {
+    StoreReader *base;
+    uint32_t block_size;
+    uint8_t *block;          // block_size
+    Sha256 sha;
+} DeltaPatch;
+
+// 釋放差異備份狀態；新備份由寫入器寫在暫存檔，驗證通過才發布（新版本可能與基準同名）
+static void delta_patch_free(DeltaPatch *patch) {
+    if (!patch) return;
+    if (patch->base) store_reader_close(patch->base);
+    free(patch->block);
+    free(patch);
+}
+
+/**
+ * 開始差異備份
+ * @param username 使用者名稱
+ * @param frame 第一個封包："檔名|時間戳" '\0' 基準備份檔名 ['\0' 原始路徑]
+ * @param writer 輸出新備份的寫入器
+ * @param file 輸出新備份的檔名
+ * @param source 輸出原始路徑，舊版客戶端沒有送時是空字串
+ * @return 差異備份狀態，失敗時回傳 NULL
+ */
+DeltaPatch *handle_start_delta(const char *username, const Frame *frame, StoreWriter **writer,
+                               char *file, size_t file_size, char *source, size_t source_size) {
+    char timestamp[MAX_DATA_SIZE + 1];
+    size_t name_len = frame_copy_string(frame, timestamp, sizeof(timestamp));
+    if (name_len + 1 >= frame->header.length) return NULL;
+
+    char base[256], filepath[512], path[512];
+    const uint8_t *rest = frame->data + name_len + 1;
+    uint32_t rest_len = frame->header.length - name_len - 1;
+    const uint8_t *nul = memchr(rest, '\0', rest_len);
+    uint32_t base_len = nul ? (uint32_t)(nul - rest) : rest_len;
+    if (base_len >= sizeof(base)) return NULL;
+    memcpy(base, rest, base_len);
+    base[base_len] = '\0';
+    uint32_t source_len = nul ? rest_len - base_len - 1 : 0;
+    if (source_len >= source_size) source_len = source_size - 1;
+    memcpy(source, rest + base_len + 1, source_len);
+    source[source_len] = '\0';
+    if (base[0] == '.' || strchr(base, '/')) {
+        log_error("無效的基準備份檔名: %s", base);
+        return NULL;
+    }
+
+    DeltaPatch *patch = calloc(1, sizeof(DeltaPatch));
+    if (!patch) return NULL;
+    snprintf(filepath, sizeof(filepath), "./backup/%s/%s", username, base);
+    patch->base = store_reader_open(filepath);
+    int64_t size = patch->base ? store_reader_size(patch->base) : -1;
+    if (size < 0) {
+        log_error("無法打開基準備份: %s", base);
+        delta_patch_free(patch);
+        return NULL;
+    }
+    // 區塊大小由基準的大小決定，與送出簽章時相同
+    patch->block_size = delta_block_size(size);
+    patch->block = malloc(patch->block_size);
+    backup_path(username, timestamp, path, sizeof(path), file, file_size);
+    *writer = patch->block ? store_writer_open(path, 0) : NULL;
+    if (!*writer) {
+        delta_patch_free(patch);
+        return NULL;
+    }
+    sha256_init(&patch->sha);
+    return patch;
+}
+
+/**
+ * 套用一個封包中的指令
+ * @return 0 表示成功，-1 表示指令格式錯誤、基準不足或寫入失敗
+ */
+int handle_write_delta(DeltaPatch *patch, StoreWriter *writer, const uint8_t *data, uint32_t len) {
+    while (len > 0) {
+        uint32_t a, b;
+        if (data[0] == DELTA_COPY && len >= DELTA_COPY_SIZE) {
+            memcpy(&a, data + 1, 4);
+            memcpy(&b, data + 5, 4);
+            uint32_t index = ntohl(a), count = ntohl(b);
+            data += DELTA_COPY_SIZE;
+            len -= DELTA_COPY_SIZE;
+
+            // 連續的複製在基準中也是連續的，seek 只在目前位置前後移動
+            if (store_reader_seek(patch->base, (uint64_t)index * patch->block_size) != 0) {
+                log_error("基準備份中沒有要複製的區塊");
+                return -1;
+            }
+            for (; count > 0; count--) {
+                uint64_t start = metrics_now_us();
+                ssize_t n = store_reader_read(patch->base, patch->block, patch->block_size);
+                metrics_observe_since(&metrics.read, start);
+                if (n != (ssize_t)patch->block_size) {
+                    log_error("基準備份中沒有要複製的區塊");
+                    return -1;
+                }
+                sha256_update(&patch->sha, patch->block, n);
+                if (handle_write_backup(writer, patch->block, n) != 0) return -1;
+            }
+        } else if (data[0] == DELTA_LITERAL && len >= DELTA_LITERAL_HEADER_SIZE) {
+            memcpy(&a, data + 1, 4);
+            uint32_t literal_len = ntohl(a);
+            data += DELTA_LITERAL_HEADER_SIZE;
+            len -= DELTA_LITERAL_HEADER_SIZE;
+            if (literal_len > len) {
+                log_error("差異指令格式錯誤");
+                return -1;
+            }
+            sha256_update(&patch->sha, data, literal_len);
+            if (handle_write_backup(writer, data, literal_len) != 0) return -1;
+            data += literal_len;
+            len -= literal_len;
+        } else {
+            log_error("差異指令格式錯誤");
+            return -1;
         }
     }
-    server_send(sockfd, 4, 1, username, &seq, NULL, 0);
-    closedir(dir);
     return 0;
 }
 
-int handle_send_backup(int sockfd, const char *username, const char *filename) {
-    char filepath[256];
-    snprintf(filepath, sizeof(filepath), "./backup/%s/%s", username, filename);
+/**
+ * 一條連線的狀態，固定由接受它的工作執行緒處理
+ */
+typedef struct StorageSession {
+    Connection conn;
+    int persistent;         // 收過 OP_SESSION_RESET：連線由轉發伺服器重用，session 結束不關閉
+    int multi_op;           // 登入時協商了 PROTO_CAP_MULTI_OP：status 1 只結束目前的操作
+    StoreWriter *backup;    // 用於備份寫入階段
+    int backup_failed;      // 多操作 session 中目前的備份已失敗，結束時回覆 "Backup Failed"
+    int in_delta;           // 差異備份進行中（收過第一個 OP_DELTA_BACKUP），即使開始時就失敗
+    DeltaPatch *delta;
+    char backup_file[256];  // 目前備份的檔名與客戶端的原始路徑，發布後記錄到備份目錄
+    char backup_source[256];
+    uint64_t backup_size;   // 客戶端宣告的檔案大小，0 表示不知道（不能續傳）
+    char login_user[MAX_USERNAME_LENGTH + 1];  // 這條連線上登入成功的使用者
+    int in_session;         // 已登入且尚未結束，計入 active_sessions
+    Lane *lane;             // 持有或等待中的使用者通道
+    LaneWaiter waiter;
+    Frame pending;          // 等待通道或同步時保留的封包，數據區仍在接收緩衝區中
+    int has_pending;
+    struct Worker *worker;  // 負責這條連線的工作執行緒
+    int queued;             // 在待處理佇列中、等待通道或等待同步，可讀事件交給那時再處理
+    int committing;         // 備份交給提交執行緒同步中（group commit），結果在 commit_result
+    int commit_result;
+    uint64_t commit_start;  // 開始提交的時間，等待同步的時間記在 commit
+    StoreSummary commit_summary;
+    struct StorageSession *next;  // 工作執行緒的待處理佇列
+} StorageSession;
 
-    FILE *fp = fopen(filepath, "r");
-    if (!fp) {
-        perror("無法打開備份檔案");
-        return -1;
+static void session_committed(void *arg, int result);
+
+// 解析 operation 2 與 OP_RESUME_BACKUP 的數據區："檔名|時間戳" ['\0' 檔案大小(8) 原始路徑]
+static void session_parse_backup(StorageSession *s, const Frame *frame, char *timestamp, size_t timestamp_size) {
+    size_t name_len = frame_copy_string(frame, timestamp, timestamp_size);
+    s->backup_size = 0;
+    s->backup_source[0] = '\0';
+    if (frame->header.length >= name_len + 1 + 8) {
+        for (int i = 0; i < 8; i++) s->backup_size = s->backup_size << 8 | frame->data[name_len + 1 + i];
+        size_t source_len = frame->header.length - (name_len + 1 + 8);
+        if (source_len >= sizeof(s->backup_source)) source_len = sizeof(s->backup_source) - 1;
+        memcpy(s->backup_source, frame->data + name_len + 1 + 8, source_len);
+        s->backup_source[source_len] = '\0';
     }
+}
 
-    uint8_t buffer[MAX_DATA_SIZE];
-    size_t read_len;
-    uint32_t seq = 1;
+// 連線或 session 在備份途中結束：多操作 session 中知道大小的備份暫存起來等待續傳，其餘的放棄
+static void session_drop_backup(StorageSession *s, const char *username) {
+    if (!s->backup) return;
+    if (s->multi_op && !s->in_delta && !s->backup_failed && s->backup_size > 0 && username[0] != '\0') {
+        resume_park(username, s->backup_file, s->backup_size, s->backup);
+    } else {
+        store_writer_abort(s->backup);
+    }
+    s->backup = NULL;
+}
 
-    while ((read_len = fread(buffer, 1, MAX_DATA_SIZE, fp)) > 0) {
-        server_send(sockfd, 5, 0, username, &seq, buffer, read_len);
-        seq++;
+/**
+ * 備份結束：資料落地並發布之後記錄到備份目錄，失敗時設定 backup_failed；失敗過的備份不發布
+ * group commit 不在工作執行緒等待同步：回傳 1，連線保留封包暫停處理，
+ * 同步完成後由 session_committed 排回工作執行緒，再處理同一個封包時取得結果
+ * @return 0 表示已有結果，1 表示等待同步
+ */
+static int session_finish_backup(StorageSession *s, const char *username) {
+    if (!s->committing) {
+        StoreWriter *writer = s->backup;
+        s->backup = NULL;
+        if (s->backup_failed || !writer) {
+            if (writer) store_writer_abort(writer);
+            s->backup_failed = 1;
+            return 0;
+        }
+        s->commit_start = metrics_now_us();
+        int ret = store_writer_close(writer, &s->commit_summary, session_committed, s);
+        if (ret == 1) {
+            s->committing = 1;
+            return 1;
+        }
+        s->commit_result = ret;
     }
 
-    server_send(sockfd, 5, 1, username, &seq, NULL, 0);
-    
-    fclose(fp);
+    s->committing = 0;
+    metrics_observe_since(&metrics.commit, s->commit_start);
+    if (s->commit_result != 0) {
+        s->backup_failed = 1;
+    } else if (catalog_add(username, s->backup_file, s->backup_source, s->commit_summary.size,
+                           s->commit_summary.sha256) != 0) {
+        log_warn("無法記錄到備份目錄: %s", s->backup_file);
+    }
     return 0;
 }
 
-void transfer_data(int src_socket, char *username) {
-    uint8_t operation = 0;
-    uint8_t status = 0;
-    int keep_receiving = 1;
-    FILE *backup_fp = NULL; // 用於備份寫入階段
+/**
+ * 處理一個封包
+ * @return 1 表示繼續，0 表示關閉連線，2 表示等待備份同步（之後再處理同一個封包）
+ */
+static int session_handle_frame(StorageSession *s, Frame *frame) {
+    Connection *conn = &s->conn;
+    char username[MAX_USERNAME_LENGTH + 1];
+    int keep = 1;
 
-    while (keep_receiving) {
-        uint8_t data[MAX_DATA_SIZE] = {0};
-        uint32_t sequence = 0;
+    uint8_t operation = frame->header.operation;
+    uint8_t status = frame->header.status;
+    uint32_t sequence = frame->header.sequence;
+    strcpy(username, frame->header.username);
 
-        int length = server_receive(src_socket, &operation, &status, username, &sequence, data);
-        if (length < 0) {
-            perror("接收資料失敗");
+    int session_end = status == 1 && !s->multi_op;
+    switch (operation) {
+        case 1: { // 登入驗證
+            char password[MAX_DATA_SIZE + 1];
+            frame_copy_string(frame, password, sizeof(password));
+            if (handle_login(username, (const uint8_t *)password)) {
+                // 登入成功，若對端附上 v2 能力宣告則在回覆中帶回協商結果
+                uint8_t reply[32] = "Login OK";
+                int reply_len = strlen((char *)reply);
+                ProtocolCaps caps;
+                if (proto_caps_parse(frame->data, frame->header.length, &caps)) {
+                    // 只帶回本端接受的旗標
+                    s->multi_op = (caps.flags & PROTO_CAP_MULTI_OP) != 0;
+                    caps.flags = (s->multi_op ? PROTO_CAP_MULTI_OP_OK : 0) |
+                                 (caps.flags & PROTO_CAP_COMPRESS ? PROTO_CAP_COMPRESS_OK : 0) |
+                                 PROTO_CAP_CATALOG | PROTO_CAP_RESUME | PROTO_CAP_RANGE;
+                    reply_len = proto_caps_append(reply, reply_len, sizeof(reply), &caps);
+                }
+                server_send(conn, 1, 0, username, &sequence, reply, reply_len, 0);
+                conn_apply_caps(conn, &caps);
+                strcpy(s->login_user, username);
+                if (!s->in_session) metrics_session(1);
+                s->in_session = 1;
+            } else {
+                // 登入失敗
+                uint8_t dummy_data[] = "Login Failed";
+                server_send(conn, 1, 0, username, &sequence, dummy_data, strlen((char*)dummy_data), 0);
+                log_warn("登入失敗，結束連線");
+                session_end = 1;
+            }
             break;
-        } else if (length == 0) {
-            printf("連線已關閉\n");
+        }
+
+        case 2: { // 創建並開啟備份檔案（data 是 timestamp，之後可以附上 '\0' 檔案大小(8) 原始路徑）
+            char timestamp[MAX_DATA_SIZE + 1];
+            session_parse_backup(s, frame, timestamp, sizeof(timestamp));
+            if (s->backup) store_writer_abort(s->backup);
+            s->backup = handle_start_backup(username, timestamp, s->backup_size, s->backup_file, sizeof(s->backup_file));
+            s->backup_failed = 0;
+            if (!s->backup) {
+                log_error("無法創建備份檔案");
+                // 多操作 session 等到這個備份結束時回覆失敗，後面的操作照常進行
+                if (s->multi_op) s->backup_failed = 1;
+                else keep = 0;
+            }
             break;
         }
 
-        printf("接收到數據 - Operation: %d, Status: %d, Sequence: %u, Data: %s\n",
-               operation, status, sequence, data);
-
-        switch (operation) {
-            case 1: // 登入驗證
-                if (handle_login(username, data)) {
-                    // 登入成功
-                    uint8_t dummy_data[] = "Login OK";
-                    server_send(src_socket, 1, 0, username, &sequence, dummy_data, strlen((char*)dummy_data));
-                } else {
-                    // 登入失敗
-                    uint8_t dummy_data[] = "Login Failed";
-                    server_send(src_socket, 1, 0, username, &sequence, dummy_data, strlen((char*)dummy_data));
-                    fprintf(stderr, "登入失敗，結束連線\n");
-                    keep_receiving = 0;
+        case 3: // 寫入備份資料（同步完成後再處理的封包已經寫過）
+            if (!s->committing && !s->backup_failed && frame->header.length > 0 &&
+                (conn->flags & PROTO_CAP_COMPRESS_OK ? handle_write_backup_encoded(s->backup, frame->data, frame->header.length)
+                             : handle_write_backup(s->backup, frame->data, frame->header.length)) != 0) {
+                log_error("備份資料寫入失敗");
+                if (s->multi_op) s->backup_failed = 1;
+                else keep = 0;
+            }
+            if (status == 1) {
+                // 備份結束：資料落地並發布之後才回覆結果
+                if (session_finish_backup(s, username)) return 2;
+                if (s->multi_op) {
+                    const char *reply = s->backup_failed ? "Backup Failed" : "Backup OK";
+                    server_send(conn, 3, 1, username, &sequence, (const uint8_t *)reply, strlen(reply), 0);
+                } else if (s->backup_failed) {
+                    log_error("備份沒有完成");
                 }
-                break;
+                s->backup_failed = 0;
+            }
+            break;
+
+        case 4: // 回傳該使用者的所有檔案名稱
+            handle_list_backups(conn, username);
+            break;
 
-            case 2: // 創建並開啟備份檔案（data 是 timestamp）
-                if (backup_fp) fclose(backup_fp);
-                backup_fp = handle_start_backup(username, (char *)data);
-                if (!backup_fp) {
-                    fprintf(stderr, "無法創建備份檔案\n");
-                    keep_receiving = 0;
+        case OP_RESUME_BACKUP: { // 續傳中斷的備份，沒有可續傳的備份時與 operation 2 相同
+            char timestamp[MAX_DATA_SIZE + 1];
+            session_parse_backup(s, frame, timestamp, sizeof(timestamp));
+            if (s->backup) store_writer_abort(s->backup);
+            s->backup = NULL;
+            s->backup_failed = 0;
+
+            uint64_t offset = 0, stored_size;
+            uint8_t reply_status = 0;
+            if (s->login_user[0] == '\0' || strcmp(s->login_user, username) != 0 || !s->multi_op) {
+                log_warn("未登入或不是多操作 session，拒絕續傳");
+                s->backup_failed = 1;
+            } else {
+                s->backup = handle_resume_backup(username, timestamp, s->backup_size, s->backup_file,
+                                                 sizeof(s->backup_file));
+                if (catalog_find(username, s->backup_file, &stored_size) == 0 && stored_size == s->backup_size) {
+                    // 中斷前已經完成（或由另一條連線完成），只是客戶端沒收到結果；暫存的備份已經用不到
+                    if (s->backup) store_writer_abort(s->backup);
+                    s->backup = NULL;
+                    reply_status = 1;
+                } else if (s->backup) {
+                    offset = store_writer_size(s->backup);
+                } else if (!(s->backup = handle_start_backup(username, timestamp, s->backup_size, s->backup_file,
+                                                             sizeof(s->backup_file)))) {
+                    log_error("無法創建備份檔案");
+                    s->backup_failed = 1;
                 }
-                break;
+            }
 
-            case 3: // 寫入備份資料
-                if (handle_write_backup(backup_fp, data, length) != 0) {
-                    fprintf(stderr, "備份資料寫入失敗\n");
-                    keep_receiving = 0;
+            uint8_t reply[8];
+            for (int i = 0; i < 8; i++) reply[i] = offset >> ((7 - i) * 8);
+            server_send(conn, OP_RESUME_BACKUP, reply_status, username, &sequence, reply, sizeof(reply), 0);
+            break;
+        }
+
+        case OP_RESTORE_RANGE: // 傳送備份的部分範圍
+            handle_send_range(conn, username, frame);
+            break;
+
+        case OP_LIST_CATALOG: // 依條件查詢備份目錄
+            handle_list_catalog(conn, username, frame);
+            break;
+
+        case 5: { // 傳送指定備份檔案內容（data 是檔名）
+            char filename[MAX_DATA_SIZE + 1];
+            frame_copy_string(frame, filename, sizeof(filename));
+            handle_send_backup(conn, username, filename);
+            break;
+        }
+
+        case OP_DELTA_SIGNATURE: { // 傳送檔案最新備份的區塊簽章（data 是檔名）
+            char filename[MAX_DATA_SIZE + 1];
+            frame_copy_string(frame, filename, sizeof(filename));
+            handle_send_signatures(conn, username, filename);
+            break;
+        }
+
+        case OP_DELTA_BACKUP: // 差異備份：第一個封包指定新備份與基準，之後是指令
+            if (status == 0 && !s->in_delta) {
+                if (s->backup) store_writer_abort(s->backup);
+                s->backup = NULL;
+                s->backup_failed = 0;
+                s->in_delta = 1;
+                s->delta = handle_start_delta(username, frame, &s->backup, s->backup_file, sizeof(s->backup_file),
+                                              s->backup_source, sizeof(s->backup_source));
+                if (!s->delta) {
+                    log_error("無法開始差異備份");
+                    s->backup_failed = 1;
                 }
-                break;
+            } else if (status == 0) {
+                if (!s->backup_failed && handle_write_delta(s->delta, s->backup, frame->data, frame->header.length) != 0) {
+                    s->backup_failed = 1;
+                }
+            } else {
+                // 備份結束：組回的內容必須與客戶端的新檔案相同（同步完成後再處理時已經比對過）
+                if (!s->committing && !s->delta) {
+                    s->backup_failed = 1;
+                } else if (!s->committing) {
+                    uint8_t digest[SHA256_DIGEST_SIZE];
+                    sha256_final(&s->delta->sha, digest);
+                    if (!s->backup_failed &&
+                        (frame->header.length != SHA256_DIGEST_SIZE || memcmp(frame->data, digest, SHA256_DIGEST_SIZE) != 0)) {
+                        log_error("差異備份組回的內容與客戶端的檔案不符");
+                        s->backup_failed = 1;
+                    }
+                }
+                if (session_finish_backup(s, username)) return 2;
+                delta_patch_free(s->delta);
+                s->delta = NULL;
+                s->in_delta = 0;
+                const char *reply = s->backup_failed ? "Backup Failed" : "Backup OK";
+                server_send(conn, OP_DELTA_BACKUP, 1, username, &sequence, (const uint8_t *)reply, strlen(reply), 0);
+                s->backup_failed = 0;
+            }
+            break;
 
-            case 4: // 回傳該使用者的所有檔案名稱
-                handle_list_backups(src_socket, username);
-                break;
+        case OP_DELETE_BACKUP: { // 刪除指定備份檔案（data 是檔名）
+            char filename[MAX_DATA_SIZE + 1];
+            frame_copy_string(frame, filename, sizeof(filename));
+            const char *reply = "Delete Failed";
+            if (s->login_user[0] == '\0' || strcmp(s->login_user, username) != 0) {
+                log_warn("未登入，拒絕刪除");
+            } else if (handle_delete_backup(username, filename) == 0) {
+                reply = "Delete OK";
+            }
+            server_send(conn, OP_DELETE_BACKUP, 0, username, &sequence, (const uint8_t *)reply, strlen(reply), 0);
+            break;
+        }
 
-            case 5: // 傳送指定備份檔案內容（data 是檔名）
-                handle_send_backup(src_socket, username, (char *)data);
-                break;
+        case OP_SESSION_RESET: { // 轉發伺服器結束 session，連線保留給下一個 session
+            // 客戶端的連線在備份途中中斷時，轉發伺服器也是送來 RESET
+            session_drop_backup(s, s->login_user);
+            delta_patch_free(s->delta);
+            s->delta = NULL;
+            s->in_delta = 0;
+            s->login_user[0] = '\0';
+            if (s->in_session) metrics_session(-1);
+            s->in_session = 0;
+            s->multi_op = 0;
+            s->backup_failed = 0;
+            ProtocolCaps caps = { PROTOCOL_VERSION_1, 0, MAX_DATA_SIZE };
+            conn_apply_caps(conn, &caps);
+            s->persistent = 1;
+            server_send(conn, OP_SESSION_RESET, 0, "", &sequence, NULL, 0, 0);
+            break;
+        }
 
-            default:
-                fprintf(stderr, "未知的操作類型: %d\n", operation);
-                break;
+        default:
+            log_warn("未知的操作類型: %d", operation);
+            break;
+    }
+
+    if (session_end && s->in_session) {
+        metrics_session(-1);
+        s->in_session = 0;
+    }
+    if (session_end && s->persistent) {
+        // 重用中的連線不關閉，改為通知轉發伺服器 session 結束
+        server_send(conn, OP_SESSION_RESET, 1, "", &sequence, NULL, 0, 0);
+    } else if (session_end) {
+        keep = 0;
+    }
+
+    return keep;
+}
+
+/**
+ * 工作執行緒：自己的 epoll 與 SO_REUSEPORT 監聽 socket，連線接受後都由同一個執行緒處理，
+ * 可讀事件不需要在執行緒之間轉交
+ */
+typedef struct Worker {
+    int epfd;
+    int listen_fd;
+    int wake_fd;                 // 其他執行緒轉來連線時通知
+    pthread_mutex_t ready_lock;
+    StorageSession *ready_head;  // 接收緩衝區中已有封包的連線（取得通道或讓出執行緒），不會再有可讀事件
+    StorageSession *ready_tail;
+} Worker;
+
+static LaneTable lanes;
+static Worker *workers;
+
+static void worker_push(Worker *w, StorageSession *s, int wake) {
+    pthread_mutex_lock(&w->ready_lock);
+    s->next = NULL;
+    if (w->ready_tail) w->ready_tail->next = s;
+    else w->ready_head = s;
+    w->ready_tail = s;
+    pthread_mutex_unlock(&w->ready_lock);
+
+    uint64_t one = 1;
+    if (wake && write(w->wake_fd, &one, sizeof(one)) < 0) log_perror("通知工作執行緒失敗");
+}
+
+static StorageSession *worker_pop(Worker *w) {
+    pthread_mutex_lock(&w->ready_lock);
+    StorageSession *s = w->ready_head;
+    if (s) {
+        w->ready_head = s->next;
+        if (!w->ready_head) w->ready_tail = NULL;
+    }
+    pthread_mutex_unlock(&w->ready_lock);
+    return s;
+}
+
+// 通道轉給等待中的連線：交回它的工作執行緒處理保留的封包（可能在持有通道表的鎖時由其他執行緒呼叫）
+static void session_wake(LaneWaiter *waiter) {
+    StorageSession *s = waiter->arg;
+    worker_push(s->worker, s, 1);
+}
+
+// 備份同步完成：交回它的工作執行緒再處理保留的封包（由提交執行緒呼叫）
+static void session_committed(void *arg, int result) {
+    StorageSession *s = arg;
+    s->commit_result = result;
+    worker_push(s->worker, s, 1);
+}
+
+static void session_unlock(StorageSession *s) {
+    if (!s->lane) return;
+    lane_release(&lanes, s->lane);
+    s->lane = NULL;
+}
+
+static void session_close(StorageSession *s) {
+    // 先暫存中斷的備份再釋放通道，同一個使用者的下一個 session 才找得到
+    session_drop_backup(s, s->login_user);
+    session_unlock(s);
+    delta_patch_free(s->delta);
+    if (s->in_session) metrics_session(-1);
+    conn_close(&s->conn);
+    free(s);
+    log_info("連線已關閉");
+}
+
+/**
+ * 處理一條連線已收到的封包，直到沒有完整封包可讀、需要等待使用者通道或處理了一批
+ * 同一個使用者的封包依通道的排隊順序處理；不同使用者的連線由不同的工作執行緒並行處理。
+ */
+static void session_run(StorageSession *s) {
+    int handled = 0;
+    while (handled < STORAGE_BATCH_FRAMES) {
+        Frame frame;
+        if (s->has_pending) {
+            // 剛取得通道或備份同步完成
+            frame = s->pending;
+            s->has_pending = 0;
+        } else {
+            int ret = frame_decoder_next(&s->conn.decoder, &frame);
+            if (ret < 0) {
+                log_error("協議解析失敗");
+                session_close(s);
+                return;
+            }
+            if (ret == 0) {
+                ssize_t bytes = frame_decoder_fill(&s->conn.decoder, s->conn.fd);
+                if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    // 已讀完 socket 中的資料（邊緣觸發），等待下一次可讀事件時不佔用通道
+                    session_unlock(s);
+                    return;
+                }
+                if (bytes <= 0) {
+                    if (bytes < 0) log_perror("接收資料失敗");
+                    else log_debug("對端關閉連線");
+                    session_close(s);
+                    return;
+                }
+                continue;
+            }
+            metrics_count_frame(0, frame.header.operation, frame.header.length);
+            log_frame("接收資料", &frame.header, frame.data);
+
+            // 控制封包（使用者名稱為空）不需要通道
+            const char *username = frame.header.username;
+            if (s->lane && strcmp(s->lane->username, username) != 0) session_unlock(s);
+            if (!s->lane && username[0] != '\0') {
+                s->lane = lane_acquire(&lanes, username, &s->waiter);
+                if (!s->lane) {
+                    log_error("配置使用者通道失敗");
+                    session_close(s);
+                    return;
+                }
+                if (!s->waiter.granted) {
+                    // 前面還有同一個使用者的操作，取得通道後由 session_wake 排回待處理佇列
+                    s->pending = frame;
+                    s->has_pending = 1;
+                    s->queued = 1;
+                    return;
+                }
+            }
         }
 
-        if (status == 1) {
-            keep_receiving = 0;
+        int keep = session_handle_frame(s, &frame);
+        if (!keep) {
+            session_close(s);
+            return;
         }
+        if (keep == 2) {
+            // 等待提交執行緒同步時保留封包與通道，同一個使用者的下一個操作等這個備份有結果
+            s->pending = frame;
+            s->has_pending = 1;
+            s->queued = 1;
+            return;
+        }
+        handled++;
+    }
 
+    // 處理了一批：讓出通道並排到待處理佇列後面，先處理這個執行緒的其他事件
+    session_unlock(s);
+    s->queued = 1;
+    worker_push(s->worker, s, 0);
+}
+
+static void accept_connection(Worker *w) {
+    int client_socket = accept4(w->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client_socket == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) log_perror("接受連線失敗");
+        return;
     }
 
-    if (backup_fp) fclose(backup_fp);
+    StorageSession *s = calloc(1, sizeof(StorageSession));
+    if (!s || conn_init(&s->conn, client_socket) != 0) {
+        log_error("配置連線緩衝區失敗");
+        free(s);
+        close(client_socket);
+        return;
+    }
+    s->waiter.wake = session_wake;
+    s->waiter.arg = s;
+    s->worker = w;
 
+    // 每條連線只由一個執行緒處理，以邊緣觸發註冊一次，之後不需要再 epoll_ctl
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | EPOLLET, .data.ptr = s };
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, client_socket, &ev) != 0) {
+        log_perror("epoll_ctl 失敗");
+        conn_close(&s->conn);
+        free(s);
+    }
 }
 
-int main() {
-    int server_socket, client_socket;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_len = sizeof(client_addr);
+static void *worker_thread(void *arg) {
+    Worker *w = arg;
+    struct epoll_event events[64];
+    while (1) {
+        // 待處理佇列有連線時只取已發生的事件，避免一條忙碌的連線讓其他連線等不到處理
+        StorageSession *s = worker_pop(w);
+        int n = epoll_wait(w->epfd, events, 64, s ? 0 : -1);
+        if (n < 0) {
+            if (errno != EINTR) log_perror("epoll_wait 失敗");
+            n = 0;
+        }
 
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket == -1) {
-        perror("建立 socket 失敗");
-        exit(EXIT_FAILURE);
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == &w->listen_fd) {
+                accept_connection(w);
+            } else if (events[i].data.ptr == &w->wake_fd) {
+                uint64_t count;
+                if (read(w->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) log_perror("讀取 eventfd 失敗");
+            } else {
+                StorageSession *ready = events[i].data.ptr;
+                if (!ready->queued) session_run(ready);
+            }
+        }
+
+        // 取出的連線放在這一批事件之後處理：事件中可能也有它，而它可能在 session_run 中被釋放
+        if (s) {
+            s->queued = 0;
+            session_run(s);
+        }
+    }
+    return NULL;
+}
+
+// 每個工作執行緒一個監聽 socket，由 SO_REUSEPORT 讓核心分配連線
+static int open_listener(int port) {
+    int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1) {
+        log_perror("建立 socket 失敗");
+        return -1;
     }
 
+    int opt = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) == -1) {
+        log_perror("設定 SO_REUSEPORT 失敗");
+        close(listen_fd);
+        return -1;
+    }
+
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(MAIN_PORT);
+    server_addr.sin_port = htons(port);
 
-    if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
-        perror("綁定 socket 失敗");
-        close(server_socket);
-        exit(EXIT_FAILURE);
+    if (bind(listen_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
+        log_perror("綁定 socket 失敗");
+        close(listen_fd);
+        return -1;
     }
 
-    if (listen(server_socket, 10) == -1) {
-        perror("監聽 socket 失敗");
-        close(server_socket);
-        exit(EXIT_FAILURE);
+    if (listen(listen_fd, SOMAXCONN) == -1) {
+        log_perror("監聽 socket 失敗");
+        close(listen_fd);
+        return -1;
     }
+    return listen_fd;
+}
 
-    printf("伺服器正在監聽 port %d\n", MAIN_PORT);
+static int worker_init(Worker *w, int port) {
+    memset(w, 0, sizeof(Worker));
+    pthread_mutex_init(&w->ready_lock, NULL);
+    w->listen_fd = open_listener(port);
+    if (w->listen_fd < 0) return -1;
 
-    while (1) {
-        client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &client_len);
-        if (client_socket == -1) {
-            perror("接受連線失敗");
-            continue;
+    w->epfd = epoll_create1(EPOLL_CLOEXEC);
+    w->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event listen_ev = { .events = EPOLLIN, .data.ptr = &w->listen_fd };
+    struct epoll_event wake_ev = { .events = EPOLLIN, .data.ptr = &w->wake_fd };
+    if (w->epfd < 0 || w->wake_fd < 0 ||
+        epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->listen_fd, &listen_ev) != 0 ||
+        epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->wake_fd, &wake_ev) != 0) {
+        log_perror("建立 epoll 失敗");
+        return -1;
+    }
+    return 0;
+}
+
+// 刪除上次中斷時留下的暫存檔（以 '.' 開頭、.tmp 結尾），這些備份沒有回覆成功過
+static void remove_partial_backups() {
+    DIR *root = opendir("./backup");
+    if (!root) return;
+    struct dirent *user;
+    while ((user = readdir(root)) != NULL) {
+        if (user->d_name[0] == '.') continue;
+        char folder[300];
+        snprintf(folder, sizeof(folder), "./backup/%s", user->d_name);
+        DIR *dir = opendir(folder);
+        if (!dir) continue;
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            size_t len = strlen(entry->d_name);
+            if (entry->d_name[0] != '.' || len < 5 || strcmp(entry->d_name + len - 4, ".tmp") != 0) continue;
+            char path[600];
+            snprintf(path, sizeof(path), "%s/%s", folder, entry->d_name);
+            if (unlink(path) == 0) log_info("刪除沒有完成的備份: %s", path);
         }
+        closedir(dir);
+    }
+    closedir(root);
+}
 
-        char username[32];
-        transfer_data(client_socket, username);
+int main(int argc, char *argv[]) {
+    struct StorageConfig config = parse_arguments(argc, argv);
+    signal(SIGPIPE, SIG_IGN);
+    if (config.hash_password) {
+        // 產生使用者清單的一行：echo 'pass' | storage --hash-password
+        char password[256], hash[256];
+        if (!fgets(password, sizeof(password), stdin)) exit(EXIT_FAILURE);
+        password[strcspn(password, "\r\n")] = '\0';
+        if (auth_hash_password(password, config.login_cost, hash, sizeof(hash)) != 0) exit(EXIT_FAILURE);
+        printf("%s\n", hash);
+        return 0;
+    }
+    if (log_start() != 0) exit(EXIT_FAILURE);
 
-        close(client_socket);
-        printf("連線已關閉\n");
+    store_init(config.dedup ? STORE_DEDUP : config.compress ? STORE_COMPRESSED : STORE_FULL);
+    if (durable_init(config.durability) != 0) exit(EXIT_FAILURE);
+    remove_partial_backups();
+    if (auth_init(config.users, config.login_cost) != 0) exit(EXIT_FAILURE);
+    if (resume_init(config.resume_timeout) != 0) exit(EXIT_FAILURE);
+    if (config.retention.interval > 0 && retention_init(&config.retention) != 0) exit(EXIT_FAILURE);
+    if (lane_table_init(&lanes) != 0) {
+        log_error("初始化使用者通道失敗");
+        exit(EXIT_FAILURE);
+    }
+    workers = calloc(config.workers, sizeof(Worker));
+    if (!workers) {
+        log_error("配置工作執行緒失敗");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < config.workers; i++) {
+        if (worker_init(&workers[i], config.port) != 0) exit(EXIT_FAILURE);
     }
 
-    close(server_socket);
-    return 0;
+    static const char *durability_names[] = { "none", "backup", "group" };
+    log_info("伺服器正在監聽 port %d，%d 個工作執行緒，持久化策略 %s", config.port, config.workers,
+             durability_names[config.durability]);
+
+    metrics.server = METRICS_STORAGE;
+    if (config.stats_socket[0] != '\0' && metrics_serve(config.stats_socket) != 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    // 主執行緒是第 0 個工作執行緒
+    for (int i = 1; i < config.workers; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, worker_thread, &workers[i]) != 0) {
+            log_perror("pthread_create 失敗");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(tid);
+    }
+    worker_thread(&workers[0]);
+    return EXIT_FAILURE;
 }
@@ -0,0 +1,632 @@
+#include "store.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include "chunk.h"
+#include "compress.h"
+#include "durable.h"
+#include "sha256.h"
+#include "log.h"
+
+/**
+ * 使用中的去重備份，依開始使用的時間排在串列中（見 store_oldest_writer）
+ */
+typedef struct StoreUse {
+    time_t opened;
+    struct StoreUse *prev;
+    struct StoreUse *next;
+} StoreUse;
+
+typedef struct {
+    StoreUse *head;          // 最久的在前面
+    StoreUse *tail;
+} UseList;
+
+struct StoreWriter {
+    DurableFile *out;        // 完整副本、區塊清單或壓縮區塊
+    int format;
+    int failed;
+    Chunker chunker;
+    uint64_t chunks;         // 去重格式的統計，關閉時輸出
+    uint64_t new_chunks;
+    uint64_t bytes;          // 原文長度
+    uint64_t new_bytes;      // 去重格式新寫入的區塊、壓縮格式寫入檔案的長度
+    uint8_t *raw;            // 壓縮格式累積中的原文；解開編碼區塊時的暫存，COMPRESS_MAX_BLOCK
+    uint32_t raw_len;
+    uint8_t *encoded;        // 壓縮格式編碼中的區塊，STORE_COMPRESS_BLOCK + COMPRESS_HEADER_SIZE
+    Sha256 sha;              // 原文的雜湊與長度，關閉時交給呼叫端記錄到目錄
+    uint64_t size;
+    StoreUse use;            // 去重格式：寫入中的備份
+    DurableDone callback;    // 不等待同步的關閉：發布之後回報結果
+    void *callback_arg;
+};
+
+struct StoreReader {
+    FILE *fp;
+    int format;
+    uint64_t pos;            // 去重與壓縮格式：已讀到的原文位置
+    FILE *chunk;             // 去重格式：目前讀取中的區塊
+    size_t chunk_left;       // 目前區塊還沒讀到的長度
+    uint8_t *block;          // 壓縮格式：目前解開的區塊，COMPRESS_MAX_BLOCK
+    uint32_t block_len;
+    uint32_t block_off;      // 區塊中已讀到的位置
+    uint8_t *encoded;        // 壓縮格式讀取的編碼區塊；其他格式編碼前的原文暫存
+    uint32_t encoded_cap;
+    StoreUse use;            // 去重格式：讀取中的清單
+};
+
+static int store_format = STORE_FULL;
+
+// 寫入中（包含暫存等待續傳）與讀取中的去重備份，回收區塊時用來判斷哪些區塊可能還在使用：
+// 寫入中的清單還沒發布，讀取中的清單可能已經被刪除，兩者參考的區塊都不在標記中
+static pthread_mutex_t use_lock = PTHREAD_MUTEX_INITIALIZER;
+static UseList writers_in_use;
+static UseList readers_in_use;
+
+static void use_add(UseList *list, StoreUse *use) {
+    pthread_mutex_lock(&use_lock);
+    use->opened = time(NULL);
+    use->prev = list->tail;
+    use->next = NULL;
+    if (list->tail) list->tail->next = use;
+    else list->head = use;
+    list->tail = use;
+    pthread_mutex_unlock(&use_lock);
+}
+
+static void use_remove(UseList *list, StoreUse *use) {
+    pthread_mutex_lock(&use_lock);
+    if (use->prev) use->prev->next = use->next;
+    else list->head = use->next;
+    if (use->next) use->next->prev = use->prev;
+    else list->tail = use->prev;
+    pthread_mutex_unlock(&use_lock);
+}
+
+static time_t use_oldest(UseList *list) {
+    pthread_mutex_lock(&use_lock);
+    time_t opened = list->head ? list->head->opened : 0;
+    pthread_mutex_unlock(&use_lock);
+    return opened;
+}
+
+time_t store_oldest_writer() {
+    return use_oldest(&writers_in_use);
+}
+
+time_t store_oldest_reader() {
+    return use_oldest(&readers_in_use);
+}
+
+void store_init(int format) {
+    store_format = format;
+}
+
+StoreWriter *store_writer_open(const char *path, uint64_t size_hint) {
+    StoreWriter *writer = calloc(1, sizeof(StoreWriter));
+    if (!writer) return NULL;
+    writer->format = store_format;
+    sha256_init(&writer->sha);
+    if (writer->format == STORE_DEDUP && chunker_init(&writer->chunker) != 0) {
+        free(writer);
+        return NULL;
+    }
+    if (writer->format == STORE_COMPRESSED) {
+        writer->raw = malloc(COMPRESS_MAX_BLOCK);
+        writer->encoded = malloc(STORE_COMPRESS_BLOCK + COMPRESS_HEADER_SIZE);
+    }
+
+    // 只有完整副本的大小事先知道，其他格式寫入的長度與原文無關
+    const char *magic = writer->format == STORE_DEDUP ? STORE_MANIFEST_MAGIC :
+                        writer->format == STORE_COMPRESSED ? STORE_COMPRESSED_MAGIC : NULL;
+    writer->out = durable_open(path, writer->format == STORE_FULL ? size_hint : 0);
+    if (!writer->out || (writer->format == STORE_COMPRESSED && (!writer->raw || !writer->encoded)) ||
+        (magic && durable_write(writer->out, magic, STORE_MAGIC_SIZE) != 0)) {
+        if (writer->out) durable_abort(writer->out);
+        if (writer->format == STORE_DEDUP) chunker_free(&writer->chunker);
+        free(writer->raw);
+        free(writer->encoded);
+        free(writer);
+        return NULL;
+    }
+    if (writer->format == STORE_DEDUP) use_add(&writers_in_use, &writer->use);
+    return writer;
+}
+
+// 儲存切好的區塊並加到清單
+static int store_emit_chunk(StoreWriter *writer) {
+    Chunker *chunker = &writer->chunker;
+    if (chunker->len == 0) return 0;
+
+    char hex[CHUNK_HEX_SIZE + 1];
+    int ret = chunk_store_put(chunker->buf, chunker->len, hex);
+    if (ret < 0) return -1;
+    writer->chunks++;
+    writer->bytes += chunker->len;
+    if (ret == 1) {
+        writer->new_chunks++;
+        writer->new_bytes += chunker->len;
+    }
+    char line[CHUNK_HEX_SIZE + 32];
+    int line_len = snprintf(line, sizeof(line), "%s %zu\n", hex, chunker->len);
+    if (durable_write(writer->out, line, line_len) != 0) return -1;
+    chunker_reset(chunker);
+    return 0;
+}
+
+// 壓縮格式的一筆紀錄：長度(4) 編碼區塊
+static int store_put_record(StoreWriter *writer, const uint8_t *block, uint32_t len) {
+    uint32_t net_len = htonl(len);
+    if (durable_write(writer->out, &net_len, 4) != 0 || durable_write(writer->out, block, len) != 0) return -1;
+    writer->new_bytes += 4 + len;
+    return 0;
+}
+
+// 壓縮並寫出累積的原文
+static int store_flush_raw(StoreWriter *writer) {
+    if (writer->raw_len == 0) return 0;
+    uint32_t len = compress_encode(writer->raw, writer->raw_len, writer->encoded);
+    writer->raw_len = 0;
+    return store_put_record(writer, writer->encoded, len);
+}
+
+int store_writer_write(StoreWriter *writer, const uint8_t *data, size_t len) {
+    if (writer->failed) return -1;
+    sha256_update(&writer->sha, data, len);
+    writer->size += len;
+    if (writer->format == STORE_FULL) {
+        if (durable_write(writer->out, data, len) != 0) writer->failed = 1;
+        return writer->failed ? -1 : 0;
+    }
+
+    if (writer->format == STORE_COMPRESSED) {
+        // 累積到 STORE_COMPRESS_BLOCK 才壓縮，小封包也有足夠的內容可以比對
+        writer->bytes += len;
+        while (len > 0) {
+            size_t n = STORE_COMPRESS_BLOCK - writer->raw_len;
+            if (n > len) n = len;
+            memcpy(writer->raw + writer->raw_len, data, n);
+            writer->raw_len += n;
+            data += n;
+            len -= n;
+            if (writer->raw_len == STORE_COMPRESS_BLOCK && store_flush_raw(writer) != 0) {
+                writer->failed = 1;
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    while (len > 0) {
+        int cut;
+        size_t used = chunker_feed(&writer->chunker, data, len, &cut);
+        data += used;
+        len -= used;
+        if (cut && store_emit_chunk(writer) != 0) {
+            writer->failed = 1;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int store_writer_write_encoded(StoreWriter *writer, const uint8_t *block, uint32_t len) {
+    if (writer->failed) return -1;
+    if (!writer->raw && !(writer->raw = malloc(COMPRESS_MAX_BLOCK))) {
+        writer->failed = 1;
+        return -1;
+    }
+
+    // 先寫出累積的原文，維持資料的順序；解開一次確認內容完整，之後取回時才不會失敗
+    if (writer->format == STORE_COMPRESSED && store_flush_raw(writer) != 0) {
+        writer->failed = 1;
+        return -1;
+    }
+    int64_t raw_len = compress_decode(block, len, writer->raw, COMPRESS_MAX_BLOCK);
+    if (raw_len < 0) {
+        log_error("壓縮資料格式錯誤");
+        writer->failed = 1;
+        return -1;
+    }
+    if (writer->format != STORE_COMPRESSED) return store_writer_write(writer, writer->raw, raw_len);
+
+    sha256_update(&writer->sha, writer->raw, raw_len);
+    writer->size += raw_len;
+    writer->bytes += raw_len;
+    if (store_put_record(writer, block, len) != 0) {
+        writer->failed = 1;
+        return -1;
+    }
+    return 0;
+}
+
+// 清單發布之後才離開串列
+static void store_writer_free(StoreWriter *writer) {
+    if (writer->format == STORE_DEDUP) use_remove(&writers_in_use, &writer->use);
+    free(writer->raw);
+    free(writer->encoded);
+    free(writer);
+}
+
+// 提交執行緒完成同步
+static void store_writer_committed(void *arg, int result) {
+    StoreWriter *writer = arg;
+    DurableDone callback = writer->callback;
+    void *callback_arg = writer->callback_arg;
+    store_writer_free(writer);
+    callback(callback_arg, result);
+}
+
+int store_writer_close(StoreWriter *writer, StoreSummary *summary, DurableDone callback, void *arg) {
+    int failed = writer->failed;
+    if (summary) {
+        summary->size = writer->size;
+        sha256_final(&writer->sha, summary->sha256);
+    }
+    if (writer->format == STORE_DEDUP) {
+        if (!failed && store_emit_chunk(writer) != 0) failed = 1;
+        // 清單參考的新區塊要與清單一起落地
+        if (writer->new_chunks > 0) durable_sync_fs(writer->out);
+        if (!failed) {
+            log_info("去重備份：%llu 個區塊，新增 %llu 個，寫入 %llu / %llu bytes",
+                     (unsigned long long)writer->chunks, (unsigned long long)writer->new_chunks,
+                     (unsigned long long)writer->new_bytes, (unsigned long long)writer->bytes);
+        }
+        chunker_free(&writer->chunker);
+    } else if (writer->format == STORE_COMPRESSED) {
+        if (!failed && store_flush_raw(writer) != 0) failed = 1;
+        if (!failed) {
+            log_info("壓縮備份：%llu bytes 存成 %llu bytes",
+                     (unsigned long long)writer->bytes, (unsigned long long)writer->new_bytes);
+        }
+    }
+    if (failed) {
+        durable_abort(writer->out);
+    } else {
+        writer->callback = callback;
+        writer->callback_arg = arg;
+        int ret = durable_commit(writer->out, callback ? store_writer_committed : NULL, writer);
+        if (ret == 1) return 1;
+        failed = ret != 0;
+    }
+    store_writer_free(writer);
+    return failed ? -1 : 0;
+}
+
+uint64_t store_writer_size(const StoreWriter *writer) {
+    return writer->size;
+}
+
+void store_writer_abort(StoreWriter *writer) {
+    if (writer->format == STORE_DEDUP) {
+        chunker_free(&writer->chunker);
+        use_remove(&writers_in_use, &writer->use);
+    }
+    durable_abort(writer->out);
+    free(writer->raw);
+    free(writer->encoded);
+    free(writer);
+}
+
+StoreReader *store_reader_open(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) return NULL;
+
+    StoreReader *reader = calloc(1, sizeof(StoreReader));
+    if (!reader) {
+        fclose(fp);
+        return NULL;
+    }
+    reader->fp = fp;
+    // 取回是從頭讀到尾，讓核心加大預讀
+    posix_fadvise(fileno(fp), 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    char magic[STORE_MAGIC_SIZE];
+    int has_magic = fread(magic, 1, sizeof(magic), fp) == sizeof(magic);
+    if (has_magic && memcmp(magic, STORE_MANIFEST_MAGIC, sizeof(magic)) == 0) {
+        reader->format = STORE_DEDUP;
+        use_add(&readers_in_use, &reader->use);
+    } else if (has_magic && memcmp(magic, STORE_COMPRESSED_MAGIC, sizeof(magic)) == 0) {
+        reader->format = STORE_COMPRESSED;
+        reader->block = malloc(COMPRESS_MAX_BLOCK);
+        reader->encoded_cap = COMPRESS_MAX_BLOCK + COMPRESS_HEADER_SIZE;
+        reader->encoded = malloc(reader->encoded_cap);
+        if (!reader->block || !reader->encoded) {
+            store_reader_close(reader);
+            return NULL;
+        }
+    } else {
+        rewind(fp);
+    }
+    return reader;
+}
+
+// 讀取清單的下一行，回傳 0 表示清單結束
+static int store_next_entry(StoreReader *reader, char hex[CHUNK_HEX_SIZE + 1], size_t *len) {
+    int fields = fscanf(reader->fp, "%64s %zu\n", hex, len);
+    if (fields == EOF) return 0;
+    if (fields != 2 || strlen(hex) != CHUNK_HEX_SIZE) {
+        log_error("區塊清單格式錯誤");
+        return -1;
+    }
+    return 1;
+}
+
+static int store_open_chunk(StoreReader *reader, const char *hex, size_t len) {
+    char path[256];
+    chunk_path(hex, path, sizeof(path));
+    reader->chunk = fopen(path, "r");
+    if (!reader->chunk) {
+        log_perror("無法打開區塊檔案");
+        return -1;
+    }
+    posix_fadvise(fileno(reader->chunk), 0, 0, POSIX_FADV_SEQUENTIAL);
+    reader->chunk_left = len;
+    return 0;
+}
+
+// 開啟清單中的下一個區塊，回傳 0 表示清單結束
+static int store_next_chunk(StoreReader *reader) {
+    char hex[CHUNK_HEX_SIZE + 1];
+    size_t len;
+    int ret = store_next_entry(reader, hex, &len);
+    if (ret <= 0) return ret;
+    return store_open_chunk(reader, hex, len) == 0 ? 1 : -1;
+}
+
+// 讀取壓縮格式下一筆紀錄的長度與編碼區塊的頭部（放進 encoded 開頭），回傳 0 表示結束
+static int store_next_record(StoreReader *reader, uint32_t *len, uint32_t *raw_len) {
+    uint8_t header[4 + COMPRESS_HEADER_SIZE];
+    size_t n = fread(header, 1, sizeof(header), reader->fp);
+    if (n == 0 && !ferror(reader->fp)) return 0;
+    uint32_t net_len;
+    memcpy(&net_len, header, 4);
+    *len = ntohl(net_len);
+    int64_t size = n == sizeof(header) && *len <= reader->encoded_cap ? compress_raw_size(header + 4, *len) : -1;
+    if (size < 0) {
+        log_error("壓縮備份格式錯誤");
+        return -1;
+    }
+    memcpy(reader->encoded, header + 4, COMPRESS_HEADER_SIZE);
+    *raw_len = size;
+    return 1;
+}
+
+// 讀完 store_next_record 之後的編碼區塊並解開
+static int store_load_record(StoreReader *reader, uint32_t len) {
+    size_t rest = len - COMPRESS_HEADER_SIZE;
+    if (fread(reader->encoded + COMPRESS_HEADER_SIZE, 1, rest, reader->fp) != rest) {
+        log_error("壓縮備份長度不符");
+        return -1;
+    }
+    int64_t n = compress_decode(reader->encoded, len, reader->block, COMPRESS_MAX_BLOCK);
+    if (n < 0) {
+        log_error("壓縮備份格式錯誤");
+        return -1;
+    }
+    reader->block_len = n;
+    reader->block_off = 0;
+    return 0;
+}
+
+ssize_t store_reader_read(StoreReader *reader, uint8_t *buffer, size_t size) {
+    if (reader->format == STORE_FULL) {
+        size_t n = fread(buffer, 1, size, reader->fp);
+        return n == 0 && ferror(reader->fp) ? -1 : (ssize_t)n;
+    }
+
+    // 跨區塊填滿 buffer，每個封包仍然塞滿協商後的上限
+    size_t filled = 0;
+    while (filled < size) {
+        size_t n;
+        if (reader->format == STORE_COMPRESSED) {
+            if (reader->block_off == reader->block_len) {
+                uint32_t len, raw_len;
+                int ret = store_next_record(reader, &len, &raw_len);
+                if (ret < 0 || (ret > 0 && store_load_record(reader, len) != 0)) return -1;
+                if (ret == 0) break;
+            }
+            n = size - filled;
+            if (n > reader->block_len - reader->block_off) n = reader->block_len - reader->block_off;
+            memcpy(buffer + filled, reader->block + reader->block_off, n);
+            reader->block_off += n;
+        } else {
+            if (!reader->chunk) {
+                int ret = store_next_chunk(reader);
+                if (ret < 0) return -1;
+                if (ret == 0) break;
+            }
+
+            n = size - filled;
+            if (n > reader->chunk_left) n = reader->chunk_left;
+            if (fread(buffer + filled, 1, n, reader->chunk) != n) {
+                log_error("區塊檔案長度不符");
+                return -1;
+            }
+            reader->chunk_left -= n;
+            if (reader->chunk_left == 0) {
+                fclose(reader->chunk);
+                reader->chunk = NULL;
+            }
+        }
+        filled += n;
+        reader->pos += n;
+    }
+    return filled;
+}
+
+ssize_t store_reader_read_encoded(StoreReader *reader, uint8_t *buffer, size_t size) {
+    if (size <= COMPRESS_HEADER_SIZE) return -1;
+    size_t want = size - COMPRESS_HEADER_SIZE;
+    if (want > COMPRESS_MAX_BLOCK) want = COMPRESS_MAX_BLOCK;
+
+    if (reader->format == STORE_COMPRESSED) {
+        // 在紀錄的邊界上：放得下就把儲存的編碼區塊原樣交出，不解壓縮再壓縮
+        if (reader->block_off == reader->block_len) {
+            uint32_t len, raw_len;
+            int ret = store_next_record(reader, &len, &raw_len);
+            if (ret <= 0) return ret;
+            if (len <= size) {
+                memcpy(buffer, reader->encoded, COMPRESS_HEADER_SIZE);
+                size_t rest = len - COMPRESS_HEADER_SIZE;
+                if (fread(buffer + COMPRESS_HEADER_SIZE, 1, rest, reader->fp) != rest) {
+                    log_error("壓縮備份長度不符");
+                    return -1;
+                }
+                // 目前沒有解開的區塊，之後的 seek 不會把這段當成上一個區塊
+                reader->pos += raw_len;
+                reader->block_len = reader->block_off = 0;
+                return len;
+            }
+            if (store_load_record(reader, len) != 0) return -1;
+        }
+
+        // 放不下（或從區塊中間開始）：只把這個區塊剩下的部分重新編碼，之後又回到紀錄的邊界
+        if (want > reader->block_len - reader->block_off) want = reader->block_len - reader->block_off;
+        const uint8_t *raw = reader->block + reader->block_off;
+        reader->block_off += want;
+        reader->pos += want;
+        return compress_encode(raw, want, buffer);
+    }
+
+    // 其他格式讀出原文再壓縮
+    if (reader->encoded_cap < want) {
+        free(reader->encoded);
+        reader->encoded = malloc(want);
+        reader->encoded_cap = reader->encoded ? want : 0;
+        if (!reader->encoded) return -1;
+    }
+    ssize_t n = store_reader_read(reader, reader->encoded, want);
+    if (n <= 0) return n;
+    return compress_encode(reader->encoded, n, buffer);
+}
+
+// 去重格式的 seek：往後時只讀清單，不開啟中間的區塊
+static int store_manifest_seek(StoreReader *reader, uint64_t offset) {
+    // 目前區塊之內直接在區塊檔案中移動
+    if (reader->chunk && offset >= reader->pos && offset - reader->pos < reader->chunk_left) {
+        if (fseeko(reader->chunk, offset - reader->pos, SEEK_CUR) != 0) return -1;
+        reader->chunk_left -= offset - reader->pos;
+        reader->pos = offset;
+        return 0;
+    }
+
+    // 往回時從清單開頭重新找，往後時從目前位置繼續找
+    uint64_t base = reader->pos + reader->chunk_left;
+    if (reader->chunk) {
+        fclose(reader->chunk);
+        reader->chunk = NULL;
+        reader->chunk_left = 0;
+    }
+    if (offset < reader->pos) {
+        if (fseeko(reader->fp, STORE_MAGIC_SIZE, SEEK_SET) != 0) return -1;
+        base = 0;
+    }
+
+    char hex[CHUNK_HEX_SIZE + 1];
+    size_t len;
+    while (1) {
+        int ret = store_next_entry(reader, hex, &len);
+        if (ret < 0) return -1;
+        if (ret == 0) {
+            // 超過結尾：之後的讀取回傳 0
+            reader->pos = base;
+            return offset == base ? 0 : -1;
+        }
+        if (offset < base + len) break;
+        base += len;
+    }
+
+    if (store_open_chunk(reader, hex, len) != 0 || fseeko(reader->chunk, offset - base, SEEK_SET) != 0) return -1;
+    reader->chunk_left = base + len - offset;
+    reader->pos = offset;
+    return 0;
+}
+
+// 壓縮格式的 seek：往後時只讀每筆紀錄的頭部，只解開目標所在的區塊
+static int store_blocks_seek(StoreReader *reader, uint64_t offset) {
+    uint64_t start = reader->pos - reader->block_off;
+    if (offset >= start && offset - start < reader->block_len) {
+        reader->block_off = offset - start;
+        reader->pos = offset;
+        return 0;
+    }
+
+    uint64_t base = start + reader->block_len;
+    reader->block_len = reader->block_off = 0;
+    if (offset < start) {
+        if (fseeko(reader->fp, STORE_MAGIC_SIZE, SEEK_SET) != 0) return -1;
+        base = 0;
+    }
+
+    while (1) {
+        uint32_t len, raw_len;
+        int ret = store_next_record(reader, &len, &raw_len);
+        if (ret < 0) return -1;
+        if (ret == 0) {
+            reader->pos = base;
+            return offset == base ? 0 : -1;
+        }
+        if (offset < base + raw_len) {
+            if (store_load_record(reader, len) != 0) return -1;
+            reader->block_off = offset - base;
+            reader->pos = offset;
+            return 0;
+        }
+        if (fseeko(reader->fp, len - COMPRESS_HEADER_SIZE, SEEK_CUR) != 0) return -1;
+        base += raw_len;
+    }
+}
+
+int store_reader_seek(StoreReader *reader, uint64_t offset) {
+    if (reader->format == STORE_DEDUP) return store_manifest_seek(reader, offset);
+    if (reader->format == STORE_COMPRESSED) return store_blocks_seek(reader, offset);
+    return fseeko(reader->fp, offset, SEEK_SET);
+}
+
+int64_t store_reader_size(StoreReader *reader) {
+    if (reader->format == STORE_FULL) {
+        struct stat st;
+        return fstat(fileno(reader->fp), &st) == 0 ? st.st_size : -1;
+    }
+
+    // 加總清單或每筆紀錄的原文長度，之後回到原本讀取的位置
+    off_t saved = ftello(reader->fp);
+    if (saved < 0 || fseeko(reader->fp, STORE_MAGIC_SIZE, SEEK_SET) != 0) return -1;
+    int64_t size = 0;
+    int ret;
+    if (reader->format == STORE_DEDUP) {
+        char hex[CHUNK_HEX_SIZE + 1];
+        size_t len;
+        while ((ret = store_next_entry(reader, hex, &len)) > 0) size += len;
+    } else {
+        uint32_t len, raw_len;
+        while ((ret = store_next_record(reader, &len, &raw_len)) > 0) {
+            size += raw_len;
+            if (fseeko(reader->fp, len - COMPRESS_HEADER_SIZE, SEEK_CUR) != 0) {
+                ret = -1;
+                break;
+            }
+        }
+    }
+    if (fseeko(reader->fp, saved, SEEK_SET) != 0 || ret < 0) return -1;
+    return size;
+}
+
+int store_reader_fd(StoreReader *reader) {
+    return reader->format == STORE_FULL ? fileno(reader->fp) : -1;
+}
+
+void store_reader_close(StoreReader *reader) {
+    if (reader->format == STORE_DEDUP) use_remove(&readers_in_use, &reader->use);
+    if (reader->chunk) fclose(reader->chunk);
+    fclose(reader->fp);
+    free(reader->block);
+    free(reader->encoded);
+    free(reader);
+}
@@ -0,0 +1,164 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "sha256.h"
+#include "durable.h"
+
+// 備份檔案的三種格式：
+//   完整副本：檔案內容就是備份的資料
+//   去重格式：檔案是區塊清單，以 STORE_MANIFEST_MAGIC 開頭，之後每行 "<SHA-256> <長度>"，
+//             區塊內容存放在 CHUNK_DIR，相同內容的區塊在所有備份之間只存一份
+//   壓縮格式：以 STORE_COMPRESSED_MAGIC 開頭，之後每筆紀錄是 長度(4) 編碼區塊（見 compress.h），
+//             客戶端送來的編碼區塊原樣存放，取回時可以原樣送出
+// 讀取時依檔案開頭判斷格式，切換格式後舊的備份仍然可以取回。
+#define STORE_MANIFEST_MAGIC "\0CHUNKS1\n"
+#define STORE_COMPRESSED_MAGIC "\0LZBLKS1\n"
+#define STORE_MAGIC_SIZE 9
+
+#define STORE_FULL       0
+#define STORE_DEDUP      1
+#define STORE_COMPRESSED 2
+
+#define STORE_COMPRESS_BLOCK (128 * 1024)   // 壓縮格式中由伺服器壓縮的原文，每累積這麼多壓縮一次
+
+typedef struct StoreWriter StoreWriter;
+
+/**
+ * 寫完的備份：原文的長度與雜湊，記錄在備份目錄中
+ */
+typedef struct {
+    uint64_t size;
+    uint8_t sha256[SHA256_DIGEST_SIZE];
+} StoreSummary;
+
+typedef struct StoreReader StoreReader;
+
+/**
+ * 設定新備份的格式
+ * @param format STORE_FULL、STORE_DEDUP 或 STORE_COMPRESSED
+ */
+void store_init(int format);
+
+/**
+ * 建立備份檔案：寫入暫存檔，store_writer_close 成功時才出現在 path（見 durable.h）
+ * @param path 備份檔案路徑
+ * @param size_hint 原文的大小，用來預先配置完整副本的空間；0 表示不知道
+ * @return 寫入器，失敗時回傳 NULL
+ */
+StoreWriter *store_writer_open(const char *path, uint64_t size_hint);
+
+/**
+ * 寫入備份資料
+ * @param writer 寫入器
+ * @param data 資料
+ * @param len 長度
+ * @return 0 表示成功，-1 表示失敗
+ */
+int store_writer_write(StoreWriter *writer, const uint8_t *data, size_t len);
+
+/**
+ * 寫入一個編碼區塊（協商了壓縮的 session 收到的數據區）
+ * 壓縮格式原樣存放，其他格式解開後寫入；兩者都會先檢查區塊能否完整解開。
+ * @param writer 寫入器
+ * @param block 編碼區塊
+ * @param len 長度
+ * @return 0 表示成功，-1 表示格式錯誤或寫入失敗
+ */
+int store_writer_write_encoded(StoreWriter *writer, const uint8_t *block, uint32_t len);
+
+/**
+ * 寫入剩下的資料，依持久化策略同步後發布備份，釋放寫入器
+ * 寫入途中失敗過的備份不會發布。有 callback 時可能不等待同步（見 durable_commit），
+ * 回傳 1 時 summary 已經填好，寫入器在發布之後由提交執行緒釋放並呼叫 callback。
+ * @param writer 寫入器
+ * @param summary 輸出原文的長度與雜湊，可以是 NULL
+ * @param callback 不等待同步時的完成通知，可以是 NULL
+ * @param arg 傳給 callback 的參數
+ * @return 0 表示成功，-1 表示失敗，1 表示結果由 callback 回報
+ */
+int store_writer_close(StoreWriter *writer, StoreSummary *summary, DurableDone callback, void *arg);
+
+/**
+ * 已寫入的原文長度，續傳時客戶端從這裡繼續
+ * @param writer 寫入器
+ * @return 長度
+ */
+uint64_t store_writer_size(const StoreWriter *writer);
+
+/**
+ * 寫入中最久的去重備份開始的時間，回收區塊時不刪除這之後用到的區塊
+ * @return 時間，沒有寫入中的去重備份時回傳 0
+ */
+time_t store_oldest_writer();
+
+/**
+ * 讀取中最久的去重備份開始的時間，回收區塊時等這之前開始的讀取結束
+ * @return 時間，沒有讀取中的去重備份時回傳 0
+ */
+time_t store_oldest_reader();
+
+/**
+ * 放棄沒有完成的備份（連線中斷、內容驗證失敗），不發布，釋放寫入器
+ * @param writer 寫入器
+ */
+void store_writer_abort(StoreWriter *writer);
+
+/**
+ * 開啟備份檔案，自動判斷格式
+ * @param path 備份檔案路徑
+ * @return 讀取器，檔案不存在或無法讀取時回傳 NULL
+ */
+StoreReader *store_reader_open(const char *path);
+
+/**
+ * 讀取備份資料，除了最後一次之外都會填滿 buffer
+ * @param reader 讀取器
+ * @param buffer 輸出緩衝區
+ * @param size 緩衝區大小
+ * @return 讀到的位元組數，0 表示結束，-1 表示失敗（例如區塊遺失）
+ */
+ssize_t store_reader_read(StoreReader *reader, uint8_t *buffer, size_t size);
+
+/**
+ * 讀取下一個編碼區塊（送給協商了壓縮的 session）
+ * 壓縮格式儲存的區塊放得下時原樣交出，否則讀出原文再壓縮。
+ * @param reader 讀取器
+ * @param buffer 輸出緩衝區
+ * @param size 緩衝區大小，必須大於 COMPRESS_HEADER_SIZE
+ * @return 編碼區塊的長度，0 表示結束，-1 表示失敗
+ */
+ssize_t store_reader_read_encoded(StoreReader *reader, uint8_t *buffer, size_t size);
+
+/**
+ * 移到指定位置，之後的讀取從那裡開始（差異備份複製基準的區塊時使用）
+ * 去重與壓縮格式往後移動時只讀清單或紀錄的頭部，往前移動時從頭重新找。
+ * @param reader 讀取器
+ * @param offset 位置
+ * @return 0 表示成功，-1 表示失敗或超過結尾
+ */
+int store_reader_seek(StoreReader *reader, uint64_t offset);
+
+/**
+ * 備份內容的總長度
+ * @param reader 讀取器
+ * @return 長度，-1 表示失敗
+ */
+int64_t store_reader_size(StoreReader *reader);
+
+/**
+ * 完整副本的檔案描述子，內容可以直接以 sendfile 送出（位置由呼叫端指定，不影響 store_reader_read）
+ * @param reader 讀取器
+ * @return 檔案描述子，其他格式回傳 -1
+ */
+int store_reader_fd(StoreReader *reader);
+
+/**
+ * 關閉並釋放讀取器
+ * @param reader 讀取器
+ */
+void store_reader_close(StoreReader *reader);
+
+#endif // STORE_H
@@ -0,0 +1,114 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include "protocol.h"
+#include "lease.h"
+#include "pool.h"
+#include "shard.h"
+#include "relay.h"
+
+#define MAIN_PORT 8080
+#define PORT_RANGE_START 50000
+#define PORT_RANGE_END 51000
+#define back_server "192.168.56.103"
+#define ACCEPT_TIMEOUT 30        // 秒，分配 port 後客戶端必須在這段時間內連線
+#define IDLE_TTL 300             // 秒，動態 port 上的 session 閒置超過這段時間就回收
+
+#define TRANSFER_MODE_THREAD 0   // 每個 session 一個執行緒（原本的模式）
+#define TRANSFER_MODE_EPOLL  1   // 多個 epoll reactor，共用 SO_REUSEPORT 的主 port
+
+// session_pump 的結果
+#define SESSION_ACTIVE   0       // 等待事件後再轉發
+#define SESSION_CLOSE    1       // session 結束，後端連線狀態不明，直接關閉
+#define SESSION_REUSABLE 2       // session 結束，後端連線已完成重設，可以歸還連線池
+
+struct TransferConfig {
+    int port;
+    char backends[1024]; // 儲存節點清單，以逗號分隔的 host:port
+    int port_range_start;
+    int port_range_end;
+    int mode;
+    int reactors;
+    int accept_timeout;
+    int idle_ttl;
+    int splice;          // 以 splice 轉發 operation 3／5 的大型數據區
+    int backend_pool;    // 每個節點的後端連線池上限，0 表示每個 session 建立新連線
+    uint64_t user_rate;  // 每個使用者的頻寬上限（bytes/s），0 表示不限制
+    uint64_t total_rate; // 所有使用者合計的頻寬上限（bytes/s），0 表示不限制
+    int user_sessions;   // 每個使用者同時進行的 session 數，超過的排隊，0 表示不限制
+    char stats_socket[108]; // 提供指標的 Unix socket 路徑，空字串表示不提供
+};
+
+extern struct TransferConfig config;
+extern LeasePool port_pool;        // 動態 port 的租約
+extern ShardRing shard_ring;       // 使用者到儲存節點的一致性雜湊
+extern BackendPool *backend_pools; // 每個儲存節點一個長連線池，索引與 shard_ring.nodes 相同
+extern Limiter limiter;            // 每個使用者與全域的頻寬、session 數限制
+
+/**
+ * 連接後端儲存伺服器
+ * @param host 儲存節點的 IP
+ * @param port 儲存節點的 port
+ * @param nonblocking 非 0 時以非阻塞方式連線，可能回傳仍在連線中（EINPROGRESS）的 socket
+ * @return socket，失敗回傳 -1
+ */
+int connect_to_backend(const char *host, int port, int nonblocking);
+
+/**
+ * 依使用者名稱選擇儲存節點的連線池
+ * @param username session 第一個封包頭部的使用者名稱
+ * @return 該使用者所在節點的連線池
+ */
+BackendPool *backend_pool_for(const char *username);
+
+/**
+ * 建立監聽 socket
+ * @param port 監聽的 port
+ * @param backlog listen 佇列長度
+ * @param reuseport 非 0 時設定 SO_REUSEPORT，讓多個 reactor 共用同一個 port
+ * @return socket，失敗回傳 -1
+ */
+int open_listener(int port, int backlog, int reuseport);
+
+/**
+ * operation 0 請求是否提出單一連線模式（PROTO_CAP_INLINE_SESSION）
+ * @param request 客戶端的 operation 0 請求
+ * @return 1 表示 session 要直接在這條連線上進行
+ */
+int inline_session_requested(const Frame *request);
+
+/**
+ * 回覆 operation 0：分配到的 port，客戶端支援 v2 時附上本端能力宣告
+ * @param conn 主 port 上的連線
+ * @param request 客戶端的 operation 0 請求
+ * @param port 分配到的 port；0 表示接受單一連線模式，session 直接在 conn 上進行
+ * @return 0 表示成功，-1 表示失敗
+ */
+int send_port_reply(Connection *conn, const Frame *request, int port);
+
+/**
+ * session 開始前是否需要先讀到第一個封包的使用者名稱（選擇儲存節點或套用使用者限制）
+ * @return 1 表示需要
+ */
+int session_needs_username();
+
+/**
+ * 雙向轉發一個 session：兩個方向都盡可能轉發，直到需要等待事件
+ * 儲存伺服器通知 session 結束時視同客戶端已結束；客戶端結束後，連線池中的後端連線送出重設，
+ * 收到回覆且該轉給客戶端的都送完才算結束。兩端的 socket 都必須是非阻塞的。
+ * @param up 客戶端 → 後端
+ * @param down 後端 → 客戶端
+ * @param backend session 使用的後端連線
+ * @param up_state 輸出 up 方向 relay_pump 的結果，決定要等待的事件
+ * @param down_state 輸出 down 方向 relay_pump 的結果
+ * @return SESSION_ACTIVE、SESSION_CLOSE 或 SESSION_REUSABLE
+ */
+int session_pump(RelayDir *up, RelayDir *down, Backend *backend, int *up_state, int *down_state);
+
+/**
+ * 以 epoll 模式執行轉發伺服器：config.reactors 個 reactor 執行緒，不會返回
+ * @return 失敗時回傳 -1
+ */
+int reactor_run();
+
+#endif // TRANSFER_H
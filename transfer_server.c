@@ -4,182 +4,399 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
 #include "protocol.h"
-
-#define MAIN_PORT 8080
-#define PORT_RANGE_START 50000
-#define PORT_RANGE_END 51000
-#define MAX_CLIENTS (PORT_RANGE_END - PORT_RANGE_START)
-#define back_server "192.168.56.103"
-
-typedef struct {
-    int port;
-    int in_use;
-} PortEntry;
-
-PortEntry port_table[MAX_CLIENTS];
-
-void init_port_table() {
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        port_table[i].port = PORT_RANGE_START + i;
-        port_table[i].in_use = 0;
-    }
-}
-
-int allocate_port() {
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (!port_table[i].in_use) {
-            port_table[i].in_use = 1;
-            return port_table[i].port;
+#include "relay.h"
+#include "transfer.h"
+#include "metrics.h"
+#include "log.h"
+
+struct TransferConfig config;
+
+struct TransferConfig parse_arguments(int argc, char *argv[]) {
+    struct TransferConfig config;
+    memset(&config, 0, sizeof(config));
+    config.port = MAIN_PORT;
+    config.port_range_start = PORT_RANGE_START;
+    config.port_range_end = PORT_RANGE_END;
+    config.mode = TRANSFER_MODE_THREAD;
+    config.reactors = sysconf(_SC_NPROCESSORS_ONLN);
+    if (config.reactors < 1) config.reactors = 1;
+    config.accept_timeout = ACCEPT_TIMEOUT;
+    config.idle_ttl = IDLE_TTL;
+    config.backend_pool = BACKEND_POOL_SIZE;
+
+    static struct option long_options[] = {
+        {"port",       required_argument, 0, 'p'},
+        {"backend",    required_argument, 0, 'b'},
+        {"port-range", required_argument, 0, 'r'},
+        {"mode",       required_argument, 0, 'm'},
+        {"reactors",   required_argument, 0, 'n'},
+        {"accept-timeout", required_argument, 0, 'a'},
+        {"idle-ttl",   required_argument, 0, 'i'},
+        {"splice",     no_argument,       0, 's'},
+        {"backend-pool", required_argument, 0, 'P'},
+        {"user-rate",  required_argument, 0, 'U'},
+        {"total-rate", required_argument, 0, 'T'},
+        {"user-sessions", required_argument, 0, 'S'},
+        {"stats-socket", required_argument, 0, 'M'},
+        {"log-level",  required_argument, 0, 'L'},
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+    int option_index = 0;
+    while ((opt = getopt_long(argc, argv, "p:b:r:m:n:a:i:sP:U:T:S:M:L:", long_options, &option_index)) != -1) {
+        switch (opt) {
+            case 'p':
+                config.port = atoi(optarg);
+                break;
+            case 'b':
+                // 可以重複指定或以逗號分隔，多個節點時依使用者名稱分配
+                if (strlen(config.backends) + strlen(optarg) + 2 > sizeof(config.backends)) {
+                    fprintf(stderr, "後端清單過長\n");
+                    exit(EXIT_FAILURE);
+                }
+                if (config.backends[0]) strcat(config.backends, ",");
+                strcat(config.backends, optarg);
+                break;
+            case 'r':
+                if (sscanf(optarg, "%d-%d", &config.port_range_start, &config.port_range_end) != 2 ||
+                    config.port_range_end <= config.port_range_start) {
+                    fprintf(stderr, "無效的 port 範圍: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'm':
+                if (strcmp(optarg, "thread") == 0) {
+                    config.mode = TRANSFER_MODE_THREAD;
+                } else if (strcmp(optarg, "epoll") == 0) {
+                    config.mode = TRANSFER_MODE_EPOLL;
+                } else {
+                    fprintf(stderr, "未知的模式: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'n':
+                config.reactors = atoi(optarg);
+                if (config.reactors < 1) {
+                    fprintf(stderr, "reactor 數量至少為 1\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'a':
+                config.accept_timeout = atoi(optarg);
+                if (config.accept_timeout < 1) {
+                    fprintf(stderr, "accept 期限至少為 1 秒\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'i':
+                config.idle_ttl = atoi(optarg);  // 0 表示不限制
+                break;
+            case 's':
+                config.splice = 1;
+                break;
+            case 'P':
+                config.backend_pool = atoi(optarg);  // 0 表示停用
+                break;
+            case 'U':
+            case 'T':
+                if (parse_rate(optarg, opt == 'U' ? &config.user_rate : &config.total_rate) != 0) {
+                    fprintf(stderr, "無效的頻寬: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'S':
+                config.user_sessions = atoi(optarg);  // 0 表示不限制
+                break;
+            case 'M':
+                strncpy(config.stats_socket, optarg, sizeof(config.stats_socket) - 1);
+                break;
+            case 'L':
+                log_level = log_parse_level(optarg);
+                if (log_level < 0) {
+                    fprintf(stderr, "未知的日誌等級: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [--port <port>] [--backend <host:port>[,<host:port>...]] [--port-range <start-end>] "
+                                "[--mode <thread|epoll>] [--reactors <n>] [--accept-timeout <sec>] [--idle-ttl <sec>] [--splice] [--backend-pool <n>]\n"
+                                "       [--user-rate <bytes/s>[K|M|G]] [--total-rate <bytes/s>[K|M|G]] [--user-sessions <n>] [--stats-socket <path>]\n"
+                                "       [--log-level <error|warn|info|debug|trace>]\n", argv[0]);
+                exit(EXIT_FAILURE);
         }
     }
-    return -1;
-}
 
-void release_port(int port) {
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (port_table[i].port == port) {
-            port_table[i].in_use = 0;
-            break;
-        }
-    }
+    if (!config.backends[0]) strcpy(config.backends, back_server);
+    return config;
 }
 
-int connect_to_backend() {
+LeasePool port_pool;
+ShardRing shard_ring;
+BackendPool *backend_pools;
+Limiter limiter;
+
+int connect_to_backend(const char *host, int port, int nonblocking) {
     int backend_socket = socket(AF_INET, SOCK_STREAM, 0);
     if (backend_socket < 0) {
-        perror("建立後端 socket 失敗");
+        log_perror("建立後端 socket 失敗");
         return -1;
     }
+    if (nonblocking) {
+        fcntl(backend_socket, F_SETFL, fcntl(backend_socket, F_GETFL) | O_NONBLOCK);
+    }
 
     struct sockaddr_in backend_addr;
     backend_addr.sin_family = AF_INET;
-    backend_addr.sin_port = htons(MAIN_PORT);  // 替換成後端伺服器的 port
-    inet_pton(AF_INET, back_server, &backend_addr.sin_addr);  // 替換成後端伺服器的 IP
+    backend_addr.sin_port = htons(port);
+    inet_pton(AF_INET, host, &backend_addr.sin_addr);
 
-    if (connect(backend_socket, (struct sockaddr *)&backend_addr, sizeof(backend_addr)) < 0) {
-        perror("連接後端伺服器失敗");
+    if (connect(backend_socket, (struct sockaddr *)&backend_addr, sizeof(backend_addr)) < 0 &&
+        !(nonblocking && errno == EINPROGRESS)) {
+        log_perror("連接後端伺服器失敗");
         close(backend_socket);
         return -1;
     }
 
     return backend_socket;
 }
-void transfer_data(int src_socket, int dest_socket, int face) {
-    int received_final_status = 0;
-
-    #define RECV_BUF_SIZE 8192
-    uint8_t recv_buffer[RECV_BUF_SIZE];
-    int buffer_len = 0;
-
-    while (received_final_status == 0) {
-        if (buffer_len < RECV_BUF_SIZE) {
-            int bytes = recv(src_socket, recv_buffer + buffer_len, RECV_BUF_SIZE - buffer_len, 0);
-             if (bytes < 0) {
-                perror("接收資料失敗 1");
-                break;
-            } else if (bytes == 0) {
-                printf("對端關閉連接 2\n");
-                break;
-            }
-            buffer_len += bytes;
+
+BackendPool *backend_pool_for(const char *username) {
+    return &backend_pools[shard_lookup(&shard_ring, username)];
+}
+
+int open_listener(int port, int backlog, int reuseport) {
+    int listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_socket < 0) {
+        log_perror("建立監聽 socket 失敗");
+        return -1;
+    }
+
+    int opt = 1;
+    setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (reuseport && setsockopt(listen_socket, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        log_perror("設定 SO_REUSEPORT 失敗");
+        close(listen_socket);
+        return -1;
+    }
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+
+    if (bind(listen_socket, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        log_perror("綁定 port 失敗");
+        close(listen_socket);
+        return -1;
+    }
+
+    if (listen(listen_socket, backlog) < 0) {
+        log_perror("監聽失敗");
+        close(listen_socket);
+        return -1;
+    }
+
+    return listen_socket;
+}
+
+int inline_session_requested(const Frame *request) {
+    ProtocolCaps caps;
+    return proto_caps_parse(request->data, request->header.length, &caps) &&
+           (caps.flags & PROTO_CAP_INLINE_SESSION);
+}
+
+int send_port_reply(Connection *conn, const Frame *request, int port) {
+    uint8_t port_str[32];
+    int port_len = snprintf((char *)port_str, sizeof(port_str), "%d", port);
+
+    // 客戶端宣告支援 v2 時，回覆本端的能力讓它決定登入時是否提出 v2
+    ProtocolCaps caps;
+    if (proto_caps_parse(request->data, request->header.length, &caps)) {
+        caps.flags = (port == 0 ? PROTO_CAP_INLINE_SESSION : 0) | PROTO_CAP_MULTI_OP;
+        port_len = proto_caps_append(port_str, port_len, sizeof(port_str), &caps);
+    }
+
+    return conn_send(conn, 0, 0, request->header.username, 0, port_str, port_len, 0);
+}
+int session_needs_username() {
+    return shard_ring.count > 1 || limiter_enabled(&limiter);
+}
+
+int session_pump(RelayDir *up, RelayDir *down, Backend *backend, int *up_state, int *down_state) {
+    *up_state = relay_pump(up);
+    *down_state = relay_pump(down);
+    backend->resets_acked = down->controls;
+
+    // 儲存伺服器通知 session 結束：不再讀取客戶端，視同客戶端已結束，重設後歸還後端連線
+    if (down->ended && !up->eof) {
+        up->eof = 1;
+        *up_state = relay_pump(up);
+    }
+
+    if (*up_state == RELAY_ERROR || *down_state == RELAY_ERROR ||
+        (*up_state == RELAY_DONE && *down_state == RELAY_DONE)) {
+        return SESSION_CLOSE;
+    }
+
+    // 客戶端（或 session）已結束：連線池中的後端連線送出重設，收到回覆且該轉給客戶端的都送完後歸還
+    if (backend->pooled && *up_state == RELAY_DONE) {
+        if (!backend->closing) {
+            backend->closing = 1;
+            if (backend_queue_reset(backend) != 0) return SESSION_CLOSE;
+            *up_state = relay_pump(up);
+            if (*up_state == RELAY_ERROR) return SESSION_CLOSE;
+        }
+        if (*up_state == RELAY_DONE && *down_state == RELAY_WANT_READ &&
+            backend->resets_acked == backend->resets_sent) {
+            return SESSION_REUSABLE;
         }
+    }
+    return SESSION_ACTIVE;
+}
 
-        // 嘗試解析完整封包
-        while (1) {
-            
-            if (buffer_len < 11) break;
-           
-            uint8_t username_len = recv_buffer[2];
-            int header_len = 3 + username_len + 8;
-            if (buffer_len < header_len) break;
-
-            
-            uint32_t data_len;
-            memcpy(&data_len, recv_buffer + 3 + username_len + 4, 4);
-            data_len = ntohl(data_len);
-            
-            int total_packet_len = header_len + data_len;
-            if (buffer_len < total_packet_len) break;
-
-            ProtocolHeader header;
-            if (parse_header(recv_buffer, &header) == -1) {
-                fprintf(stderr, "協議解析失敗 3\n");
-                // 無效封包也要跳過，不然卡死
-                buffer_len = 0;
-                break;
-            }
-            
-            uint8_t data[MAX_DATA_SIZE + 1];
-            parse_data(recv_buffer + 3 + header.username_len + 8, header.length, data);
-            printf("接收到數據 - Operation: %d, Status: %d, Sequence: %u, Data: %s\n",
-               header.operation, header.status, header.sequence, data);
-
-            int send_bytes = send(dest_socket, recv_buffer, total_packet_len, 0);
-            if (send_bytes != total_packet_len) {
-                perror("轉發資料失敗");
-                break;
-            }
+// 轉發一個 session：連接後端後兩個方向同時轉發，直到任一端結束，再關閉兩端連線
+// 客戶端可以在同一個 session 中連續送出多個操作，轉發伺服器不需要知道操作的邊界
+// 有多個儲存節點或設定了使用者限制時先讀到第一個封包的頭部，依使用者名稱選擇節點、
+// 取得 session 名額（超過上限時在這裡排隊）
+// lease 為動態 port 的租約（單一連線模式為 NULL），到期時回收執行緒會 shutdown 兩端讓轉發結束
+void relay_session(Connection *client_conn, PortLease *lease) {
+    char username[MAX_USERNAME_LENGTH + 1] = "";
+    if (session_needs_username() && relay_read_username(client_conn, username) <= 0) {
+        lease_detach(lease);
+        conn_close(client_conn);
+        return;
+    }
 
-            if ((header.status == 1 ) ||
-                header.operation == 1 ||
-                (header.operation == 3 && face == 1) ||
-                (header.operation == 4 && face == 0) ||
-                (header.operation == 5 && face == 0)) {
-                received_final_status = 1;
-            }
+    UserLimit *limit = NULL;
+    LimitWaiter waiter = { 0 };
+    if (limiter_enabled(&limiter)) {
+        limit = limiter_join(&limiter, username, &waiter);
+        if (!limit || limiter_wait(limit, &waiter, client_conn->fd) != 0) {
+            if (limit) log_warn("排隊中的客戶端已離開");
+            limiter_leave(limit, &waiter);
+            lease_detach(lease);
+            conn_close(client_conn);
+            return;
+        }
+    }
 
-            memmove(recv_buffer, recv_buffer + total_packet_len, buffer_len - total_packet_len);
-            buffer_len -= total_packet_len;
+    Backend backend;
+    uint64_t connect_us = metrics_now_us();
+    if (backend_open(backend_pool_for(username), &backend, 0) != 0) {
+        limiter_leave(limit, &waiter);
+        lease_detach(lease);
+        conn_close(client_conn);
+        return;
+    }
+    metrics_observe_since(&metrics.backend_connect, connect_us);
+    Connection *backend_conn = backend.conn;
+    if (lease) lease_watch(lease, LEASE_ACTIVE, client_conn->fd, backend_conn->fd);
+
+    // 連線已完成後才改為非阻塞，和 epoll 模式共用同一套轉發狀態
+    fcntl(client_conn->fd, F_SETFL, fcntl(client_conn->fd, F_GETFL) | O_NONBLOCK);
+    fcntl(backend_conn->fd, F_SETFL, fcntl(backend_conn->fd, F_GETFL) | O_NONBLOCK);
+
+    RelayDir up, down;
+    relay_init(&up, client_conn, backend_conn, 0);
+    relay_init(&down, backend_conn, client_conn, 1);
+    splice_state_init(&up.splice, config.splice);
+    splice_state_init(&down.splice, config.splice);
+    up.keep_open = backend.pooled;
+    up.limit = down.limit = limit;
+
+    int result, up_state, down_state;
+    while ((result = session_pump(&up, &down, &backend, &up_state, &down_state)) == SESSION_ACTIVE) {
+        // 超過頻寬限制的方向不等待可讀，改為等到額度恢復
+        int timeout = -1;
+        if (up_state == RELAY_WANT_TIME) timeout = up.wait_ms;
+        if (down_state == RELAY_WANT_TIME && (timeout < 0 || down.wait_ms < timeout)) timeout = down.wait_ms;
+
+        // 沒有要等待的事件時以 -1 略過該 socket，避免錯誤狀態讓 poll 不斷返回
+        short client_events = (up_state == RELAY_WANT_READ ? POLLIN : 0) | (down_state == RELAY_WANT_WRITE ? POLLOUT : 0);
+        short backend_events = (down_state == RELAY_WANT_READ ? POLLIN : 0) | (up_state == RELAY_WANT_WRITE ? POLLOUT : 0);
+        struct pollfd fds[2] = {
+            { .fd = client_events ? client_conn->fd : -1, .events = client_events },
+            { .fd = backend_events ? backend_conn->fd : -1, .events = backend_events },
+        };
+        if (poll(fds, 2, timeout) < 0 && errno != EINTR) {
+            log_perror("poll 失敗");
+            result = SESSION_CLOSE;
+            break;
         }
+        lease_touch(lease);
     }
+
+    relay_free(&up);
+    relay_free(&down);
+    lease_detach(lease);
+    backend_close(&backend, result == SESSION_REUSABLE);
+    conn_close(client_conn);
+    limiter_leave(limit, &waiter);
 }
 
+typedef struct {
+    int dynamic_socket;
+    PortLease *lease;
+} DynamicPortArgs;
 
 void *handle_dynamic_port(void *arg) {
-    int dynamic_socket = ((int *)arg)[0];
-    int allocated_port = ((int *)arg)[1];
-    int port_to_release = allocated_port;  // 獨立儲存 port
+    int dynamic_socket = ((DynamicPortArgs *)arg)->dynamic_socket;
+    PortLease *lease = ((DynamicPortArgs *)arg)->lease;
     free(arg);
 
     struct sockaddr_in client_addr;
     socklen_t addr_len = sizeof(client_addr);
 
+    // 客戶端沒有在期限內連線時，回收執行緒會 shutdown 監聽 socket，accept 隨即返回錯誤
     int client_socket = accept(dynamic_socket, (struct sockaddr *)&client_addr, &addr_len);
+    if (client_socket >= 0) {
+        lease_watch(lease, LEASE_ACTIVE, client_socket, -1);
+    } else {
+        log_perror("accept 失敗");
+        lease_detach(lease);
+    }
+    close(dynamic_socket);
     if (client_socket < 0) {
-        perror("accept 失敗");
-        close(dynamic_socket);
+        lease_release(lease);
         return NULL;
     }
 
-    int backend_socket = connect_to_backend();
-    if (backend_socket < 0) {
+    // 每條連線各自的接收緩衝區，session 開始前已讀到的位元組由轉發接手
+    Connection client_conn;
+    if (conn_init(&client_conn, client_socket) != 0) {
+        lease_detach(lease);
         close(client_socket);
-        close(dynamic_socket);
+        lease_release(lease);
         return NULL;
     }
-    
-    //uint8_t buf[MAX_DATA_SIZE];
-    //int n;
-   // while ((n = recv(client_socket, buf, sizeof(buf), 0)) > 0) {
-     //   write(1, buf, n);  // 直接印出
-    //}
-
-    transfer_data(client_socket, backend_socket, 0);
-    transfer_data(backend_socket, client_socket, 1);
-    transfer_data(client_socket, backend_socket, 0);
-    transfer_data(backend_socket, client_socket, 1);
-    
-    close(backend_socket);
-    close(client_socket);
-    close(dynamic_socket);
+
+    metrics_session(1);
+    relay_session(&client_conn, lease);
+    metrics_session(-1);
 
     //釋放port
-    release_port( port_to_release);
+    lease_release(lease);
 
     return NULL;
 }
 
+// 直接在主 port 的連線上進行的 session，接收緩衝區中已讀到的位元組一併接手
+void *handle_inline_session(void *arg) {
+    Connection *client_conn = arg;
+    metrics_session(1);
+    relay_session(client_conn, NULL);
+    metrics_session(-1);
+    free(client_conn);
+    return NULL;
+}
 
 void *handle_main_port(void *arg) {
     int server_fd = *(int *)arg;
@@ -189,84 +406,78 @@ void *handle_main_port(void *arg) {
     while (1) {
         int client_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t *)&addrlen);
         if (client_socket < 0) {
-            perror("接受連接失敗");
+            log_perror("接受連接失敗");
             continue;
         }
 
-        uint8_t buffer[MAX_DATA_SIZE];
-        int bytes_received = recv(client_socket, buffer, MAX_DATA_SIZE, 0);
-        if (bytes_received <= 0) {
+        Connection conn;
+        if (conn_init(&conn, client_socket) != 0) {
             close(client_socket);
             continue;
         }
 
-        ProtocolHeader header;
-        if (parse_header(buffer, &header) == -1 || header.operation != 0) {
-            fprintf(stderr, "協議解析失敗或操作碼錯誤\n");
-            close(client_socket);
+        Frame frame;
+        if (conn_receive(&conn, &frame) <= 0 || frame.header.operation != 0) {
+            log_error("協議解析失敗或操作碼錯誤");
+            conn_close(&conn);
             continue;
         }
 
-        int allocated_port = allocate_port();
-        if (allocated_port == -1) {
-            fprintf(stderr, "無可用 port\n");
-            close(client_socket);
+        // 客戶端提出單一連線模式：回覆 port 0 後整條連線交給 session 執行緒
+        if (inline_session_requested(&frame)) {
+            Connection *session_conn = malloc(sizeof(Connection));
+            pthread_t tid;
+            if (!session_conn || send_port_reply(&conn, &frame, 0) != 0) {
+                free(session_conn);
+                conn_close(&conn);
+                continue;
+            }
+            *session_conn = conn;
+            if (pthread_create(&tid, NULL, handle_inline_session, session_conn) != 0) {
+                log_perror("pthread_create 失敗");
+                conn_close(session_conn);
+                free(session_conn);
+            } else {
+                pthread_detach(tid);
+            }
             continue;
         }
 
-        printf("分配 port %d 給新的客戶端\n", allocated_port);
-
-        char port_str[6];
-        snprintf(port_str, sizeof(port_str), "%d", allocated_port);
-
-        uint8_t send_buffer[MAX_DATA_SIZE];
-        int send_len = pack_message(0, 0, header.username, 0, (const uint8_t *)port_str, strlen(port_str), send_buffer);
-        send(client_socket, send_buffer, send_len, 0);
-        close(client_socket);
-
-        // 建立新的 socket
-        int dynamic_socket = socket(AF_INET, SOCK_STREAM, 0);
-        if (dynamic_socket < 0) {
-            perror("建立動態 socket 失敗");
-            // 釋放 port
-            release_port(allocated_port);
-            close(client_socket);
+        PortLease *lease = lease_acquire(&port_pool);
+        if (!lease) {
+            log_warn("無可用 port");
+            conn_close(&conn);
             continue;
         }
+        int allocated_port = lease->port;
 
-        // 設定動態 port 的 sockaddr
-        struct sockaddr_in dynamic_addr;
-        dynamic_addr.sin_family = AF_INET;
-        dynamic_addr.sin_addr.s_addr = INADDR_ANY;
-        dynamic_addr.sin_port = htons(allocated_port);
-
-        if (bind(dynamic_socket, (struct sockaddr *)&dynamic_addr, sizeof(dynamic_addr)) < 0) {
-            perror("bind 動態 port 失敗");
-            release_port(allocated_port);
-            close(dynamic_socket);
-            close(client_socket);
+        // 建立動態 port 的監聽 socket
+        int dynamic_socket = open_listener(allocated_port, 3, 0);
+        if (dynamic_socket < 0) {
+            lease_release(lease);
+            conn_close(&conn);
             continue;
         }
+        lease_watch(lease, LEASE_ACCEPTING, dynamic_socket, -1);
 
-        if (listen(dynamic_socket, 3) < 0) {
-            perror("listen 動態 port 失敗");
-            release_port(allocated_port);
-            close(dynamic_socket);
-            close(client_socket);
-            continue;
-        }
+        // 動態 port 已開始監聽後才回覆客戶端，避免客戶端搶先連線被拒
+        log_info("分配 port %d 給新的客戶端", allocated_port);
+        send_port_reply(&conn, &frame, allocated_port);
+        conn_close(&conn);
 
         // 把動態 socket 傳給執行緒
         pthread_t tid;
-        int *new_socket = malloc(2 * sizeof(int));
-        new_socket[0] = dynamic_socket;
-        new_socket[1] = allocated_port;
-        if (pthread_create(&tid, NULL, handle_dynamic_port, new_socket) != 0) {
-            perror("pthread_create 失敗");
-            release_port(allocated_port);
+        DynamicPortArgs *args = malloc(sizeof(DynamicPortArgs));
+        if (args) {
+            args->dynamic_socket = dynamic_socket;
+            args->lease = lease;
+        }
+        if (!args || pthread_create(&tid, NULL, handle_dynamic_port, args) != 0) {
+            log_perror("pthread_create 失敗");
+            lease_detach(lease);
             close(dynamic_socket);
-            close(client_socket);
-            free(new_socket);
+            lease_release(lease);
+            free(args);
         }else{
             pthread_detach(tid);
         }
@@ -276,34 +487,67 @@ void *handle_main_port(void *arg) {
     return NULL;
 }
 
-int main() {
-    init_port_table();
+static int ports_in_use() {
+    return lease_in_use(&port_pool);
+}
 
-    int main_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (main_socket == 0) {
-        perror("建立 socket 失敗");
+static uint64_t ports_reclaimed() {
+    return lease_reclaimed(&port_pool);
+}
+
+int main(int argc, char *argv[]) {
+    config = parse_arguments(argc, argv);
+    signal(SIGPIPE, SIG_IGN);
+    if (log_start() != 0) exit(EXIT_FAILURE);
+
+    if (lease_pool_init(&port_pool, config.port_range_start, config.port_range_end,
+                        config.accept_timeout * 1000, config.idle_ttl * 1000) != 0 ||
+        lease_pool_start_reaper(&port_pool) != 0) {
         exit(EXIT_FAILURE);
     }
 
-    int opt = 1;
-    setsockopt(main_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (shard_ring_init(&shard_ring, config.backends, MAIN_PORT) != 0) {
+        log_error("無效的後端清單: %s", config.backends);
+        exit(EXIT_FAILURE);
+    }
+    backend_pools = calloc(shard_ring.count, sizeof(BackendPool));
+    if (!backend_pools) exit(EXIT_FAILURE);
+    for (int i = 0; i < shard_ring.count; i++) {
+        ShardNode *node = &shard_ring.nodes[i];
+        if (backend_pool_init(&backend_pools[i], node->host, node->port, config.backend_pool) != 0) {
+            exit(EXIT_FAILURE);
+        }
+        log_info("儲存節點 %d：%s:%d", i, node->host, node->port);
+    }
 
-    struct sockaddr_in address;
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(MAIN_PORT);
+    metrics.server = METRICS_TRANSFER;
+    metrics.ports_in_use = ports_in_use;
+    metrics.ports_total = port_pool.count;
+    metrics.ports_reclaimed = ports_reclaimed;
+    if (config.stats_socket[0] != '\0' && metrics_serve(config.stats_socket) != 0) {
+        exit(EXIT_FAILURE);
+    }
 
-    if (bind(main_socket, (struct sockaddr *)&address, sizeof(address)) < 0) {
-        perror("綁定失敗");
+    if (limiter_init(&limiter, config.user_rate, config.total_rate, config.user_sessions) != 0) {
         exit(EXIT_FAILURE);
     }
+    if (limiter_enabled(&limiter)) {
+        log_info("使用者限制：每人 %llu bytes/s、%d 個 session，全域 %llu bytes/s（0 表示不限制）",
+                 (unsigned long long)config.user_rate, config.user_sessions, (unsigned long long)config.total_rate);
+    }
+
+    if (config.mode == TRANSFER_MODE_EPOLL) {
+        log_info("epoll 模式：%d 個 reactor 共用 port %d，%d 個儲存節點",
+                 config.reactors, config.port, shard_ring.count);
+        return reactor_run() == 0 ? 0 : EXIT_FAILURE;
+    }
 
-    if (listen(main_socket, 3) < 0) {
-        perror("監聽失敗");
+    int main_socket = open_listener(config.port, 3, 0);
+    if (main_socket < 0) {
         exit(EXIT_FAILURE);
     }
 
-    printf("主執行序啟動於 port %d\n", MAIN_PORT);
+    log_info("主執行序啟動於 port %d，%d 個儲存節點", config.port, shard_ring.count);
 
     pthread_t main_thread;
     pthread_create(&main_thread, NULL, handle_main_port, &main_socket);